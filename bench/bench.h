@@ -0,0 +1,62 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+
+/*!
+ * \file bench.h
+ *
+ * \brief blue2th benchmark helpers
+ *
+ * Every result is printed as one JSON object per line on stdout, so runs can
+ * be appended to a file and compared across releases.
+ */
+
+
+/*!
+ * \brief blue2th allocation counters, filled by the linker wrapped allocators
+ */
+struct bench_alloc {
+    uint64_t calls;         /**<! malloc, calloc and realloc calls */
+    uint64_t bytes;         /**<! bytes requested */
+    uint64_t frees;         /**<! free calls on non NULL pointers */
+};
+
+
+/*!
+ * \brief bench_alloc_get - Get the allocation counters of the calling thread
+ *
+ * \param[out]  alloc   counters since the thread started.
+ */
+void bench_alloc_get(struct bench_alloc *alloc);
+
+
+static inline uint64_t bench_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static inline void bench_report_by(const char *bench, const char *metric, const char *param, size_t param_value,
+        double value, const char *unit)
+{
+    printf("{\"bench\":\"%s\",\"metric\":\"%s\",\"%s\":%zu,\"value\":%.3f,\"unit\":\"%s\"}\n",
+            bench, metric, param, param_value, value, unit);
+    fflush(stdout);
+}
+
+
+static inline void bench_report(const char *bench, const char *metric, size_t devices, double value, const char *unit)
+{
+    bench_report_by(bench, metric, "devices", devices, value, unit);
+}
+
+
+#endif /* __BENCH_H__ */
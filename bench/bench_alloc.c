@@ -0,0 +1,60 @@
+#include <stddef.h>
+
+#include "bench.h"
+
+
+/*
+ * Benchmarks are linked with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=free:
+ * every allocation made by the blue2th objects goes through these counters.
+ * Allocations made inside the C library itself, strdup() for instance, are not seen.
+ */
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+
+static __thread struct bench_alloc bench_alloc;
+
+
+void bench_alloc_get(struct bench_alloc *alloc)
+{
+    *alloc = bench_alloc;
+}
+
+
+void *__wrap_malloc(size_t size)
+{
+    bench_alloc.calls++;
+    bench_alloc.bytes += size;
+
+    return __real_malloc(size);
+}
+
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    bench_alloc.calls++;
+    bench_alloc.bytes += nmemb * size;
+
+    return __real_calloc(nmemb, size);
+}
+
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    bench_alloc.calls++;
+    bench_alloc.bytes += size;
+
+    return __real_realloc(ptr, size);
+}
+
+
+void __wrap_free(void *ptr)
+{
+    if (ptr)
+        bench_alloc.frees++;
+
+    __real_free(ptr);
+}
@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blue2th.h"
+#include "bench.h"
+
+
+/*
+ * L2CAP benchmark on a simulated echo device: throughput of batched sends
+ * and receives, and round trip latency of single packets, for each MTU.
+ * The link itself is a local socket, what is measured is the library and
+ * system call cost per packet.
+ */
+
+
+#define BENCH_BYTES             (16 * 1024 * 1024)
+#define BENCH_WINDOW_BYTES      (64 * 1024)     /* in flight, below the socket buffers */
+#define BENCH_MAX_BATCH         64
+#define BENCH_PINGS             2000
+#define BENCH_PSM               0x1001
+
+
+static int bench_cmp_ns(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+
+static int bench_l2cap_run(b2th_device_t *local_device, b2th_device_t *bd, uint16_t mtu)
+{
+    b2th_l2cap_opts_t opts = { .imtu = mtu, .omtu = mtu };
+    b2th_l2cap_t *ch = b2th_l2cap_connect(local_device, bd, BENCH_PSM, &opts, 0);
+    if (!ch)
+        return -1;
+
+    unsigned int batch = BENCH_WINDOW_BYTES / opts.omtu;
+    if (batch == 0)
+        batch = 1;
+    if (batch > BENCH_MAX_BATCH)
+        batch = BENCH_MAX_BATCH;
+
+    int ret = -1;
+    b2th_l2cap_packet_t out[BENCH_MAX_BATCH];
+    b2th_l2cap_packet_t in[BENCH_MAX_BATCH];
+    unsigned char *out_buf = calloc(batch, opts.omtu);
+    unsigned char *in_buf = malloc((size_t)batch * opts.imtu);
+    uint64_t *rtt = malloc(BENCH_PINGS * sizeof(uint64_t));
+    if (!out_buf || !in_buf || !rtt)
+        goto clean;
+
+    unsigned int i;
+    for (i = 0; i < batch; i++) {
+        out[i].data = out_buf + (size_t)i * opts.omtu;
+        out[i].len = opts.omtu;
+    }
+
+    // Throughput: a window of full packets out, every echo back, repeated
+    uint64_t packets = 0;
+    uint64_t bytes = 0;
+    uint64_t start = bench_now_ns();
+    while (bytes < BENCH_BYTES) {
+        if (b2th_l2cap_send_batch(ch, out, batch) != (int)batch)
+            goto clean;
+
+        unsigned int echoed = 0;
+        while (echoed < batch) {
+            for (i = 0; i < batch - echoed; i++) {
+                in[i].data = in_buf + (size_t)i * opts.imtu;
+                in[i].len = opts.imtu;
+            }
+
+            int n = b2th_l2cap_recv_batch(ch, in, batch - echoed, 1000);
+            if (n <= 0)
+                goto clean;
+
+            for (i = 0; i < (unsigned int)n; i++)
+                bytes += in[i].len;
+            echoed += n;
+        }
+        packets += batch;
+    }
+    uint64_t end = bench_now_ns();
+
+    bench_report_by("l2cap", "throughput", "mtu", opts.omtu, bytes * 1e3 / (end - start), "MB/s");
+    bench_report_by("l2cap", "packet_rate", "mtu", opts.omtu, packets * 1e9 / (end - start), "packets/s");
+    bench_report_by("l2cap", "batch", "mtu", opts.omtu, batch, "packets");
+
+    // Latency: one packet out, its echo back
+    for (i = 0; i < BENCH_PINGS; i++) {
+        uint64_t sent = bench_now_ns();
+        if (b2th_l2cap_send(ch, out_buf, opts.omtu) == -1 || b2th_l2cap_recv(ch, in_buf, opts.imtu, 1000) <= 0)
+            goto clean;
+        rtt[i] = bench_now_ns() - sent;
+    }
+
+    qsort(rtt, BENCH_PINGS, sizeof(uint64_t), bench_cmp_ns);
+    bench_report_by("l2cap", "rtt_p50_us", "mtu", opts.omtu, rtt[BENCH_PINGS / 2] / 1e3, "us");
+    bench_report_by("l2cap", "rtt_p99_us", "mtu", opts.omtu, rtt[BENCH_PINGS * 99 / 100] / 1e3, "us");
+
+    ret = 0;
+
+clean:
+    if (ret == -1)
+        fprintf(stderr, "l2cap benchmark failed for MTU %u\n", opts.omtu);
+    free(rtt);
+    free(in_buf);
+    free(out_buf);
+    b2th_l2cap_close(ch);
+
+    return ret;
+}
+
+
+int main(int argc, char *argv[])
+{
+    static const uint16_t defaults[] = { 48, 672, 1021, 4096, 16384, 65535 };
+
+    b2th_sim_params_t sim_params;
+    b2th_sim_params_init(&sim_params);
+    sim_params.nb_devices = 1;
+    sim_params.inquiry_unit_ms = 1;
+    sim_params.miss_percent = 0;
+    sim_params.name_latency_min_ms = 1;
+
+    b2th_transport_t *sim = b2th_sim_create(&sim_params);
+    if (!sim)
+        return -1;
+
+    b2th_transport_set(sim);
+
+    int ret = -1;
+    b2th_list_t *remote_device = NULL;
+    b2th_device_t *local_device = b2th_local_device_get_first();
+    if (!local_device)
+        goto clean;
+
+    // Any device in range will do, all of them echo
+    remote_device = b2th_device_scan(local_device, 1);
+    if (!remote_device || b2th_list_size(remote_device) == 0)
+        goto clean;
+
+    b2th_device_t *bd = list_entry(remote_device->head.next, b2th_device_t, node);
+
+    ret = 0;
+    if (argc == 1) {
+        size_t i;
+        for (i = 0; i < sizeof(defaults) / sizeof(defaults[0]); i++)
+            ret |= bench_l2cap_run(local_device, bd, defaults[i]);
+    } else {
+        int i;
+        for (i = 1; i < argc; i++) {
+            unsigned long mtu = strtoul(argv[i], NULL, 10);
+            if (mtu && mtu <= 65535)
+                ret |= bench_l2cap_run(local_device, bd, mtu);
+        }
+    }
+
+clean:
+    if (remote_device)
+        b2th_list_deinit(remote_device);
+    if (local_device)
+        b2th_device_deinit(local_device);
+    b2th_transport_set(NULL);
+    b2th_sim_destroy(sim);
+
+    return ret ? -1 : 0;
+}
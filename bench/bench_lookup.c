@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "b2th_internal.h"
+#include "bench.h"
+
+
+/*
+ * Lookup benchmark: latency of b2th_get_device_by_addr(), _by_name() and
+ * _by_bdaddr() on hits and misses, list build and b2th_list_deinit() cost
+ * for 10, 1k and 100k devices.
+ */
+
+
+#define BENCH_LOOKUPS   1000000
+
+
+static volatile uintptr_t bench_sink;
+
+
+static void bench_lookup_run(size_t nb_devices)
+{
+    char (*addr)[18] = malloc(nb_devices * sizeof(*addr));
+    char (*name)[32] = malloc(nb_devices * sizeof(*name));
+    uint64_t *keys = malloc(nb_devices * sizeof(uint64_t));
+    size_t *order = malloc(BENCH_LOOKUPS * sizeof(size_t));
+    if (!addr || !name || !keys || !order)
+        goto clean;
+
+    size_t i;
+    for (i = 0; i < nb_devices; i++) {
+        uint64_t key = 0x001a7d000000ULL | i;
+        snprintf(addr[i], sizeof(addr[i]), "%02X:%02X:%02X:%02X:%02X:%02X",
+                (unsigned int)(key >> 40) & 0xff, (unsigned int)(key >> 32) & 0xff, (unsigned int)(key >> 24) & 0xff,
+                (unsigned int)(key >> 16) & 0xff, (unsigned int)(key >> 8) & 0xff, (unsigned int)key & 0xff);
+        snprintf(name[i], sizeof(name[i]), "device-%zu", i);
+        keys[i] = key;
+    }
+
+    // Random access pattern, the same for every lookup function
+    unsigned int seed = 1;
+    for (i = 0; i < BENCH_LOOKUPS; i++)
+        order[i] = rand_r(&seed) % nb_devices;
+
+    struct bench_alloc before, after;
+    bench_alloc_get(&before);
+    uint64_t start = bench_now_ns();
+
+    b2th_list_t *bl = b2th_list_init();
+    for (i = 0; bl && i < nb_devices; i++)
+        b2th_list_add_node(bl, addr[i], name[i]);
+
+    uint64_t end = bench_now_ns();
+    bench_alloc_get(&after);
+    if (!bl)
+        goto clean;
+
+    bench_report("lookup", "build_ns_per_device", nb_devices, (double)(end - start) / nb_devices, "ns");
+    bench_report("lookup", "build_allocs", nb_devices, after.calls - before.calls, "calls");
+
+    start = bench_now_ns();
+    for (i = 0; i < BENCH_LOOKUPS; i++)
+        bench_sink = (uintptr_t)b2th_get_device_by_addr(bl, addr[order[i]]);
+    bench_report("lookup", "by_addr_hit_ns", nb_devices, (double)(bench_now_ns() - start) / BENCH_LOOKUPS, "ns");
+
+    start = bench_now_ns();
+    for (i = 0; i < BENCH_LOOKUPS; i++)
+        bench_sink = (uintptr_t)b2th_get_device_by_name(bl, name[order[i]]);
+    bench_report("lookup", "by_name_hit_ns", nb_devices, (double)(bench_now_ns() - start) / BENCH_LOOKUPS, "ns");
+
+    start = bench_now_ns();
+    for (i = 0; i < BENCH_LOOKUPS; i++)
+        bench_sink = (uintptr_t)b2th_get_device_by_bdaddr(bl, keys[order[i]]);
+    bench_report("lookup", "by_bdaddr_hit_ns", nb_devices, (double)(bench_now_ns() - start) / BENCH_LOOKUPS, "ns");
+
+    start = bench_now_ns();
+    for (i = 0; i < BENCH_LOOKUPS; i++)
+        bench_sink = (uintptr_t)b2th_get_device_by_addr(bl, "FF:FF:FF:FF:FF:FF");
+    bench_report("lookup", "by_addr_miss_ns", nb_devices, (double)(bench_now_ns() - start) / BENCH_LOOKUPS, "ns");
+
+    start = bench_now_ns();
+    for (i = 0; i < BENCH_LOOKUPS; i++)
+        bench_sink = (uintptr_t)b2th_get_device_by_name(bl, "no such device");
+    bench_report("lookup", "by_name_miss_ns", nb_devices, (double)(bench_now_ns() - start) / BENCH_LOOKUPS, "ns");
+
+    bench_alloc_get(&before);
+    start = bench_now_ns();
+    b2th_list_deinit(bl);
+    end = bench_now_ns();
+    bench_alloc_get(&after);
+
+    bench_report("lookup", "deinit_us", nb_devices, (end - start) / 1e3, "us");
+    bench_report("lookup", "deinit_frees", nb_devices, after.frees - before.frees, "calls");
+
+clean:
+    free(order);
+    free(keys);
+    free(name);
+    free(addr);
+}
+
+
+int main(int argc, char *argv[])
+{
+    static const size_t defaults[] = { 10, 1000, 100000 };
+
+    if (argc == 1) {
+        size_t i;
+        for (i = 0; i < sizeof(defaults) / sizeof(defaults[0]); i++)
+            bench_lookup_run(defaults[i]);
+        return 0;
+    }
+
+    int i;
+    for (i = 1; i < argc; i++) {
+        size_t nb_devices = strtoul(argv[i], NULL, 10);
+        if (nb_devices)
+            bench_lookup_run(nb_devices);
+    }
+
+    return 0;
+}
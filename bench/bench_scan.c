@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "blue2th.h"
+#include "bench.h"
+
+
+/*
+ * End to end scan benchmark on simulated controllers: time to the first and
+ * the last device found, remote name resolution throughput and allocations
+ * made by one scan, for growing device populations.
+ */
+
+
+#define BENCH_INQUIRY_UNITS     8
+#define BENCH_UNIT_MS           10
+
+
+struct bench_scan {
+    uint64_t start;             /**<! scan start in ns */
+    uint64_t first_device;      /**<! first device found in ns */
+    uint64_t last_device;       /**<! last device found in ns */
+    uint64_t first_name;        /**<! first name resolved in ns */
+    uint64_t last_name;         /**<! last name resolved in ns */
+    size_t nb_names;            /**<! names resolved */
+};
+
+
+static int bench_scan_cb(b2th_scan_event_e event, b2th_device_t *bd, void *userdata)
+{
+    struct bench_scan *bs = userdata;
+    uint64_t now = bench_now_ns();
+    (void)bd;
+
+    switch (event) {
+    case B2TH_SCAN_DEVICE_FOUND:
+        if (!bs->first_device)
+            bs->first_device = now;
+        bs->last_device = now;
+        break;
+    case B2TH_SCAN_NAME_RESOLVED:
+        if (!bs->first_name)
+            bs->first_name = now;
+        bs->last_name = now;
+        bs->nb_names++;
+        break;
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+
+static int bench_scan_run(size_t nb_devices, unsigned int concurrency)
+{
+    b2th_sim_params_t sim_params;
+    b2th_sim_params_init(&sim_params);
+    sim_params.nb_devices = nb_devices;
+    sim_params.inquiry_unit_ms = BENCH_UNIT_MS;
+    sim_params.response_window_ms = BENCH_INQUIRY_UNITS * BENCH_UNIT_MS / 2;
+    sim_params.miss_percent = 0;
+    sim_params.name_latency_min_ms = 2;
+    sim_params.name_latency_max_ms = 10;
+    sim_params.max_pages = concurrency;
+
+    b2th_transport_t *sim = b2th_sim_create(&sim_params);
+    if (!sim)
+        return -1;
+
+    b2th_transport_set(sim);
+
+    b2th_device_t *local_device = b2th_local_device_get_first();
+    if (!local_device) {
+        b2th_transport_set(NULL);
+        b2th_sim_destroy(sim);
+        return -1;
+    }
+
+    b2th_scan_params_t params;
+    b2th_scan_params_init(&params);
+    params.name_concurrency = concurrency;
+
+    struct bench_scan bs;
+    memset(&bs, 0, sizeof(bs));
+
+    struct bench_alloc before, after;
+    bench_alloc_get(&before);
+
+    bs.start = bench_now_ns();
+    b2th_list_t *remote_device = b2th_device_scan_stream(local_device, BENCH_INQUIRY_UNITS, &params, bench_scan_cb, &bs);
+    uint64_t end = bench_now_ns();
+
+    bench_alloc_get(&after);
+
+    if (remote_device) {
+        bench_report("scan", "first_device_ms", nb_devices, bs.first_device ? (bs.first_device - bs.start) / 1e6 : -1, "ms");
+        bench_report("scan", "last_device_ms", nb_devices, bs.last_device ? (bs.last_device - bs.start) / 1e6 : -1, "ms");
+        bench_report("scan", "total_ms", nb_devices, (end - bs.start) / 1e6, "ms");
+        bench_report("scan", "devices_found", nb_devices, b2th_list_size(remote_device), "devices");
+        bench_report("scan", "names_resolved", nb_devices, bs.nb_names, "names");
+        if (bs.nb_names > 1 && bs.last_name > bs.first_name)
+            bench_report("scan", "name_throughput", nb_devices, (bs.nb_names - 1) * 1e9 / (bs.last_name - bs.first_name), "names/s");
+        bench_report("scan", "allocs", nb_devices, after.calls - before.calls, "calls");
+        bench_report("scan", "alloc_bytes", nb_devices, after.bytes - before.bytes, "bytes");
+
+        struct bench_alloc freed;
+        b2th_list_deinit(remote_device);
+        bench_alloc_get(&freed);
+        bench_report("scan", "frees_deinit", nb_devices, freed.frees - after.frees, "calls");
+    }
+
+    b2th_device_deinit(local_device);
+    b2th_transport_set(NULL);
+    b2th_sim_destroy(sim);
+
+    return remote_device ? 0 : -1;
+}
+
+
+int main(int argc, char *argv[])
+{
+    unsigned int concurrency = 4;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:h")) != -1) {
+        switch (opt) {
+        case 'c':
+            concurrency = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            printf("Usage: %s [-c name_concurrency] [devices...]\n", argv[0]);
+            return (opt == 'h') ? 0 : -1;
+        }
+    }
+
+    static const size_t defaults[] = { 10, 100, 1000 };
+
+    int ret = 0;
+    if (optind == argc) {
+        size_t i;
+        for (i = 0; i < sizeof(defaults) / sizeof(defaults[0]); i++)
+            ret |= bench_scan_run(defaults[i], concurrency);
+    } else {
+        for (; optind < argc; optind++)
+            ret |= bench_scan_run(strtoul(argv[optind], NULL, 10), concurrency);
+    }
+
+    return ret ? -1 : 0;
+}
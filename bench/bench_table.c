@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "b2th_internal.h"
+#include "bench.h"
+
+
+/*
+ * Shared table benchmark: aggregate b2th_table_lookup() throughput for 1, 2,
+ * 4 and 8 reader threads while a writer keeps updating the same devices, and
+ * the update rate the writer sustains meanwhile.
+ */
+
+
+#define BENCH_DEVICES   10000
+#define BENCH_LOOKUPS   2000000
+
+
+struct bench_table {
+    b2th_table_t *table;
+    uint64_t *keys;
+    volatile int stop;                  /**<! readers done, the writer stops */
+    uint64_t updates;                   /**<! updates made by the writer */
+};
+
+
+static volatile uintptr_t bench_sink;
+
+
+static void *bench_table_reader(void *arg)
+{
+    struct bench_table *bt = arg;
+    unsigned int seed = (unsigned int)(uintptr_t)pthread_self();
+    b2th_table_entry_t entry;
+
+    size_t i;
+    for (i = 0; i < BENCH_LOOKUPS; i++)
+        bench_sink = b2th_table_lookup(bt->table, bt->keys[rand_r(&seed) % BENCH_DEVICES], &entry);
+
+    return NULL;
+}
+
+
+static void *bench_table_writer(void *arg)
+{
+    struct bench_table *bt = arg;
+    unsigned int seed = 1;
+    char name[32];
+
+    b2th_device_t bd;
+    memset(&bd, 0, sizeof(bd));
+    bd.name = name;
+
+    while (!bt->stop) {
+        size_t i = rand_r(&seed) % BENCH_DEVICES;
+        bd.bdaddr = bt->keys[i];
+        snprintf(name, sizeof(name), "device-%zu-%u", i, seed & 0xff);
+        bd.rssi = -(int8_t)(40 + seed % 50);
+        b2th_table_update(bt->table, &bd, b2th_now_ms());
+        bt->updates++;
+    }
+
+    return NULL;
+}
+
+
+static void bench_table_run(size_t nb_readers)
+{
+    struct bench_table bt = { 0 };
+    pthread_t *readers = malloc(nb_readers * sizeof(pthread_t));
+    bt.keys = malloc(BENCH_DEVICES * sizeof(uint64_t));
+    bt.table = b2th_table_create(BENCH_DEVICES);
+    if (!readers || !bt.keys || !bt.table)
+        goto clean;
+
+    b2th_device_t bd;
+    memset(&bd, 0, sizeof(bd));
+    bd.name = B2TH_UNKNOWN_NAME;
+
+    size_t i;
+    for (i = 0; i < BENCH_DEVICES; i++) {
+        bt.keys[i] = bd.bdaddr = 0x001a7d000000ULL | i;
+        b2th_table_update(bt.table, &bd, b2th_now_ms());
+    }
+
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, bench_table_writer, &bt) != 0)
+        goto clean;
+
+    uint64_t start = bench_now_ns();
+
+    size_t started;
+    for (started = 0; started < nb_readers; started++)
+        if (pthread_create(&readers[started], NULL, bench_table_reader, &bt) != 0)
+            break;
+    for (i = 0; i < started; i++)
+        pthread_join(readers[i], NULL);
+
+    uint64_t end = bench_now_ns();
+
+    bt.stop = 1;
+    pthread_join(writer, NULL);
+
+    double seconds = (end - start) / 1e9;
+    bench_report_by("table", "lookups_per_s", "readers", started, started * BENCH_LOOKUPS / seconds / 1e6, "M/s");
+    bench_report_by("table", "updates_per_s", "readers", started, bt.updates / seconds / 1e6, "M/s");
+
+clean:
+    b2th_table_destroy(bt.table);
+    free(bt.keys);
+    free(readers);
+}
+
+
+int main(int argc, char *argv[])
+{
+    static const size_t defaults[] = { 1, 2, 4, 8 };
+
+    if (argc == 1) {
+        size_t i;
+        for (i = 0; i < sizeof(defaults) / sizeof(defaults[0]); i++)
+            bench_table_run(defaults[i]);
+        return 0;
+    }
+
+    int i;
+    for (i = 1; i < argc; i++) {
+        size_t nb_readers = strtoul(argv[i], NULL, 10);
+        if (nb_readers)
+            bench_table_run(nb_readers);
+    }
+
+    return 0;
+}
@@ -0,0 +1,93 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "b2th_internal.h"
+
+
+#define B2TH_ARENA_CHUNK_MIN    4096
+#define B2TH_ARENA_CHUNK_MAX    65536
+#define B2TH_ARENA_ALIGN        sizeof(void *)
+
+
+/*
+ * Arena chunk: allocations are carved out of data[] one after the other
+ * and only released all at once by b2th_arena_deinit().
+ */
+struct b2th_arena_chunk {
+    struct b2th_arena_chunk *next;      /**<! previously filled chunk */
+    size_t size;                        /**<! usable bytes in data */
+    size_t used;                        /**<! bytes already handed out */
+    unsigned char data[];               /**<! chunk storage */
+};
+
+
+static struct b2th_arena_chunk *b2th_arena_chunk_new(size_t size)
+{
+    struct b2th_arena_chunk *chunk = malloc(sizeof(struct b2th_arena_chunk) + size);
+    if (!chunk)
+        return NULL;
+
+    b2th_stats_alloc();
+
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+
+    return chunk;
+}
+
+
+void *b2th_arena_alloc(struct b2th_arena *arena, size_t size)
+{
+    size = (size + B2TH_ARENA_ALIGN - 1) & ~(B2TH_ARENA_ALIGN - 1);
+
+    struct b2th_arena_chunk *chunk = arena->chunks;
+    if (!chunk || chunk->size - chunk->used < size) {
+
+        // Chunks double in size so a list needs O(log n) mallocs
+        size_t chunk_size = chunk ? chunk->size * 2 : B2TH_ARENA_CHUNK_MIN;
+        if (chunk_size > B2TH_ARENA_CHUNK_MAX)
+            chunk_size = B2TH_ARENA_CHUNK_MAX;
+        if (chunk_size < size)
+            chunk_size = size;
+
+        struct b2th_arena_chunk *new_chunk = b2th_arena_chunk_new(chunk_size);
+        if (!new_chunk)
+            return NULL;
+
+        new_chunk->next = chunk;
+        arena->chunks = chunk = new_chunk;
+        arena->nb_chunks++;
+    }
+
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+
+    return ptr;
+}
+
+
+char *b2th_arena_strdup(struct b2th_arena *arena, const char *str)
+{
+    size_t len = strlen(str) + 1;
+
+    char *dup = b2th_arena_alloc(arena, len);
+    if (dup)
+        memcpy(dup, str, len);
+
+    return dup;
+}
+
+
+void b2th_arena_deinit(struct b2th_arena *arena)
+{
+    struct b2th_arena_chunk *chunk = arena->chunks;
+    while (chunk) {
+        struct b2th_arena_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+
+    arena->chunks = NULL;
+    arena->nb_chunks = 0;
+}
@@ -0,0 +1,1036 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "b2th_internal.h"
+
+
+#define B2TH_ASYNC_PAGES        4       /* name requests and connections sent at once */
+#define B2TH_ASYNC_BATCH        64      /* events read per b2th_async_process() */
+#define B2TH_ASYNC_NAME_TIMEOUT 5120
+
+#define B2TH_DISCOVERY_MIN_SLICE    1   /* 1.28 s */
+#define B2TH_DISCOVERY_MAX_SLICE    8   /* 10.24 s, the standard inquiry */
+#define B2TH_DISCOVERY_DUTY         50
+#define B2TH_DISCOVERY_GROW         2
+#define B2TH_DISCOVERY_BACKOFF_MS   1280    /* first retry of a refused slice, doubled up to the max */
+#define B2TH_DISCOVERY_BACKOFF_MAX  40960
+
+
+enum b2th_async_op_e {
+    OP_INQUIRY,
+    OP_NAME,
+    OP_CONNECT,
+    OP_DISCONNECT
+};
+
+
+/*!
+ * \brief one operation started on an asynchronous context
+ */
+struct b2th_async_op {
+    enum b2th_async_op_e type;          /**<! what the operation does */
+    b2th_async_cb_t cb;                 /**<! completion callback */
+    void *userdata;                     /**<! callback context */
+    b2th_device_t *bd;                  /**<! target device, NULL for inquiries and disconnections */
+    b2th_list_t *list;                  /**<! list receiving the devices found by an inquiry */
+    bdaddr_t bdaddr;                    /**<! target address */
+    int handle;                         /**<! connection handle, -1 if none */
+    unsigned int timeout_ms;            /**<! timeout once sent */
+    long long sent;                     /**<! monotonic send time */
+    long long deadline;                 /**<! monotonic deadline once sent */
+    unsigned long seq;                  /**<! send order, used to match command status events */
+    int wait_status;                    /**<! command status event not received yet */
+    list_t node;                        /**<! pending, sent or free list node */
+};
+
+
+/*!
+ * \brief adaptive discovery state, slices are inquiry operations reported to b2th_async_slice_cb()
+ */
+struct b2th_async_discovery {
+    int running;                        /**<! slices scheduled until stopped */
+    b2th_discovery_params_t params;     /**<! slice bounds and duty cycle */
+    b2th_list_t *list;                  /**<! list receiving the devices found */
+    b2th_async_cb_t cb;                 /**<! user callback, may be NULL */
+    void *userdata;                     /**<! user context of cb */
+    unsigned int slice;                 /**<! length of the next slice in 1.28 s units */
+    unsigned int found;                 /**<! new devices found by the running slice */
+    int preempted;                      /**<! running slice cut short by a connection */
+    long long start;                    /**<! start of the running slice */
+    long long next;                     /**<! earliest start of the next slice, -1 while one runs */
+    unsigned int backoff_ms;            /**<! wait before retrying a refused slice, 0 after an accepted one */
+};
+
+
+struct b2th_async {
+    int sock;                           /**<! HCI socket bound to the local controller */
+    int timer;                          /**<! timerfd armed at the nearest deadline */
+    int epfd;                           /**<! pollable fd gathering sock and timer */
+    int dev_id;                         /**<! local controller id */
+    list_t pending;                     /**<! paging operations waiting for a free slot */
+    list_t sent;                        /**<! operations waiting for the controller */
+    list_t free;                        /**<! completed operations, recycled */
+    unsigned int pages;                 /**<! paging operations sent and not completed */
+    unsigned int max_pages;             /**<! paging cap, lowered if the controller rejects */
+    int pages_deferred;                 /**<! controller refused to page during inquiry */
+    unsigned long seq;                  /**<! send counter */
+    long long armed;                    /**<! deadline the timer is armed for, -1 if disarmed */
+    struct b2th_async_discovery discovery; /**<! adaptive discovery, if running */
+    b2th_scan_stats_t stats;            /**<! counters not published yet */
+    uint64_t allocs;                    /**<! b2th_allocs when stats were last published */
+};
+
+
+static int b2th_async_paging(const struct b2th_async_op *op)
+{
+    return op->type == OP_NAME || op->type == OP_CONNECT;
+}
+
+
+static uint16_t b2th_async_opcode(const struct b2th_async_op *op)
+{
+    switch (op->type) {
+    case OP_INQUIRY:
+        return cmd_opcode_pack(OGF_LINK_CTL, OCF_INQUIRY);
+    case OP_NAME:
+        return cmd_opcode_pack(OGF_LINK_CTL, OCF_REMOTE_NAME_REQ);
+    case OP_CONNECT:
+        return cmd_opcode_pack(OGF_LINK_CTL, OCF_CREATE_CONN);
+    default:
+        return cmd_opcode_pack(OGF_LINK_CTL, OCF_DISCONNECT);
+    }
+}
+
+
+static struct b2th_async_op *b2th_async_inquiry_op(b2th_async_t *as)
+{
+    struct b2th_async_op *op;
+    list_for_each_entry(op, &as->sent, node)
+        if (op->type == OP_INQUIRY)
+            return op;
+
+    return NULL;
+}
+
+
+static int b2th_async_connecting(b2th_async_t *as)
+{
+    struct b2th_async_op *op;
+    list_for_each_entry(op, &as->pending, node)
+        if (op->type == OP_CONNECT)
+            return 1;
+    list_for_each_entry(op, &as->sent, node)
+        if (op->type == OP_CONNECT)
+            return 1;
+
+    return 0;
+}
+
+
+static struct b2th_async_op *b2th_async_op_new(b2th_async_t *as, enum b2th_async_op_e type,
+        b2th_async_cb_t cb, void *userdata)
+{
+    struct b2th_async_op *op;
+
+    if (!list_empty(&as->free)) {
+        op = list_entry(as->free.next, struct b2th_async_op, node);
+        list_del(&op->node);
+    } else {
+        op = malloc(sizeof(struct b2th_async_op));
+        if (!op)
+            return NULL;
+        b2th_stats_alloc();
+    }
+
+    memset(op, 0, sizeof(*op));
+    op->type = type;
+    op->cb = cb;
+    op->userdata = userdata;
+
+    return op;
+}
+
+
+/*
+ * Remove an operation from its list and report it: callbacks run with no
+ * list walk in progress, so they may start new operations.
+ */
+static void b2th_async_complete(b2th_async_t *as, struct b2th_async_op *op, int status, const char *name)
+{
+    list_del(&op->node);
+    if (b2th_async_paging(op) && op->sent && as->pages)
+        as->pages--;
+
+    b2th_async_event_t ev = {
+        .status = status,
+        .bd = op->bd,
+        .name = name,
+        .handle = op->handle,
+    };
+
+    switch (op->type) {
+    case OP_INQUIRY:
+        ev.event = B2TH_ASYNC_INQUIRY_COMPLETE;
+        // Each inquiry, discovery slices included, is a scan of its own
+        as->stats.scans++;
+        as->stats.inquiries++;
+        as->stats.inquiry_ms += b2th_now_ms() - op->sent;
+        if (status != 0)
+            as->stats.errors++;
+        // Paging is possible again
+        as->pages_deferred = 0;
+        break;
+    case OP_NAME:
+        ev.event = B2TH_ASYNC_NAME_COMPLETE;
+        if (status == 0) {
+            as->stats.names_resolved++;
+            b2th_stats_name_latency(&as->stats, b2th_now_ms() - op->sent);
+        } else if (status > 0) {
+            as->stats.name_failures++;
+        }
+        break;
+    case OP_CONNECT:
+        ev.event = B2TH_ASYNC_CONNECT_COMPLETE;
+        break;
+    case OP_DISCONNECT:
+        ev.event = B2TH_ASYNC_DISCONNECT_COMPLETE;
+        break;
+    }
+
+    // The callback may start an operation that recycles op right away
+    b2th_async_cb_t cb = op->cb;
+    void *userdata = op->userdata;
+    list_add_head(&op->node, &as->free);
+
+    if (cb)
+        cb(&ev, userdata);
+}
+
+
+static int b2th_async_send(b2th_async_t *as, struct b2th_async_op *op)
+{
+    int ret = -1;
+
+    switch (op->type) {
+
+    case OP_NAME: {
+        remote_name_req_cp cp;
+        memset(&cp, 0, sizeof(cp));
+        bacpy(&cp.bdaddr, &op->bdaddr);
+        cp.pscan_rep_mode = op->bd->pscan_rep_mode;
+        cp.clock_offset = htobs(op->bd->clock_offset);
+        ret = b2th_hci_send_cmd(as->sock, OGF_LINK_CTL, OCF_REMOTE_NAME_REQ, REMOTE_NAME_REQ_CP_SIZE, &cp);
+        if (ret >= 0)
+            as->stats.name_requests++;
+        break;
+    }
+
+    case OP_CONNECT: {
+        create_conn_cp cp;
+        memset(&cp, 0, sizeof(cp));
+        bacpy(&cp.bdaddr, &op->bdaddr);
+        cp.pkt_type = htobs(HCI_DM1 | HCI_DM3 | HCI_DM5 | HCI_DH1 | HCI_DH3 | HCI_DH5);
+        cp.pscan_rep_mode = op->bd->pscan_rep_mode;
+        cp.clock_offset = htobs(op->bd->clock_offset);
+        cp.role_switch = 0x01;
+        ret = b2th_hci_send_cmd(as->sock, OGF_LINK_CTL, OCF_CREATE_CONN, CREATE_CONN_CP_SIZE, &cp);
+        break;
+    }
+
+    case OP_DISCONNECT: {
+        disconnect_cp cp = {
+            .handle = htobs(op->handle),
+            .reason = HCI_OE_USER_ENDED_CONNECTION,
+        };
+        ret = b2th_hci_send_cmd(as->sock, OGF_LINK_CTL, OCF_DISCONNECT, DISCONNECT_CP_SIZE, &cp);
+        break;
+    }
+
+    default:
+        break;
+    }
+
+    if (ret < 0)
+        return -1;
+
+    op->sent = b2th_now_ms();
+    op->deadline = op->sent + op->timeout_ms;
+    op->seq = as->seq++;
+    op->wait_status = 1;
+    if (b2th_async_paging(op))
+        as->pages++;
+
+    list_add_tail(&op->node, &as->sent);
+
+    return 0;
+}
+
+
+static int b2th_async_fill(b2th_async_t *as)
+{
+    int count = 0;
+
+    if (as->pages_deferred && b2th_async_inquiry_op(as))
+        return 0;
+
+    // Discovery slices keep the controller for themselves, paging waits for the window
+    if (as->discovery.running && b2th_async_inquiry_op(as))
+        return 0;
+
+    while (as->pages < as->max_pages && !list_empty(&as->pending)) {
+        struct b2th_async_op *op = list_entry(as->pending.next, struct b2th_async_op, node);
+        list_del(&op->node);
+
+        if (b2th_async_send(as, op) == -1) {
+            // Put back on a list for b2th_async_complete() to remove it from
+            list_add_head(&op->node, &as->pending);
+            b2th_async_complete(as, op, -1, NULL);
+            count++;
+        }
+    }
+
+    return count;
+}
+
+
+static void b2th_async_arm(b2th_async_t *as)
+{
+    long long deadline = -1;
+
+    struct b2th_async_op *op;
+    list_for_each_entry(op, &as->sent, node)
+        if (deadline == -1 || op->deadline < deadline)
+            deadline = op->deadline;
+
+    // Wake up for the next slice, or right away when a connection waits for the running slice to give way
+    const struct b2th_async_discovery *d = &as->discovery;
+    if (d->running && !b2th_async_connecting(as) && !as->pages && d->next != -1 && (deadline == -1 || d->next < deadline))
+        deadline = d->next;
+    else if (d->running && b2th_async_connecting(as) && b2th_async_inquiry_op(as))
+        deadline = b2th_now_ms();
+
+    if (deadline == as->armed)
+        return;
+
+    // A zero it_value disarms: deadlines are strictly positive monotonic times
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (deadline != -1) {
+        its.it_value.tv_sec = deadline / 1000;
+        its.it_value.tv_nsec = (deadline % 1000) * 1000000;
+    }
+
+    if (timerfd_settime(as->timer, TFD_TIMER_ABSTIME, &its, NULL) == 0)
+        as->armed = deadline;
+}
+
+
+static int b2th_async_cmd_status(b2th_async_t *as, evt_cmd_status *cs)
+{
+    uint16_t opcode = btohs(cs->opcode);
+
+    // Command status events come back in the order the commands were sent
+    struct b2th_async_op *op, *found = NULL;
+    list_for_each_entry(op, &as->sent, node)
+        if (op->wait_status && b2th_async_opcode(op) == opcode && (!found || op->seq < found->seq))
+            found = op;
+
+    if (!found)
+        return 0;
+
+    found->wait_status = 0;
+    if (cs->status == 0)
+        return 0;
+
+    // The controller refused to page one more device: retry later with less parallelism
+    if (b2th_async_paging(found) && (cs->status == HCI_MAX_NUMBER_OF_CONNECTIONS || cs->status == HCI_COMMAND_DISALLOWED)
+            && (as->pages > 1 || b2th_async_inquiry_op(as))) {
+        if (found->type == OP_NAME)
+            as->stats.name_refused++;
+        if (b2th_async_inquiry_op(as))
+            as->pages_deferred = 1;
+        if (as->max_pages > 1)
+            as->max_pages--;
+
+        list_del(&found->node);
+        as->pages--;
+        found->sent = 0;
+        list_add_head(&found->node, &as->pending);
+        return 0;
+    }
+
+    b2th_async_complete(as, found, cs->status, NULL);
+
+    return 1;
+}
+
+
+static struct b2th_async_op *b2th_async_find(b2th_async_t *as, enum b2th_async_op_e type, const bdaddr_t *bdaddr)
+{
+    struct b2th_async_op *op;
+    list_for_each_entry(op, &as->sent, node)
+        if (op->type == type && bacmp(&op->bdaddr, bdaddr) == 0)
+            return op;
+
+    return NULL;
+}
+
+
+static int b2th_async_inquiry_result(b2th_async_t *as, uint8_t evt, const unsigned char *ptr, ssize_t len)
+{
+    struct b2th_async_op *op = b2th_async_inquiry_op(as);
+    if (!op)
+        return 0;
+
+    // The callback may stop the inquiry and recycle op: what the loop needs is copied first
+    b2th_list_t *list = op->list;
+    b2th_async_cb_t cb = op->cb;
+    void *userdata = op->userdata;
+    unsigned long seq = op->seq;
+
+    struct b2th_result res[B2TH_INQUIRY_MAX_RESULTS];
+    int num_rsp = b2th_inquiry_parse(evt, ptr, len, as->dev_id, res);
+    int count = 0;
+
+    int i;
+    for (i = 0; i < num_rsp; i++) {
+        as->stats.responses++;
+
+        // Only the first response of a device is reported, later ones refresh the paging hints
+        b2th_device_t *bd = b2th_get_device_by_bdaddr(list, b2th_bdaddr_to_key(&res[i].bdaddr));
+        int found = (bd != NULL);
+        if (!bd) {
+            char addr[19] = { 0 };
+            ba2str(&res[i].bdaddr, addr);
+            bd = b2th_list_add_node(list, addr, B2TH_UNKNOWN_NAME);
+            if (!bd)
+                continue;
+            bd->dev_class = res[i].dev_class;
+            bd->dev_id = res[i].dev_id;
+        }
+
+        // A complete name in the extended inquiry response spares the name request
+        char name[HCI_MAX_NAME_LENGTH + 1];
+        int named = !found && b2th_result_get_name(&res[i], name, sizeof(name)) == 0;
+        if (named) {
+            b2th_list_set_name(list, bd, name);
+            as->stats.eir_names++;
+        }
+        b2th_device_set_eir(bd, &res[i]);
+
+        bd->pscan_rep_mode = res[i].pscan_rep_mode;
+        bd->clock_offset = res[i].clock_offset;
+        if (res[i].rssi)
+            bd->rssi = res[i].rssi;
+        bd->last_seen = b2th_now_ms();
+
+        if (found)
+            continue;
+
+        as->stats.devices++;
+        count++;
+
+        b2th_async_event_t ev = {
+            .event = B2TH_ASYNC_INQUIRY_RESULT,
+            .bd = bd,
+            .name = named ? bd->name : NULL,
+            .handle = -1,
+        };
+
+        if (!cb)
+            continue;
+
+        cb(&ev, userdata);
+
+        // Stopped or replaced by the callback: the rest of the event belongs to no inquiry
+        if (b2th_async_inquiry_op(as) != op || op->seq != seq)
+            break;
+    }
+
+    return count;
+}
+
+
+static int b2th_async_handle_event(b2th_async_t *as, unsigned char *buf, ssize_t len)
+{
+    if (len < 1 + HCI_EVENT_HDR_SIZE || buf[0] != HCI_EVENT_PKT)
+        return 0;
+
+    hci_event_hdr *hdr = (hci_event_hdr *)(buf + 1);
+    unsigned char *ptr = buf + 1 + HCI_EVENT_HDR_SIZE;
+    len -= 1 + HCI_EVENT_HDR_SIZE;
+
+    struct b2th_async_op *op;
+
+    switch (hdr->evt) {
+
+    case EVT_INQUIRY_RESULT:
+    case EVT_INQUIRY_RESULT_WITH_RSSI:
+    case EVT_EXTENDED_INQUIRY_RESULT:
+        return b2th_async_inquiry_result(as, hdr->evt, ptr, len);
+
+    case EVT_INQUIRY_COMPLETE:
+        op = b2th_async_inquiry_op(as);
+        if (!op || len < 1)
+            return 0;
+        b2th_async_complete(as, op, ptr[0], NULL);
+        return 1;
+
+    case EVT_CMD_STATUS:
+        if (len < EVT_CMD_STATUS_SIZE)
+            return 0;
+        return b2th_async_cmd_status(as, (evt_cmd_status *)ptr);
+
+    case EVT_REMOTE_NAME_REQ_COMPLETE: {
+        if (len < EVT_REMOTE_NAME_REQ_COMPLETE_SIZE)
+            return 0;
+        evt_remote_name_req_complete *rn = (evt_remote_name_req_complete *)ptr;
+        op = b2th_async_find(as, OP_NAME, &rn->bdaddr);
+        if (!op)
+            return 0;
+        char name[HCI_MAX_NAME_LENGTH + 1] = { 0 };
+        memcpy(name, rn->name, HCI_MAX_NAME_LENGTH);
+        b2th_async_complete(as, op, rn->status, rn->status == 0 ? name : NULL);
+        return 1;
+    }
+
+    case EVT_CONN_COMPLETE: {
+        if (len < EVT_CONN_COMPLETE_SIZE)
+            return 0;
+        evt_conn_complete *cc = (evt_conn_complete *)ptr;
+        op = b2th_async_find(as, OP_CONNECT, &cc->bdaddr);
+        if (!op || cc->link_type != ACL_LINK)
+            return 0;
+        op->handle = (cc->status == 0) ? btohs(cc->handle) : -1;
+        b2th_async_complete(as, op, cc->status, NULL);
+        return 1;
+    }
+
+    case EVT_DISCONN_COMPLETE: {
+        if (len < EVT_DISCONN_COMPLETE_SIZE)
+            return 0;
+        evt_disconn_complete *dc = (evt_disconn_complete *)ptr;
+        list_for_each_entry(op, &as->sent, node) {
+            if (op->type == OP_DISCONNECT && op->handle == btohs(dc->handle)) {
+                b2th_async_complete(as, op, dc->status, NULL);
+                return 1;
+            }
+        }
+        return 0;
+    }
+    }
+
+    return 0;
+}
+
+
+static void b2th_async_cancel(b2th_async_t *as, struct b2th_async_op *op)
+{
+    if (!op->sent)
+        return;
+
+    if (op->type == OP_INQUIRY) {
+        b2th_hci_send_cmd(as->sock, OGF_LINK_CTL, OCF_INQUIRY_CANCEL, 0, NULL);
+    } else if (op->type == OP_NAME) {
+        remote_name_req_cancel_cp cp;
+        bacpy(&cp.bdaddr, &op->bdaddr);
+        b2th_hci_send_cmd(as->sock, OGF_LINK_CTL, OCF_REMOTE_NAME_REQ_CANCEL, REMOTE_NAME_REQ_CANCEL_CP_SIZE, &cp);
+    } else if (op->type == OP_CONNECT) {
+        create_conn_cancel_cp cp;
+        bacpy(&cp.bdaddr, &op->bdaddr);
+        b2th_hci_send_cmd(as->sock, OGF_LINK_CTL, OCF_CREATE_CONN_CANCEL, CREATE_CONN_CANCEL_CP_SIZE, &cp);
+    }
+}
+
+
+static int b2th_async_expire(b2th_async_t *as, long long now)
+{
+    int count = 0;
+
+    // Completions may start operations: walk the list again after each one
+    for (;;) {
+        struct b2th_async_op *op, *expired = NULL;
+        list_for_each_entry(op, &as->sent, node) {
+            if (op->deadline <= now) {
+                expired = op;
+                break;
+            }
+        }
+
+        if (!expired)
+            return count;
+
+        if (expired->type == OP_NAME)
+            as->stats.name_timeouts++;
+
+        b2th_async_cancel(as, expired);
+        b2th_async_complete(as, expired, -1, NULL);
+        count++;
+    }
+}
+
+
+static int b2th_async_inquiry_send(b2th_async_t *as, unsigned int secs, b2th_list_t *list, b2th_async_cb_t cb,
+        void *userdata)
+{
+    if (!as || !list || secs == 0 || b2th_async_inquiry_op(as))
+        return -1;
+
+    struct b2th_async_op *op = b2th_async_op_new(as, OP_INQUIRY, cb, userdata);
+    if (!op)
+        return -1;
+
+    b2th_inquiry_mode_set(as->sock);
+
+    // General/Unlimited Inquiry Access Code (GIAC)
+    inquiry_cp cp = {
+        .lap = { 0x33, 0x8b, 0x9e },
+        .length = secs,
+        .num_rsp = 255,
+    };
+
+    if (b2th_hci_send_cmd(as->sock, OGF_LINK_CTL, OCF_INQUIRY, INQUIRY_CP_SIZE, &cp) < 0) {
+        perror("Failed to start inquiry");
+        list_add_head(&op->node, &as->free);
+        return -1;
+    }
+
+    op->list = list;
+    op->handle = -1;
+    op->sent = b2th_now_ms();
+    op->deadline = op->sent + secs * B2TH_INQUIRY_UNIT_MS + B2TH_INQUIRY_MARGIN_MS;
+    op->seq = as->seq++;
+    op->wait_status = 1;
+    list_add_tail(&op->node, &as->sent);
+
+    b2th_async_arm(as);
+
+    return 0;
+}
+
+
+static void b2th_async_slice_cb(const b2th_async_event_t *ev, void *userdata)
+{
+    b2th_async_t *as = userdata;
+    struct b2th_async_discovery *d = &as->discovery;
+
+    if (ev->event == B2TH_ASYNC_INQUIRY_RESULT) {
+        d->found++;
+    } else if (ev->event == B2TH_ASYNC_INQUIRY_COMPLETE && ev->status > 0) {
+        // Refused, another process may be inquiring: retry later and later instead of flooding the controller
+        d->backoff_ms = d->backoff_ms ? d->backoff_ms * 2 : B2TH_DISCOVERY_BACKOFF_MS;
+        if (d->backoff_ms > B2TH_DISCOVERY_BACKOFF_MAX)
+            d->backoff_ms = B2TH_DISCOVERY_BACKOFF_MAX;
+        d->next = b2th_now_ms() + d->backoff_ms;
+        d->preempted = 0;
+    } else if (ev->event == B2TH_ASYNC_INQUIRY_COMPLETE) {
+        // Many arrivals: the environment changes, inquire longer. None: it is stable, give the time back to paging
+        if (d->found >= d->params.grow_devices)
+            d->slice = (d->slice * 2 < d->params.max_slice) ? d->slice * 2 : d->params.max_slice;
+        else if (!d->found && !d->preempted)
+            d->slice = (d->slice / 2 > d->params.min_slice) ? d->slice / 2 : d->params.min_slice;
+
+        long long now = b2th_now_ms();
+        d->next = now + (now - d->start) * (100 - d->params.duty_percent) / d->params.duty_percent;
+        d->preempted = 0;
+        d->backoff_ms = 0;
+    }
+
+    if (d->cb)
+        d->cb(ev, d->userdata);
+}
+
+
+static int b2th_async_slice_start(b2th_async_t *as)
+{
+    struct b2th_async_discovery *d = &as->discovery;
+
+    d->found = 0;
+    d->start = b2th_now_ms();
+    d->next = -1;
+
+    if (b2th_async_inquiry_send(as, d->slice, d->list, b2th_async_slice_cb, as) == 0)
+        return 0;
+
+    d->running = 0;
+    as->stats.errors++;
+
+    b2th_async_event_t ev = {
+        .event = B2TH_ASYNC_INQUIRY_COMPLETE,
+        .status = -1,
+        .handle = -1,
+    };
+
+    if (d->cb)
+        d->cb(&ev, d->userdata);
+
+    return -1;
+}
+
+
+static int b2th_async_schedule(b2th_async_t *as, long long now)
+{
+    struct b2th_async_discovery *d = &as->discovery;
+    if (!d->running)
+        return 0;
+
+    struct b2th_async_op *op = b2th_async_inquiry_op(as);
+    if (op) {
+        // A connection would otherwise wait up to a whole slice: the slice gives way
+        if (!b2th_async_connecting(as))
+            return 0;
+
+        b2th_async_cancel(as, op);
+        d->preempted = 1;
+        as->stats.inquiries_preempted++;
+        b2th_async_complete(as, op, 0, NULL);
+        return 1;
+    }
+
+    // Connections keep the controller until they complete, name requests already paging finish first
+    if (d->next > now || b2th_async_connecting(as) || as->pages)
+        return 0;
+
+    return (b2th_async_slice_start(as) == -1) ? 1 : 0;
+}
+
+
+static void b2th_async_publish(b2th_async_t *as)
+{
+    // Operations and devices allocated since the last call, from b2th_async_process() or the API calls before it
+    as->stats.allocs = b2th_allocs - as->allocs;
+    b2th_stats_scan_done(&as->stats, NULL);
+
+    memset(&as->stats, 0, sizeof(as->stats));
+    as->allocs = b2th_allocs;
+}
+
+
+b2th_async_t *b2th_async_create(b2th_device_t *local_device)
+{
+    if (!local_device)
+        return NULL;
+
+    int dev_id = b2th_get_dev_id(local_device->address);
+    if (dev_id < 0) {
+        printf("Couldn't retrieve bluetooth interface\n");
+        return NULL;
+    }
+
+    b2th_async_t *as = calloc(1, sizeof(struct b2th_async));
+    if (!as)
+        return NULL;
+
+    init_list(&as->pending);
+    init_list(&as->sent);
+    init_list(&as->free);
+    as->dev_id = dev_id;
+    as->max_pages = B2TH_ASYNC_PAGES;
+    as->armed = -1;
+    as->timer = -1;
+    as->epfd = -1;
+    as->allocs = b2th_allocs;
+
+    as->sock = b2th_hci_open_dev(dev_id);
+    if (as->sock < 0) {
+        perror("Failed to open HCI device");
+        free(as);
+        return NULL;
+    }
+
+    b2th_stats_socket_open();
+
+    struct hci_filter flt;
+    hci_filter_clear(&flt);
+    hci_filter_set_ptype(HCI_EVENT_PKT, &flt);
+    hci_filter_set_event(EVT_CMD_STATUS, &flt);
+    hci_filter_set_event(EVT_CMD_COMPLETE, &flt);
+    hci_filter_set_event(EVT_INQUIRY_RESULT, &flt);
+    hci_filter_set_event(EVT_INQUIRY_RESULT_WITH_RSSI, &flt);
+    hci_filter_set_event(EVT_EXTENDED_INQUIRY_RESULT, &flt);
+    hci_filter_set_event(EVT_INQUIRY_COMPLETE, &flt);
+    hci_filter_set_event(EVT_REMOTE_NAME_REQ_COMPLETE, &flt);
+    hci_filter_set_event(EVT_CONN_COMPLETE, &flt);
+    hci_filter_set_event(EVT_DISCONN_COMPLETE, &flt);
+    if (b2th_hci_set_filter(as->sock, &flt) == -1) {
+        perror("Failed to set HCI filter");
+        goto clean;
+    }
+
+    int flags = fcntl(as->sock, F_GETFL);
+    if (flags == -1 || fcntl(as->sock, F_SETFL, flags | O_NONBLOCK) == -1)
+        goto clean;
+
+    // One descriptor for the caller: readable on HCI events and on deadlines
+    as->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    as->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (as->timer == -1 || as->epfd == -1)
+        goto clean;
+
+    struct epoll_event ev = { .events = EPOLLIN };
+    ev.data.fd = as->sock;
+    if (epoll_ctl(as->epfd, EPOLL_CTL_ADD, as->sock, &ev) == -1)
+        goto clean;
+    ev.data.fd = as->timer;
+    if (epoll_ctl(as->epfd, EPOLL_CTL_ADD, as->timer, &ev) == -1)
+        goto clean;
+
+    return as;
+
+clean:
+    if (as->epfd != -1)
+        close(as->epfd);
+    if (as->timer != -1)
+        close(as->timer);
+    b2th_hci_close_dev(as->sock);
+    free(as);
+
+    return NULL;
+}
+
+
+int b2th_async_fd(b2th_async_t *as)
+{
+    return as ? as->epfd : -1;
+}
+
+
+int b2th_async_process(b2th_async_t *as)
+{
+    if (!as)
+        return -1;
+
+    // Expiry is checked against the clock: the timer only has to be drained
+    uint64_t expirations;
+    while (read(as->timer, &expirations, sizeof(expirations)) > 0)
+        ;
+
+    int count = 0;
+    int ret = 0;
+
+    // Bounded batch: a busy controller must not starve the rest of the event loop
+    int i;
+    for (i = 0; i < B2TH_ASYNC_BATCH; i++) {
+        unsigned char buf[HCI_MAX_EVENT_SIZE + 1];
+        ssize_t len = b2th_hci_read(as->sock, buf, sizeof(buf));
+        if (len == -1 && errno == EINTR)
+            continue;
+
+        if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+
+        if (len <= 0) {
+            perror("Failed to read HCI event");
+            as->stats.errors++;
+            ret = -1;
+            break;
+        }
+
+        as->stats.events++;
+        count += b2th_async_handle_event(as, buf, len);
+    }
+
+    count += b2th_async_expire(as, b2th_now_ms());
+    count += b2th_async_schedule(as, b2th_now_ms());
+    count += b2th_async_fill(as);
+    b2th_async_arm(as);
+
+    b2th_async_publish(as);
+
+    return (ret == -1) ? -1 : count;
+}
+
+
+static int b2th_async_start(b2th_async_t *as, struct b2th_async_op *op)
+{
+    if (b2th_async_paging(op)) {
+        list_add_tail(&op->node, &as->pending);
+        b2th_async_fill(as);
+    } else if (b2th_async_send(as, op) == -1) {
+        list_add_head(&op->node, &as->free);
+        return -1;
+    }
+
+    b2th_async_arm(as);
+
+    return 0;
+}
+
+
+int b2th_async_inquiry(b2th_async_t *as, unsigned int secs, b2th_list_t *list, b2th_async_cb_t cb, void *userdata)
+{
+    if (!as || as->discovery.running)
+        return -1;
+
+    return b2th_async_inquiry_send(as, secs, list, cb, userdata);
+}
+
+
+void b2th_discovery_params_init(b2th_discovery_params_t *params)
+{
+    params->min_slice = B2TH_DISCOVERY_MIN_SLICE;
+    params->max_slice = B2TH_DISCOVERY_MAX_SLICE;
+    params->duty_percent = B2TH_DISCOVERY_DUTY;
+    params->grow_devices = B2TH_DISCOVERY_GROW;
+}
+
+
+int b2th_async_discover(b2th_async_t *as, const b2th_discovery_params_t *params, b2th_list_t *list,
+        b2th_async_cb_t cb, void *userdata)
+{
+    if (!as || !list || as->discovery.running || b2th_async_inquiry_op(as))
+        return -1;
+
+    struct b2th_async_discovery *d = &as->discovery;
+    memset(d, 0, sizeof(*d));
+
+    if (params)
+        d->params = *params;
+    else
+        b2th_discovery_params_init(&d->params);
+
+    if (d->params.min_slice == 0)
+        d->params.min_slice = B2TH_DISCOVERY_MIN_SLICE;
+    if (d->params.max_slice < d->params.min_slice)
+        d->params.max_slice = d->params.min_slice;
+    if (d->params.duty_percent == 0 || d->params.duty_percent > 100)
+        d->params.duty_percent = B2TH_DISCOVERY_DUTY;
+    if (d->params.grow_devices == 0)
+        d->params.grow_devices = B2TH_DISCOVERY_GROW;
+
+    d->list = list;
+    d->cb = cb;
+    d->userdata = userdata;
+    d->slice = d->params.min_slice;
+    d->running = 1;
+
+    // Connections and name requests already under way finish first, the slice starts from b2th_async_process()
+    if (b2th_async_connecting(as) || as->pages) {
+        d->next = b2th_now_ms();
+        b2th_async_arm(as);
+        return 0;
+    }
+
+    d->start = b2th_now_ms();
+    d->next = -1;
+
+    if (b2th_async_inquiry_send(as, d->slice, d->list, b2th_async_slice_cb, as) == -1) {
+        d->running = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void b2th_async_discover_stop(b2th_async_t *as)
+{
+    if (!as || !as->discovery.running)
+        return;
+
+    as->discovery.running = 0;
+
+    struct b2th_async_op *op = b2th_async_inquiry_op(as);
+    if (op && op->cb == b2th_async_slice_cb) {
+        b2th_async_cancel(as, op);
+        list_del(&op->node);
+        list_add_head(&op->node, &as->free);
+        as->pages_deferred = 0;
+    }
+
+    b2th_async_arm(as);
+}
+
+
+int b2th_async_name(b2th_async_t *as, b2th_device_t *bd, unsigned int timeout_ms, b2th_async_cb_t cb, void *userdata)
+{
+    if (!as || !bd)
+        return -1;
+
+    struct b2th_async_op *op = b2th_async_op_new(as, OP_NAME, cb, userdata);
+    if (!op)
+        return -1;
+
+    op->bd = bd;
+    op->handle = -1;
+    op->timeout_ms = timeout_ms ? timeout_ms : B2TH_ASYNC_NAME_TIMEOUT;
+    str2ba(bd->address, &op->bdaddr);
+
+    return b2th_async_start(as, op);
+}
+
+
+int b2th_async_connect(b2th_async_t *as, b2th_device_t *bd, unsigned int timeout_ms, b2th_async_cb_t cb, void *userdata)
+{
+    if (!as || !bd)
+        return -1;
+
+    struct b2th_async_op *op = b2th_async_op_new(as, OP_CONNECT, cb, userdata);
+    if (!op)
+        return -1;
+
+    op->bd = bd;
+    op->handle = -1;
+    op->timeout_ms = timeout_ms ? timeout_ms : B2TH_CONN_TIMEOUT_MS;
+    str2ba(bd->address, &op->bdaddr);
+
+    return b2th_async_start(as, op);
+}
+
+
+int b2th_async_disconnect(b2th_async_t *as, int handle, b2th_async_cb_t cb, void *userdata)
+{
+    if (!as || handle < 0)
+        return -1;
+
+    struct b2th_async_op *op = b2th_async_op_new(as, OP_DISCONNECT, cb, userdata);
+    if (!op)
+        return -1;
+
+    op->handle = handle;
+    op->timeout_ms = B2TH_CONN_TIMEOUT_MS;
+
+    return b2th_async_start(as, op);
+}
+
+
+void b2th_async_destroy(b2th_async_t *as)
+{
+    if (!as)
+        return;
+
+    struct b2th_async_op *op, *save;
+    list_for_each_entry_safe(op, save, &as->sent, node) {
+        b2th_async_cancel(as, op);
+        list_del(&op->node);
+        free(op);
+    }
+
+    list_for_each_entry_safe(op, save, &as->pending, node) {
+        list_del(&op->node);
+        free(op);
+    }
+
+    list_for_each_entry_safe(op, save, &as->free, node) {
+        list_del(&op->node);
+        free(op);
+    }
+
+    b2th_async_publish(as);
+
+    close(as->epfd);
+    close(as->timer);
+    b2th_hci_close_dev(as->sock);
+    free(as);
+}
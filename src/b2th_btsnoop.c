@@ -0,0 +1,742 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "b2th_internal.h"
+
+
+/*
+ * Captures use the btsnoop "Linux monitor" datalink written by btmon: every
+ * record carries the controller index, so multi controller scans replay on
+ * the controller they were recorded on, and btmon -r reads them as is.
+ */
+
+#define B2TH_BTSNOOP_DATALINK       2001
+#define B2TH_BTSNOOP_EPOCH_US       0x00dcddb30f2f8000ULL   /* 0000-01-01 to 1970-01-01 in us */
+
+#define B2TH_MON_NEW_INDEX          0
+#define B2TH_MON_COMMAND_PKT        2
+#define B2TH_MON_EVENT_PKT          3
+#define B2TH_MON_OPEN_INDEX         8
+#define B2TH_MON_CLOSE_INDEX        9
+
+#define B2TH_BTSNOOP_MAX_SOCKS      64
+#define B2TH_REPLAY_MAX_LINKS       64
+
+
+static const unsigned char b2th_btsnoop_magic[8] = { 'b', 't', 's', 'n', 'o', 'o', 'p', 0 };
+
+
+struct b2th_btsnoop_hdr {
+    unsigned char magic[8];
+    uint32_t version;
+    uint32_t datalink;
+} __attribute__ ((packed));
+
+
+struct b2th_btsnoop_rec {
+    uint32_t orig_len;
+    uint32_t incl_len;
+    uint32_t flags;                     /* controller index << 16 | monitor opcode */
+    uint32_t drops;
+    uint64_t ts;                        /* us since 0000-01-01 */
+} __attribute__ ((packed));
+
+
+struct b2th_mon_new_index {
+    uint8_t type;
+    uint8_t bus;
+    bdaddr_t bdaddr;
+    char name[8];
+} __attribute__ ((packed));
+
+
+/*
+ * Recorder
+ */
+
+
+static struct {
+    pthread_mutex_t lock;               /**<! serializes writes of every thread */
+    FILE *file;                         /**<! capture, NULL when not recording */
+    struct {
+        int sock;
+        int dev_id;
+    } socks[B2TH_BTSNOOP_MAX_SOCKS];    /**<! controller of each socket opened while recording */
+    uint32_t announced;                 /**<! controllers already described by a NEW_INDEX record */
+} b2th_btsnoop = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+
+static int b2th_btsnoop_recording()
+{
+    return __atomic_load_n(&b2th_btsnoop.file, __ATOMIC_ACQUIRE) != NULL;
+}
+
+
+static void b2th_btsnoop_write(int dev_id, uint16_t opcode, const void *data1, size_t len1, const void *data2, size_t len2)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    struct b2th_btsnoop_rec rec = {
+        .orig_len = htobe32(len1 + len2),
+        .incl_len = htobe32(len1 + len2),
+        .flags = htobe32((uint32_t)dev_id << 16 | opcode),
+        .drops = 0,
+        .ts = htobe64(B2TH_BTSNOOP_EPOCH_US + (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000),
+    };
+
+    fwrite(&rec, sizeof(rec), 1, b2th_btsnoop.file);
+    if (len1)
+        fwrite(data1, len1, 1, b2th_btsnoop.file);
+    if (len2)
+        fwrite(data2, len2, 1, b2th_btsnoop.file);
+}
+
+
+static int b2th_btsnoop_dev_id(int sock)
+{
+    size_t i;
+    for (i = 0; i < B2TH_BTSNOOP_MAX_SOCKS; i++)
+        if (b2th_btsnoop.socks[i].dev_id >= 0 && b2th_btsnoop.socks[i].sock == sock)
+            return b2th_btsnoop.socks[i].dev_id;
+
+    return -1;
+}
+
+
+int b2th_btsnoop_record_start(const char *path)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        perror("Failed to open btsnoop capture");
+        return -1;
+    }
+
+    struct b2th_btsnoop_hdr hdr = {
+        .version = htobe32(1),
+        .datalink = htobe32(B2TH_BTSNOOP_DATALINK),
+    };
+    memcpy(hdr.magic, b2th_btsnoop_magic, sizeof(hdr.magic));
+
+    if (fwrite(&hdr, sizeof(hdr), 1, file) != 1) {
+        perror("Failed to write btsnoop capture");
+        fclose(file);
+        return -1;
+    }
+
+    b2th_btsnoop_record_stop();
+
+    pthread_mutex_lock(&b2th_btsnoop.lock);
+    size_t i;
+    for (i = 0; i < B2TH_BTSNOOP_MAX_SOCKS; i++)
+        b2th_btsnoop.socks[i].dev_id = -1;
+    b2th_btsnoop.announced = 0;
+    __atomic_store_n(&b2th_btsnoop.file, file, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&b2th_btsnoop.lock);
+
+    return 0;
+}
+
+
+void b2th_btsnoop_record_stop()
+{
+    pthread_mutex_lock(&b2th_btsnoop.lock);
+    FILE *file = b2th_btsnoop.file;
+    __atomic_store_n(&b2th_btsnoop.file, NULL, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&b2th_btsnoop.lock);
+
+    if (file)
+        fclose(file);
+}
+
+
+void b2th_btsnoop_open(int sock, int dev_id)
+{
+    if (!b2th_btsnoop_recording() || dev_id < 0)
+        return;
+
+    // Describe the controller once, so the replay can list it again
+    struct hci_dev_info di[HCI_MAX_DEV];
+    int nb_dev = -1;
+    if (dev_id < 32 && !(__atomic_load_n(&b2th_btsnoop.announced, __ATOMIC_ACQUIRE) & (1U << dev_id)))
+        nb_dev = b2th_hci_get_dev_list(di, HCI_MAX_DEV);
+
+    pthread_mutex_lock(&b2th_btsnoop.lock);
+    if (!b2th_btsnoop.file)
+        goto unlock;
+
+    int i;
+    for (i = 0; i < nb_dev; i++) {
+        if (di[i].dev_id != dev_id || (b2th_btsnoop.announced & (1U << dev_id)))
+            continue;
+
+        struct b2th_mon_new_index ni = { .type = 0x00, .bus = 0x00 };
+        bacpy(&ni.bdaddr, &di[i].bdaddr);
+        memcpy(ni.name, di[i].name, sizeof(ni.name));
+        b2th_btsnoop_write(dev_id, B2TH_MON_NEW_INDEX, &ni, sizeof(ni), NULL, 0);
+        b2th_btsnoop.announced |= 1U << dev_id;
+    }
+
+    for (i = 0; i < B2TH_BTSNOOP_MAX_SOCKS; i++) {
+        if (b2th_btsnoop.socks[i].dev_id < 0) {
+            b2th_btsnoop.socks[i].sock = sock;
+            b2th_btsnoop.socks[i].dev_id = dev_id;
+            break;
+        }
+    }
+
+    // Each socket is one session: the replay serves it to one open of the controller
+    b2th_btsnoop_write(dev_id, B2TH_MON_OPEN_INDEX, NULL, 0, NULL, 0);
+
+unlock:
+    pthread_mutex_unlock(&b2th_btsnoop.lock);
+}
+
+
+void b2th_btsnoop_close(int sock)
+{
+    if (!b2th_btsnoop_recording())
+        return;
+
+    pthread_mutex_lock(&b2th_btsnoop.lock);
+    if (b2th_btsnoop.file) {
+        size_t i;
+        for (i = 0; i < B2TH_BTSNOOP_MAX_SOCKS; i++) {
+            if (b2th_btsnoop.socks[i].dev_id >= 0 && b2th_btsnoop.socks[i].sock == sock) {
+                b2th_btsnoop_write(b2th_btsnoop.socks[i].dev_id, B2TH_MON_CLOSE_INDEX, NULL, 0, NULL, 0);
+                b2th_btsnoop.socks[i].dev_id = -1;
+                break;
+            }
+        }
+        fflush(b2th_btsnoop.file);
+    }
+    pthread_mutex_unlock(&b2th_btsnoop.lock);
+}
+
+
+void b2th_btsnoop_command(int sock, uint16_t ogf, uint16_t ocf, uint8_t plen, const void *param)
+{
+    if (!b2th_btsnoop_recording())
+        return;
+
+    hci_command_hdr hdr = {
+        .opcode = htobs(cmd_opcode_pack(ogf, ocf)),
+        .plen = plen,
+    };
+
+    pthread_mutex_lock(&b2th_btsnoop.lock);
+    int dev_id = b2th_btsnoop_dev_id(sock);
+    if (b2th_btsnoop.file && dev_id >= 0)
+        b2th_btsnoop_write(dev_id, B2TH_MON_COMMAND_PKT, &hdr, HCI_COMMAND_HDR_SIZE, param, plen);
+    pthread_mutex_unlock(&b2th_btsnoop.lock);
+}
+
+
+void b2th_btsnoop_event(int sock, const unsigned char *buf, size_t len)
+{
+    if (!b2th_btsnoop_recording() || len < 1 || buf[0] != HCI_EVENT_PKT)
+        return;
+
+    pthread_mutex_lock(&b2th_btsnoop.lock);
+    int dev_id = b2th_btsnoop_dev_id(sock);
+    if (b2th_btsnoop.file && dev_id >= 0)
+        b2th_btsnoop_write(dev_id, B2TH_MON_EVENT_PKT, buf + 1, len - 1, NULL, 0);
+    pthread_mutex_unlock(&b2th_btsnoop.lock);
+}
+
+
+void b2th_btsnoop_reply(int sock, int event, const void *param, size_t len)
+{
+    if (!b2th_btsnoop_recording())
+        return;
+
+    hci_event_hdr hdr = {
+        .evt = event,
+        .plen = len,
+    };
+
+    pthread_mutex_lock(&b2th_btsnoop.lock);
+    int dev_id = b2th_btsnoop_dev_id(sock);
+    if (b2th_btsnoop.file && dev_id >= 0)
+        b2th_btsnoop_write(dev_id, B2TH_MON_EVENT_PKT, &hdr, HCI_EVENT_HDR_SIZE, param, len);
+    pthread_mutex_unlock(&b2th_btsnoop.lock);
+}
+
+
+/*
+ * Replay
+ */
+
+
+/*!
+ * \brief record of a loaded capture
+ */
+struct b2th_replay_rec {
+    uint64_t ts;                        /**<! timestamp in us */
+    uint16_t index;                     /**<! controller index */
+    uint16_t opcode;                    /**<! monitor opcode */
+    uint32_t len;                       /**<! payload length */
+    unsigned char *data;                /**<! payload, points into the capture buffer */
+};
+
+
+/*!
+ * \brief one socket opened on a replayed controller, serving one recorded session
+ */
+struct b2th_replay_link {
+    struct b2th_replay *replay;         /**<! replay owning the link */
+    int dev_id;                         /**<! replayed controller */
+    int fds[2];                         /**<! library side, controller side */
+    pthread_t thread;                   /**<! event delivery thread */
+    pthread_mutex_t lock;               /**<! protects stop and cmds_sent */
+    pthread_cond_t cond;                /**<! signaled on new commands and on close */
+    int stop;                           /**<! close requested */
+    size_t begin;                       /**<! first record of the session */
+    size_t end;                         /**<! record ending the session */
+    uint64_t cmds_sent;                 /**<! commands sent by the library */
+};
+
+
+/*!
+ * \brief controllers replaying a btsnoop capture
+ */
+struct b2th_replay {
+    struct b2th_transport transport;    /**<! must stay first */
+    unsigned int speed;                 /**<! time divider, 0 for no delay at all */
+    unsigned char *buf;                 /**<! capture content */
+    struct b2th_replay_rec *recs;       /**<! records in capture order */
+    size_t nb_recs;                     /**<! number of records */
+    pthread_mutex_t lock;               /**<! protects cursors and links */
+    struct {
+        int present;                    /**<! controller found in the capture */
+        bdaddr_t bdaddr;                /**<! controller address, from NEW_INDEX */
+        char name[8];                   /**<! controller name, from NEW_INDEX */
+        size_t cursor;                  /**<! where the next session of this controller starts */
+    } index[HCI_MAX_DEV];
+    struct b2th_replay_link *links[B2TH_REPLAY_MAX_LINKS];
+};
+
+
+static void *b2th_replay_link_thread(void *arg)
+{
+    struct b2th_replay_link *link = arg;
+    struct b2th_replay *replay = link->replay;
+    unsigned char buf[HCI_MAX_EVENT_SIZE + 1];
+    uint64_t cmds_seen = 0;
+
+    // Events are timed against the last command: the capture's own pace, whatever the library's
+    uint64_t anchor_ts = replay->recs[link->begin].ts;
+    struct timespec anchor;
+    clock_gettime(CLOCK_MONOTONIC, &anchor);
+
+    size_t pos;
+    for (pos = link->begin; pos < link->end; pos++) {
+        const struct b2th_replay_rec *rec = &replay->recs[pos];
+        if (rec->index != link->dev_id)
+            continue;
+
+        pthread_mutex_lock(&link->lock);
+
+        if (rec->opcode == B2TH_MON_COMMAND_PKT) {
+            while (!link->stop && link->cmds_sent == cmds_seen)
+                pthread_cond_wait(&link->cond, &link->lock);
+            cmds_seen++;
+            anchor_ts = rec->ts;
+            clock_gettime(CLOCK_MONOTONIC, &anchor);
+        } else if (rec->opcode == B2TH_MON_EVENT_PKT && replay->speed && rec->ts > anchor_ts) {
+            long long delay_us = (rec->ts - anchor_ts) / replay->speed;
+            struct timespec due = anchor;
+            due.tv_sec += delay_us / 1000000;
+            due.tv_nsec += (delay_us % 1000000) * 1000;
+            if (due.tv_nsec >= 1000000000) {
+                due.tv_sec++;
+                due.tv_nsec -= 1000000000;
+            }
+            while (!link->stop && pthread_cond_timedwait(&link->cond, &link->lock, &due) != ETIMEDOUT)
+                ;
+        }
+
+        int stop = link->stop;
+        pthread_mutex_unlock(&link->lock);
+        if (stop)
+            break;
+
+        if (rec->opcode != B2TH_MON_EVENT_PKT || rec->len + 1 > sizeof(buf))
+            continue;
+
+        buf[0] = HCI_EVENT_PKT;
+        memcpy(buf + 1, rec->data, rec->len);
+        if (send(link->fds[1], buf, rec->len + 1, MSG_NOSIGNAL) == -1)
+            break;
+    }
+
+    return NULL;
+}
+
+
+static struct b2th_replay_link *b2th_replay_link_get(struct b2th_replay *replay, int sock)
+{
+    struct b2th_replay_link *link = NULL;
+
+    pthread_mutex_lock(&replay->lock);
+    size_t i;
+    for (i = 0; i < B2TH_REPLAY_MAX_LINKS && !link; i++)
+        if (replay->links[i] && replay->links[i]->fds[0] == sock)
+            link = replay->links[i];
+    pthread_mutex_unlock(&replay->lock);
+
+    return link;
+}
+
+
+static int b2th_replay_get_dev_list(struct b2th_transport *t, struct hci_dev_info *di, int max)
+{
+    struct b2th_replay *replay = (struct b2th_replay *)t;
+
+    int i, count = 0;
+    for (i = 0; i < HCI_MAX_DEV && count < max; i++) {
+        if (!replay->index[i].present)
+            continue;
+
+        memset(&di[count], 0, sizeof(di[count]));
+        di[count].dev_id = i;
+        bacpy(&di[count].bdaddr, &replay->index[i].bdaddr);
+        memcpy(di[count].name, replay->index[i].name, sizeof(di[count].name));
+        di[count].name[sizeof(di[count].name) - 1] = '\0';
+        count++;
+    }
+
+    return count;
+}
+
+
+static int b2th_replay_get_dev_id(struct b2th_transport *t, const char *interface)
+{
+    struct b2th_replay *replay = (struct b2th_replay *)t;
+
+    bdaddr_t ba;
+    int check_ba = interface && strncmp(interface, "hci", 3) != 0 && bachk(interface) == 0;
+    if (check_ba)
+        str2ba(interface, &ba);
+
+    int i;
+    for (i = 0; i < HCI_MAX_DEV; i++) {
+        if (!replay->index[i].present)
+            continue;
+
+        if (!interface || (check_ba && bacmp(&ba, &replay->index[i].bdaddr) == 0)
+                || (!check_ba && strncmp(interface, "hci", 3) == 0 && atoi(interface + 3) == i))
+            return i;
+    }
+
+    return -1;
+}
+
+
+static int b2th_replay_close_dev(struct b2th_transport *t, int sock)
+{
+    struct b2th_replay *replay = (struct b2th_replay *)t;
+    struct b2th_replay_link *link = NULL;
+
+    pthread_mutex_lock(&replay->lock);
+    size_t i;
+    for (i = 0; i < B2TH_REPLAY_MAX_LINKS && !link; i++) {
+        if (replay->links[i] && replay->links[i]->fds[0] == sock) {
+            link = replay->links[i];
+            replay->links[i] = NULL;
+        }
+    }
+    pthread_mutex_unlock(&replay->lock);
+
+    if (!link)
+        return -1;
+
+    pthread_mutex_lock(&link->lock);
+    link->stop = 1;
+    pthread_cond_signal(&link->cond);
+    pthread_mutex_unlock(&link->lock);
+
+    shutdown(link->fds[0], SHUT_RDWR);
+    pthread_join(link->thread, NULL);
+
+    close(link->fds[0]);
+    close(link->fds[1]);
+    pthread_cond_destroy(&link->cond);
+    pthread_mutex_destroy(&link->lock);
+    free(link);
+
+    return 0;
+}
+
+
+static int b2th_replay_open_dev(struct b2th_transport *t, int dev_id)
+{
+    struct b2th_replay *replay = (struct b2th_replay *)t;
+
+    if (dev_id < 0 || dev_id >= HCI_MAX_DEV || !replay->index[dev_id].present) {
+        errno = ENODEV;
+        return -1;
+    }
+
+    struct b2th_replay_link *link = calloc(1, sizeof(struct b2th_replay_link));
+    if (!link)
+        return -1;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, link->fds) == -1) {
+        free(link);
+        return -1;
+    }
+
+    link->replay = replay;
+    link->dev_id = dev_id;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&link->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&link->lock, NULL);
+
+    pthread_mutex_lock(&replay->lock);
+
+    // The next recorded session of this controller, the rest of the capture without session markers
+    size_t pos = replay->index[dev_id].cursor;
+    size_t begin = pos;
+    for (; pos < replay->nb_recs; pos++) {
+        if (replay->recs[pos].index == dev_id && replay->recs[pos].opcode == B2TH_MON_OPEN_INDEX) {
+            begin = pos;
+            break;
+        }
+    }
+
+    link->begin = begin;
+    link->end = replay->nb_recs;
+    for (pos = begin + 1; pos < replay->nb_recs; pos++) {
+        if (replay->recs[pos].index == dev_id && replay->recs[pos].opcode == B2TH_MON_CLOSE_INDEX) {
+            link->end = pos;
+            break;
+        }
+    }
+    replay->index[dev_id].cursor = (link->end < replay->nb_recs) ? link->end + 1 : replay->nb_recs;
+
+    size_t i;
+    for (i = 0; i < B2TH_REPLAY_MAX_LINKS && replay->links[i]; i++)
+        ;
+    if (i < B2TH_REPLAY_MAX_LINKS)
+        replay->links[i] = link;
+
+    pthread_mutex_unlock(&replay->lock);
+
+    if (i == B2TH_REPLAY_MAX_LINKS || link->begin >= replay->nb_recs
+            || b2th_thread_create(&link->thread, NULL, b2th_replay_link_thread, link) != 0) {
+        if (i < B2TH_REPLAY_MAX_LINKS) {
+            pthread_mutex_lock(&replay->lock);
+            replay->links[i] = NULL;
+            pthread_mutex_unlock(&replay->lock);
+        }
+        close(link->fds[0]);
+        close(link->fds[1]);
+        pthread_cond_destroy(&link->cond);
+        pthread_mutex_destroy(&link->lock);
+        free(link);
+        errno = ENODEV;
+        return -1;
+    }
+
+    return link->fds[0];
+}
+
+
+static int b2th_replay_set_filter(struct b2th_transport *t, int sock, const struct hci_filter *flt)
+{
+    (void)flt;
+
+    // The capture only holds the events the library asked for
+    return b2th_replay_link_get((struct b2th_replay *)t, sock) ? 0 : -1;
+}
+
+
+static int b2th_replay_send_cmd(struct b2th_transport *t, int sock, uint16_t ogf, uint16_t ocf, uint8_t plen, void *param)
+{
+    (void)ogf;
+    (void)ocf;
+    (void)plen;
+    (void)param;
+
+    struct b2th_replay_link *link = b2th_replay_link_get((struct b2th_replay *)t, sock);
+    if (!link)
+        return -1;
+
+    // Commands only release the recorded answers, their content is not checked
+    pthread_mutex_lock(&link->lock);
+    link->cmds_sent++;
+    pthread_cond_signal(&link->cond);
+    pthread_mutex_unlock(&link->lock);
+
+    return 0;
+}
+
+
+static int b2th_replay_send_req(struct b2th_transport *t, int sock, struct hci_request *rq, int timeout_ms)
+{
+    if (b2th_replay_send_cmd(t, sock, rq->ogf, rq->ocf, rq->clen, rq->cparam) == -1)
+        return -1;
+
+    // Wait for the recorded reply the same way hci_send_req() waits on a raw socket
+    unsigned char buf[HCI_MAX_EVENT_SIZE + 1];
+    struct pollfd pfd = { .fd = sock, .events = POLLIN };
+    for (;;) {
+        int ret = poll(&pfd, 1, timeout_ms > 0 ? timeout_ms : -1);
+        if (ret <= 0) {
+            errno = ret ? errno : ETIMEDOUT;
+            return -1;
+        }
+
+        ssize_t len = read(sock, buf, sizeof(buf));
+        if (len <= 0)
+            return -1;
+
+        hci_event_hdr *hdr = (hci_event_hdr *)(buf + 1);
+        if (len < 1 + HCI_EVENT_HDR_SIZE || hdr->evt != rq->event)
+            continue;
+
+        size_t plen = len - 1 - HCI_EVENT_HDR_SIZE;
+        memcpy(rq->rparam, buf + 1 + HCI_EVENT_HDR_SIZE, plen < (size_t)rq->rlen ? plen : (size_t)rq->rlen);
+        return 0;
+    }
+}
+
+
+static int b2th_replay_load(struct b2th_replay *replay, const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        perror("Failed to open btsnoop capture");
+        return -1;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    replay->buf = malloc(size > 0 ? size : 1);
+    if (!replay->buf || size < (long)sizeof(struct b2th_btsnoop_hdr) || fread(replay->buf, size, 1, file) != 1) {
+        fprintf(stderr, "Failed to read btsnoop capture %s\n", path);
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+
+    struct b2th_btsnoop_hdr *hdr = (struct b2th_btsnoop_hdr *)replay->buf;
+    if (memcmp(hdr->magic, b2th_btsnoop_magic, sizeof(hdr->magic)) != 0 || be32toh(hdr->datalink) != B2TH_BTSNOOP_DATALINK) {
+        fprintf(stderr, "%s is not a btsnoop monitor capture\n", path);
+        return -1;
+    }
+
+    size_t off = sizeof(*hdr), nb_alloc = 0;
+    while (off + sizeof(struct b2th_btsnoop_rec) <= (size_t)size) {
+        struct b2th_btsnoop_rec *rec = (struct b2th_btsnoop_rec *)(replay->buf + off);
+        uint32_t len = be32toh(rec->incl_len);
+        off += sizeof(*rec);
+        if (off + len > (size_t)size)
+            break;
+
+        if (replay->nb_recs == nb_alloc) {
+            nb_alloc = nb_alloc ? nb_alloc * 2 : 1024;
+            struct b2th_replay_rec *recs = realloc(replay->recs, nb_alloc * sizeof(struct b2th_replay_rec));
+            if (!recs)
+                return -1;
+            replay->recs = recs;
+        }
+
+        uint32_t flags = be32toh(rec->flags);
+        struct b2th_replay_rec *r = &replay->recs[replay->nb_recs++];
+        r->ts = be64toh(rec->ts);
+        r->index = flags >> 16;
+        r->opcode = flags & 0xffff;
+        r->len = len;
+        r->data = replay->buf + off;
+        off += len;
+
+        if (r->index >= HCI_MAX_DEV) {
+            replay->nb_recs--;
+            continue;
+        }
+
+        replay->index[r->index].present = 1;
+        if (r->opcode == B2TH_MON_NEW_INDEX && len >= sizeof(struct b2th_mon_new_index)) {
+            struct b2th_mon_new_index *ni = (struct b2th_mon_new_index *)r->data;
+            bacpy(&replay->index[r->index].bdaddr, &ni->bdaddr);
+            memcpy(replay->index[r->index].name, ni->name, sizeof(ni->name));
+        }
+    }
+
+    int i;
+    for (i = 0; i < HCI_MAX_DEV; i++)
+        if (replay->index[i].present && replay->index[i].name[0] == '\0')
+            snprintf(replay->index[i].name, sizeof(replay->index[i].name), "hci%d", i);
+
+    return 0;
+}
+
+
+b2th_transport_t *b2th_replay_create(const char *path, unsigned int speed)
+{
+    struct b2th_replay *replay = calloc(1, sizeof(struct b2th_replay));
+    if (!replay)
+        return NULL;
+
+    replay->speed = speed;
+    replay->transport = (struct b2th_transport) {
+        .name = "replay",
+        .get_dev_list = b2th_replay_get_dev_list,
+        .get_dev_id = b2th_replay_get_dev_id,
+        .open_dev = b2th_replay_open_dev,
+        .close_dev = b2th_replay_close_dev,
+        .set_filter = b2th_replay_set_filter,
+        .send_cmd = b2th_replay_send_cmd,
+        .send_req = b2th_replay_send_req,
+    };
+
+    if (b2th_replay_load(replay, path) == -1) {
+        free(replay->recs);
+        free(replay->buf);
+        free(replay);
+        return NULL;
+    }
+
+    pthread_mutex_init(&replay->lock, NULL);
+
+    return &replay->transport;
+}
+
+
+void b2th_replay_destroy(b2th_transport_t *transport)
+{
+    struct b2th_replay *replay = (struct b2th_replay *)transport;
+    if (!replay)
+        return;
+
+    size_t i;
+    for (i = 0; i < B2TH_REPLAY_MAX_LINKS; i++)
+        if (replay->links[i])
+            b2th_replay_close_dev(transport, replay->links[i]->fds[0]);
+
+    pthread_mutex_destroy(&replay->lock);
+    free(replay->recs);
+    free(replay->buf);
+    free(replay);
+}
@@ -0,0 +1,379 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "b2th_internal.h"
+
+
+#define B2TH_CACHE_MAGIC    0x68743262  /* "b2th" */
+#define B2TH_CACHE_VERSION  2
+#define B2TH_CACHE_PROBE    32          /* slots searched from the home slot of an address */
+#define B2TH_CACHE_SDP_UUIDS 8          /* UUIDs of the last service search kept */
+
+
+/*
+ * Cache file layout: one header followed by a power of two number of
+ * entries, indexed by open addressing on the 48-bit device address.
+ * The same layout is used for anonymous (in-memory) caches.
+ */
+struct b2th_cache_hdr {
+    uint32_t magic;                     /**<! B2TH_CACHE_MAGIC */
+    uint32_t version;                   /**<! B2TH_CACHE_VERSION */
+    uint64_t capacity;                  /**<! number of entries following the header */
+};
+
+
+struct b2th_cache_entry {
+    uint64_t key;                       /**<! 48-bit device address */
+    int64_t seen;                       /**<! last time the device answered an inquiry (epoch secs) */
+    int64_t named;                      /**<! last time the device name was resolved (epoch secs) */
+    uint32_t dev_class;                 /**<! 24-bit class of device */
+    uint16_t clock_offset;              /**<! clock offset, bit 15 set when valid */
+    uint8_t pscan_rep_mode;             /**<! page scan repetition mode */
+    uint8_t used;                       /**<! slot holds a device */
+    char name[HCI_MAX_NAME_LENGTH + 1];           /**<! last resolved name, empty if never resolved */
+    int64_t discovered;                 /**<! last time the services were searched (epoch secs) */
+    uint16_t sdp_uuids[B2TH_CACHE_SDP_UUIDS];     /**<! UUIDs searched, the unused ones are 0 */
+    uint8_t nb_services;                /**<! services found */
+    b2th_service_t services[B2TH_SDP_MAX_SERVICES]; /**<! services found for those UUIDs */
+};
+
+
+struct b2th_cache {
+    struct b2th_cache_hdr *hdr;         /**<! start of the cache storage */
+    struct b2th_cache_entry *entries;   /**<! entry table */
+    size_t capacity;                    /**<! number of entries, power of two */
+    size_t size;                        /**<! storage size in bytes */
+    int mapped;                         /**<! storage is a memory-mapped file */
+    unsigned int presence_ttl;          /**<! seconds a device stays present after its last sighting */
+    unsigned int name_ttl;              /**<! seconds a resolved name is trusted */
+};
+
+
+static size_t b2th_cache_home(b2th_cache_t *cache, uint64_t key)
+{
+    return (key * 0x9e3779b97f4a7c15ULL) >> 16 & (cache->capacity - 1);
+}
+
+
+static struct b2th_cache_entry *b2th_cache_find(b2th_cache_t *cache, uint64_t key)
+{
+    size_t home = b2th_cache_home(cache, key);
+
+    size_t i;
+    for (i = 0; i < B2TH_CACHE_PROBE && i < cache->capacity; i++) {
+        struct b2th_cache_entry *e = &cache->entries[(home + i) & (cache->capacity - 1)];
+        if (!e->used)
+            return NULL;
+        if (e->key == key)
+            return e;
+    }
+
+    return NULL;
+}
+
+
+static struct b2th_cache_entry *b2th_cache_slot(b2th_cache_t *cache, uint64_t key)
+{
+    size_t home = b2th_cache_home(cache, key);
+    struct b2th_cache_entry *oldest = NULL;
+
+    size_t i;
+    for (i = 0; i < B2TH_CACHE_PROBE && i < cache->capacity; i++) {
+        struct b2th_cache_entry *e = &cache->entries[(home + i) & (cache->capacity - 1)];
+        if (e->used && e->key == key)
+            return e;
+
+        if (!e->used) {
+            oldest = e;
+            break;
+        }
+
+        if (!oldest || e->seen < oldest->seen)
+            oldest = e;
+    }
+
+    // Probe window full: the device seen the longest time ago makes room
+    memset(oldest, 0, sizeof(*oldest));
+    oldest->key = key;
+    oldest->used = 1;
+
+    return oldest;
+}
+
+
+static int b2th_cache_fresh(int64_t stamp, unsigned int ttl)
+{
+    return stamp != 0 && time(NULL) - stamp < (int64_t)ttl;
+}
+
+
+static int b2th_cache_map(b2th_cache_t *cache, const char *path)
+{
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        perror("Failed to open cache file");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (st.st_size != (off_t)cache->size && ftruncate(fd, cache->size) == -1)) {
+        perror("Failed to size cache file");
+        close(fd);
+        return -1;
+    }
+
+    void *addr = mmap(NULL, cache->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        perror("Failed to map cache file");
+        return -1;
+    }
+
+    cache->hdr = addr;
+    cache->mapped = 1;
+
+    return 0;
+}
+
+
+b2th_cache_t *b2th_cache_open(const char *path, size_t capacity, unsigned int presence_ttl, unsigned int name_ttl)
+{
+    b2th_cache_t *cache = calloc(1, sizeof(b2th_cache_t));
+    if (!cache)
+        return NULL;
+
+    cache->capacity = 1;
+    while (cache->capacity < capacity)
+        cache->capacity <<= 1;
+
+    cache->size = sizeof(struct b2th_cache_hdr) + cache->capacity * sizeof(struct b2th_cache_entry);
+    cache->presence_ttl = presence_ttl;
+    cache->name_ttl = name_ttl;
+
+    if (path) {
+        if (b2th_cache_map(cache, path) == -1) {
+            free(cache);
+            return NULL;
+        }
+    } else {
+        cache->hdr = calloc(1, cache->size);
+        if (!cache->hdr) {
+            free(cache);
+            return NULL;
+        }
+    }
+
+    cache->entries = (struct b2th_cache_entry *)(cache->hdr + 1);
+
+    // Start over if the file was written by another version or with another capacity
+    if (cache->hdr->magic != B2TH_CACHE_MAGIC || cache->hdr->version != B2TH_CACHE_VERSION
+            || cache->hdr->capacity != cache->capacity) {
+        memset(cache->hdr, 0, cache->size);
+        cache->hdr->magic = B2TH_CACHE_MAGIC;
+        cache->hdr->version = B2TH_CACHE_VERSION;
+        cache->hdr->capacity = cache->capacity;
+    }
+
+    return cache;
+}
+
+
+void b2th_cache_close(b2th_cache_t *cache)
+{
+    if (!cache)
+        return;
+
+    if (cache->mapped) {
+        msync(cache->hdr, cache->size, MS_ASYNC);
+        munmap(cache->hdr, cache->size);
+    } else {
+        free(cache->hdr);
+    }
+
+    free(cache);
+}
+
+
+int b2th_cache_update(b2th_cache_t *cache, const b2th_device_t *bd)
+{
+    uint64_t key;
+    if (!cache || !bd || b2th_str_to_key(bd->address, &key) == -1)
+        return -1;
+
+    struct b2th_cache_entry *e = b2th_cache_slot(cache, key);
+
+    e->seen = time(NULL);
+    e->dev_class = bd->dev_class;
+    if (bd->clock_offset) {
+        e->clock_offset = bd->clock_offset;
+        e->pscan_rep_mode = bd->pscan_rep_mode;
+    }
+
+    if (bd->name && strcmp(bd->name, B2TH_UNKNOWN_NAME) != 0) {
+        strncpy(e->name, bd->name, sizeof(e->name) - 1);
+        e->named = e->seen;
+    }
+
+    return 0;
+}
+
+
+int b2th_cache_get_name(b2th_cache_t *cache, const char *address, char *name, size_t len)
+{
+    uint64_t key;
+    if (!cache || len == 0 || b2th_str_to_key(address, &key) == -1)
+        return -1;
+
+    struct b2th_cache_entry *e = b2th_cache_find(cache, key);
+    if (!e || !b2th_cache_fresh(e->named, cache->name_ttl))
+        return -1;
+
+    strncpy(name, e->name, len - 1);
+    name[len - 1] = '\0';
+
+    return 0;
+}
+
+
+static b2th_device_t *b2th_cache_device(b2th_cache_t *cache, struct b2th_cache_entry *e, b2th_list_t *bl)
+{
+    bdaddr_t ba;
+    char address[18];
+    b2th_key_to_bdaddr(e->key, &ba);
+    ba2str(&ba, address);
+
+    const char *name = b2th_cache_fresh(e->named, cache->name_ttl) ? e->name : B2TH_UNKNOWN_NAME;
+
+    b2th_device_t *bd = bl ? b2th_list_add_node(bl, address, name) : b2th_device_create(address, name);
+    if (!bd)
+        return NULL;
+
+    bd->dev_class = e->dev_class;
+    bd->pscan_rep_mode = e->pscan_rep_mode;
+    bd->clock_offset = e->clock_offset;
+
+    return bd;
+}
+
+
+b2th_device_t *b2th_cache_get_device_by_addr(b2th_cache_t *cache, const char *address)
+{
+    uint64_t key;
+    if (!cache || b2th_str_to_key(address, &key) == -1)
+        return NULL;
+
+    struct b2th_cache_entry *e = b2th_cache_find(cache, key);
+    if (!e || !b2th_cache_fresh(e->seen, cache->presence_ttl))
+        return NULL;
+
+    return b2th_cache_device(cache, e, NULL);
+}
+
+
+b2th_device_t *b2th_cache_get_device_by_name(b2th_cache_t *cache, const char *name)
+{
+    if (!cache || !name)
+        return NULL;
+
+    size_t i;
+    for (i = 0; i < cache->capacity; i++) {
+        struct b2th_cache_entry *e = &cache->entries[i];
+        if (e->used && b2th_cache_fresh(e->seen, cache->presence_ttl)
+                && b2th_cache_fresh(e->named, cache->name_ttl) && strcmp(e->name, name) == 0)
+            return b2th_cache_device(cache, e, NULL);
+    }
+
+    return NULL;
+}
+
+
+b2th_list_t *b2th_cache_get_list(b2th_cache_t *cache)
+{
+    if (!cache)
+        return NULL;
+
+    b2th_list_t *bl = b2th_list_init();
+    if (!bl)
+        return NULL;
+
+    size_t i;
+    for (i = 0; i < cache->capacity; i++) {
+        struct b2th_cache_entry *e = &cache->entries[i];
+        if (!e->used || !b2th_cache_fresh(e->seen, cache->presence_ttl))
+            continue;
+
+        b2th_cache_device(cache, e, bl);
+    }
+
+    return bl;
+}
+
+
+static int b2th_cache_searched(const struct b2th_cache_entry *e, uint16_t uuid)
+{
+    size_t i;
+    for (i = 0; i < B2TH_CACHE_SDP_UUIDS && e->sdp_uuids[i]; i++)
+        if (e->sdp_uuids[i] == uuid)
+            return 1;
+
+    return 0;
+}
+
+
+int b2th_cache_get_services(b2th_cache_t *cache, uint64_t key, const uint16_t *uuids, size_t nb_uuids,
+        b2th_service_t *services)
+{
+    if (!cache)
+        return -1;
+
+    struct b2th_cache_entry *e = b2th_cache_find(cache, key);
+    if (!e || !b2th_cache_fresh(e->discovered, cache->name_ttl))
+        return -1;
+
+    // Only an answer if every UUID asked for was part of the last search
+    size_t i;
+    for (i = 0; i < nb_uuids; i++)
+        if (!b2th_cache_searched(e, uuids[i]))
+            return -1;
+
+    int nb_services = 0;
+    for (i = 0; i < e->nb_services && i < B2TH_SDP_MAX_SERVICES; i++) {
+        size_t j;
+        for (j = 0; j < nb_uuids; j++) {
+            if (e->services[i].uuid == uuids[j]) {
+                services[nb_services++] = e->services[i];
+                break;
+            }
+        }
+    }
+
+    return nb_services;
+}
+
+
+int b2th_cache_set_services(b2th_cache_t *cache, uint64_t key, const uint16_t *uuids, size_t nb_uuids,
+        const b2th_service_t *services, size_t nb_services)
+{
+    if (!cache || nb_uuids > B2TH_CACHE_SDP_UUIDS || nb_services > B2TH_SDP_MAX_SERVICES)
+        return -1;
+
+    struct b2th_cache_entry *e = b2th_cache_slot(cache, key);
+
+    memset(e->sdp_uuids, 0, sizeof(e->sdp_uuids));
+    memcpy(e->sdp_uuids, uuids, nb_uuids * sizeof(uint16_t));
+    memcpy(e->services, services, nb_services * sizeof(b2th_service_t));
+    e->nb_services = nb_services;
+    e->discovered = time(NULL);
+
+    return 0;
+}
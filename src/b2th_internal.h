@@ -0,0 +1,670 @@
+#ifndef __B2TH_INTERNAL_H__
+#define __B2TH_INTERNAL_H__
+
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "blue2th.h"
+
+
+/*!
+ * \file b2th_internal.h
+ *
+ * \brief blue2th helpers shared between the library translation units
+ */
+
+
+/*!
+ * \brief B2TH_UNKNOWN_NAME - name of a device whose remote name is not resolved
+ */
+#define B2TH_UNKNOWN_NAME "unknown"
+
+
+/*!
+ * \brief blue2th hash map slot
+ */
+struct b2th_map_slot {
+    uint64_t key;           /**<! slot key */
+    void *value;            /**<! slot value, NULL for a free slot */
+};
+
+
+/*!
+ * \brief blue2th open addressing hash map from a 64-bit key to a non NULL pointer
+ */
+struct b2th_map {
+    struct b2th_map_slot *slots;    /**<! slot table, power of two sized */
+    size_t capacity;                /**<! number of slots */
+    size_t count;                   /**<! number of keys stored */
+};
+
+
+/*!
+ * \brief b2th_map_init - Initialize an empty hash map
+ *
+ * \param[out]  map         hash map to initialize.
+ * \param[in]   capacity    expected number of keys.
+ *
+ * \return  0 on success, -1 on error.
+ */
+int b2th_map_init(struct b2th_map *map, size_t capacity);
+
+
+/*!
+ * \brief b2th_map_deinit - Free the slots of a hash map
+ *
+ * \param[in]   map     hash map to free.
+ */
+void b2th_map_deinit(struct b2th_map *map);
+
+
+/*!
+ * \brief b2th_map_get - Look a key up
+ *
+ * \param[in]   map     hash map.
+ * \param[in]   key     key to look up.
+ *
+ * \return  value stored for key, NULL if absent.
+ */
+void *b2th_map_get(const struct b2th_map *map, uint64_t key);
+
+
+/*!
+ * \brief b2th_map_put - Insert a key or replace its value
+ *
+ * \param[in]   map     hash map.
+ * \param[in]   key     key to store.
+ * \param[in]   value   non NULL value.
+ *
+ * \return  0 on success, -1 on error.
+ */
+int b2th_map_put(struct b2th_map *map, uint64_t key, void *value);
+
+
+/*!
+ * \brief b2th_map_del - Remove a key
+ *
+ * \param[in]   map     hash map.
+ * \param[in]   key     key to remove.
+ *
+ * \return  value that was stored for key, NULL if absent.
+ */
+void *b2th_map_del(struct b2th_map *map, uint64_t key);
+
+
+/*!
+ * \brief blue2th arena allocator, everything it hands out is freed at once
+ */
+struct b2th_arena {
+    struct b2th_arena_chunk *chunks;    /**<! chunks, most recent first */
+    size_t nb_chunks;                   /**<! number of chunks allocated */
+};
+
+
+/*!
+ * \brief b2th_arena_alloc - Allocate memory from an arena
+ *
+ * \param[in]   arena   arena to allocate from.
+ * \param[in]   size    number of bytes, rounded up to pointer alignment.
+ *
+ * \return  pointer on success, NULL on error.
+ */
+void *b2th_arena_alloc(struct b2th_arena *arena, size_t size);
+
+
+/*!
+ * \brief b2th_arena_strdup - Duplicate a string into an arena
+ *
+ * \param[in]   arena   arena to allocate from.
+ * \param[in]   str     string to duplicate.
+ *
+ * \return  copy of str on success, NULL on error.
+ */
+char *b2th_arena_strdup(struct b2th_arena *arena, const char *str);
+
+
+/*!
+ * \brief b2th_arena_deinit - Free every allocation of an arena
+ *
+ * \param[in]   arena   arena to free.
+ */
+void b2th_arena_deinit(struct b2th_arena *arena);
+
+
+/*!
+ * \brief indexes and storage behind a b2th_list_t, the list frees them all at once
+ */
+struct b2th_list_store {
+    struct b2th_map addr_index;         /**<! devices indexed by bdaddr */
+    struct b2th_map name_index;         /**<! devices indexed by name hash */
+    struct b2th_arena arena;            /**<! storage of the devices, names and services of the list */
+    char *unknown_name;                 /**<! name shared by every unresolved device of the list */
+};
+
+
+/*!
+ * \brief b2th_hash_str - Hash a string
+ *
+ * \param[in]   str     string to hash.
+ *
+ * \return  64-bit hash of str.
+ */
+uint64_t b2th_hash_str(const char *str);
+
+
+/*!
+ * \brief b2th_bdaddr_to_key - Convert a binary bluetooth address to its integer form
+ *
+ * \param[in]   ba      bluetooth address.
+ *
+ * \return  48-bit address in the b2th_device_t::bdaddr layout.
+ */
+uint64_t b2th_bdaddr_to_key(const bdaddr_t *ba);
+
+
+/*!
+ * \brief b2th_key_to_bdaddr - Convert an integer bluetooth address to its binary form
+ *
+ * \param[in]   key     48-bit address in the b2th_device_t::bdaddr layout.
+ * \param[out]  ba      bluetooth address.
+ */
+void b2th_key_to_bdaddr(uint64_t key, bdaddr_t *ba);
+
+
+/*!
+ * \brief b2th_str_to_key - Parse a bluetooth address string to its integer form
+ *
+ * \param[in]   address     bluetooth address string "XX:XX:XX:XX:XX:XX".
+ * \param[out]  key         48-bit address in the b2th_device_t::bdaddr layout.
+ *
+ * \return  0 on success, -1 if address is not a valid bluetooth address.
+ */
+int b2th_str_to_key(const char *address, uint64_t *key);
+
+
+/*!
+ * \brief b2th_now_ms - Get the monotonic time
+ *
+ * \return  monotonic time in milliseconds.
+ */
+long long b2th_now_ms();
+
+
+/*!
+ * \brief b2th_thread_create - Start a library background thread, every signal blocked in it
+ *
+ * \param[out]  thread  thread id.
+ * \param[in]   attr    thread attributes, may be NULL.
+ * \param[in]   fn      thread function.
+ * \param[in]   arg     argument given to fn.
+ *
+ * \return  0 on success, an error number otherwise, as pthread_create().
+ */
+int b2th_thread_create(pthread_t *thread, const pthread_attr_t *attr, void *(*fn)(void *), void *arg);
+
+
+/*!
+ * \brief HCI timings shared by the blocking and the asynchronous paths
+ */
+#define B2TH_CLOCK_OFFSET_VALID 0x8000  /* clock offset bit telling the controller the offset is valid */
+#define B2TH_CONN_TIMEOUT_MS    25000   /* connection attempt timeout */
+#define B2TH_INQUIRY_UNIT_MS    1280    /* inquiry length unit */
+#define B2TH_INQUIRY_MARGIN_MS  2000    /* wait for inquiry complete that long after the inquiry length */
+
+
+/*!
+ * \brief B2TH_INQUIRY_MAX_RESULTS - most responses a single inquiry result event can carry
+ */
+#define B2TH_INQUIRY_MAX_RESULTS (HCI_MAX_EVENT_SIZE / INQUIRY_INFO_SIZE)
+
+
+/*!
+ * \brief extended inquiry response data types (Bluetooth assigned numbers)
+ */
+#define B2TH_EIR_UUID16_SOME    0x02
+#define B2TH_EIR_UUID16_ALL     0x03
+#define B2TH_EIR_UUID32_SOME    0x04
+#define B2TH_EIR_UUID32_ALL     0x05
+#define B2TH_EIR_UUID128_SOME   0x06
+#define B2TH_EIR_UUID128_ALL    0x07
+#define B2TH_EIR_NAME_SHORT     0x08
+#define B2TH_EIR_NAME_COMPLETE  0x09
+#define B2TH_EIR_TX_POWER       0x0a
+
+
+/*!
+ * \brief blue2th inquiry response, whatever the inquiry mode that produced it
+ */
+struct b2th_result {
+    bdaddr_t bdaddr;                    /**<! remote device address */
+    uint8_t pscan_rep_mode;             /**<! page scan repetition mode */
+    uint16_t clock_offset;              /**<! host order clock offset, valid bit set */
+    uint32_t dev_class;                 /**<! 24-bit class of device */
+    int8_t rssi;                        /**<! signal strength in dBm, 0 if unknown */
+    int dev_id;                         /**<! local controller that received the result */
+    int8_t tx_power;                    /**<! EIR transmit power in dBm, B2TH_TX_POWER_UNKNOWN if not given */
+    const char *name;                   /**<! EIR name, points into the event and is not NUL terminated, NULL if not given */
+    uint8_t name_len;                   /**<! length of name */
+    uint8_t name_complete;              /**<! name is the complete local name, not a shortened one */
+    uint16_t uuids[B2TH_EIR_MAX_UUIDS]; /**<! EIR 16-bit service class UUIDs */
+    uint8_t nb_uuids;                   /**<! number of uuids */
+};
+
+
+/*!
+ * \brief b2th_eir_parse - Decode the fields of an extended inquiry response into a result
+ *
+ * Unknown fields are skipped, parsing stops at the first malformed one.
+ *
+ * \param[in]   eir     extended inquiry response data.
+ * \param[in]   len     length of the data.
+ * \param[out]  res     result receiving the name, the transmit power and the UUIDs.
+ */
+void b2th_eir_parse(const uint8_t *eir, size_t len, struct b2th_result *res);
+
+
+/*!
+ * \brief b2th_result_get_name - Get the complete name of an extended inquiry response
+ *
+ * \param[in]   res     inquiry response.
+ * \param[out]  name    NUL terminated name.
+ * \param[in]   size    size of the name buffer.
+ *
+ * \return  0 on success, -1 if the response carries no complete name.
+ */
+int b2th_result_get_name(const struct b2th_result *res, char *name, size_t size);
+
+
+/*!
+ * \brief b2th_device_set_eir - Record the transmit power and the UUIDs of an inquiry response in a device
+ *
+ * \param[out]  bd      device to update, what the response does not carry is left untouched.
+ * \param[in]   res     inquiry response.
+ */
+void b2th_device_set_eir(b2th_device_t *bd, const struct b2th_result *res);
+
+
+/*!
+ * \brief b2th_inquiry_parse - Decode the responses of an inquiry result event
+ *
+ * \param[in]   evt     event code, EVT_INQUIRY_RESULT, EVT_INQUIRY_RESULT_WITH_RSSI or EVT_EXTENDED_INQUIRY_RESULT.
+ * \param[in]   ptr     event parameters.
+ * \param[in]   len     length of the event parameters.
+ * \param[in]   dev_id  local controller that received the event.
+ * \param[out]  res     responses, B2TH_INQUIRY_MAX_RESULTS at most.
+ *
+ * \return  number of responses decoded, truncated ones are dropped.
+ */
+int b2th_inquiry_parse(uint8_t evt, const unsigned char *ptr, ssize_t len, int dev_id, struct b2th_result *res);
+
+
+/*!
+ * \brief b2th_inquiry_mode_set - Ask a controller for extended inquiry results, or results with RSSI
+ *
+ * \param[in]   sock    HCI socket of the controller.
+ */
+void b2th_inquiry_mode_set(int sock);
+
+
+/*!
+ * \brief blue2th HCI transport, every controller access of the library goes through one
+ *
+ * Sockets returned by open_dev must be pollable and deliver one HCI event
+ * packet per read, exactly like a raw HCI socket. Sockets returned by
+ * connect are connected data sockets of the requested protocol, NULL
+ * connect meaning the backend carries no data. L2CAP sockets keep packet
+ * boundaries and connect fills opts with the negotiated values.
+ */
+struct b2th_transport {
+    const char *name;                                       /**<! backend name */
+    int (*get_dev_list)(struct b2th_transport *t, struct hci_dev_info *di, int max);
+    int (*get_dev_id)(struct b2th_transport *t, const char *interface);
+    int (*open_dev)(struct b2th_transport *t, int dev_id);
+    int (*close_dev)(struct b2th_transport *t, int sock);
+    int (*set_filter)(struct b2th_transport *t, int sock, const struct hci_filter *flt);
+    int (*send_cmd)(struct b2th_transport *t, int sock, uint16_t ogf, uint16_t ocf, uint8_t plen, void *param);
+    int (*send_req)(struct b2th_transport *t, int sock, struct hci_request *rq, int timeout_ms);
+    int (*connect)(struct b2th_transport *t, int dev_id, int proto, const bdaddr_t *bdaddr, uint16_t port,
+            b2th_l2cap_opts_t *opts, int timeout_ms);
+    int (*open_monitor)(struct b2th_transport *t);          /**<! NULL when controllers never change */
+};
+
+
+/*!
+ * \brief b2th_hci_get_dev_list - Get the local controllers of the current transport
+ *
+ * \param[out]  di      controller information array.
+ * \param[in]   max     size of the array.
+ *
+ * \return  number of controllers on success, -1 on error.
+ */
+int b2th_hci_get_dev_list(struct hci_dev_info *di, int max);
+
+
+/*!
+ * \brief b2th_transport_get_dev_list - Enumerate the local controllers of the current transport
+ *
+ * Unlike b2th_hci_get_dev_list(), always asks the transport, even when the registry runs.
+ *
+ * \param[out]  di      controller information array.
+ * \param[in]   max     size of the array.
+ *
+ * \return  number of controllers on success, -1 on error.
+ */
+int b2th_transport_get_dev_list(struct hci_dev_info *di, int max);
+
+
+/*!
+ * \brief b2th_hci_open_monitor - Open a socket receiving the device events of every controller
+ *
+ * The socket delivers EVT_STACK_INTERNAL event packets carrying an EVT_SI_DEVICE
+ * (HCI_DEV_REG, HCI_DEV_UNREG, HCI_DEV_UP or HCI_DEV_DOWN), it is closed with close().
+ *
+ * \return  socket on success, -1 on error or if the transport has no such events.
+ */
+int b2th_hci_open_monitor(void);
+
+
+/*!
+ * \brief b2th_registry_get_dev_list - Get the local controllers from the registry table
+ *
+ * \param[out]  di      controller information array, dev_id, name, bdaddr and HCI_UP flag only.
+ * \param[in]   max     size of the array.
+ *
+ * \return  number of controllers, -1 if the registry is not running.
+ */
+int b2th_registry_get_dev_list(struct hci_dev_info *di, int max);
+
+
+/*!
+ * \brief b2th_registry_get_dev_id - Look a controller up in the registry table
+ *
+ * Same rules as the kernel lookups: only controllers that are up match.
+ *
+ * \param[in]   interface   controller name ("hciX") or address, NULL for the first one up.
+ * \param[out]  dev_id      device id, -1 if no controller matches.
+ *
+ * \return  0 on success, -1 if the registry is not running.
+ */
+int b2th_registry_get_dev_id(const char *interface, int *dev_id);
+
+
+/*!
+ * \brief b2th_get_dev_id - Get the HCI device id of a local controller
+ *
+ * \param[in]   interface   controller name ("hciX") or address, NULL for the first one available.
+ *
+ * \return  device id on success, -1 on error.
+ */
+int b2th_get_dev_id(const char *interface);
+
+
+/*!
+ * \brief b2th_hci_open_dev - Open an event socket on a local controller
+ *
+ * \param[in]   dev_id  HCI device id.
+ *
+ * \return  socket on success, -1 on error.
+ */
+int b2th_hci_open_dev(int dev_id);
+
+
+/*!
+ * \brief b2th_hci_close_dev - Close a socket opened by b2th_hci_open_dev()
+ *
+ * \param[in]   sock    socket to close.
+ *
+ * \return  0 on success, -1 on error.
+ */
+int b2th_hci_close_dev(int sock);
+
+
+/*!
+ * \brief b2th_hci_set_filter - Select the HCI events delivered on a socket
+ *
+ * \param[in]   sock    socket opened by b2th_hci_open_dev().
+ * \param[in]   flt     HCI filter.
+ *
+ * \return  0 on success, -1 on error.
+ */
+int b2th_hci_set_filter(int sock, const struct hci_filter *flt);
+
+
+/*!
+ * \brief b2th_hci_send_cmd - Send an HCI command without waiting for its completion
+ *
+ * \return  0 on success, -1 on error.
+ */
+int b2th_hci_send_cmd(int sock, uint16_t ogf, uint16_t ocf, uint8_t plen, void *param);
+
+
+/*!
+ * \brief b2th_hci_send_req - Send an HCI command and wait for the event it ends with
+ *
+ * \return  0 on success, -1 on error.
+ */
+int b2th_hci_send_req(int sock, struct hci_request *rq, int timeout_ms);
+
+
+/*!
+ * \brief b2th_hci_read - Read one HCI event packet from a socket opened by b2th_hci_open_dev()
+ *
+ * \return  packet length on success, -1 on error.
+ */
+ssize_t b2th_hci_read(int sock, void *buf, size_t len);
+
+
+/*!
+ * \brief b2th_bt_connect - Connect a data socket of proto to port of a remote device
+ *
+ * port is the channel of BTPROTO_RFCOMM, the PSM of BTPROTO_L2CAP, whose
+ * options are requested in opts and negotiated ones returned there (NULL
+ * for the defaults, and for RFCOMM).
+ *
+ * \return  connected socket on success, -1 on error with errno set.
+ */
+int b2th_bt_connect(int dev_id, int proto, const bdaddr_t *bdaddr, uint16_t port, b2th_l2cap_opts_t *opts,
+        int timeout_ms);
+
+
+/*!
+ * \brief b2th_btsnoop_open - Start the capture session of a socket, no-op when not recording
+ *
+ * \param[in]   sock    socket just opened.
+ * \param[in]   dev_id  HCI device id of the socket.
+ */
+void b2th_btsnoop_open(int sock, int dev_id);
+
+
+/*!
+ * \brief b2th_btsnoop_close - End the capture session of a socket, no-op when not recording
+ *
+ * \param[in]   sock    socket about to be closed.
+ */
+void b2th_btsnoop_close(int sock);
+
+
+/*!
+ * \brief b2th_btsnoop_command - Capture an HCI command sent on a socket, no-op when not recording
+ */
+void b2th_btsnoop_command(int sock, uint16_t ogf, uint16_t ocf, uint8_t plen, const void *param);
+
+
+/*!
+ * \brief b2th_btsnoop_event - Capture an HCI event packet received on a socket, no-op when not recording
+ *
+ * \param[in]   sock    socket the packet has been read from.
+ * \param[in]   buf     packet, starting with its HCI_EVENT_PKT type byte.
+ * \param[in]   len     packet length.
+ */
+void b2th_btsnoop_event(int sock, const unsigned char *buf, size_t len);
+
+
+/*!
+ * \brief b2th_btsnoop_reply - Capture the event a synchronous request ended with, no-op when not recording
+ *
+ * \param[in]   sock    socket of the request.
+ * \param[in]   event   event code.
+ * \param[in]   param   event parameters.
+ * \param[in]   len     event parameters length.
+ */
+void b2th_btsnoop_reply(int sock, int event, const void *param, size_t len);
+
+
+/*!
+ * \brief b2th_device_init - Allocate an empty b2th device
+ *
+ * \return  b2th_device_t on success, NULL on error.
+ */
+b2th_device_t *b2th_device_init();
+
+
+/*!
+ * \brief b2th_device_create - Allocate a b2th device out of any list
+ *
+ * \param[in]   address     bluetooth 48-bit device address string.
+ * \param[in]   name        bluetooth user friendly string name.
+ *
+ * \return  b2th_device_t on success, NULL on error.
+ */
+b2th_device_t *b2th_device_create(const char *address, const char *name);
+
+
+/*!
+ * \brief b2th_list_set_name - Replace the name of a b2th device and keep the list name index up to date
+ *
+ * \param[in]   bl      b2th list holding the device, NULL for a device out of any list.
+ * \param[in]   bd      b2th device to rename.
+ * \param[in]   name    new name.
+ *
+ * \return  0 on success, -1 on error.
+ */
+int b2th_list_set_name(b2th_list_t *bl, b2th_device_t *bd, const char *name);
+
+
+/*!
+ * \brief b2th_list_retain - Drop the devices of a b2th list that keep rejects, the others move to fresh storage
+ *
+ * The arena of a list only grows: the kept devices, their names and services
+ * are copied into a new one and the old one is freed. Pointers to any device
+ * of the list are invalid afterwards, kept ones included.
+ *
+ * \param[in]   bl          b2th list.
+ * \param[in]   keep        returns non-zero for the devices to keep, called twice per device.
+ * \param[in]   userdata    context given to keep.
+ *
+ * \return  number of devices dropped, -1 on error with the list left unchanged.
+ */
+int b2th_list_retain(b2th_list_t *bl, int (*keep)(const b2th_device_t *bd, void *userdata), void *userdata);
+
+
+/*!
+ * \brief b2th_list_add_node - Append a new device to a b2th list
+ *
+ * \param[in]   bl          b2th list.
+ * \param[in]   address     bluetooth 48-bit device address string.
+ * \param[in]   name        bluetooth user friendly string name.
+ *
+ * \return  the new b2th_device_t on success, NULL on error.
+ */
+b2th_device_t *b2th_list_add_node(b2th_list_t *bl, const char *address, const char *name);
+
+
+/*!
+ * \brief b2th_cache_get_name - Get the cached name of a device if it is still fresh
+ *
+ * \param[in]   cache       b2th cache.
+ * \param[in]   address     bluetooth 48-bit device address string.
+ * \param[out]  name        buffer receiving the name.
+ * \param[in]   len         size of the name buffer.
+ *
+ * \return  0 if a fresh name has been copied, -1 otherwise.
+ */
+int b2th_cache_get_name(b2th_cache_t *cache, const char *address, char *name, size_t len);
+
+
+/*!
+ * \brief b2th_cache_get_services - Get the cached services of a device if the last search is fresh and covers uuids
+ *
+ * \param[in]   cache       b2th cache.
+ * \param[in]   key         device address as an integer.
+ * \param[in]   uuids       service class UUIDs looked for.
+ * \param[in]   nb_uuids    number of UUIDs.
+ * \param[out]  services    services of those UUIDs, B2TH_SDP_MAX_SERVICES long.
+ *
+ * \return  number of services copied, -1 if the cache cannot answer.
+ */
+int b2th_cache_get_services(b2th_cache_t *cache, uint64_t key, const uint16_t *uuids, size_t nb_uuids,
+        b2th_service_t *services);
+
+
+/*!
+ * \brief b2th_cache_set_services - Record the result of a service search
+ *
+ * \param[in]   cache           b2th cache.
+ * \param[in]   key             device address as an integer.
+ * \param[in]   uuids           service class UUIDs searched.
+ * \param[in]   nb_uuids        number of UUIDs, 8 at most.
+ * \param[in]   services        services found.
+ * \param[in]   nb_services     number of services, B2TH_SDP_MAX_SERVICES at most.
+ *
+ * \return  0 on success, -1 on error.
+ */
+int b2th_cache_set_services(b2th_cache_t *cache, uint64_t key, const uint16_t *uuids, size_t nb_uuids,
+        const b2th_service_t *services, size_t nb_services);
+
+
+/*!
+ * \brief b2th_allocs - heap allocations made by the library on the calling thread
+ */
+extern __thread uint64_t b2th_allocs;
+
+
+/*!
+ * \brief b2th_stats_alloc - Count one heap allocation, a thread local increment
+ */
+static inline void b2th_stats_alloc()
+{
+    b2th_allocs++;
+}
+
+
+/*!
+ * \brief b2th_stats_add - Add counters to others, safe against concurrent adds
+ *
+ * \param[in]   dst     counters to add to.
+ * \param[in]   src     counters to add.
+ */
+void b2th_stats_add(b2th_scan_stats_t *dst, const b2th_scan_stats_t *src);
+
+
+/*!
+ * \brief b2th_stats_name_latency - Record the latency of an answered remote name request
+ *
+ * \param[in]   stats       counters of the scan.
+ * \param[in]   latency_ms  request latency.
+ */
+void b2th_stats_name_latency(b2th_scan_stats_t *stats, long long latency_ms);
+
+
+/*!
+ * \brief b2th_stats_socket_open - Count an HCI socket opened out of any scan
+ */
+void b2th_stats_socket_open();
+
+
+/*!
+ * \brief b2th_stats_scan_done - Publish the counters of a scan, when it ends or after each cycle
+ *
+ * \param[in]   scan    counters of the scan since they were last published.
+ * \param[in]   user    counters given in the scan parameters, may be NULL.
+ */
+void b2th_stats_scan_done(const b2th_scan_stats_t *scan, b2th_scan_stats_t *user);
+
+
+#endif /* __B2TH_INTERNAL_H__ */
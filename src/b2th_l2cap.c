@@ -0,0 +1,227 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+#include <bluetooth/l2cap.h>
+
+#include "b2th_internal.h"
+
+
+#define B2TH_L2CAP_TIMEOUT_MS   B2TH_CONN_TIMEOUT_MS
+#define B2TH_L2CAP_BATCH        64          /* packets per sendmmsg()/recvmmsg() */
+
+
+struct b2th_l2cap {
+    int sock;                           /**<! connected L2CAP socket */
+    b2th_l2cap_opts_t opts;             /**<! negotiated options */
+};
+
+
+b2th_l2cap_t *b2th_l2cap_connect(b2th_device_t *local_device, b2th_device_t *bd, uint16_t psm,
+        b2th_l2cap_opts_t *opts, unsigned int timeout_ms)
+{
+    // Valid PSMs are odd
+    if (!local_device || !bd || !(psm & 1))
+        return NULL;
+
+    int dev_id = b2th_get_dev_id(local_device->address);
+    if (dev_id < 0) {
+        printf("Couldn't retrieve bluetooth interface\n");
+        return NULL;
+    }
+
+    b2th_l2cap_t *ch = calloc(1, sizeof(b2th_l2cap_t));
+    if (!ch)
+        return NULL;
+
+    b2th_stats_alloc();
+
+    if (opts)
+        ch->opts = *opts;
+
+    bdaddr_t bdaddr;
+    b2th_key_to_bdaddr(bd->bdaddr, &bdaddr);
+
+    ch->sock = b2th_bt_connect(dev_id, BTPROTO_L2CAP, &bdaddr, psm, &ch->opts,
+            timeout_ms ? timeout_ms : B2TH_L2CAP_TIMEOUT_MS);
+    if (ch->sock == -1) {
+        perror("Failed to connect L2CAP channel");
+        free(ch);
+        return NULL;
+    }
+
+    if (opts)
+        *opts = ch->opts;
+
+    return ch;
+}
+
+
+int b2th_l2cap_fd(b2th_l2cap_t *ch)
+{
+    return ch ? ch->sock : -1;
+}
+
+
+void b2th_l2cap_get_opts(b2th_l2cap_t *ch, b2th_l2cap_opts_t *opts)
+{
+    if (ch && opts)
+        *opts = ch->opts;
+}
+
+
+ssize_t b2th_l2cap_send(b2th_l2cap_t *ch, const void *buf, size_t len)
+{
+    if (!ch)
+        return -1;
+
+    if (len > ch->opts.omtu) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    ssize_t ret;
+    do {
+        ret = send(ch->sock, buf, len, MSG_NOSIGNAL);
+    } while (ret == -1 && errno == EINTR);
+
+    return ret;
+}
+
+
+int b2th_l2cap_send_batch(b2th_l2cap_t *ch, const b2th_l2cap_packet_t *pkts, unsigned int count)
+{
+    if (!ch || (!pkts && count))
+        return -1;
+
+    struct mmsghdr msgs[B2TH_L2CAP_BATCH];
+    struct iovec iov[B2TH_L2CAP_BATCH];
+    unsigned int sent = 0;
+
+    while (sent < count) {
+        // Headers point at the caller packets, nothing is copied
+        unsigned int n = 0;
+        while (n < B2TH_L2CAP_BATCH && sent + n < count) {
+            const b2th_l2cap_packet_t *pkt = &pkts[sent + n];
+            if (pkt->len > ch->opts.omtu)
+                break;
+
+            iov[n].iov_base = pkt->data;
+            iov[n].iov_len = pkt->len;
+            memset(&msgs[n], 0, sizeof(msgs[n]));
+            msgs[n].msg_hdr.msg_iov = &iov[n];
+            msgs[n].msg_hdr.msg_iovlen = 1;
+            n++;
+        }
+
+        if (n == 0) {
+            errno = EMSGSIZE;
+            break;
+        }
+
+        int ret = sendmmsg(ch->sock, msgs, n, MSG_NOSIGNAL);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret == -1)
+            break;
+
+        sent += ret;
+        if ((unsigned int)ret < n)
+            break;
+    }
+
+    return (sent || count == 0) ? (int)sent : -1;
+}
+
+
+static int b2th_l2cap_wait(b2th_l2cap_t *ch, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = ch->sock, .events = POLLIN };
+    int ret;
+    do {
+        ret = poll(&pfd, 1, timeout_ms);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret == 0)
+        errno = ETIMEDOUT;
+
+    return (ret > 0) ? 0 : -1;
+}
+
+
+ssize_t b2th_l2cap_recv(b2th_l2cap_t *ch, void *buf, size_t len, int timeout_ms)
+{
+    if (!ch || b2th_l2cap_wait(ch, timeout_ms) == -1)
+        return -1;
+
+    ssize_t ret;
+    do {
+        ret = recv(ch->sock, buf, len, MSG_DONTWAIT);
+    } while (ret == -1 && errno == EINTR);
+
+    return ret;
+}
+
+
+int b2th_l2cap_recv_batch(b2th_l2cap_t *ch, b2th_l2cap_packet_t *pkts, unsigned int count, int timeout_ms)
+{
+    if (!ch || !pkts || count == 0 || b2th_l2cap_wait(ch, timeout_ms) == -1)
+        return -1;
+
+    struct mmsghdr msgs[B2TH_L2CAP_BATCH];
+    struct iovec iov[B2TH_L2CAP_BATCH];
+    unsigned int received = 0;
+
+    // Drain what is queued without waiting again, one recvmmsg() per batch
+    while (received < count) {
+        unsigned int n = 0;
+        while (n < B2TH_L2CAP_BATCH && received + n < count) {
+            iov[n].iov_base = pkts[received + n].data;
+            iov[n].iov_len = pkts[received + n].len;
+            memset(&msgs[n], 0, sizeof(msgs[n]));
+            msgs[n].msg_hdr.msg_iov = &iov[n];
+            msgs[n].msg_hdr.msg_iovlen = 1;
+            n++;
+        }
+
+        int ret = recvmmsg(ch->sock, msgs, n, MSG_DONTWAIT, NULL);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret == -1)
+            return received ? (int)received : -1;
+
+        // An empty packet is the end of the connection
+        int i;
+        for (i = 0; i < ret; i++) {
+            if (msgs[i].msg_len == 0)
+                return received;
+            pkts[received++].len = msgs[i].msg_len;
+        }
+
+        if ((unsigned int)ret < n)
+            break;
+    }
+
+    return received;
+}
+
+
+void b2th_l2cap_close(b2th_l2cap_t *ch)
+{
+    if (!ch)
+        return;
+
+    close(ch->sock);
+    free(ch);
+}
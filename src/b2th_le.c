@@ -0,0 +1,332 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "b2th_internal.h"
+
+
+#define B2TH_LE_BATCH           64          /* events read per recvmmsg() */
+#define B2TH_LE_RCVBUF          (1 << 20)   /* socket buffer absorbing report bursts */
+#define B2TH_LE_MAX_DEVICES     4096
+#define B2TH_LE_INTERVAL        0x0010      /* 10 ms */
+#define B2TH_LE_WINDOW          0x0010      /* 10 ms, continuous scanning */
+#define B2TH_LE_ADV_SCAN_RSP    0x04
+#define B2TH_LE_CMD_TIMEOUT_MS  1000        /* command complete wait */
+
+
+struct b2th_le_scanner {
+    int sock;                               /**<! HCI socket bound to the local controller */
+    b2th_le_device_t *devices;              /**<! device table, preallocated */
+    size_t nb_devices;                      /**<! devices in the table */
+    size_t max_devices;                     /**<! table capacity */
+    struct b2th_map index;                  /**<! device position + 1 by address and address type */
+    b2th_le_stats_t stats;                  /**<! ingestion counters */
+    struct mmsghdr msgs[B2TH_LE_BATCH];     /**<! recvmmsg() headers */
+    struct iovec iov[B2TH_LE_BATCH];        /**<! one buffer per event */
+    unsigned char bufs[B2TH_LE_BATCH][HCI_MAX_EVENT_SIZE + 1];
+};
+
+
+void b2th_le_params_init(b2th_le_params_t *params)
+{
+    params->interval = B2TH_LE_INTERVAL;
+    params->window = B2TH_LE_WINDOW;
+    params->active = 0;
+    params->max_devices = B2TH_LE_MAX_DEVICES;
+}
+
+
+static b2th_le_device_t *b2th_le_lookup(b2th_le_scanner_t *sc, const le_advertising_info *info, long long now)
+{
+    // Public and random addresses may collide: the address type is part of the key
+    uint64_t key = b2th_bdaddr_to_key(&info->bdaddr) | (uint64_t)info->bdaddr_type << 48;
+
+    uintptr_t pos = (uintptr_t)b2th_map_get(&sc->index, key);
+    if (pos)
+        return &sc->devices[pos - 1];
+
+    if (sc->nb_devices == sc->max_devices) {
+        sc->stats.dropped++;
+        return NULL;
+    }
+
+    b2th_le_device_t *dev = &sc->devices[sc->nb_devices];
+    memset(dev, 0, sizeof(*dev));
+    dev->bdaddr = b2th_bdaddr_to_key(&info->bdaddr);
+    dev->addr_type = info->bdaddr_type;
+    dev->first_seen = now;
+    ba2str(&info->bdaddr, dev->address);
+
+    // The index was sized for max_devices, this never reallocates
+    if (b2th_map_put(&sc->index, key, (void *)(uintptr_t)(sc->nb_devices + 1)) == -1) {
+        sc->stats.dropped++;
+        return NULL;
+    }
+
+    sc->nb_devices++;
+
+    return dev;
+}
+
+
+static void b2th_le_parse(b2th_le_scanner_t *sc, const unsigned char *buf, size_t len, long long now)
+{
+    if (len < 1 + HCI_EVENT_HDR_SIZE + EVT_LE_META_EVENT_SIZE + 1 || buf[0] != HCI_EVENT_PKT)
+        return;
+
+    const hci_event_hdr *hdr = (const hci_event_hdr *)(buf + 1);
+    const evt_le_meta_event *meta = (const evt_le_meta_event *)(buf + 1 + HCI_EVENT_HDR_SIZE);
+    if (hdr->evt != EVT_LE_META_EVENT || meta->subevent != EVT_LE_ADVERTISING_REPORT)
+        return;
+
+    sc->stats.events++;
+
+    const unsigned char *ptr = meta->data + 1;
+    const unsigned char *end = buf + len;
+    uint8_t num_reports = meta->data[0];
+
+    // Reports are packed back to back: header, data[length], rssi
+    uint8_t i;
+    for (i = 0; i < num_reports; i++) {
+        const le_advertising_info *info = (const le_advertising_info *)ptr;
+        if (ptr + LE_ADVERTISING_INFO_SIZE > end || ptr + LE_ADVERTISING_INFO_SIZE + info->length + 1 > end) {
+            sc->stats.malformed++;
+            return;
+        }
+
+        ptr += LE_ADVERTISING_INFO_SIZE + info->length + 1;
+        sc->stats.reports++;
+
+        b2th_le_device_t *dev = b2th_le_lookup(sc, info, now);
+        if (!dev)
+            continue;
+
+        uint8_t length = info->length > B2TH_LE_ADV_MAX ? B2TH_LE_ADV_MAX : info->length;
+        if (info->evt_type == B2TH_LE_ADV_SCAN_RSP) {
+            memcpy(dev->scan_rsp, info->data, length);
+            dev->scan_rsp_len = length;
+        } else {
+            memcpy(dev->adv_data, info->data, length);
+            dev->adv_len = length;
+            dev->evt_type = info->evt_type;
+        }
+
+        dev->rssi = (int8_t)info->data[info->length];
+        dev->last_seen = now;
+        dev->nb_reports++;
+    }
+}
+
+
+static int b2th_le_scan_command(int sock, uint16_t ocf, void *param, uint8_t plen)
+{
+    uint8_t status = 0;
+    struct hci_request rq = {
+        .ogf = OGF_LE_CTL,
+        .ocf = ocf,
+        .event = EVT_CMD_COMPLETE,
+        .cparam = param,
+        .clen = plen,
+        .rparam = &status,
+        .rlen = 1,
+    };
+
+    if (b2th_hci_send_req(sock, &rq, B2TH_LE_CMD_TIMEOUT_MS) < 0) {
+        perror("Failed to enable LE scan");
+        return -1;
+    }
+
+    // Command Disallowed when another user of the controller is already scanning
+    if (status != 0) {
+        fprintf(stderr, "LE scan refused by controller (status 0x%02x)\n", status);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+b2th_le_scanner_t *b2th_le_scan_start(b2th_device_t *local_device, const b2th_le_params_t *params)
+{
+    if (!local_device) {
+        printf("Bluetooth object not initialized\n");
+        return NULL;
+    }
+
+    int dev_id = b2th_get_dev_id(local_device->address);
+    if (dev_id < 0) {
+        printf("Couldn't retrieve bluetooth interface\n");
+        return NULL;
+    }
+
+    b2th_le_params_t defaults;
+    if (!params) {
+        b2th_le_params_init(&defaults);
+        params = &defaults;
+    }
+
+    b2th_le_scanner_t *sc = calloc(1, sizeof(b2th_le_scanner_t));
+    if (!sc)
+        return NULL;
+
+    sc->max_devices = params->max_devices ? params->max_devices : B2TH_LE_MAX_DEVICES;
+    sc->devices = calloc(sc->max_devices, sizeof(b2th_le_device_t));
+    if (!sc->devices || b2th_map_init(&sc->index, sc->max_devices) == -1)
+        goto clean;
+
+    size_t i;
+    for (i = 0; i < B2TH_LE_BATCH; i++) {
+        sc->iov[i].iov_base = sc->bufs[i];
+        sc->iov[i].iov_len = sizeof(sc->bufs[i]);
+        sc->msgs[i].msg_hdr.msg_iov = &sc->iov[i];
+        sc->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    sc->sock = b2th_hci_open_dev(dev_id);
+    if (sc->sock < 0) {
+        perror("Failed to open HCI device");
+        goto clean;
+    }
+
+    b2th_stats_socket_open();
+
+    int rcvbuf = B2TH_LE_RCVBUF;
+    setsockopt(sc->sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    struct hci_filter flt;
+    hci_filter_clear(&flt);
+    hci_filter_set_ptype(HCI_EVENT_PKT, &flt);
+    hci_filter_set_event(EVT_LE_META_EVENT, &flt);
+    if (b2th_hci_set_filter(sc->sock, &flt) == -1) {
+        perror("Failed to set HCI filter");
+        goto clean_sock;
+    }
+
+    le_set_scan_parameters_cp scp = {
+        .type = params->active ? 0x01 : 0x00,
+        .interval = htobs(params->interval),
+        .window = htobs(params->window),
+        .own_bdaddr_type = 0x00,
+        .filter = 0x00,
+    };
+
+    // Duplicate filtering stays off in the controller: every report refreshes the RSSI
+    le_set_scan_enable_cp ecp = {
+        .enable = 0x01,
+        .filter_dup = 0x00,
+    };
+
+    // Both commands wait for their command complete: a refused scan never returns a scanner
+    if (b2th_le_scan_command(sc->sock, OCF_LE_SET_SCAN_PARAMETERS, &scp, LE_SET_SCAN_PARAMETERS_CP_SIZE) == -1
+            || b2th_le_scan_command(sc->sock, OCF_LE_SET_SCAN_ENABLE, &ecp, LE_SET_SCAN_ENABLE_CP_SIZE) == -1)
+        goto clean_sock;
+
+    return sc;
+
+clean_sock:
+    b2th_hci_close_dev(sc->sock);
+clean:
+    b2th_map_deinit(&sc->index);
+    free(sc->devices);
+    free(sc);
+    return NULL;
+}
+
+
+int b2th_le_scan_fd(b2th_le_scanner_t *sc)
+{
+    return sc->sock;
+}
+
+
+int b2th_le_scan_process(b2th_le_scanner_t *sc, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = sc->sock, .events = POLLIN };
+    int ret = poll(&pfd, 1, timeout_ms);
+    if (ret <= 0)
+        return (ret == -1 && errno != EINTR) ? -1 : 0;
+
+    uint64_t reports = sc->stats.reports;
+
+    // Drain the socket by batches of events, one syscall per batch
+    for (;;) {
+        int n = recvmmsg(sc->sock, sc->msgs, B2TH_LE_BATCH, MSG_DONTWAIT, NULL);
+        if (n <= 0)
+            break;
+
+        sc->stats.batches++;
+        long long now = b2th_now_ms();
+
+        int i;
+        for (i = 0; i < n; i++) {
+            b2th_btsnoop_event(sc->sock, sc->bufs[i], sc->msgs[i].msg_len);
+            b2th_le_parse(sc, sc->bufs[i], sc->msgs[i].msg_len, now);
+        }
+
+        if (n < B2TH_LE_BATCH)
+            break;
+    }
+
+    return (int)(sc->stats.reports - reports);
+}
+
+
+const b2th_le_device_t *b2th_le_get_device(b2th_le_scanner_t *sc, const char *address)
+{
+    uint64_t key;
+    if (b2th_str_to_key(address, &key) == -1)
+        return NULL;
+
+    // Address type unknown to the caller: try public then random
+    uint64_t type;
+    for (type = 0; type < 2; type++) {
+        uintptr_t pos = (uintptr_t)b2th_map_get(&sc->index, key | type << 48);
+        if (pos)
+            return &sc->devices[pos - 1];
+    }
+
+    return NULL;
+}
+
+
+const b2th_le_device_t *b2th_le_get_devices(b2th_le_scanner_t *sc, size_t *count)
+{
+    *count = sc->nb_devices;
+
+    return sc->devices;
+}
+
+
+void b2th_le_get_stats(b2th_le_scanner_t *sc, b2th_le_stats_t *stats)
+{
+    *stats = sc->stats;
+}
+
+
+void b2th_le_scan_stop(b2th_le_scanner_t *sc)
+{
+    if (!sc)
+        return;
+
+    le_set_scan_enable_cp ecp = {
+        .enable = 0x00,
+        .filter_dup = 0x00,
+    };
+    b2th_hci_send_cmd(sc->sock, OGF_LE_CTL, OCF_LE_SET_SCAN_ENABLE, LE_SET_SCAN_ENABLE_CP_SIZE, &ecp);
+
+    b2th_hci_close_dev(sc->sock);
+    b2th_map_deinit(&sc->index);
+    free(sc->devices);
+    free(sc);
+}
@@ -0,0 +1,147 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "b2th_internal.h"
+
+
+#define B2TH_MAP_MIN_CAPACITY   16
+
+
+static size_t b2th_map_home(const struct b2th_map *map, uint64_t key)
+{
+    return (key * 0x9e3779b97f4a7c15ULL) >> 16 & (map->capacity - 1);
+}
+
+
+int b2th_map_init(struct b2th_map *map, size_t capacity)
+{
+    map->capacity = B2TH_MAP_MIN_CAPACITY;
+    while (map->capacity < capacity * 2)
+        map->capacity <<= 1;
+
+    map->count = 0;
+    map->slots = calloc(map->capacity, sizeof(struct b2th_map_slot));
+    if (!map->slots)
+        return -1;
+
+    b2th_stats_alloc();
+
+    return 0;
+}
+
+
+void b2th_map_deinit(struct b2th_map *map)
+{
+    free(map->slots);
+    map->slots = NULL;
+    map->capacity = 0;
+    map->count = 0;
+}
+
+
+void *b2th_map_get(const struct b2th_map *map, uint64_t key)
+{
+    if (!map->slots)
+        return NULL;
+
+    size_t i = b2th_map_home(map, key);
+    while (map->slots[i].value) {
+        if (map->slots[i].key == key)
+            return map->slots[i].value;
+        i = (i + 1) & (map->capacity - 1);
+    }
+
+    return NULL;
+}
+
+
+static int b2th_map_grow(struct b2th_map *map)
+{
+    struct b2th_map old = *map;
+
+    if (b2th_map_init(map, old.capacity) == -1) {
+        *map = old;
+        return -1;
+    }
+
+    size_t i;
+    for (i = 0; i < old.capacity; i++)
+        if (old.slots[i].value)
+            b2th_map_put(map, old.slots[i].key, old.slots[i].value);
+
+    free(old.slots);
+
+    return 0;
+}
+
+
+int b2th_map_put(struct b2th_map *map, uint64_t key, void *value)
+{
+    if (!value)
+        return -1;
+
+    // Keep the load factor under 1/2 so probe sequences stay short
+    if (!map->slots || (map->count + 1) * 2 > map->capacity)
+        if ((map->slots ? b2th_map_grow(map) : b2th_map_init(map, 0)) == -1)
+            return -1;
+
+    size_t i = b2th_map_home(map, key);
+    while (map->slots[i].value) {
+        if (map->slots[i].key == key) {
+            map->slots[i].value = value;
+            return 0;
+        }
+        i = (i + 1) & (map->capacity - 1);
+    }
+
+    map->slots[i].key = key;
+    map->slots[i].value = value;
+    map->count++;
+
+    return 0;
+}
+
+
+void *b2th_map_del(struct b2th_map *map, uint64_t key)
+{
+    if (!map->slots)
+        return NULL;
+
+    size_t mask = map->capacity - 1;
+    size_t i = b2th_map_home(map, key);
+    while (map->slots[i].value && map->slots[i].key != key)
+        i = (i + 1) & mask;
+
+    void *value = map->slots[i].value;
+    if (!value)
+        return NULL;
+
+    // Backward shift deletion: pull up the entries whose probe sequence crossed the hole
+    size_t j = i;
+    for (;;) {
+        map->slots[i].value = NULL;
+        do {
+            j = (j + 1) & mask;
+            if (!map->slots[j].value) {
+                map->count--;
+                return value;
+            }
+        } while (((j - b2th_map_home(map, map->slots[j].key)) & mask) < ((j - i) & mask));
+
+        map->slots[i] = map->slots[j];
+        i = j;
+    }
+}
+
+
+uint64_t b2th_hash_str(const char *str)
+{
+    // 64-bit FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    while (*str) {
+        hash ^= (unsigned char)*str++;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
@@ -0,0 +1,308 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "b2th_internal.h"
+
+
+/*!
+ * \brief registry controller entry
+ */
+struct b2th_registry_entry {
+    b2th_controller_t ctrl;             /**<! what is handed out */
+    bdaddr_t bdaddr;                    /**<! address, for hci_dev_info copies and address lookups */
+};
+
+
+static struct {
+    pthread_mutex_t lock;               /**<! protects the table, held for copies only */
+    int running;                        /**<! table valid, lookups served from it */
+    struct b2th_registry_entry table[HCI_MAX_DEV]; /**<! controllers in device id order */
+    int count;                          /**<! entries in table */
+    int monitor;                        /**<! device event socket, -1 if the transport has none */
+    int wake[2];                        /**<! pipe stopping the thread */
+    pthread_t thread;                   /**<! device event thread */
+    b2th_controller_cb_t cb;            /**<! change callback, may be NULL */
+    void *userdata;                     /**<! user context of cb */
+} b2th_registry = { .lock = PTHREAD_MUTEX_INITIALIZER, .monitor = -1, .wake = { -1, -1 } };
+
+
+static int b2th_registry_cmp(const void *a, const void *b)
+{
+    const struct b2th_registry_entry *x = a;
+    const struct b2th_registry_entry *y = b;
+
+    return x->ctrl.dev_id - y->ctrl.dev_id;
+}
+
+
+static int b2th_registry_enumerate(struct b2th_registry_entry *table)
+{
+    struct hci_dev_info di[HCI_MAX_DEV];
+    int count = b2th_transport_get_dev_list(di, HCI_MAX_DEV);
+    if (count == -1)
+        return -1;
+
+    int i;
+    for (i = 0; i < count; i++) {
+        memset(&table[i], 0, sizeof(table[i]));
+        table[i].ctrl.dev_id = di[i].dev_id;
+        ba2str(&di[i].bdaddr, table[i].ctrl.address);
+        memcpy(table[i].ctrl.name, di[i].name, sizeof(table[i].ctrl.name) - 1);
+        table[i].ctrl.up = (di[i].flags & (1 << HCI_UP)) != 0;
+        bacpy(&table[i].bdaddr, &di[i].bdaddr);
+    }
+
+    // The kernel lists the last registered controller first
+    qsort(table, count, sizeof(table[0]), b2th_registry_cmp);
+
+    return count;
+}
+
+
+static const struct b2th_registry_entry *b2th_registry_find(const struct b2th_registry_entry *table, int count, int dev_id)
+{
+    int i;
+    for (i = 0; i < count; i++)
+        if (table[i].ctrl.dev_id == dev_id)
+            return &table[i];
+
+    return NULL;
+}
+
+
+static void b2th_registry_notify(b2th_controller_event_e event, const b2th_controller_t *ctrl)
+{
+    if (b2th_registry.cb)
+        b2th_registry.cb(event, ctrl, b2th_registry.userdata);
+}
+
+
+static void b2th_registry_refresh(void)
+{
+    // A device event only says something changed: enumerating again also catches the events missed
+    struct b2th_registry_entry table[HCI_MAX_DEV];
+    int count = b2th_registry_enumerate(table);
+    if (count == -1)
+        return;
+
+    struct b2th_registry_entry old[HCI_MAX_DEV];
+    pthread_mutex_lock(&b2th_registry.lock);
+    int old_count = b2th_registry.count;
+    memcpy(old, b2th_registry.table, old_count * sizeof(old[0]));
+    memcpy(b2th_registry.table, table, count * sizeof(table[0]));
+    b2th_registry.count = count;
+    pthread_mutex_unlock(&b2th_registry.lock);
+
+    // Callbacks run without the lock, from the copies
+    int i;
+    for (i = 0; i < old_count; i++) {
+        const struct b2th_registry_entry *now = b2th_registry_find(table, count, old[i].ctrl.dev_id);
+        if (!now) {
+            old[i].ctrl.up = 0;
+            b2th_registry_notify(B2TH_CONTROLLER_REMOVED, &old[i].ctrl);
+        } else if (now->ctrl.up != old[i].ctrl.up) {
+            b2th_registry_notify(now->ctrl.up ? B2TH_CONTROLLER_UP : B2TH_CONTROLLER_DOWN, &now->ctrl);
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        if (b2th_registry_find(old, old_count, table[i].ctrl.dev_id))
+            continue;
+
+        b2th_registry_notify(B2TH_CONTROLLER_ADDED, &table[i].ctrl);
+        if (table[i].ctrl.up)
+            b2th_registry_notify(B2TH_CONTROLLER_UP, &table[i].ctrl);
+    }
+}
+
+
+static void *b2th_registry_thread(void *arg)
+{
+    (void)arg;
+
+    for (;;) {
+        struct pollfd pfd[2] = {
+            { .fd = b2th_registry.monitor, .events = POLLIN },
+            { .fd = b2th_registry.wake[0], .events = POLLIN },
+        };
+
+        int ret = poll(pfd, 2, -1);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret == -1 || pfd[1].revents)
+            break;
+
+        unsigned char buf[HCI_MAX_EVENT_SIZE + 1];
+        ssize_t len = read(b2th_registry.monitor, buf, sizeof(buf));
+        if (len == -1 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if (len <= 0)
+            break;
+
+        const hci_event_hdr *hdr = (const hci_event_hdr *)(buf + 1);
+        const evt_stack_internal *si = (const evt_stack_internal *)(buf + 1 + HCI_EVENT_HDR_SIZE);
+        if (len < 1 + HCI_EVENT_HDR_SIZE + 2 + (ssize_t)sizeof(evt_si_device) || buf[0] != HCI_EVENT_PKT
+                || hdr->evt != EVT_STACK_INTERNAL || btohs(si->type) != EVT_SI_DEVICE)
+            continue;
+
+        b2th_registry_refresh();
+    }
+
+    return NULL;
+}
+
+
+int b2th_registry_start(b2th_controller_cb_t cb, void *userdata)
+{
+    if (b2th_registry.running)
+        return -1;
+
+    // Listen first: a controller plugged while enumerating is not missed
+    b2th_registry.monitor = b2th_hci_open_monitor();
+    if (b2th_registry.monitor >= 0 && pipe(b2th_registry.wake) == -1) {
+        close(b2th_registry.monitor);
+        b2th_registry.monitor = -1;
+        return -1;
+    }
+
+    int count = b2th_registry_enumerate(b2th_registry.table);
+    if (count == -1)
+        goto clean;
+
+    b2th_registry.cb = cb;
+    b2th_registry.userdata = userdata;
+
+    pthread_mutex_lock(&b2th_registry.lock);
+    b2th_registry.count = count;
+    b2th_registry.running = 1;
+    pthread_mutex_unlock(&b2th_registry.lock);
+
+    // Without device events the table is only enumerated once, as a replayed capture needs
+    if (b2th_registry.monitor >= 0
+            && b2th_thread_create(&b2th_registry.thread, NULL, b2th_registry_thread, NULL) != 0) {
+        pthread_mutex_lock(&b2th_registry.lock);
+        b2th_registry.running = 0;
+        pthread_mutex_unlock(&b2th_registry.lock);
+        goto clean;
+    }
+
+    return 0;
+
+clean:
+    if (b2th_registry.monitor >= 0) {
+        close(b2th_registry.monitor);
+        close(b2th_registry.wake[0]);
+        close(b2th_registry.wake[1]);
+    }
+    b2th_registry.monitor = -1;
+    b2th_registry.wake[0] = b2th_registry.wake[1] = -1;
+
+    return -1;
+}
+
+
+int b2th_registry_get_controllers(b2th_controller_t *ctrls, int max)
+{
+    pthread_mutex_lock(&b2th_registry.lock);
+
+    int i = -1;
+    if (b2th_registry.running)
+        for (i = 0; i < b2th_registry.count && i < max; i++)
+            ctrls[i] = b2th_registry.table[i].ctrl;
+
+    pthread_mutex_unlock(&b2th_registry.lock);
+
+    return i;
+}
+
+
+int b2th_registry_get_dev_list(struct hci_dev_info *di, int max)
+{
+    pthread_mutex_lock(&b2th_registry.lock);
+
+    int i = -1;
+    if (b2th_registry.running) {
+        for (i = 0; i < b2th_registry.count && i < max; i++) {
+            const struct b2th_registry_entry *entry = &b2th_registry.table[i];
+            memset(&di[i], 0, sizeof(di[i]));
+            di[i].dev_id = entry->ctrl.dev_id;
+            memcpy(di[i].name, entry->ctrl.name, sizeof(di[i].name));
+            bacpy(&di[i].bdaddr, &entry->bdaddr);
+            di[i].flags = entry->ctrl.up ? (1 << HCI_UP) : 0;
+        }
+    }
+
+    pthread_mutex_unlock(&b2th_registry.lock);
+
+    return i;
+}
+
+
+int b2th_registry_get_dev_id(const char *interface, int *dev_id)
+{
+    pthread_mutex_lock(&b2th_registry.lock);
+
+    if (!b2th_registry.running) {
+        pthread_mutex_unlock(&b2th_registry.lock);
+        return -1;
+    }
+
+    bdaddr_t ba;
+    int check_ba = interface && strncmp(interface, "hci", 3) != 0 && bachk(interface) == 0;
+    if (check_ba)
+        str2ba(interface, &ba);
+
+    *dev_id = -1;
+
+    int i;
+    for (i = 0; i < b2th_registry.count && *dev_id == -1; i++) {
+        const struct b2th_registry_entry *entry = &b2th_registry.table[i];
+        if (!entry->ctrl.up)
+            continue;
+
+        if (!interface || (check_ba && bacmp(&ba, &entry->bdaddr) == 0)
+                || (!check_ba && strcmp(interface, entry->ctrl.name) == 0))
+            *dev_id = entry->ctrl.dev_id;
+    }
+
+    pthread_mutex_unlock(&b2th_registry.lock);
+
+    return 0;
+}
+
+
+void b2th_registry_stop(void)
+{
+    if (!b2th_registry.running)
+        return;
+
+    if (b2th_registry.monitor >= 0) {
+        ssize_t ret;
+        do {
+            ret = write(b2th_registry.wake[1], "", 1);
+        } while (ret == -1 && errno == EINTR);
+        pthread_join(b2th_registry.thread, NULL);
+        close(b2th_registry.monitor);
+        close(b2th_registry.wake[0]);
+        close(b2th_registry.wake[1]);
+    }
+
+    pthread_mutex_lock(&b2th_registry.lock);
+    b2th_registry.running = 0;
+    b2th_registry.count = 0;
+    pthread_mutex_unlock(&b2th_registry.lock);
+
+    b2th_registry.monitor = -1;
+    b2th_registry.wake[0] = b2th_registry.wake[1] = -1;
+    b2th_registry.cb = NULL;
+    b2th_registry.userdata = NULL;
+}
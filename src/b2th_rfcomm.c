@@ -0,0 +1,397 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+#include <bluetooth/rfcomm.h>
+
+#include "b2th_internal.h"
+
+
+#define B2TH_RFCOMM_TIMEOUT_MS  B2TH_CONN_TIMEOUT_MS
+#define B2TH_RFCOMM_IDLE_MS     60000
+
+
+struct b2th_rfcomm {
+    int sock;                           /**<! connected RFCOMM socket, -1 while connecting */
+    uint64_t key;                       /**<! remote address with the channel in bits 55..48 */
+    int busy;                           /**<! handed out by the pool */
+    long long last_used;                /**<! monotonic time of the last release to the pool */
+    b2th_rfcomm_pool_t *pool;           /**<! pool owning the connection, NULL if standalone */
+    list_t node;                        /**<! pool idle list node */
+};
+
+
+struct b2th_rfcomm_pool {
+    int dev_id;                         /**<! local controller id */
+    pthread_mutex_t lock;               /**<! protects everything below */
+    struct b2th_map index;              /**<! connections by address and channel */
+    list_t idle;                        /**<! idle connections, least recently used first */
+    size_t nb_conns;                    /**<! connections open or being opened */
+    size_t max_conns;                   /**<! connection cap */
+    unsigned int idle_timeout_ms;       /**<! idle connections older than this are closed */
+    unsigned int timeout_ms;            /**<! connection timeout */
+};
+
+
+static int b2th_rfcomm_dial(int dev_id, uint64_t key, unsigned int timeout_ms)
+{
+    bdaddr_t bdaddr;
+    b2th_key_to_bdaddr(key & 0xffffffffffffULL, &bdaddr);
+
+    return b2th_bt_connect(dev_id, BTPROTO_RFCOMM, &bdaddr, key >> 48, NULL, timeout_ms);
+}
+
+
+b2th_rfcomm_t *b2th_rfcomm_connect(b2th_device_t *local_device, b2th_device_t *bd, uint8_t channel,
+        unsigned int timeout_ms)
+{
+    if (!local_device || !bd || channel == 0)
+        return NULL;
+
+    int dev_id = b2th_get_dev_id(local_device->address);
+    if (dev_id < 0) {
+        printf("Couldn't retrieve bluetooth interface\n");
+        return NULL;
+    }
+
+    b2th_rfcomm_t *rc = calloc(1, sizeof(b2th_rfcomm_t));
+    if (!rc)
+        return NULL;
+
+    b2th_stats_alloc();
+
+    rc->key = bd->bdaddr | (uint64_t)channel << 48;
+    rc->sock = b2th_rfcomm_dial(dev_id, rc->key, timeout_ms ? timeout_ms : B2TH_RFCOMM_TIMEOUT_MS);
+    if (rc->sock == -1) {
+        perror("Failed to connect RFCOMM channel");
+        free(rc);
+        return NULL;
+    }
+
+    return rc;
+}
+
+
+int b2th_rfcomm_fd(b2th_rfcomm_t *rc)
+{
+    return rc ? rc->sock : -1;
+}
+
+
+ssize_t b2th_rfcomm_writev(b2th_rfcomm_t *rc, const struct iovec *iov, int iovcnt)
+{
+    if (!rc || iovcnt < 0)
+        return -1;
+
+    size_t total = 0;
+    size_t skip = 0;
+
+    // Buffers go straight from the caller to the socket: only partial writes are resumed, never copied
+    while (iovcnt > 0) {
+        ssize_t len;
+        if (skip) {
+            len = send(rc->sock, (const char *)iov->iov_base + skip, iov->iov_len - skip, MSG_NOSIGNAL);
+        } else {
+            struct msghdr msg = {
+                .msg_iov = (struct iovec *)iov,
+                .msg_iovlen = (iovcnt < IOV_MAX) ? iovcnt : IOV_MAX,
+            };
+            len = sendmsg(rc->sock, &msg, MSG_NOSIGNAL);
+        }
+
+        if (len == -1 && errno == EINTR)
+            continue;
+        if (len == -1)
+            return -1;
+
+        total += len;
+
+        size_t done = skip + len;
+        while (iovcnt > 0 && done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        skip = done;
+    }
+
+    return total;
+}
+
+
+ssize_t b2th_rfcomm_write(b2th_rfcomm_t *rc, const void *buf, size_t len)
+{
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+
+    return b2th_rfcomm_writev(rc, &iov, 1);
+}
+
+
+ssize_t b2th_rfcomm_readv(b2th_rfcomm_t *rc, const struct iovec *iov, int iovcnt, int timeout_ms)
+{
+    if (!rc || iovcnt < 0)
+        return -1;
+
+    struct pollfd pfd = { .fd = rc->sock, .events = POLLIN };
+    int ret;
+    do {
+        ret = poll(&pfd, 1, timeout_ms);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret == 0)
+        errno = ETIMEDOUT;
+    if (ret <= 0)
+        return -1;
+
+    struct msghdr msg = {
+        .msg_iov = (struct iovec *)iov,
+        .msg_iovlen = (iovcnt < IOV_MAX) ? iovcnt : IOV_MAX,
+    };
+
+    ssize_t len;
+    do {
+        len = recvmsg(rc->sock, &msg, MSG_DONTWAIT);
+    } while (len == -1 && errno == EINTR);
+
+    return len;
+}
+
+
+ssize_t b2th_rfcomm_read(b2th_rfcomm_t *rc, void *buf, size_t len, int timeout_ms)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+
+    return b2th_rfcomm_readv(rc, &iov, 1, timeout_ms);
+}
+
+
+static void b2th_rfcomm_free(b2th_rfcomm_t *rc)
+{
+    if (rc->sock != -1)
+        close(rc->sock);
+    free(rc);
+}
+
+
+void b2th_rfcomm_close(b2th_rfcomm_t *rc)
+{
+    if (!rc)
+        return;
+
+    if (rc->pool)
+        b2th_rfcomm_pool_put(rc->pool, rc, 1);
+    else
+        b2th_rfcomm_free(rc);
+}
+
+
+b2th_rfcomm_pool_t *b2th_rfcomm_pool_create(b2th_device_t *local_device, size_t max_conns, unsigned int idle_timeout_ms)
+{
+    if (!local_device || max_conns == 0)
+        return NULL;
+
+    int dev_id = b2th_get_dev_id(local_device->address);
+    if (dev_id < 0) {
+        printf("Couldn't retrieve bluetooth interface\n");
+        return NULL;
+    }
+
+    b2th_rfcomm_pool_t *pool = calloc(1, sizeof(b2th_rfcomm_pool_t));
+    if (!pool)
+        return NULL;
+
+    if (b2th_map_init(&pool->index, max_conns) == -1) {
+        free(pool);
+        return NULL;
+    }
+
+    pool->dev_id = dev_id;
+    pool->max_conns = max_conns;
+    pool->idle_timeout_ms = idle_timeout_ms ? idle_timeout_ms : B2TH_RFCOMM_IDLE_MS;
+    pool->timeout_ms = B2TH_RFCOMM_TIMEOUT_MS;
+    init_list(&pool->idle);
+    pthread_mutex_init(&pool->lock, NULL);
+
+    return pool;
+}
+
+
+/*
+ * Called with the pool lock held: forget a connection, the caller closes it
+ * once the lock is released.
+ */
+static void b2th_rfcomm_pool_remove(b2th_rfcomm_pool_t *pool, b2th_rfcomm_t *rc)
+{
+    if (!rc->busy)
+        list_del(&rc->node);
+
+    b2th_map_del(&pool->index, rc->key);
+    pool->nb_conns--;
+}
+
+
+static int b2th_rfcomm_alive(b2th_rfcomm_t *rc)
+{
+    // The device may have dropped an idle link: a pending end of stream or error means it did
+    struct pollfd pfd = { .fd = rc->sock, .events = POLLIN };
+    if (poll(&pfd, 1, 0) == -1 || (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)))
+        return 0;
+
+    if (pfd.revents & POLLIN) {
+        char byte;
+        ssize_t len = recv(rc->sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (len == 0 || (len == -1 && errno != EAGAIN && errno != EWOULDBLOCK))
+            return 0;
+    }
+
+    return 1;
+}
+
+
+b2th_rfcomm_t *b2th_rfcomm_pool_get(b2th_rfcomm_pool_t *pool, b2th_device_t *bd, uint8_t channel)
+{
+    if (!pool || !bd || channel == 0)
+        return NULL;
+
+    uint64_t key = bd->bdaddr | (uint64_t)channel << 48;
+    long long now = b2th_now_ms();
+    list_t stale;
+    init_list(&stale);
+
+    pthread_mutex_lock(&pool->lock);
+
+    // Idle connections are ordered by last use: the expired ones are at the front
+    while (!list_empty(&pool->idle)) {
+        b2th_rfcomm_t *old = list_entry(pool->idle.next, b2th_rfcomm_t, node);
+        if (old->last_used + pool->idle_timeout_ms > now)
+            break;
+        b2th_rfcomm_pool_remove(pool, old);
+        list_add_tail(&old->node, &stale);
+    }
+
+    b2th_rfcomm_t *rc = b2th_map_get(&pool->index, key);
+    if (rc && rc->busy) {
+        // One connection per channel and device: it is in use
+        pthread_mutex_unlock(&pool->lock);
+        rc = NULL;
+        errno = EBUSY;
+        goto clean;
+    }
+
+    if (rc) {
+        list_del(&rc->node);
+        rc->busy = 1;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (b2th_rfcomm_alive(rc))
+            goto clean;
+
+        // Reconnect in place: the entry stays busy and keeps the channel reserved
+        close(rc->sock);
+        rc->sock = -1;
+    } else {
+        if (pool->nb_conns == pool->max_conns) {
+            if (list_empty(&pool->idle)) {
+                pthread_mutex_unlock(&pool->lock);
+                errno = EAGAIN;
+                goto clean;
+            }
+
+            b2th_rfcomm_t *old = list_entry(pool->idle.next, b2th_rfcomm_t, node);
+            b2th_rfcomm_pool_remove(pool, old);
+            list_add_tail(&old->node, &stale);
+        }
+
+        rc = calloc(1, sizeof(b2th_rfcomm_t));
+        if (rc && b2th_map_put(&pool->index, key, rc) == -1) {
+            free(rc);
+            rc = NULL;
+        }
+
+        if (!rc) {
+            pthread_mutex_unlock(&pool->lock);
+            goto clean;
+        }
+
+        // Registered busy before connecting: concurrent gets of the same channel fail fast
+        b2th_stats_alloc();
+        rc->key = key;
+        rc->sock = -1;
+        rc->busy = 1;
+        rc->pool = pool;
+        pool->nb_conns++;
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    rc->sock = b2th_rfcomm_dial(pool->dev_id, key, pool->timeout_ms);
+    if (rc->sock == -1) {
+        int err = errno;
+        pthread_mutex_lock(&pool->lock);
+        b2th_rfcomm_pool_remove(pool, rc);
+        pthread_mutex_unlock(&pool->lock);
+        free(rc);
+        rc = NULL;
+        errno = err;
+    }
+
+clean:
+    // Sockets are closed out of the lock, close() may linger on unsent data
+    while (!list_empty(&stale)) {
+        b2th_rfcomm_t *old = list_entry(stale.next, b2th_rfcomm_t, node);
+        list_del(&old->node);
+        b2th_rfcomm_free(old);
+    }
+
+    return rc;
+}
+
+
+void b2th_rfcomm_pool_put(b2th_rfcomm_pool_t *pool, b2th_rfcomm_t *rc, int drop)
+{
+    if (!pool || !rc)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+
+    if (drop || rc->sock == -1) {
+        b2th_rfcomm_pool_remove(pool, rc);
+        pthread_mutex_unlock(&pool->lock);
+        b2th_rfcomm_free(rc);
+        return;
+    }
+
+    rc->busy = 0;
+    rc->last_used = b2th_now_ms();
+    list_add_tail(&rc->node, &pool->idle);
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+void b2th_rfcomm_pool_destroy(b2th_rfcomm_pool_t *pool)
+{
+    if (!pool)
+        return;
+
+    size_t i;
+    for (i = 0; i < pool->index.capacity; i++)
+        if (pool->index.slots[i].value)
+            b2th_rfcomm_free(pool->index.slots[i].value);
+
+    b2th_map_deinit(&pool->index);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
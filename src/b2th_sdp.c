@@ -0,0 +1,495 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+#include <bluetooth/l2cap.h>
+#include <bluetooth/sdp.h>
+
+#include "b2th_internal.h"
+
+
+#define B2TH_SDP_TIMEOUT_MS     B2TH_CONN_TIMEOUT_MS
+#define B2TH_SDP_CONCURRENCY    4
+#define B2TH_SDP_MTU            L2CAP_DEFAULT_MTU   /* largest response PDU accepted */
+#define B2TH_SDP_MAX_CSTATE     16                  /* longest continuation state */
+#define B2TH_SDP_MAX_RSP        (64 * 1024)         /* largest attribute list reassembled */
+
+/* data element types, the 5 high bits of a data element descriptor */
+#define B2TH_SDP_TYPE_UINT      1
+#define B2TH_SDP_TYPE_UUID      3
+#define B2TH_SDP_TYPE_SEQ       6
+#define B2TH_SDP_TYPE_ALT       7
+
+
+/*!
+ * \brief service search of one device
+ */
+struct b2th_sdp_job {
+    b2th_device_t *bd;                  /**<! device searched */
+    int status;                         /**<! 0 once searched, -1 if the device could not be asked */
+    uint8_t nb_services;                /**<! services found */
+    b2th_service_t services[B2TH_SDP_MAX_SERVICES];
+};
+
+
+/*!
+ * \brief service searches shared by the workers
+ */
+struct b2th_sdp_run {
+    int dev_id;                         /**<! local controller */
+    const uint16_t *uuids;              /**<! UUIDs searched */
+    size_t nb_uuids;                    /**<! number of UUIDs */
+    unsigned int timeout_ms;            /**<! time allowed per device */
+    struct b2th_sdp_job *jobs;          /**<! devices to search */
+    size_t nb_jobs;                     /**<! number of devices */
+    size_t next;                        /**<! next job to take, atomically incremented */
+};
+
+
+static uint16_t b2th_sdp_get16(const unsigned char *p)
+{
+    return p[0] << 8 | p[1];
+}
+
+
+static void b2th_sdp_put16(unsigned char *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+
+/*
+ * Decode the header of the data element at p: its type, its size and where
+ * its value starts. NULL if the element does not fit before end.
+ */
+static const unsigned char *b2th_sdp_elem(const unsigned char *p, const unsigned char *end, uint8_t *type,
+        uint32_t *size)
+{
+    static const uint8_t fixed[] = { 1, 2, 4, 8, 16 };
+
+    if (p >= end)
+        return NULL;
+
+    uint8_t desc = *p++;
+    *type = desc >> 3;
+
+    uint8_t index = desc & 0x07;
+    if (*type == 0) {
+        *size = 0;
+    } else if (index < 5) {
+        *size = fixed[index];
+    } else {
+        size_t len_size = 1 << (index - 5);
+        if ((size_t)(end - p) < len_size)
+            return NULL;
+        *size = 0;
+        while (len_size--)
+            *size = *size << 8 | *p++;
+    }
+
+    if ((size_t)(end - p) < *size)
+        return NULL;
+
+    return p;
+}
+
+
+static uint32_t b2th_sdp_uint(const unsigned char *p, uint32_t size)
+{
+    uint32_t v = 0;
+    while (size--)
+        v = v << 8 | *p++;
+
+    return v;
+}
+
+
+static uint16_t b2th_sdp_uuid16(const unsigned char *p, uint32_t size)
+{
+    // 128-bit UUIDs of the Bluetooth base UUID carry a 16-bit one in bytes 2..3
+    static const unsigned char base[12] = {
+        0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0x80, 0x5f, 0x9b, 0x34, 0xfb
+    };
+
+    if (size == 2)
+        return b2th_sdp_get16(p);
+    if (size == 4 && p[0] == 0 && p[1] == 0)
+        return b2th_sdp_get16(p + 2);
+    if (size == 16 && p[0] == 0 && p[1] == 0 && memcmp(p + 4, base, sizeof(base)) == 0)
+        return b2th_sdp_get16(p + 2);
+
+    return 0;
+}
+
+
+static void b2th_sdp_parse_protos(const unsigned char *p, const unsigned char *end, b2th_service_t *svc)
+{
+    uint8_t type;
+    uint32_t size;
+
+    // A ProtocolDescriptorList may list alternatives: the first one is used
+    const unsigned char *list = b2th_sdp_elem(p, end, &type, &size);
+    if (list && type == B2TH_SDP_TYPE_ALT)
+        list = b2th_sdp_elem(list, list + size, &type, &size);
+    if (!list || type != B2TH_SDP_TYPE_SEQ)
+        return;
+
+    const unsigned char *list_end = list + size;
+    while (list < list_end) {
+        const unsigned char *proto = b2th_sdp_elem(list, list_end, &type, &size);
+        if (!proto || type != B2TH_SDP_TYPE_SEQ)
+            return;
+        list = proto + size;
+
+        // Each protocol: its UUID then its parameters, the PSM or the channel
+        uint32_t uuid_size;
+        const unsigned char *uuid = b2th_sdp_elem(proto, list, &type, &uuid_size);
+        if (!uuid || type != B2TH_SDP_TYPE_UUID)
+            continue;
+
+        uint32_t param_size;
+        const unsigned char *param = b2th_sdp_elem(uuid + uuid_size, list, &type, &param_size);
+        if (!param || type != B2TH_SDP_TYPE_UINT)
+            continue;
+
+        switch (b2th_sdp_uuid16(uuid, uuid_size)) {
+        case L2CAP_UUID:
+            svc->l2cap_psm = b2th_sdp_uint(param, param_size);
+            break;
+        case RFCOMM_UUID:
+            svc->rfcomm_channel = b2th_sdp_uint(param, param_size);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+
+static void b2th_sdp_parse(const unsigned char *p, size_t len, uint16_t uuid, struct b2th_sdp_job *job)
+{
+    const unsigned char *end = p + len;
+    uint8_t type;
+    uint32_t size;
+
+    // AttributeLists: one sequence per record, of attribute id and value pairs
+    const unsigned char *rec = b2th_sdp_elem(p, end, &type, &size);
+    if (!rec || type != B2TH_SDP_TYPE_SEQ)
+        return;
+    end = rec + size;
+
+    while (rec < end && job->nb_services < B2TH_SDP_MAX_SERVICES) {
+        const unsigned char *attr = b2th_sdp_elem(rec, end, &type, &size);
+        if (!attr || type != B2TH_SDP_TYPE_SEQ)
+            return;
+        rec = attr + size;
+
+        b2th_service_t *svc = &job->services[job->nb_services++];
+        memset(svc, 0, sizeof(*svc));
+        svc->uuid = uuid;
+
+        while (attr < rec) {
+            uint32_t id_size;
+            const unsigned char *id = b2th_sdp_elem(attr, rec, &type, &id_size);
+            if (!id || type != B2TH_SDP_TYPE_UINT || id_size != 2)
+                break;
+
+            const unsigned char *value = b2th_sdp_elem(id + id_size, rec, &type, &size);
+            if (!value)
+                break;
+
+            if (b2th_sdp_get16(id) == SDP_ATTR_PROTO_DESC_LIST)
+                b2th_sdp_parse_protos(id + id_size, rec, svc);
+
+            attr = value + size;
+        }
+    }
+}
+
+
+static int b2th_sdp_request(int sock, uint16_t tid, uint16_t uuid, const unsigned char *cstate, uint8_t cstate_len)
+{
+    unsigned char req[sizeof(sdp_pdu_hdr_t) + 12 + 1 + B2TH_SDP_MAX_CSTATE];
+    unsigned char *p = req + sizeof(sdp_pdu_hdr_t);
+
+    // ServiceSearchPattern: the UUID alone
+    *p++ = SDP_SEQ8;
+    *p++ = 3;
+    *p++ = SDP_UUID16;
+    b2th_sdp_put16(p, uuid);
+    p += 2;
+
+    // MaximumAttributeByteCount: what fits in one response PDU
+    b2th_sdp_put16(p, B2TH_SDP_MTU - sizeof(sdp_pdu_hdr_t) - 2 - 1 - B2TH_SDP_MAX_CSTATE);
+    p += 2;
+
+    // AttributeIDList: only the protocols, to know where to connect
+    *p++ = SDP_SEQ8;
+    *p++ = 3;
+    *p++ = SDP_UINT16;
+    b2th_sdp_put16(p, SDP_ATTR_PROTO_DESC_LIST);
+    p += 2;
+
+    *p++ = cstate_len;
+    memcpy(p, cstate, cstate_len);
+    p += cstate_len;
+
+    req[0] = SDP_SVC_SEARCH_ATTR_REQ;
+    b2th_sdp_put16(req + 1, tid);
+    b2th_sdp_put16(req + 3, p - req - sizeof(sdp_pdu_hdr_t));
+
+    ssize_t len;
+    do {
+        len = send(sock, req, p - req, MSG_NOSIGNAL);
+    } while (len == -1 && errno == EINTR);
+
+    return (len == p - req) ? 0 : -1;
+}
+
+
+static ssize_t b2th_sdp_recv(int sock, unsigned char *buf, size_t len, long long deadline)
+{
+    long long left = deadline - b2th_now_ms();
+    if (left <= 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+
+    struct pollfd pfd = { .fd = sock, .events = POLLIN };
+    int ret;
+    do {
+        ret = poll(&pfd, 1, left);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret == 0)
+        errno = ETIMEDOUT;
+    if (ret <= 0)
+        return -1;
+
+    return recv(sock, buf, len, MSG_DONTWAIT);
+}
+
+
+/*
+ * One ServiceSearchAttributeRequest, followed by as many continuation
+ * requests as the device needs to return the whole attribute lists.
+ */
+static int b2th_sdp_search_uuid(int sock, uint16_t *tid, uint16_t uuid, long long deadline, struct b2th_sdp_job *job)
+{
+    unsigned char rsp[B2TH_SDP_MTU];
+    unsigned char cstate[B2TH_SDP_MAX_CSTATE];
+    uint8_t cstate_len = 0;
+    unsigned char *lists = NULL;
+    size_t lists_len = 0;
+    int ret = -1;
+
+    do {
+        (*tid)++;
+        if (b2th_sdp_request(sock, *tid, uuid, cstate, cstate_len) == -1)
+            goto clean;
+
+        ssize_t len = b2th_sdp_recv(sock, rsp, sizeof(rsp), deadline);
+        if (len < (ssize_t)sizeof(sdp_pdu_hdr_t) || b2th_sdp_get16(rsp + 1) != *tid)
+            goto clean;
+
+        // An error response means no such service, not a broken device
+        if (rsp[0] == SDP_ERROR_RSP) {
+            ret = 0;
+            goto clean;
+        }
+
+        const unsigned char *p = rsp + sizeof(sdp_pdu_hdr_t);
+        const unsigned char *end = rsp + len;
+        if (rsp[0] != SDP_SVC_SEARCH_ATTR_RSP || end - p < 3)
+            goto clean;
+
+        uint16_t count = b2th_sdp_get16(p);
+        p += 2;
+        if (end - p < count + 1 || lists_len + count > B2TH_SDP_MAX_RSP)
+            goto clean;
+
+        unsigned char *new_lists = realloc(lists, lists_len + count + 1);
+        if (!new_lists)
+            goto clean;
+        lists = new_lists;
+        memcpy(lists + lists_len, p, count);
+        lists_len += count;
+        p += count;
+
+        cstate_len = *p++;
+        if (cstate_len > B2TH_SDP_MAX_CSTATE || end - p < cstate_len)
+            goto clean;
+        memcpy(cstate, p, cstate_len);
+    } while (cstate_len);
+
+    b2th_sdp_parse(lists, lists_len, uuid, job);
+    ret = 0;
+
+clean:
+    free(lists);
+    return ret;
+}
+
+
+static void b2th_sdp_search(struct b2th_sdp_run *run, struct b2th_sdp_job *job)
+{
+    long long deadline = b2th_now_ms() + run->timeout_ms;
+
+    bdaddr_t bdaddr;
+    b2th_key_to_bdaddr(job->bd->bdaddr, &bdaddr);
+
+    b2th_l2cap_opts_t opts = { .imtu = B2TH_SDP_MTU };
+    int sock = b2th_bt_connect(run->dev_id, BTPROTO_L2CAP, &bdaddr, SDP_PSM, &opts, run->timeout_ms);
+    if (sock == -1) {
+        job->status = -1;
+        return;
+    }
+
+    // Every UUID over the same connection, paging the device costs far more than a request
+    uint16_t tid = 0;
+    size_t i;
+    for (i = 0; i < run->nb_uuids; i++) {
+        if (b2th_sdp_search_uuid(sock, &tid, run->uuids[i], deadline, job) == -1) {
+            job->status = -1;
+            break;
+        }
+    }
+
+    close(sock);
+}
+
+
+static void *b2th_sdp_worker(void *arg)
+{
+    struct b2th_sdp_run *run = arg;
+
+    size_t i;
+    while ((i = __atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED)) < run->nb_jobs)
+        b2th_sdp_search(run, &run->jobs[i]);
+
+    return NULL;
+}
+
+
+static int b2th_sdp_attach(b2th_list_t *bl, b2th_device_t *bd, const b2th_service_t *services, size_t nb_services)
+{
+    b2th_service_t *copy = NULL;
+    if (nb_services) {
+        copy = b2th_arena_alloc(&bl->store->arena, nb_services * sizeof(b2th_service_t));
+        if (!copy)
+            return -1;
+        memcpy(copy, services, nb_services * sizeof(b2th_service_t));
+    }
+
+    // A previous search result stays in the arena until the list is freed
+    bd->services = copy;
+    bd->nb_services = nb_services;
+    bd->sdp_done = 1;
+
+    return 0;
+}
+
+
+int b2th_sdp_discover(b2th_device_t *local_device, b2th_list_t *bl, const uint16_t *uuids, size_t nb_uuids,
+        const b2th_sdp_params_t *params)
+{
+    if (!local_device || !bl || !uuids || nb_uuids == 0)
+        return -1;
+
+    int dev_id = b2th_get_dev_id(local_device->address);
+    if (dev_id < 0) {
+        printf("Couldn't retrieve bluetooth interface\n");
+        return -1;
+    }
+
+    struct b2th_sdp_run run = {
+        .dev_id = dev_id,
+        .uuids = uuids,
+        .nb_uuids = nb_uuids,
+        .timeout_ms = B2TH_SDP_TIMEOUT_MS,
+    };
+    unsigned int concurrency = B2TH_SDP_CONCURRENCY;
+    b2th_cache_t *cache = NULL;
+    if (params) {
+        if (params->concurrency)
+            concurrency = params->concurrency;
+        if (params->timeout_ms)
+            run.timeout_ms = params->timeout_ms;
+        cache = params->cache;
+    }
+
+    run.jobs = calloc(b2th_list_size(bl) + 1, sizeof(struct b2th_sdp_job));
+    if (!run.jobs)
+        return -1;
+
+    b2th_stats_alloc();
+
+    // Devices the cache knows the services of are not asked again
+    b2th_device_t *bd;
+    b2th_device_for_each_entry(bl, bd) {
+        b2th_service_t services[B2TH_SDP_MAX_SERVICES];
+        int nb_services = b2th_cache_get_services(cache, bd->bdaddr, uuids, nb_uuids, services);
+        if (nb_services >= 0 && b2th_sdp_attach(bl, bd, services, nb_services) == 0)
+            continue;
+
+        run.jobs[run.nb_jobs++].bd = bd;
+    }
+
+    if (concurrency > run.nb_jobs)
+        concurrency = run.nb_jobs;
+
+    pthread_t *threads = NULL;
+    size_t nb_threads = 0;
+    if (concurrency > 1) {
+        threads = calloc(concurrency - 1, sizeof(pthread_t));
+        if (threads)
+            b2th_stats_alloc();
+    }
+
+    // The calling thread is a worker too: with no thread started it runs every search
+    while (threads && nb_threads < concurrency - 1
+            && pthread_create(&threads[nb_threads], NULL, b2th_sdp_worker, &run) == 0)
+        nb_threads++;
+
+    b2th_sdp_worker(&run);
+
+    size_t i;
+    for (i = 0; i < nb_threads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    int ret = 0;
+    for (i = 0; i < run.nb_jobs; i++) {
+        struct b2th_sdp_job *job = &run.jobs[i];
+        if (job->status == -1)
+            continue;
+
+        if (b2th_sdp_attach(bl, job->bd, job->services, job->nb_services) == -1) {
+            ret = -1;
+            break;
+        }
+
+        b2th_cache_set_services(cache, job->bd->bdaddr, uuids, nb_uuids, job->services, job->nb_services);
+    }
+
+    free(run.jobs);
+
+    if (ret == -1)
+        return -1;
+
+    b2th_device_for_each_entry(bl, bd)
+        if (bd->sdp_done && bd->nb_services)
+            ret++;
+
+    return ret;
+}
@@ -0,0 +1,1456 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+#include <bluetooth/l2cap.h>
+#include <bluetooth/sdp.h>
+
+#include "b2th_internal.h"
+
+
+#define B2TH_SIM_MAX_ADAPTERS   HCI_MAX_DEV
+#define B2TH_SIM_MAX_LINKS      64
+#define B2TH_SIM_MAX_MONITORS   8
+#define B2TH_SIM_DATA_BUF       65536   /* largest L2CAP packet */
+#define B2TH_SIM_SDP_CHUNK      16      /* attribute bytes per SDP response, small to exercise continuations */
+
+
+static uint16_t b2th_sim_handle = 0x0001;
+
+
+/*!
+ * \brief simulated remote device
+ */
+struct b2th_sim_device {
+    bdaddr_t bdaddr;                    /**<! device address */
+    uint8_t dev_class[3];               /**<! class of device */
+    uint8_t pscan_rep_mode;             /**<! page scan repetition mode */
+    uint16_t clock_offset;              /**<! clock offset */
+    int8_t rssi;                        /**<! signal strength heard by hci0 */
+    int named;                          /**<! answers remote name requests */
+    uint8_t services;                   /**<! offered services, bits of b2th_sim_services */
+    int limited;                        /**<! limited discoverable, also answers LIAC inquiries */
+    uint8_t eir;                        /**<! extended inquiry response: B2TH_SIM_EIR_NONE, _SHORT or _COMPLETE */
+    int8_t tx_power;                    /**<! transmit power advertised in the extended inquiry response */
+    char name[HCI_MAX_NAME_LENGTH];     /**<! remote name */
+};
+
+
+/*!
+ * \brief name carried by the extended inquiry response of a simulated device
+ */
+#define B2TH_SIM_EIR_NONE       0       /* no extended inquiry response */
+#define B2TH_SIM_EIR_SHORT      1       /* shortened name, a name request is still needed */
+#define B2TH_SIM_EIR_COMPLETE   2       /* complete name */
+
+
+/*!
+ * \brief classes of device simulated devices pick from: phone, headset, laptop, keyboard
+ */
+static const uint32_t b2th_sim_classes[] = { 0x5a020c, 0x240404, 0x3e010c, 0x002540 };
+
+
+/*!
+ * \brief services simulated devices pick from
+ */
+static const struct b2th_sim_service {
+    uint16_t uuid;                      /**<! service class */
+    uint16_t psm;                       /**<! L2CAP PSM, 0 for RFCOMM services */
+    uint8_t channel;                    /**<! RFCOMM channel */
+} b2th_sim_services[] = {
+    { SERIAL_PORT_SVCLASS_ID, 0, 1 },
+    { OBEX_OBJPUSH_SVCLASS_ID, 0, 9 },
+    { HANDSFREE_SVCLASS_ID, 0, 3 },
+    { AUDIO_SINK_SVCLASS_ID, 0x0019, 0 },
+    { HID_SVCLASS_ID, 0x0011, 0 },
+    { PNP_INFO_SVCLASS_ID, SDP_PSM, 0 },
+};
+
+
+enum b2th_sim_event_e {
+    SIM_NONE,                           /* cancelled */
+    SIM_CMD_STATUS,
+    SIM_CMD_COMPLETE,
+    SIM_INQUIRY_RESULT,
+    SIM_INQUIRY_COMPLETE,
+    SIM_NAME_COMPLETE,
+    SIM_CONN_COMPLETE,
+    SIM_DISCONN_COMPLETE,
+    SIM_CYCLE_START
+};
+
+
+/*!
+ * \brief event scheduled by a simulated controller
+ */
+struct b2th_sim_event {
+    long long due;                      /**<! monotonic delivery time in ms */
+    uint64_t seq;                       /**<! scheduling order, keeps command events in FIFO order */
+    enum b2th_sim_event_e type;         /**<! what to deliver */
+    uint16_t opcode;                    /**<! command of status and complete events */
+    uint8_t status;                     /**<! HCI status */
+    uint64_t key;                       /**<! remote address as an integer */
+    size_t device;                      /**<! remote device position, population size if unknown, handle of connection events */
+};
+
+
+/*!
+ * \brief one socket opened on a simulated controller
+ */
+struct b2th_sim_link {
+    struct b2th_sim *sim;               /**<! simulator owning the link */
+    int dev_id;                         /**<! simulated controller */
+    int fds[2];                         /**<! library side, controller side */
+    pthread_t thread;                   /**<! event delivery thread */
+    pthread_mutex_t lock;               /**<! protects everything below */
+    pthread_cond_t cond;                /**<! signaled on new events and on close */
+    int stop;                           /**<! close requested */
+    struct b2th_sim_event *heap;        /**<! pending events, min heap on (due, seq) */
+    size_t nb_events;                   /**<! events in the heap */
+    size_t heap_size;                   /**<! heap capacity */
+    uint64_t seq;                       /**<! next event sequence number */
+    unsigned int rand_state;            /**<! per link random state */
+    uint8_t inquiry_mode;               /**<! 0 standard, 1 with RSSI */
+    int inquiring;                      /**<! inquiry in progress */
+    int periodic;                       /**<! periodic inquiry mode */
+    long long inquiry_len_ms;           /**<! length of one inquiry */
+    long long period_ms;                /**<! periodic inquiry period */
+    uint8_t num_rsp;                    /**<! maximum responses per inquiry, 0 unlimited */
+    uint32_t lap;                       /**<! inquiry access code of the current inquiry */
+    int cod_filter;                     /**<! inquiry results filtered on the class of device */
+    uint32_t cod_value;                 /**<! class of device to match */
+    uint32_t cod_mask;                  /**<! bits of the class of device to compare */
+    unsigned int nb_rsp;                /**<! responses of the current inquiry */
+    unsigned int pages;                 /**<! name requests in progress */
+};
+
+
+/*!
+ * \brief simulated controllers sharing one population of remote devices
+ */
+struct b2th_sim {
+    struct b2th_transport transport;    /**<! must stay first */
+    b2th_sim_params_t params;           /**<! population and timing model */
+    struct b2th_sim_device *devices;    /**<! remote devices in range */
+    struct b2th_map index;              /**<! device position + 1 by address */
+    pthread_mutex_t lock;               /**<! protects links, controller states and monitors */
+    struct b2th_sim_link *links[B2TH_SIM_MAX_LINKS];
+    uint8_t removed[B2TH_SIM_MAX_ADAPTERS]; /**<! unplugged controllers */
+    uint8_t down[B2TH_SIM_MAX_ADAPTERS];    /**<! controllers brought down */
+    int monitors[B2TH_SIM_MAX_MONITORS];    /**<! controller side of the device event sockets, -1 if free */
+};
+
+
+void b2th_sim_params_init(b2th_sim_params_t *params)
+{
+    params->nb_adapters = 1;
+    params->nb_devices = 32;
+    params->inquiry_unit_ms = 1280;
+    params->response_window_ms = 2560;
+    params->miss_percent = 5;
+    params->name_latency_min_ms = 20;
+    params->name_latency_max_ms = 400;
+    params->unnamed_percent = 0;
+    params->eir_percent = 0;
+    params->page_timeout_ms = 5120;
+    params->max_pages = 7;
+    params->seed = 1;
+}
+
+
+static unsigned int b2th_sim_rand(struct b2th_sim_link *link, unsigned int bound)
+{
+    return bound ? (unsigned int)rand_r(&link->rand_state) % bound : 0;
+}
+
+
+static int b2th_sim_event_before(const struct b2th_sim_event *a, const struct b2th_sim_event *b)
+{
+    return a->due < b->due || (a->due == b->due && a->seq < b->seq);
+}
+
+
+static int b2th_sim_push(struct b2th_sim_link *link, enum b2th_sim_event_e type, long long due,
+        uint16_t opcode, uint8_t status, uint64_t key, size_t device)
+{
+    if (link->nb_events == link->heap_size) {
+        size_t size = link->heap_size ? link->heap_size * 2 : 64;
+        struct b2th_sim_event *heap = realloc(link->heap, size * sizeof(struct b2th_sim_event));
+        if (!heap)
+            return -1;
+
+        link->heap = heap;
+        link->heap_size = size;
+    }
+
+    struct b2th_sim_event ev = {
+        .due = due,
+        .seq = link->seq++,
+        .type = type,
+        .opcode = opcode,
+        .status = status,
+        .key = key,
+        .device = device,
+    };
+
+    size_t i = link->nb_events++;
+    while (i > 0 && b2th_sim_event_before(&ev, &link->heap[(i - 1) / 2])) {
+        link->heap[i] = link->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    link->heap[i] = ev;
+
+    pthread_cond_signal(&link->cond);
+
+    return 0;
+}
+
+
+static void b2th_sim_pop(struct b2th_sim_link *link, struct b2th_sim_event *ev)
+{
+    *ev = link->heap[0];
+
+    struct b2th_sim_event last = link->heap[--link->nb_events];
+    size_t i = 0;
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= link->nb_events)
+            break;
+        if (child + 1 < link->nb_events && b2th_sim_event_before(&link->heap[child + 1], &link->heap[child]))
+            child++;
+        if (!b2th_sim_event_before(&link->heap[child], &last))
+            break;
+        link->heap[i] = link->heap[child];
+        i = child;
+    }
+
+    if (link->nb_events)
+        link->heap[i] = last;
+}
+
+
+static void b2th_sim_drop_inquiry(struct b2th_sim_link *link)
+{
+    // Cancelled events stay in the heap and are skipped when they come due
+    size_t i;
+    for (i = 0; i < link->nb_events; i++) {
+        enum b2th_sim_event_e type = link->heap[i].type;
+        if (type == SIM_INQUIRY_RESULT || type == SIM_INQUIRY_COMPLETE || type == SIM_CYCLE_START)
+            link->heap[i].type = SIM_NONE;
+    }
+
+    link->inquiring = 0;
+}
+
+
+static int b2th_sim_answers(const struct b2th_sim_link *link, const struct b2th_sim_device *dev)
+{
+    if (link->lap == B2TH_LAP_LIAC && !dev->limited)
+        return 0;
+
+    if (link->lap != B2TH_LAP_GIAC && link->lap != B2TH_LAP_LIAC)
+        return 0;
+
+    uint32_t cod = dev->dev_class[0] | (dev->dev_class[1] << 8) | (dev->dev_class[2] << 16);
+
+    return !link->cod_filter || (cod & link->cod_mask) == (link->cod_value & link->cod_mask);
+}
+
+
+static void b2th_sim_start_cycle(struct b2th_sim_link *link, long long now)
+{
+    struct b2th_sim *sim = link->sim;
+    long long window = sim->params.response_window_ms;
+    if (window <= 0 || window > link->inquiry_len_ms)
+        window = link->inquiry_len_ms;
+
+    link->inquiring = 1;
+    link->nb_rsp = 0;
+
+    // Every device in range answers once at a random time of the window, unless it misses this inquiry
+    size_t i;
+    for (i = 0; i < sim->params.nb_devices; i++) {
+        if (b2th_sim_rand(link, 100) < sim->params.miss_percent)
+            continue;
+
+        // Drawn before filtering so that filters do not change when the other devices answer
+        long long due = now + b2th_sim_rand(link, (unsigned int)window);
+        if (!b2th_sim_answers(link, &sim->devices[i]))
+            continue;
+
+        b2th_sim_push(link, SIM_INQUIRY_RESULT, due, 0, 0, 0, i);
+    }
+
+    b2th_sim_push(link, SIM_INQUIRY_COMPLETE, now + link->inquiry_len_ms, 0, 0, 0, 0);
+
+    if (link->periodic)
+        b2th_sim_push(link, SIM_CYCLE_START, now + link->period_ms, 0, 0, 0, 0);
+}
+
+
+static void b2th_sim_eir_build(const struct b2th_sim_device *dev, uint8_t *eir)
+{
+    size_t name_len = strlen(dev->name);
+    size_t pos = 0;
+
+    // Shortened names keep the first 8 characters, like most stacks do
+    if (dev->eir == B2TH_SIM_EIR_SHORT && name_len > 8)
+        name_len = 8;
+
+    eir[pos++] = 1 + name_len;
+    eir[pos++] = (dev->eir == B2TH_SIM_EIR_SHORT) ? B2TH_EIR_NAME_SHORT : B2TH_EIR_NAME_COMPLETE;
+    memcpy(eir + pos, dev->name, name_len);
+    pos += name_len;
+
+    eir[pos++] = 2;
+    eir[pos++] = B2TH_EIR_TX_POWER;
+    eir[pos++] = (uint8_t)dev->tx_power;
+
+    // Then the 16-bit UUIDs of the services the device offers, the rest stays zero
+    size_t len_pos = pos;
+    eir[pos++] = 1;
+    eir[pos++] = B2TH_EIR_UUID16_ALL;
+
+    size_t i;
+    for (i = 0; i < sizeof(b2th_sim_services) / sizeof(b2th_sim_services[0]); i++) {
+        if (!(dev->services & (1 << i)))
+            continue;
+        eir[pos++] = b2th_sim_services[i].uuid & 0xff;
+        eir[pos++] = b2th_sim_services[i].uuid >> 8;
+        eir[len_pos] += 2;
+    }
+}
+
+
+static size_t b2th_sim_event_build(struct b2th_sim_link *link, const struct b2th_sim_event *ev, unsigned char *buf)
+{
+    struct b2th_sim *sim = link->sim;
+    unsigned char *ptr = buf + 1 + HCI_EVENT_HDR_SIZE;
+    hci_event_hdr *hdr = (hci_event_hdr *)(buf + 1);
+    const struct b2th_sim_device *dev = (ev->device < sim->params.nb_devices) ? &sim->devices[ev->device] : NULL;
+    size_t plen = 0;
+
+    buf[0] = HCI_EVENT_PKT;
+
+    switch (ev->type) {
+
+    case SIM_CMD_STATUS: {
+        evt_cmd_status *cs = (evt_cmd_status *)ptr;
+        cs->status = ev->status;
+        cs->ncmd = 1;
+        cs->opcode = htobs(ev->opcode);
+        hdr->evt = EVT_CMD_STATUS;
+        plen = EVT_CMD_STATUS_SIZE;
+        break;
+    }
+
+    case SIM_CMD_COMPLETE: {
+        evt_cmd_complete *cc = (evt_cmd_complete *)ptr;
+        cc->ncmd = 1;
+        cc->opcode = htobs(ev->opcode);
+        ptr[EVT_CMD_COMPLETE_SIZE] = ev->status;
+        plen = EVT_CMD_COMPLETE_SIZE + 1;
+        if (ev->opcode == cmd_opcode_pack(OGF_LINK_CTL, OCF_REMOTE_NAME_REQ_CANCEL)
+                || ev->opcode == cmd_opcode_pack(OGF_LINK_CTL, OCF_CREATE_CONN_CANCEL)) {
+            b2th_key_to_bdaddr(ev->key, (bdaddr_t *)(ptr + plen));
+            plen += sizeof(bdaddr_t);
+        }
+        hdr->evt = EVT_CMD_COMPLETE;
+        break;
+    }
+
+    case SIM_INQUIRY_RESULT:
+        ptr[0] = 1;
+        if (link->inquiry_mode == 0x02 && dev->eir != B2TH_SIM_EIR_NONE) {
+            extended_inquiry_info *ii = (extended_inquiry_info *)(ptr + 1);
+            memset(ii, 0, sizeof(*ii));
+            bacpy(&ii->bdaddr, &dev->bdaddr);
+            ii->pscan_rep_mode = dev->pscan_rep_mode;
+            memcpy(ii->dev_class, dev->dev_class, 3);
+            ii->clock_offset = htobs(dev->clock_offset);
+            ii->rssi = dev->rssi - 3 * link->dev_id;
+            b2th_sim_eir_build(dev, ii->data);
+            hdr->evt = EVT_EXTENDED_INQUIRY_RESULT;
+            plen = 1 + EXTENDED_INQUIRY_INFO_SIZE;
+        } else if (link->inquiry_mode >= 0x01) {
+            inquiry_info_with_rssi *ii = (inquiry_info_with_rssi *)(ptr + 1);
+            memset(ii, 0, sizeof(*ii));
+            bacpy(&ii->bdaddr, &dev->bdaddr);
+            ii->pscan_rep_mode = dev->pscan_rep_mode;
+            memcpy(ii->dev_class, dev->dev_class, 3);
+            ii->clock_offset = htobs(dev->clock_offset);
+            // Farther controllers hear the device a little weaker
+            ii->rssi = dev->rssi - 3 * link->dev_id;
+            hdr->evt = EVT_INQUIRY_RESULT_WITH_RSSI;
+            plen = 1 + INQUIRY_INFO_WITH_RSSI_SIZE;
+        } else {
+            inquiry_info *ii = (inquiry_info *)(ptr + 1);
+            memset(ii, 0, sizeof(*ii));
+            bacpy(&ii->bdaddr, &dev->bdaddr);
+            ii->pscan_rep_mode = dev->pscan_rep_mode;
+            memcpy(ii->dev_class, dev->dev_class, 3);
+            ii->clock_offset = htobs(dev->clock_offset);
+            hdr->evt = EVT_INQUIRY_RESULT;
+            plen = 1 + INQUIRY_INFO_SIZE;
+        }
+        break;
+
+    case SIM_INQUIRY_COMPLETE:
+        ptr[0] = 0;
+        hdr->evt = EVT_INQUIRY_COMPLETE;
+        plen = 1;
+        break;
+
+    case SIM_NAME_COMPLETE: {
+        evt_remote_name_req_complete *rn = (evt_remote_name_req_complete *)ptr;
+        memset(rn, 0, sizeof(*rn));
+        rn->status = ev->status;
+        b2th_key_to_bdaddr(ev->key, &rn->bdaddr);
+        if (ev->status == 0 && dev)
+            memcpy(rn->name, dev->name, HCI_MAX_NAME_LENGTH);
+        hdr->evt = EVT_REMOTE_NAME_REQ_COMPLETE;
+        plen = EVT_REMOTE_NAME_REQ_COMPLETE_SIZE;
+        break;
+    }
+
+    case SIM_CONN_COMPLETE: {
+        evt_conn_complete *cc = (evt_conn_complete *)ptr;
+        memset(cc, 0, sizeof(*cc));
+        cc->status = ev->status;
+        cc->handle = htobs(ev->device);
+        b2th_key_to_bdaddr(ev->key, &cc->bdaddr);
+        cc->link_type = ACL_LINK;
+        hdr->evt = EVT_CONN_COMPLETE;
+        plen = EVT_CONN_COMPLETE_SIZE;
+        break;
+    }
+
+    case SIM_DISCONN_COMPLETE: {
+        evt_disconn_complete *dc = (evt_disconn_complete *)ptr;
+        dc->status = ev->status;
+        dc->handle = htobs(ev->device);
+        dc->reason = HCI_OE_USER_ENDED_CONNECTION;
+        hdr->evt = EVT_DISCONN_COMPLETE;
+        plen = EVT_DISCONN_COMPLETE_SIZE;
+        break;
+    }
+
+    default:
+        return 0;
+    }
+
+    hdr->plen = plen;
+
+    return 1 + HCI_EVENT_HDR_SIZE + plen;
+}
+
+
+static int b2th_sim_deliver(struct b2th_sim_link *link, struct b2th_sim_event *ev, long long now)
+{
+    // Returns 1 when the event has to be written to the library socket
+    switch (ev->type) {
+
+    case SIM_CYCLE_START:
+        if (link->periodic)
+            b2th_sim_start_cycle(link, now);
+        return 0;
+
+    case SIM_INQUIRY_RESULT:
+        if (link->num_rsp && link->nb_rsp >= link->num_rsp)
+            return 0;
+
+        // The controller ends the inquiry as soon as it got num_rsp responses
+        if (link->num_rsp && ++link->nb_rsp == link->num_rsp) {
+            size_t i;
+            for (i = 0; i < link->nb_events; i++) {
+                if (link->heap[i].type == SIM_INQUIRY_RESULT)
+                    link->heap[i].type = SIM_NONE;
+                else if (link->heap[i].type == SIM_INQUIRY_COMPLETE)
+                    link->heap[i].due = now;
+            }
+        }
+        return 1;
+
+    case SIM_INQUIRY_COMPLETE:
+        if (!link->periodic)
+            link->inquiring = 0;
+        return 1;
+
+    case SIM_NAME_COMPLETE:
+    case SIM_CONN_COMPLETE:
+        if (link->pages)
+            link->pages--;
+        return 1;
+
+    case SIM_NONE:
+        return 0;
+
+    default:
+        return 1;
+    }
+}
+
+
+static void *b2th_sim_link_thread(void *arg)
+{
+    struct b2th_sim_link *link = arg;
+    unsigned char buf[HCI_MAX_EVENT_SIZE + 1];
+
+    pthread_mutex_lock(&link->lock);
+
+    while (!link->stop) {
+
+        if (link->nb_events == 0) {
+            pthread_cond_wait(&link->cond, &link->lock);
+            continue;
+        }
+
+        long long now = b2th_now_ms();
+        if (link->heap[0].due > now) {
+            long long due = link->heap[0].due;
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            ts.tv_sec += (due - now) / 1000;
+            ts.tv_nsec += ((due - now) % 1000) * 1000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&link->cond, &link->lock, &ts);
+            continue;
+        }
+
+        struct b2th_sim_event ev;
+        b2th_sim_pop(link, &ev);
+        if (!b2th_sim_deliver(link, &ev, now))
+            continue;
+
+        size_t len = b2th_sim_event_build(link, &ev, buf);
+        if (len == 0)
+            continue;
+
+        // Never block on the socket with the lock held: commands are sent from the reader thread
+        pthread_mutex_unlock(&link->lock);
+        ssize_t ret = send(link->fds[1], buf, len, MSG_NOSIGNAL);
+        pthread_mutex_lock(&link->lock);
+
+        if (ret == -1 && errno != EINTR)
+            break;
+    }
+
+    pthread_mutex_unlock(&link->lock);
+
+    return NULL;
+}
+
+
+static struct b2th_sim_link *b2th_sim_link_get(struct b2th_sim *sim, int sock)
+{
+    struct b2th_sim_link *link = NULL;
+
+    pthread_mutex_lock(&sim->lock);
+    size_t i;
+    for (i = 0; i < B2TH_SIM_MAX_LINKS && !link; i++)
+        if (sim->links[i] && sim->links[i]->fds[0] == sock)
+            link = sim->links[i];
+    pthread_mutex_unlock(&sim->lock);
+
+    return link;
+}
+
+
+static int b2th_sim_get_dev_list(struct b2th_transport *t, struct hci_dev_info *di, int max)
+{
+    struct b2th_sim *sim = (struct b2th_sim *)t;
+
+    pthread_mutex_lock(&sim->lock);
+    int i, count = 0;
+    for (i = 0; i < (int)sim->params.nb_adapters && count < max; i++) {
+        if (sim->removed[i])
+            continue;
+
+        memset(&di[count], 0, sizeof(di[count]));
+        di[count].dev_id = i;
+        snprintf(di[count].name, sizeof(di[count].name), "hci%d", i);
+        b2th_key_to_bdaddr(0xb2b2b2b20000ULL | i, &di[count].bdaddr);
+        di[count].flags = sim->down[i] ? 0 : (1 << HCI_UP);
+        count++;
+    }
+    pthread_mutex_unlock(&sim->lock);
+
+    return count;
+}
+
+
+static int b2th_sim_usable(struct b2th_sim *sim, int dev_id)
+{
+    if (dev_id < 0 || dev_id >= (int)sim->params.nb_adapters)
+        return 0;
+
+    pthread_mutex_lock(&sim->lock);
+    int usable = !sim->removed[dev_id] && !sim->down[dev_id];
+    pthread_mutex_unlock(&sim->lock);
+
+    return usable;
+}
+
+
+static int b2th_sim_get_dev_id(struct b2th_transport *t, const char *interface)
+{
+    struct b2th_sim *sim = (struct b2th_sim *)t;
+
+    int dev_id = -1;
+    if (!interface) {
+        // First controller up, as hci_get_route() does
+        for (dev_id = 0; dev_id < (int)sim->params.nb_adapters; dev_id++)
+            if (b2th_sim_usable(sim, dev_id))
+                return dev_id;
+        return -1;
+    }
+
+    uint64_t key;
+    if (strncmp(interface, "hci", 3) == 0)
+        dev_id = atoi(interface + 3);
+    else if (b2th_str_to_key(interface, &key) == 0 && (key & ~0xffffULL) == 0xb2b2b2b20000ULL)
+        dev_id = key & 0xffff;
+
+    return b2th_sim_usable(sim, dev_id) ? dev_id : -1;
+}
+
+
+static int b2th_sim_open_monitor(struct b2th_transport *t)
+{
+    struct b2th_sim *sim = (struct b2th_sim *)t;
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) == -1)
+        return -1;
+
+    pthread_mutex_lock(&sim->lock);
+    size_t i;
+    for (i = 0; i < B2TH_SIM_MAX_MONITORS && sim->monitors[i] >= 0; i++)
+        ;
+    if (i < B2TH_SIM_MAX_MONITORS)
+        sim->monitors[i] = fds[1];
+    pthread_mutex_unlock(&sim->lock);
+
+    if (i == B2TH_SIM_MAX_MONITORS) {
+        close(fds[0]);
+        close(fds[1]);
+        errno = EMFILE;
+        return -1;
+    }
+
+    return fds[0];
+}
+
+
+static void b2th_sim_device_event(struct b2th_sim *sim, int dev_id, uint16_t event)
+{
+    unsigned char buf[1 + HCI_EVENT_HDR_SIZE + 2 + sizeof(evt_si_device)];
+    hci_event_hdr *hdr = (hci_event_hdr *)(buf + 1);
+    evt_stack_internal *si = (evt_stack_internal *)(buf + 1 + HCI_EVENT_HDR_SIZE);
+    evt_si_device sd = { .event = htobs(event), .dev_id = htobs(dev_id) };
+
+    buf[0] = HCI_EVENT_PKT;
+    hdr->evt = EVT_STACK_INTERNAL;
+    hdr->plen = 2 + sizeof(evt_si_device);
+    si->type = htobs(EVT_SI_DEVICE);
+    memcpy(si->data, &sd, sizeof(sd));
+
+    // Called with the lock held, listeners that went away are forgotten
+    size_t i;
+    for (i = 0; i < B2TH_SIM_MAX_MONITORS; i++) {
+        if (sim->monitors[i] < 0)
+            continue;
+        if (send(sim->monitors[i], buf, sizeof(buf), MSG_DONTWAIT | MSG_NOSIGNAL) == -1 && errno != EAGAIN) {
+            close(sim->monitors[i]);
+            sim->monitors[i] = -1;
+        }
+    }
+}
+
+
+int b2th_sim_controller_event(b2th_transport_t *transport, int dev_id, b2th_controller_event_e event)
+{
+    struct b2th_sim *sim = (struct b2th_sim *)transport;
+    if (!sim || dev_id < 0 || dev_id >= (int)sim->params.nb_adapters)
+        return -1;
+
+    int ret = 0;
+    pthread_mutex_lock(&sim->lock);
+
+    // State first, then the event: listeners enumerating on the event see the change
+    switch (event) {
+
+    case B2TH_CONTROLLER_ADDED:
+        if (!sim->removed[dev_id]) {
+            ret = -1;
+            break;
+        }
+        // Registered controllers come up later, when asked to
+        sim->removed[dev_id] = 0;
+        sim->down[dev_id] = 1;
+        b2th_sim_device_event(sim, dev_id, HCI_DEV_REG);
+        break;
+
+    case B2TH_CONTROLLER_REMOVED:
+        if (sim->removed[dev_id]) {
+            ret = -1;
+            break;
+        }
+        if (!sim->down[dev_id]) {
+            sim->down[dev_id] = 1;
+            b2th_sim_device_event(sim, dev_id, HCI_DEV_DOWN);
+        }
+        sim->removed[dev_id] = 1;
+        b2th_sim_device_event(sim, dev_id, HCI_DEV_UNREG);
+        break;
+
+    case B2TH_CONTROLLER_UP:
+    case B2TH_CONTROLLER_DOWN:
+        if (sim->removed[dev_id] || sim->down[dev_id] == (event == B2TH_CONTROLLER_DOWN)) {
+            ret = -1;
+            break;
+        }
+        sim->down[dev_id] = (event == B2TH_CONTROLLER_DOWN);
+        b2th_sim_device_event(sim, dev_id, sim->down[dev_id] ? HCI_DEV_DOWN : HCI_DEV_UP);
+        break;
+
+    default:
+        ret = -1;
+        break;
+    }
+
+    pthread_mutex_unlock(&sim->lock);
+
+    return ret;
+}
+
+
+static int b2th_sim_close_dev(struct b2th_transport *t, int sock)
+{
+    struct b2th_sim *sim = (struct b2th_sim *)t;
+    struct b2th_sim_link *link = NULL;
+
+    pthread_mutex_lock(&sim->lock);
+    size_t i;
+    for (i = 0; i < B2TH_SIM_MAX_LINKS && !link; i++) {
+        if (sim->links[i] && sim->links[i]->fds[0] == sock) {
+            link = sim->links[i];
+            sim->links[i] = NULL;
+        }
+    }
+    pthread_mutex_unlock(&sim->lock);
+
+    if (!link)
+        return -1;
+
+    pthread_mutex_lock(&link->lock);
+    link->stop = 1;
+    pthread_cond_signal(&link->cond);
+    pthread_mutex_unlock(&link->lock);
+
+    // Unblock a delivery stuck on a full socket
+    shutdown(link->fds[0], SHUT_RDWR);
+    pthread_join(link->thread, NULL);
+
+    close(link->fds[0]);
+    close(link->fds[1]);
+    pthread_cond_destroy(&link->cond);
+    pthread_mutex_destroy(&link->lock);
+    free(link->heap);
+    free(link);
+
+    return 0;
+}
+
+
+static int b2th_sim_open_dev(struct b2th_transport *t, int dev_id)
+{
+    struct b2th_sim *sim = (struct b2th_sim *)t;
+
+    if (!b2th_sim_usable(sim, dev_id)) {
+        errno = ENODEV;
+        return -1;
+    }
+
+    struct b2th_sim_link *link = calloc(1, sizeof(struct b2th_sim_link));
+    if (!link)
+        return -1;
+
+    // Sequenced packets keep one event per read, like a raw HCI socket
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, link->fds) == -1) {
+        free(link);
+        return -1;
+    }
+
+    link->sim = sim;
+    link->dev_id = dev_id;
+    link->rand_state = sim->params.seed + 7919 * (unsigned int)link->fds[0] + dev_id;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&link->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&link->lock, NULL);
+
+    pthread_mutex_lock(&sim->lock);
+    size_t i;
+    for (i = 0; i < B2TH_SIM_MAX_LINKS && sim->links[i]; i++)
+        ;
+    if (i < B2TH_SIM_MAX_LINKS)
+        sim->links[i] = link;
+    pthread_mutex_unlock(&sim->lock);
+
+    if (i == B2TH_SIM_MAX_LINKS || b2th_thread_create(&link->thread, NULL, b2th_sim_link_thread, link) != 0) {
+        if (i < B2TH_SIM_MAX_LINKS) {
+            pthread_mutex_lock(&sim->lock);
+            sim->links[i] = NULL;
+            pthread_mutex_unlock(&sim->lock);
+        }
+        close(link->fds[0]);
+        close(link->fds[1]);
+        pthread_cond_destroy(&link->cond);
+        pthread_mutex_destroy(&link->lock);
+        free(link);
+        errno = EMFILE;
+        return -1;
+    }
+
+    return link->fds[0];
+}
+
+
+static int b2th_sim_set_filter(struct b2th_transport *t, int sock, const struct hci_filter *flt)
+{
+    (void)flt;
+
+    // Only the events a command triggers are ever generated
+    return b2th_sim_link_get((struct b2th_sim *)t, sock) ? 0 : -1;
+}
+
+
+static void b2th_sim_name_req(struct b2th_sim_link *link, long long now, uint16_t opcode, const remote_name_req_cp *cp)
+{
+    struct b2th_sim *sim = link->sim;
+
+    if (sim->params.max_pages && link->pages >= sim->params.max_pages) {
+        b2th_sim_push(link, SIM_CMD_STATUS, now, opcode, HCI_MAX_NUMBER_OF_CONNECTIONS, 0, 0);
+        return;
+    }
+
+    b2th_sim_push(link, SIM_CMD_STATUS, now, opcode, 0, 0, 0);
+    link->pages++;
+
+    uint64_t key = b2th_bdaddr_to_key(&cp->bdaddr);
+    uintptr_t pos = (uintptr_t)b2th_map_get(&sim->index, key);
+    if (!pos || !sim->devices[pos - 1].named) {
+        b2th_sim_push(link, SIM_NAME_COMPLETE, now + sim->params.page_timeout_ms, 0, HCI_PAGE_TIMEOUT, key,
+                sim->params.nb_devices);
+        return;
+    }
+
+    unsigned int spread = 0;
+    if (sim->params.name_latency_max_ms > sim->params.name_latency_min_ms)
+        spread = sim->params.name_latency_max_ms - sim->params.name_latency_min_ms + 1;
+
+    long long latency = sim->params.name_latency_min_ms + b2th_sim_rand(link, spread);
+    b2th_sim_push(link, SIM_NAME_COMPLETE, now + latency, 0, 0, key, pos - 1);
+}
+
+
+static void b2th_sim_name_cancel(struct b2th_sim_link *link, long long now, uint16_t opcode,
+        const remote_name_req_cancel_cp *cp)
+{
+    uint64_t key = b2th_bdaddr_to_key(&cp->bdaddr);
+    uint8_t status = HCI_NO_CONNECTION;
+
+    size_t i;
+    for (i = 0; i < link->nb_events; i++) {
+        if (link->heap[i].type == SIM_NAME_COMPLETE && link->heap[i].key == key) {
+            link->heap[i].type = SIM_NONE;
+            status = 0;
+            break;
+        }
+    }
+
+    b2th_sim_push(link, SIM_CMD_COMPLETE, now, opcode, status, key, 0);
+    if (status == 0) {
+        if (link->pages)
+            link->pages--;
+        b2th_sim_push(link, SIM_NAME_COMPLETE, now, 0, HCI_NO_CONNECTION, key, link->sim->params.nb_devices);
+    }
+}
+
+
+static void b2th_sim_create_conn(struct b2th_sim_link *link, long long now, uint16_t opcode, const create_conn_cp *cp)
+{
+    struct b2th_sim *sim = link->sim;
+
+    // Connections page the device like name requests and share the same limit
+    if (sim->params.max_pages && link->pages >= sim->params.max_pages) {
+        b2th_sim_push(link, SIM_CMD_STATUS, now, opcode, HCI_MAX_NUMBER_OF_CONNECTIONS, 0, 0);
+        return;
+    }
+
+    b2th_sim_push(link, SIM_CMD_STATUS, now, opcode, 0, 0, 0);
+    link->pages++;
+
+    uint64_t key = b2th_bdaddr_to_key(&cp->bdaddr);
+    uintptr_t pos = (uintptr_t)b2th_map_get(&sim->index, key);
+    if (!pos) {
+        b2th_sim_push(link, SIM_CONN_COMPLETE, now + sim->params.page_timeout_ms, 0, HCI_PAGE_TIMEOUT, key, 0);
+        return;
+    }
+
+    uint16_t handle = __sync_fetch_and_add(&b2th_sim_handle, 1) & 0x0eff;
+    b2th_sim_push(link, SIM_CONN_COMPLETE, now + sim->params.name_latency_min_ms, 0, 0, key, handle);
+}
+
+
+static void b2th_sim_create_conn_cancel(struct b2th_sim_link *link, long long now, uint16_t opcode,
+        const create_conn_cancel_cp *cp)
+{
+    uint64_t key = b2th_bdaddr_to_key(&cp->bdaddr);
+    uint8_t status = HCI_NO_CONNECTION;
+
+    size_t i;
+    for (i = 0; i < link->nb_events; i++) {
+        if (link->heap[i].type == SIM_CONN_COMPLETE && link->heap[i].key == key) {
+            link->heap[i].type = SIM_NONE;
+            status = 0;
+            break;
+        }
+    }
+
+    b2th_sim_push(link, SIM_CMD_COMPLETE, now, opcode, status, key, 0);
+    if (status == 0) {
+        if (link->pages)
+            link->pages--;
+        b2th_sim_push(link, SIM_CONN_COMPLETE, now, 0, HCI_NO_CONNECTION, key, 0);
+    }
+}
+
+
+static int b2th_sim_send_cmd(struct b2th_transport *t, int sock, uint16_t ogf, uint16_t ocf, uint8_t plen, void *param)
+{
+    struct b2th_sim *sim = (struct b2th_sim *)t;
+    struct b2th_sim_link *link = b2th_sim_link_get(sim, sock);
+    if (!link)
+        return -1;
+
+    uint16_t opcode = cmd_opcode_pack(ogf, ocf);
+    long long now = b2th_now_ms();
+
+    pthread_mutex_lock(&link->lock);
+
+    if (ogf == OGF_LINK_CTL && ocf == OCF_INQUIRY && plen >= INQUIRY_CP_SIZE) {
+        inquiry_cp *cp = param;
+        if (link->inquiring) {
+            b2th_sim_push(link, SIM_CMD_STATUS, now, opcode, HCI_COMMAND_DISALLOWED, 0, 0);
+        } else {
+            b2th_sim_push(link, SIM_CMD_STATUS, now, opcode, 0, 0, 0);
+            link->periodic = 0;
+            link->num_rsp = cp->num_rsp;
+            link->lap = cp->lap[0] | (cp->lap[1] << 8) | (cp->lap[2] << 16);
+            link->inquiry_len_ms = (long long)cp->length * sim->params.inquiry_unit_ms;
+            b2th_sim_start_cycle(link, now);
+        }
+
+    } else if (ogf == OGF_LINK_CTL && ocf == OCF_PERIODIC_INQUIRY && plen >= PERIODIC_INQUIRY_CP_SIZE) {
+        periodic_inquiry_cp *cp = param;
+        if (link->inquiring || link->periodic) {
+            b2th_sim_push(link, SIM_CMD_COMPLETE, now, opcode, HCI_COMMAND_DISALLOWED, 0, 0);
+        } else {
+            b2th_sim_push(link, SIM_CMD_COMPLETE, now, opcode, 0, 0, 0);
+            link->periodic = 1;
+            link->num_rsp = cp->num_rsp;
+            link->lap = cp->lap[0] | (cp->lap[1] << 8) | (cp->lap[2] << 16);
+            link->inquiry_len_ms = (long long)cp->length * sim->params.inquiry_unit_ms;
+            link->period_ms = (long long)btohs(cp->max_period) * sim->params.inquiry_unit_ms;
+            b2th_sim_start_cycle(link, now);
+        }
+
+    } else if (ogf == OGF_LINK_CTL && (ocf == OCF_INQUIRY_CANCEL || ocf == OCF_EXIT_PERIODIC_INQUIRY)) {
+        b2th_sim_drop_inquiry(link);
+        link->periodic = 0;
+        b2th_sim_push(link, SIM_CMD_COMPLETE, now, opcode, 0, 0, 0);
+
+    } else if (ogf == OGF_LINK_CTL && ocf == OCF_REMOTE_NAME_REQ && plen >= REMOTE_NAME_REQ_CP_SIZE) {
+        b2th_sim_name_req(link, now, opcode, param);
+
+    } else if (ogf == OGF_LINK_CTL && ocf == OCF_REMOTE_NAME_REQ_CANCEL && plen >= REMOTE_NAME_REQ_CANCEL_CP_SIZE) {
+        b2th_sim_name_cancel(link, now, opcode, param);
+
+    } else if (ogf == OGF_LINK_CTL && ocf == OCF_CREATE_CONN && plen >= CREATE_CONN_CP_SIZE) {
+        b2th_sim_create_conn(link, now, opcode, param);
+
+    } else if (ogf == OGF_LINK_CTL && ocf == OCF_CREATE_CONN_CANCEL && plen >= CREATE_CONN_CANCEL_CP_SIZE) {
+        b2th_sim_create_conn_cancel(link, now, opcode, param);
+
+    } else if (ogf == OGF_LINK_CTL && ocf == OCF_DISCONNECT && plen >= DISCONNECT_CP_SIZE) {
+        b2th_sim_push(link, SIM_CMD_STATUS, now, opcode, 0, 0, 0);
+        b2th_sim_push(link, SIM_DISCONN_COMPLETE, now, 0, 0, 0, btohs(((disconnect_cp *)param)->handle));
+
+    } else if (ogf == OGF_HOST_CTL && ocf == OCF_WRITE_INQUIRY_MODE && plen >= WRITE_INQUIRY_MODE_CP_SIZE) {
+        link->inquiry_mode = ((write_inquiry_mode_cp *)param)->mode;
+        b2th_sim_push(link, SIM_CMD_COMPLETE, now, opcode, 0, 0, 0);
+
+    } else if (ogf == OGF_HOST_CTL && ocf == OCF_SET_EVENT_FLT && plen >= SET_EVENT_FLT_CP_SIZE) {
+        set_event_flt_cp *cp = param;
+        if (cp->flt_type == FLT_CLEAR_ALL
+                || (cp->flt_type == FLT_INQ_RESULT && cp->cond_type == INQ_RESULT_RETURN_ALL)) {
+            link->cod_filter = 0;
+        } else if (cp->flt_type == FLT_INQ_RESULT && cp->cond_type == INQ_RESULT_RETURN_CLASS
+                && plen >= SET_EVENT_FLT_CP_SIZE + 6) {
+            link->cod_filter = 1;
+            link->cod_value = cp->condition[0] | (cp->condition[1] << 8) | (cp->condition[2] << 16);
+            link->cod_mask = cp->condition[3] | (cp->condition[4] << 8) | (cp->condition[5] << 16);
+        }
+        b2th_sim_push(link, SIM_CMD_COMPLETE, now, opcode, 0, 0, 0);
+
+    } else if (ogf == OGF_LE_CTL) {
+        // No LE population: scans are accepted and stay silent
+        b2th_sim_push(link, SIM_CMD_COMPLETE, now, opcode, 0, 0, 0);
+
+    } else {
+        b2th_sim_push(link, SIM_CMD_STATUS, now, opcode, HCI_UNKNOWN_COMMAND, 0, 0);
+    }
+
+    pthread_mutex_unlock(&link->lock);
+
+    return 0;
+}
+
+
+static int b2th_sim_send_req(struct b2th_transport *t, int sock, struct hci_request *rq, int timeout_ms)
+{
+    struct b2th_sim *sim = (struct b2th_sim *)t;
+
+    if (!b2th_sim_link_get(sim, sock))
+        return -1;
+
+    if (rq->ogf == OGF_LINK_CTL && rq->ocf == OCF_CREATE_CONN && rq->rlen >= EVT_CONN_COMPLETE_SIZE) {
+        const create_conn_cp *cp = rq->cparam;
+        evt_conn_complete *rp = rq->rparam;
+        uintptr_t pos = (uintptr_t)b2th_map_get(&sim->index, b2th_bdaddr_to_key(&cp->bdaddr));
+
+        long long latency = pos ? sim->params.name_latency_min_ms : sim->params.page_timeout_ms;
+        if (timeout_ms > 0 && latency > timeout_ms) {
+            usleep(timeout_ms * 1000);
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        usleep(latency * 1000);
+
+        memset(rp, 0, sizeof(*rp));
+        rp->status = pos ? 0 : HCI_PAGE_TIMEOUT;
+        rp->handle = htobs(__sync_fetch_and_add(&b2th_sim_handle, 1) & 0x0eff);
+        bacpy(&rp->bdaddr, &cp->bdaddr);
+        rp->link_type = ACL_LINK;
+        return 0;
+    }
+
+    if (rq->ogf == OGF_LE_CTL && rq->rlen >= 1) {
+        // No LE population: scans are accepted and stay silent
+        *(uint8_t *)rq->rparam = 0;
+        return 0;
+    }
+
+    if (rq->ogf == OGF_LINK_CTL && rq->ocf == OCF_DISCONNECT && rq->rlen >= EVT_DISCONN_COMPLETE_SIZE) {
+        const disconnect_cp *cp = rq->cparam;
+        evt_disconn_complete *rp = rq->rparam;
+        rp->status = 0;
+        rp->handle = cp->handle;
+        rp->reason = cp->reason;
+        return 0;
+    }
+
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+
+/*!
+ * \brief device side of a simulated data connection
+ */
+struct b2th_sim_peer {
+    int fd;                             /**<! device end of the socketpair */
+    uint8_t services;                   /**<! services the device offers */
+};
+
+
+static void *b2th_sim_echo_thread(void *arg)
+{
+    struct b2th_sim_peer *peer = arg;
+    unsigned char buf[B2TH_SIM_DATA_BUF];
+
+    // A serial port or packet device echoing what it gets, dropping what the host does not read in time
+    for (;;) {
+        ssize_t len = read(peer->fd, buf, sizeof(buf));
+        if (len == -1 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            break;
+
+        send(peer->fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+
+    close(peer->fd);
+    free(peer);
+
+    return NULL;
+}
+
+
+static int b2th_sim_sdp_match(const struct b2th_sim_service *svc, const uint16_t *pattern, size_t nb_pattern)
+{
+    // A record matches when it contains every UUID of the pattern
+    size_t i;
+    for (i = 0; i < nb_pattern; i++) {
+        if (pattern[i] != svc->uuid && pattern[i] != L2CAP_UUID && !(pattern[i] == RFCOMM_UUID && svc->channel))
+            return 0;
+    }
+
+    return 1;
+}
+
+
+/*
+ * Attribute lists of the records matching a search pattern, each with its
+ * ProtocolDescriptorList only: L2CAP with the PSM, or L2CAP then RFCOMM
+ * with the channel.
+ */
+static size_t b2th_sim_sdp_records(uint8_t services, const uint16_t *pattern, size_t nb_pattern, unsigned char *buf)
+{
+    unsigned char *p = buf + 3;
+
+    size_t i;
+    for (i = 0; i < sizeof(b2th_sim_services) / sizeof(b2th_sim_services[0]); i++) {
+        const struct b2th_sim_service *svc = &b2th_sim_services[i];
+        if (!(services & (1 << i)) || !b2th_sim_sdp_match(svc, pattern, nb_pattern))
+            continue;
+
+        unsigned char *rec = p;
+        p += 2;
+        *p++ = SDP_UINT16;
+        *p++ = SDP_ATTR_PROTO_DESC_LIST >> 8;
+        *p++ = SDP_ATTR_PROTO_DESC_LIST & 0xff;
+
+        unsigned char *protos = p;
+        p += 2;
+        if (svc->channel) {
+            *p++ = SDP_SEQ8;
+            *p++ = 3;
+            *p++ = SDP_UUID16;
+            *p++ = L2CAP_UUID >> 8;
+            *p++ = L2CAP_UUID & 0xff;
+            *p++ = SDP_SEQ8;
+            *p++ = 5;
+            *p++ = SDP_UUID16;
+            *p++ = RFCOMM_UUID >> 8;
+            *p++ = RFCOMM_UUID & 0xff;
+            *p++ = SDP_UINT8;
+            *p++ = svc->channel;
+        } else {
+            *p++ = SDP_SEQ8;
+            *p++ = 6;
+            *p++ = SDP_UUID16;
+            *p++ = L2CAP_UUID >> 8;
+            *p++ = L2CAP_UUID & 0xff;
+            *p++ = SDP_UINT16;
+            *p++ = svc->psm >> 8;
+            *p++ = svc->psm & 0xff;
+        }
+
+        protos[0] = SDP_SEQ8;
+        protos[1] = p - protos - 2;
+        rec[0] = SDP_SEQ8;
+        rec[1] = p - rec - 2;
+    }
+
+    buf[0] = SDP_SEQ16;
+    buf[1] = (p - buf - 3) >> 8;
+    buf[2] = (p - buf - 3) & 0xff;
+
+    return p - buf;
+}
+
+
+static void *b2th_sim_sdp_thread(void *arg)
+{
+    struct b2th_sim_peer *peer = arg;
+    unsigned char req[L2CAP_DEFAULT_MTU];
+    unsigned char rsp[L2CAP_DEFAULT_MTU];
+    unsigned char records[512];
+
+    // An SDP server answering ServiceSearchAttributeRequests in small chunks
+    for (;;) {
+        ssize_t len = recv(peer->fd, req, sizeof(req), 0);
+        if (len == -1 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            break;
+
+        uint16_t error = SDP_INVALID_SYNTAX;
+        uint16_t pattern[12];
+        size_t nb_pattern = 0;
+        const unsigned char *p = req + 5;
+        const unsigned char *end = req + len;
+
+        if (len < 5 || req[0] != SDP_SVC_SEARCH_ATTR_REQ || end - p < 2 || p[0] != SDP_SEQ8 || end - p < 2 + p[1])
+            goto error;
+
+        const unsigned char *pattern_end = p + 2 + p[1];
+        for (p += 2; p < pattern_end && nb_pattern < 12; p += 3) {
+            if (pattern_end - p < 3 || p[0] != SDP_UUID16)
+                goto error;
+            pattern[nb_pattern++] = p[1] << 8 | p[2];
+        }
+        p = pattern_end;
+
+        // The AttributeIDList is not looked at: records only hold their protocols
+        if (end - p < 4 || p[2] != SDP_SEQ8 || end - p < 4 + p[3] + 1)
+            goto error;
+        uint16_t max_count = p[0] << 8 | p[1];
+        p += 4 + p[3];
+
+        size_t offset = 0;
+        if (*p == 2 && end - p >= 3)
+            offset = p[1] << 8 | p[2];
+        else if (*p != 0)
+            goto error;
+
+        size_t total = b2th_sim_sdp_records(peer->services, pattern, nb_pattern, records);
+        error = SDP_INVALID_CSTATE;
+        if (offset > total)
+            goto error;
+
+        size_t count = total - offset;
+        if (count > max_count)
+            count = max_count;
+        if (count > B2TH_SIM_SDP_CHUNK)
+            count = B2TH_SIM_SDP_CHUNK;
+
+        unsigned char *q = rsp + 5;
+        *q++ = count >> 8;
+        *q++ = count & 0xff;
+        memcpy(q, records + offset, count);
+        q += count;
+        if (offset + count < total) {
+            *q++ = 2;
+            *q++ = (offset + count) >> 8;
+            *q++ = (offset + count) & 0xff;
+        } else {
+            *q++ = 0;
+        }
+
+        rsp[0] = SDP_SVC_SEARCH_ATTR_RSP;
+        rsp[1] = req[1];
+        rsp[2] = req[2];
+        rsp[3] = (q - rsp - 5) >> 8;
+        rsp[4] = (q - rsp - 5) & 0xff;
+        send(peer->fd, rsp, q - rsp, MSG_NOSIGNAL);
+        continue;
+
+error:
+        rsp[0] = SDP_ERROR_RSP;
+        rsp[1] = len >= 3 ? req[1] : 0;
+        rsp[2] = len >= 3 ? req[2] : 0;
+        rsp[3] = 0;
+        rsp[4] = 2;
+        rsp[5] = error >> 8;
+        rsp[6] = error & 0xff;
+        send(peer->fd, rsp, 7, MSG_NOSIGNAL);
+    }
+
+    close(peer->fd);
+    free(peer);
+
+    return NULL;
+}
+
+
+static int b2th_sim_connect(struct b2th_transport *t, int dev_id, int proto, const bdaddr_t *bdaddr, uint16_t port,
+        b2th_l2cap_opts_t *opts, int timeout_ms)
+{
+    struct b2th_sim *sim = (struct b2th_sim *)t;
+
+    if (dev_id < 0 || dev_id >= (int)sim->params.nb_adapters) {
+        errno = ENODEV;
+        return -1;
+    }
+
+    if (proto != BTPROTO_RFCOMM && proto != BTPROTO_L2CAP) {
+        errno = EPROTONOSUPPORT;
+        return -1;
+    }
+
+    uintptr_t pos = (uintptr_t)b2th_map_get(&sim->index, b2th_bdaddr_to_key(bdaddr));
+
+    long long latency = pos ? sim->params.name_latency_min_ms : sim->params.page_timeout_ms;
+    if (timeout_ms > 0 && latency > timeout_ms) {
+        usleep(timeout_ms * 1000);
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    usleep(latency * 1000);
+
+    if (!pos) {
+        errno = EHOSTDOWN;
+        return -1;
+    }
+
+    // Devices take packets as large as the host ones: they echo them back
+    if (proto == BTPROTO_L2CAP && opts) {
+        if (!opts->imtu)
+            opts->imtu = L2CAP_DEFAULT_MTU;
+        if (!opts->omtu)
+            opts->omtu = opts->imtu;
+        if (!opts->flush_timeout)
+            opts->flush_timeout = 0xffff;
+    }
+
+    int fds[2];
+    int type = (proto == BTPROTO_L2CAP) ? SOCK_SEQPACKET : SOCK_STREAM;
+    if (socketpair(AF_UNIX, type | SOCK_CLOEXEC, 0, fds) == -1)
+        return -1;
+
+    struct b2th_sim_peer *peer = malloc(sizeof(struct b2th_sim_peer));
+    if (!peer) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    peer->fd = fds[1];
+    peer->services = sim->devices[pos - 1].services;
+
+    // The device side lives until the library closes its end: an SDP server on the SDP PSM, an echo elsewhere
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int sdp = (proto == BTPROTO_L2CAP && port == SDP_PSM);
+    int ret = b2th_thread_create(&thread, &attr, sdp ? b2th_sim_sdp_thread : b2th_sim_echo_thread, peer);
+    pthread_attr_destroy(&attr);
+
+    if (ret != 0) {
+        close(fds[0]);
+        close(fds[1]);
+        free(peer);
+        errno = EMFILE;
+        return -1;
+    }
+
+    return fds[0];
+}
+
+
+b2th_transport_t *b2th_sim_create(const b2th_sim_params_t *params)
+{
+    struct b2th_sim *sim = calloc(1, sizeof(struct b2th_sim));
+    if (!sim)
+        return NULL;
+
+    if (params)
+        sim->params = *params;
+    else
+        b2th_sim_params_init(&sim->params);
+
+    if (sim->params.nb_adapters > B2TH_SIM_MAX_ADAPTERS)
+        sim->params.nb_adapters = B2TH_SIM_MAX_ADAPTERS;
+    if (sim->params.nb_devices > 0xffffff)
+        sim->params.nb_devices = 0xffffff;
+    if (sim->params.inquiry_unit_ms == 0)
+        sim->params.inquiry_unit_ms = 1;
+
+    sim->transport = (struct b2th_transport) {
+        .name = "sim",
+        .get_dev_list = b2th_sim_get_dev_list,
+        .get_dev_id = b2th_sim_get_dev_id,
+        .open_dev = b2th_sim_open_dev,
+        .close_dev = b2th_sim_close_dev,
+        .set_filter = b2th_sim_set_filter,
+        .send_cmd = b2th_sim_send_cmd,
+        .send_req = b2th_sim_send_req,
+        .connect = b2th_sim_connect,
+        .open_monitor = b2th_sim_open_monitor,
+    };
+
+    size_t m;
+    for (m = 0; m < B2TH_SIM_MAX_MONITORS; m++)
+        sim->monitors[m] = -1;
+
+    sim->devices = calloc(sim->params.nb_devices + 1, sizeof(struct b2th_sim_device));
+    if (!sim->devices || b2th_map_init(&sim->index, sim->params.nb_devices) == -1) {
+        free(sim->devices);
+        free(sim);
+        return NULL;
+    }
+
+    // The population only depends on the seed: runs are comparable across machines
+    unsigned int state = sim->params.seed;
+    size_t i;
+    for (i = 0; i < sim->params.nb_devices; i++) {
+        struct b2th_sim_device *dev = &sim->devices[i];
+        uint64_t key = 0x001a7d000000ULL | (i & 0xffffff);
+        b2th_key_to_bdaddr(key, &dev->bdaddr);
+        b2th_map_put(&sim->index, key, (void *)(uintptr_t)(i + 1));
+
+        // Out of the random sequence so that older seeds keep their population
+        uint64_t hash = key * 0x9e3779b97f4a7c15ULL;
+        uint32_t cod = b2th_sim_classes[(hash >> 40) & 3];
+        dev->dev_class[0] = cod & 0xff;
+        dev->dev_class[1] = (cod >> 8) & 0xff;
+        dev->dev_class[2] = (cod >> 16) & 0xff;
+        dev->limited = ((hash >> 44) & 7) == 0;
+        if ((hash >> 16) % 100 < sim->params.eir_percent)
+            dev->eir = ((hash >> 24) & 7) == 0 ? B2TH_SIM_EIR_SHORT : B2TH_SIM_EIR_COMPLETE;
+        dev->tx_power = ((hash >> 28) & 1) ? 4 : 0;
+        dev->services = hash >> 58;
+
+        dev->pscan_rep_mode = 0x01;
+        dev->clock_offset = rand_r(&state) & 0x7fff;
+        dev->rssi = -30 - rand_r(&state) % 60;
+        dev->named = (unsigned int)(rand_r(&state) % 100) >= sim->params.unnamed_percent;
+        snprintf(dev->name, sizeof(dev->name), "sim-device-%zu", i);
+    }
+
+    pthread_mutex_init(&sim->lock, NULL);
+
+    return &sim->transport;
+}
+
+
+void b2th_sim_destroy(b2th_transport_t *transport)
+{
+    struct b2th_sim *sim = (struct b2th_sim *)transport;
+    if (!sim)
+        return;
+
+    size_t i;
+    for (i = 0; i < B2TH_SIM_MAX_LINKS; i++)
+        if (sim->links[i])
+            b2th_sim_close_dev(transport, sim->links[i]->fds[0]);
+
+    for (i = 0; i < B2TH_SIM_MAX_MONITORS; i++)
+        if (sim->monitors[i] >= 0)
+            close(sim->monitors[i]);
+
+    pthread_mutex_destroy(&sim->lock);
+    b2th_map_deinit(&sim->index);
+    free(sim->devices);
+    free(sim);
+}
@@ -0,0 +1,362 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "b2th_internal.h"
+
+
+struct b2th_snapshot {
+    size_t count;                       /**<! records */
+    size_t names_size;                  /**<! bytes of names, the empty name first */
+    int by_address;                     /**<! records sorted by ascending address */
+    char *names;                        /**<! NUL terminated names, right after the records */
+    b2th_record_t records[];            /**<! device records */
+};
+
+
+static b2th_snapshot_t *b2th_snapshot_alloc(size_t count, size_t names_size)
+{
+    b2th_snapshot_t *snap = malloc(sizeof(b2th_snapshot_t) + count * sizeof(b2th_record_t) + names_size);
+    if (!snap)
+        return NULL;
+
+    b2th_stats_alloc();
+
+    snap->count = count;
+    snap->names_size = names_size;
+    snap->by_address = 0;
+    snap->names = (char *)&snap->records[count];
+    snap->names[0] = '\0';
+
+    return snap;
+}
+
+
+static size_t b2th_snapshot_name_size(const char *name)
+{
+    return strcmp(name, B2TH_UNKNOWN_NAME) == 0 ? 0 : strlen(name) + 1;
+}
+
+
+static void b2th_snapshot_set_name(b2th_snapshot_t *snap, b2th_record_t *rec, size_t *offset, const char *name)
+{
+    if (strcmp(name, B2TH_UNKNOWN_NAME) == 0)
+        return;
+
+    size_t len = strlen(name);
+    memcpy(snap->names + *offset, name, len + 1);
+    rec->name = *offset;
+    rec->name_len = len;
+    *offset += len + 1;
+}
+
+
+b2th_snapshot_t *b2th_snapshot_create(b2th_list_t *bl)
+{
+    // Sized first so that records and names live in a single allocation
+    size_t names_size = 1;
+    b2th_device_t *pos;
+    b2th_device_for_each_entry(bl, pos)
+        names_size += b2th_snapshot_name_size(pos->name);
+
+    b2th_snapshot_t *snap = b2th_snapshot_alloc(b2th_list_size(bl), names_size);
+    if (!snap)
+        return NULL;
+
+    size_t i = 0;
+    size_t offset = 1;
+    b2th_device_for_each_entry(bl, pos) {
+        b2th_record_t *rec = &snap->records[i++];
+        memset(rec, 0, sizeof(*rec));
+        rec->bdaddr = pos->bdaddr;
+        rec->last_seen = pos->last_seen;
+        rec->dev_class = pos->dev_class;
+        rec->dev_id = pos->dev_id;
+        rec->rssi = pos->rssi;
+        rec->tx_power = pos->tx_power;
+        b2th_snapshot_set_name(snap, rec, &offset, pos->name);
+    }
+
+    return snap;
+}
+
+
+/*!
+ * \brief table entries gathered before the snapshot can be sized
+ */
+struct b2th_snapshot_collect {
+    b2th_table_entry_t *entries;        /**<! copies of the present devices */
+    size_t count;                       /**<! entries used */
+    size_t size;                        /**<! entries allocated */
+    size_t names_size;                  /**<! bytes the names will take */
+    int error;                          /**<! an allocation failed */
+};
+
+
+static void b2th_snapshot_collect(const b2th_table_entry_t *entry, void *userdata)
+{
+    struct b2th_snapshot_collect *sc = userdata;
+
+    if (sc->count == sc->size) {
+        size_t size = sc->size ? sc->size * 2 : 64;
+        b2th_table_entry_t *entries = realloc(sc->entries, size * sizeof(b2th_table_entry_t));
+        if (!entries) {
+            sc->error = 1;
+            return;
+        }
+
+        b2th_stats_alloc();
+        sc->entries = entries;
+        sc->size = size;
+    }
+
+    sc->entries[sc->count++] = *entry;
+    sc->names_size += b2th_snapshot_name_size(entry->name);
+}
+
+
+b2th_snapshot_t *b2th_table_snapshot(b2th_table_t *table)
+{
+    // The table may change while it is walked: the entries are copied once, then sized and packed
+    struct b2th_snapshot_collect sc = { .names_size = 1 };
+    b2th_table_for_each(table, b2th_snapshot_collect, &sc);
+
+    b2th_snapshot_t *snap = NULL;
+    if (sc.error)
+        goto clean;
+
+    snap = b2th_snapshot_alloc(sc.count, sc.names_size);
+    if (!snap)
+        goto clean;
+
+    size_t i;
+    size_t offset = 1;
+    for (i = 0; i < sc.count; i++) {
+        const b2th_table_entry_t *entry = &sc.entries[i];
+        b2th_record_t *rec = &snap->records[i];
+        memset(rec, 0, sizeof(*rec));
+        rec->bdaddr = entry->bdaddr;
+        rec->last_seen = entry->last_seen;
+        rec->dev_class = entry->dev_class;
+        rec->dev_id = -1;
+        rec->rssi = entry->rssi;
+        rec->tx_power = B2TH_TX_POWER_UNKNOWN;
+        b2th_snapshot_set_name(snap, rec, &offset, entry->name);
+    }
+
+clean:
+    free(sc.entries);
+
+    return snap;
+}
+
+
+static int b2th_record_cmp_address(const void *a, const void *b)
+{
+    const b2th_record_t *x = a;
+    const b2th_record_t *y = b;
+
+    return (x->bdaddr > y->bdaddr) - (x->bdaddr < y->bdaddr);
+}
+
+
+static int b2th_record_cmp_rssi(const void *a, const void *b)
+{
+    const b2th_record_t *x = a;
+    const b2th_record_t *y = b;
+
+    // An unknown RSSI (0) sorts after every measured one
+    int xr = x->rssi ? x->rssi : -256;
+    int yr = y->rssi ? y->rssi : -256;
+    if (xr != yr)
+        return yr - xr;
+
+    return b2th_record_cmp_address(a, b);
+}
+
+
+static int b2th_record_cmp_last_seen(const void *a, const void *b)
+{
+    const b2th_record_t *x = a;
+    const b2th_record_t *y = b;
+
+    if (x->last_seen != y->last_seen)
+        return (y->last_seen > x->last_seen) - (y->last_seen < x->last_seen);
+
+    return b2th_record_cmp_address(a, b);
+}
+
+
+void b2th_snapshot_sort(b2th_snapshot_t *snap, b2th_sort_e order)
+{
+    int (*cmp)(const void *, const void *) = NULL;
+
+    switch (order) {
+    case B2TH_SORT_ADDRESS:
+        cmp = b2th_record_cmp_address;
+        break;
+
+    case B2TH_SORT_RSSI:
+        cmp = b2th_record_cmp_rssi;
+        break;
+
+    case B2TH_SORT_LAST_SEEN:
+        cmp = b2th_record_cmp_last_seen;
+        break;
+    }
+
+    if (!cmp)
+        return;
+
+    qsort(snap->records, snap->count, sizeof(b2th_record_t), cmp);
+    snap->by_address = (order == B2TH_SORT_ADDRESS);
+}
+
+
+const b2th_record_t *b2th_snapshot_records(const b2th_snapshot_t *snap, size_t *count)
+{
+    *count = snap->count;
+
+    return snap->records;
+}
+
+
+const b2th_record_t *b2th_snapshot_find(const b2th_snapshot_t *snap, uint64_t bdaddr)
+{
+    b2th_record_t key = { .bdaddr = bdaddr };
+
+    if (snap->by_address)
+        return bsearch(&key, snap->records, snap->count, sizeof(b2th_record_t), b2th_record_cmp_address);
+
+    size_t i;
+    for (i = 0; i < snap->count; i++)
+        if (snap->records[i].bdaddr == bdaddr)
+            return &snap->records[i];
+
+    return NULL;
+}
+
+
+const char *b2th_snapshot_name(const b2th_snapshot_t *snap, const b2th_record_t *rec)
+{
+    return snap->names + rec->name;
+}
+
+
+void b2th_snapshot_export(const b2th_snapshot_t *snap, struct iovec iov[2])
+{
+    iov[0].iov_base = (void *)snap->records;
+    iov[0].iov_len = snap->count * sizeof(b2th_record_t);
+    iov[1].iov_base = snap->names;
+    iov[1].iov_len = snap->names_size;
+}
+
+
+static uint8_t b2th_record_changes(const b2th_snapshot_t *before, const b2th_record_t *old,
+        const b2th_snapshot_t *after, const b2th_record_t *rec, unsigned int rssi_threshold)
+{
+    uint8_t changed = 0;
+
+    if (rec->name_len && (rec->name_len != old->name_len
+            || memcmp(after->names + rec->name, before->names + old->name, rec->name_len) != 0))
+        changed |= B2TH_CHANGED_NAME;
+
+    if (rssi_threshold && rec->rssi && old->rssi && (unsigned int)abs(rec->rssi - old->rssi) >= rssi_threshold)
+        changed |= B2TH_CHANGED_RSSI;
+
+    return changed;
+}
+
+
+int b2th_snapshot_diff(const b2th_snapshot_t *before, const b2th_snapshot_t *after, unsigned int rssi_threshold,
+        b2th_diff_t *diff)
+{
+    size_t nb_before = before ? before->count : 0;
+    size_t nb_after = after ? after->count : 0;
+
+    memset(diff, 0, sizeof(*diff));
+
+    // Older records by address, one hash lookup per newer record keeps the whole diff linear
+    struct b2th_map index;
+    if (b2th_map_init(&index, nb_before) == -1)
+        return -1;
+
+    uint8_t *matched = calloc(nb_before + 1, 1);
+    diff->changes = malloc((nb_before + nb_after + 1) * sizeof(b2th_change_t));
+    if (!matched || !diff->changes)
+        goto clean;
+
+    b2th_stats_alloc();
+    b2th_stats_alloc();
+
+    size_t i;
+    for (i = 0; i < nb_before; i++)
+        if (b2th_map_put(&index, before->records[i].bdaddr, (void *)(uintptr_t)(i + 1)) == -1)
+            goto clean;
+
+    for (i = 0; i < nb_after; i++) {
+        const b2th_record_t *rec = &after->records[i];
+        size_t idx = (uintptr_t)b2th_map_get(&index, rec->bdaddr);
+
+        b2th_change_t *change = &diff->changes[diff->nb_changes];
+        if (!idx) {
+            *change = (b2th_change_t){ .type = B2TH_DEVICE_ADDED, .after = rec };
+            diff->nb_added++;
+            diff->nb_changes++;
+            continue;
+        }
+
+        const b2th_record_t *old = &before->records[idx - 1];
+        matched[idx - 1] = 1;
+
+        uint8_t changed = b2th_record_changes(before, old, after, rec, rssi_threshold);
+        if (!changed)
+            continue;
+
+        *change = (b2th_change_t){ .type = B2TH_DEVICE_CHANGED, .changed = changed, .before = old, .after = rec };
+        diff->nb_changed++;
+        diff->nb_changes++;
+    }
+
+    for (i = 0; i < nb_before; i++) {
+        if (matched[i])
+            continue;
+
+        diff->changes[diff->nb_changes++] = (b2th_change_t){ .type = B2TH_DEVICE_REMOVED, .before = &before->records[i] };
+        diff->nb_removed++;
+    }
+
+    free(matched);
+    b2th_map_deinit(&index);
+
+    return diff->nb_changes;
+
+clean:
+    free(matched);
+    b2th_map_deinit(&index);
+    b2th_diff_deinit(diff);
+
+    return -1;
+}
+
+
+void b2th_diff_deinit(b2th_diff_t *diff)
+{
+    free(diff->changes);
+    memset(diff, 0, sizeof(*diff));
+}
+
+
+void b2th_record_address(const b2th_record_t *rec, char *address)
+{
+    snprintf(address, 18, "%02X:%02X:%02X:%02X:%02X:%02X",
+            (unsigned int)(rec->bdaddr >> 40) & 0xff, (unsigned int)(rec->bdaddr >> 32) & 0xff,
+            (unsigned int)(rec->bdaddr >> 24) & 0xff, (unsigned int)(rec->bdaddr >> 16) & 0xff,
+            (unsigned int)(rec->bdaddr >> 8) & 0xff, (unsigned int)rec->bdaddr & 0xff);
+}
+
+
+void b2th_snapshot_destroy(b2th_snapshot_t *snap)
+{
+    free(snap);
+}
@@ -0,0 +1,132 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "b2th_internal.h"
+
+
+__thread uint64_t b2th_allocs;
+
+
+static const unsigned int b2th_latency_bounds[B2TH_STATS_LATENCY_BUCKETS - 1] = {
+    25, 50, 100, 250, 500, 1000, 2500, 5000, 10000
+};
+
+
+static b2th_scan_stats_t b2th_stats;
+
+
+void b2th_stats_add(b2th_scan_stats_t *dst, const b2th_scan_stats_t *src)
+{
+    // Counters only: the struct is an array of uint64_t, summed one field at a time
+    uint64_t *d = (uint64_t *)dst;
+    const uint64_t *s = (const uint64_t *)src;
+
+    size_t i;
+    for (i = 0; i < sizeof(b2th_scan_stats_t) / sizeof(uint64_t); i++)
+        if (s[i])
+            __atomic_fetch_add(&d[i], s[i], __ATOMIC_RELAXED);
+}
+
+
+void b2th_stats_name_latency(b2th_scan_stats_t *stats, long long latency_ms)
+{
+    if (latency_ms < 0)
+        latency_ms = 0;
+
+    size_t i;
+    for (i = 0; i < B2TH_STATS_LATENCY_BUCKETS - 1 && latency_ms > b2th_latency_bounds[i]; i++)
+        ;
+
+    stats->name_latency[i]++;
+    stats->name_latency_ms += latency_ms;
+}
+
+
+void b2th_stats_socket_open()
+{
+    __atomic_fetch_add(&b2th_stats.socket_opens, 1, __ATOMIC_RELAXED);
+}
+
+
+void b2th_stats_scan_done(const b2th_scan_stats_t *scan, b2th_scan_stats_t *user)
+{
+    b2th_stats_add(&b2th_stats, scan);
+    if (user)
+        b2th_stats_add(user, scan);
+}
+
+
+void b2th_stats_get(b2th_scan_stats_t *stats)
+{
+    uint64_t *d = (uint64_t *)stats;
+    uint64_t *s = (uint64_t *)&b2th_stats;
+
+    size_t i;
+    for (i = 0; i < sizeof(b2th_scan_stats_t) / sizeof(uint64_t); i++)
+        d[i] = __atomic_load_n(&s[i], __ATOMIC_RELAXED);
+}
+
+
+void b2th_stats_reset()
+{
+    uint64_t *s = (uint64_t *)&b2th_stats;
+
+    size_t i;
+    for (i = 0; i < sizeof(b2th_scan_stats_t) / sizeof(uint64_t); i++)
+        __atomic_store_n(&s[i], 0, __ATOMIC_RELAXED);
+}
+
+
+int b2th_stats_write_prometheus(const b2th_scan_stats_t *stats, FILE *out)
+{
+    static const struct {
+        const char *name;
+        const char *help;
+        size_t offset;
+    } counters[] = {
+        { "b2th_scans_total", "Scans run", offsetof(b2th_scan_stats_t, scans) },
+        { "b2th_scan_errors_total", "Scans that failed or were cut short by an error", offsetof(b2th_scan_stats_t, errors) },
+        { "b2th_inquiries_total", "Inquiries completed", offsetof(b2th_scan_stats_t, inquiries) },
+        { "b2th_inquiry_milliseconds_total", "Time spent with an inquiry running", offsetof(b2th_scan_stats_t, inquiry_ms) },
+        { "b2th_inquiries_preempted_total", "Discovery inquiry slices cut short by a connection", offsetof(b2th_scan_stats_t, inquiries_preempted) },
+        { "b2th_inquiry_responses_total", "Inquiry responses, duplicates included", offsetof(b2th_scan_stats_t, responses) },
+        { "b2th_inquiry_filtered_total", "Inquiry responses dropped by the inquiry filter", offsetof(b2th_scan_stats_t, filtered) },
+        { "b2th_devices_total", "Distinct devices found", offsetof(b2th_scan_stats_t, devices) },
+        { "b2th_name_requests_total", "Remote name requests sent", offsetof(b2th_scan_stats_t, name_requests) },
+        { "b2th_names_resolved_total", "Remote name requests answered", offsetof(b2th_scan_stats_t, names_resolved) },
+        { "b2th_name_failures_total", "Remote name requests failed by the controller", offsetof(b2th_scan_stats_t, name_failures) },
+        { "b2th_name_timeouts_total", "Remote name requests cancelled on timeout", offsetof(b2th_scan_stats_t, name_timeouts) },
+        { "b2th_name_refused_total", "Remote name requests refused by the controller", offsetof(b2th_scan_stats_t, name_refused) },
+        { "b2th_name_cache_hits_total", "Names served by a known or cached name", offsetof(b2th_scan_stats_t, name_cache_hits) },
+        { "b2th_eir_names_total", "Names taken from extended inquiry responses", offsetof(b2th_scan_stats_t, eir_names) },
+        { "b2th_hci_events_total", "HCI events read", offsetof(b2th_scan_stats_t, events) },
+        { "b2th_socket_opens_total", "HCI sockets opened", offsetof(b2th_scan_stats_t, socket_opens) },
+        { "b2th_scan_allocations_total", "Heap allocations made by scans", offsetof(b2th_scan_stats_t, allocs) },
+    };
+
+    size_t i;
+    for (i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+        fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", counters[i].name, counters[i].help,
+                counters[i].name, counters[i].name,
+                (unsigned long long)*(const uint64_t *)((const char *)stats + counters[i].offset));
+    }
+
+    fprintf(out, "# HELP b2th_name_latency_milliseconds Remote name request latency\n");
+    fprintf(out, "# TYPE b2th_name_latency_milliseconds histogram\n");
+
+    uint64_t count = 0;
+    for (i = 0; i < B2TH_STATS_LATENCY_BUCKETS; i++) {
+        count += stats->name_latency[i];
+        if (i < B2TH_STATS_LATENCY_BUCKETS - 1)
+            fprintf(out, "b2th_name_latency_milliseconds_bucket{le=\"%u\"} %llu\n", b2th_latency_bounds[i],
+                    (unsigned long long)count);
+        else
+            fprintf(out, "b2th_name_latency_milliseconds_bucket{le=\"+Inf\"} %llu\n", (unsigned long long)count);
+    }
+
+    fprintf(out, "b2th_name_latency_milliseconds_sum %llu\n", (unsigned long long)stats->name_latency_ms);
+    fprintf(out, "b2th_name_latency_milliseconds_count %llu\n", (unsigned long long)count);
+
+    return ferror(out) ? -1 : 0;
+}
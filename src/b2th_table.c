@@ -0,0 +1,306 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "b2th_internal.h"
+
+
+/*!
+ * \brief shared device table slot, one cache line apart from its neighbours
+ */
+struct b2th_table_slot {
+    uint32_t seq;                       /**<! odd while a writer updates entry */
+    uint64_t key;                       /**<! bdaddr of the device, 0 while free, changed by writers only while absent */
+    b2th_table_entry_t entry;           /**<! device, read only between two equal even seq values */
+} __attribute__((aligned(64)));
+
+
+struct b2th_table {
+    pthread_mutex_t write_lock;         /**<! serializes the writers, readers never take it */
+    size_t capacity;                    /**<! slots, power of two */
+    size_t max_devices;                 /**<! devices present at once, keeps probe sequences short */
+    size_t used;                        /**<! slots with a key, writers only */
+    size_t present;                     /**<! present devices, read atomically */
+    struct b2th_table_slot *slots;      /**<! open addressing by bdaddr */
+};
+
+
+static size_t b2th_table_home(const b2th_table_t *table, uint64_t key)
+{
+    return (key * 0x9e3779b97f4a7c15ULL) >> 16 & (table->capacity - 1);
+}
+
+
+static struct b2th_table_slot *b2th_table_find(b2th_table_t *table, uint64_t key)
+{
+    size_t i = b2th_table_home(table, key);
+
+    // No slot between the home of a key and its slot is ever free: the first free slot ends the probe sequence
+    size_t n;
+    for (n = 0; n < table->capacity; n++) {
+        struct b2th_table_slot *slot = &table->slots[i];
+        uint64_t slot_key = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+        if (slot_key == key)
+            return slot;
+        if (slot_key == 0)
+            return NULL;
+        i = (i + 1) & (table->capacity - 1);
+    }
+
+    return NULL;
+}
+
+
+static void b2th_table_read(const struct b2th_table_slot *slot, b2th_table_entry_t *entry)
+{
+    uint32_t seq;
+
+    do {
+        while ((seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE)) & 1)
+            ;
+
+        // May race with a writer, the copy is only kept if seq did not move
+        memcpy(entry, &slot->entry, sizeof(*entry));
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq);
+}
+
+
+static void b2th_table_write_begin(struct b2th_table_slot *slot)
+{
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+
+static void b2th_table_write_end(struct b2th_table_slot *slot)
+{
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+
+b2th_table_t *b2th_table_create(size_t max_devices)
+{
+    b2th_table_t *table = calloc(1, sizeof(b2th_table_t));
+    if (!table)
+        return NULL;
+
+    b2th_stats_alloc();
+
+    table->capacity = 16;
+    while (table->capacity < max_devices * 2)
+        table->capacity <<= 1;
+
+    table->max_devices = max_devices;
+    pthread_mutex_init(&table->write_lock, NULL);
+
+    if (posix_memalign((void **)&table->slots, 64, table->capacity * sizeof(struct b2th_table_slot)) != 0) {
+        free(table);
+        return NULL;
+    }
+    memset(table->slots, 0, table->capacity * sizeof(struct b2th_table_slot));
+
+    b2th_stats_alloc();
+
+    return table;
+}
+
+
+static int b2th_table_update_locked(b2th_table_t *table, const b2th_device_t *bd, long long now)
+{
+    if (bd->bdaddr == 0)
+        return -1;
+
+    struct b2th_table_slot *slot = b2th_table_find(table, bd->bdaddr);
+    if (!slot) {
+        if (table->present == table->max_devices)
+            return -1;
+
+        // First free or absent slot: fewer than half the slots hold a present device, one is always found
+        size_t i = b2th_table_home(table, bd->bdaddr);
+        while (table->slots[i].key && table->slots[i].entry.present)
+            i = (i + 1) & (table->capacity - 1);
+
+        // An absent device gives its slot away, readers holding the old key see the bdaddr change
+        slot = &table->slots[i];
+        b2th_table_write_begin(slot);
+        if (!slot->key)
+            table->used++;
+        memset(&slot->entry, 0, sizeof(slot->entry));
+        memcpy(slot->entry.address, bd->address, sizeof(slot->entry.address));
+        strcpy(slot->entry.name, B2TH_UNKNOWN_NAME);
+        slot->entry.bdaddr = bd->bdaddr;
+        __atomic_store_n(&slot->key, bd->bdaddr, __ATOMIC_RELEASE);
+    } else {
+        b2th_table_write_begin(slot);
+    }
+
+    b2th_table_entry_t *entry = &slot->entry;
+    int arrived = !entry->present;
+    if (arrived) {
+        entry->present = 1;
+        entry->first_seen = now;
+    }
+
+    if (bd->name && strcmp(bd->name, B2TH_UNKNOWN_NAME) != 0)
+        strncpy(entry->name, bd->name, sizeof(entry->name) - 1);
+    if (bd->rssi)
+        entry->rssi = bd->rssi;
+    if (bd->dev_class)
+        entry->dev_class = bd->dev_class;
+    entry->last_seen = now;
+    entry->sightings++;
+
+    b2th_table_write_end(slot);
+
+    if (arrived)
+        __atomic_add_fetch(&table->present, 1, __ATOMIC_RELAXED);
+
+    return arrived;
+}
+
+
+int b2th_table_update(b2th_table_t *table, const b2th_device_t *bd, long long now)
+{
+    pthread_mutex_lock(&table->write_lock);
+    int ret = b2th_table_update_locked(table, bd, now);
+    pthread_mutex_unlock(&table->write_lock);
+
+    return ret;
+}
+
+
+int b2th_table_update_list(b2th_table_t *table, b2th_list_t *bl, long long now)
+{
+    int arrivals = 0;
+    int full = 0;
+
+    pthread_mutex_lock(&table->write_lock);
+
+    b2th_device_t *bd;
+    list_for_each_entry(bd, &bl->head, node) {
+        int ret = b2th_table_update_locked(table, bd, now);
+        if (ret == -1)
+            full = 1;
+        else
+            arrivals += ret;
+    }
+
+    pthread_mutex_unlock(&table->write_lock);
+
+    return full ? -1 : arrivals;
+}
+
+
+static void b2th_table_release(b2th_table_t *table)
+{
+    size_t mask = table->capacity - 1;
+
+    // An absent slot followed by a free one ends every probe sequence going through it: it can be freed too
+    size_t i;
+    for (i = 0; i < table->capacity; i++) {
+        if (table->slots[i].key)
+            continue;
+
+        size_t j = (i - 1) & mask;
+        while (j != i && table->slots[j].key && !table->slots[j].entry.present) {
+            struct b2th_table_slot *slot = &table->slots[j];
+            b2th_table_write_begin(slot);
+            __atomic_store_n(&slot->key, 0, __ATOMIC_RELEASE);
+            b2th_table_write_end(slot);
+            table->used--;
+            j = (j - 1) & mask;
+        }
+    }
+}
+
+
+size_t b2th_table_expire(b2th_table_t *table, long long limit, b2th_table_cb_t cb, void *userdata)
+{
+    size_t departures = 0;
+
+    pthread_mutex_lock(&table->write_lock);
+
+    size_t i;
+    for (i = 0; i < table->capacity; i++) {
+        struct b2th_table_slot *slot = &table->slots[i];
+        if (!slot->key || !slot->entry.present || slot->entry.last_seen >= limit)
+            continue;
+
+        b2th_table_write_begin(slot);
+        slot->entry.present = 0;
+        b2th_table_write_end(slot);
+
+        __atomic_sub_fetch(&table->present, 1, __ATOMIC_RELAXED);
+        departures++;
+
+        if (cb)
+            cb(&slot->entry, userdata);
+    }
+
+    b2th_table_release(table);
+
+    pthread_mutex_unlock(&table->write_lock);
+
+    return departures;
+}
+
+
+int b2th_table_lookup(b2th_table_t *table, uint64_t bdaddr, b2th_table_entry_t *entry)
+{
+    if (bdaddr == 0)
+        return -1;
+
+    for (;;) {
+        const struct b2th_table_slot *slot = b2th_table_find(table, bdaddr);
+        if (!slot)
+            return -1;
+
+        b2th_table_read(slot, entry);
+
+        // The slot was given to another device meanwhile, this one may have come back elsewhere
+        if (entry->bdaddr == bdaddr)
+            return entry->present ? 0 : -1;
+    }
+}
+
+
+size_t b2th_table_for_each(b2th_table_t *table, b2th_table_cb_t cb, void *userdata)
+{
+    size_t count = 0;
+
+    size_t i;
+    for (i = 0; i < table->capacity; i++) {
+        const struct b2th_table_slot *slot = &table->slots[i];
+        if (!__atomic_load_n(&slot->key, __ATOMIC_ACQUIRE))
+            continue;
+
+        b2th_table_entry_t entry;
+        b2th_table_read(slot, &entry);
+        if (!entry.present)
+            continue;
+
+        cb(&entry, userdata);
+        count++;
+    }
+
+    return count;
+}
+
+
+size_t b2th_table_count(b2th_table_t *table)
+{
+    return __atomic_load_n(&table->present, __ATOMIC_RELAXED);
+}
+
+
+void b2th_table_destroy(b2th_table_t *table)
+{
+    if (!table)
+        return;
+
+    pthread_mutex_destroy(&table->write_lock);
+    free(table->slots);
+    free(table);
+}
@@ -0,0 +1,418 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+#include <bluetooth/l2cap.h>
+#include <bluetooth/rfcomm.h>
+
+#include "b2th_internal.h"
+
+
+static struct hci_dev_list_req *__get_bluetooth_device_list(int bluetooth_fd)
+{
+    // Allocate memory for the devices list + the maximum HCI_MAX_DEV devices
+    struct hci_dev_list_req *hdlr = calloc(1, sizeof(struct hci_dev_list_req)
+            + HCI_MAX_DEV * sizeof(struct hci_dev_req));
+    if (!hdlr) {
+        perror("Failed allocate HCI device request memory");
+        return NULL;
+    }
+
+    // Fill HCI_MAX_DEV in dev_num to prepare the ioctl request
+    hdlr->dev_num = HCI_MAX_DEV;
+
+    // Retrieve every bluetooth controller available
+    if (ioctl(bluetooth_fd, HCIGETDEVLIST, hdlr) == -1) {
+        perror("Failed to get HCI device list");
+        free(hdlr);
+        return NULL;
+    }
+
+    return hdlr;
+}
+
+
+static int b2th_kernel_get_dev_list(struct b2th_transport *t, struct hci_dev_info *di, int max)
+{
+    (void)t;
+
+    int bluetooth_fd = socket(AF_BLUETOOTH, SOCK_RAW, BTPROTO_HCI);
+    if (bluetooth_fd == -1) {
+        perror("Failed to open raw HCI socket");
+        return -1;
+    }
+
+    struct hci_dev_list_req *hdlr = __get_bluetooth_device_list(bluetooth_fd);
+    if (!hdlr) {
+        close(bluetooth_fd);
+        return -1;
+    }
+
+    int i, count = 0;
+    for (i = 0; i < hdlr->dev_num && count < max; i++) {
+        memset(&di[count], 0, sizeof(di[count]));
+        di[count].dev_id = (hdlr->dev_req + i)->dev_id;
+
+        if (ioctl(bluetooth_fd, HCIGETDEVINFO, &di[count]) == -1)
+            continue;
+
+        count++;
+    }
+
+    close(bluetooth_fd);
+    free(hdlr);
+
+    return count;
+}
+
+
+static int b2th_kernel_get_dev_id(struct b2th_transport *t, const char *interface)
+{
+    (void)t;
+
+    if (interface == NULL)
+        return hci_get_route(NULL); // Passing NULL argument will retrieve the id of first avalaible bluetooth interface
+
+    return hci_devid(interface);
+}
+
+
+static int b2th_kernel_open_dev(struct b2th_transport *t, int dev_id)
+{
+    (void)t;
+
+    return hci_open_dev(dev_id);
+}
+
+
+static int b2th_kernel_close_dev(struct b2th_transport *t, int sock)
+{
+    (void)t;
+
+    return hci_close_dev(sock);
+}
+
+
+static int b2th_kernel_set_filter(struct b2th_transport *t, int sock, const struct hci_filter *flt)
+{
+    (void)t;
+
+    return setsockopt(sock, SOL_HCI, HCI_FILTER, flt, sizeof(*flt));
+}
+
+
+static int b2th_kernel_send_cmd(struct b2th_transport *t, int sock, uint16_t ogf, uint16_t ocf, uint8_t plen, void *param)
+{
+    (void)t;
+
+    return hci_send_cmd(sock, ogf, ocf, plen, param) < 0 ? -1 : 0;
+}
+
+
+static int b2th_kernel_send_req(struct b2th_transport *t, int sock, struct hci_request *rq, int timeout_ms)
+{
+    (void)t;
+
+    return hci_send_req(sock, rq, timeout_ms) < 0 ? -1 : 0;
+}
+
+
+static int b2th_kernel_open_monitor(struct b2th_transport *t)
+{
+    (void)t;
+
+    int sock = socket(AF_BLUETOOTH, SOCK_RAW | SOCK_CLOEXEC, BTPROTO_HCI);
+    if (sock == -1)
+        return -1;
+
+    // Bound to no controller, the socket only gets the device events of all of them
+    struct sockaddr_hci addr = {
+        .hci_family = AF_BLUETOOTH,
+        .hci_dev = HCI_DEV_NONE,
+        .hci_channel = HCI_CHANNEL_RAW,
+    };
+
+    struct hci_filter flt;
+    hci_filter_clear(&flt);
+    hci_filter_set_ptype(HCI_EVENT_PKT, &flt);
+    hci_filter_set_event(EVT_STACK_INTERNAL, &flt);
+
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1
+            || setsockopt(sock, SOL_HCI, HCI_FILTER, &flt, sizeof(flt)) == -1) {
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+
+static int b2th_socket_connect(int sock, const struct sockaddr *addr, socklen_t len, int timeout_ms)
+{
+    int flags = fcntl(sock, F_GETFL);
+    if (flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1)
+        return -1;
+
+    // Paging a device takes seconds: connect without blocking and bound the wait
+    if (connect(sock, addr, len) == -1) {
+        if (errno != EINPROGRESS)
+            return -1;
+
+        struct pollfd pfd = { .fd = sock, .events = POLLOUT };
+        int ret;
+        do {
+            ret = poll(&pfd, 1, timeout_ms ? timeout_ms : -1);
+        } while (ret == -1 && errno == EINTR);
+
+        if (ret == 0)
+            errno = ETIMEDOUT;
+        if (ret <= 0)
+            return -1;
+
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+        if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &err_len) == -1)
+            return -1;
+        if (err) {
+            errno = err;
+            return -1;
+        }
+    }
+
+    return fcntl(sock, F_SETFL, flags);
+}
+
+
+static int b2th_kernel_l2cap_opts(int sock, b2th_l2cap_opts_t *opts, int set)
+{
+    struct l2cap_options lo;
+    socklen_t len = sizeof(lo);
+
+    memset(&lo, 0, sizeof(lo));
+    if (getsockopt(sock, SOL_L2CAP, L2CAP_OPTIONS, &lo, &len) == -1)
+        return -1;
+
+    if (!set) {
+        opts->imtu = lo.imtu;
+        opts->omtu = lo.omtu;
+        opts->flush_timeout = lo.flush_to;
+        return 0;
+    }
+
+    // MTUs are negotiated while connecting: they must be set before
+    if (opts->imtu)
+        lo.imtu = opts->imtu;
+    if (opts->omtu)
+        lo.omtu = opts->omtu;
+    if (opts->flush_timeout)
+        lo.flush_to = opts->flush_timeout;
+
+    return setsockopt(sock, SOL_L2CAP, L2CAP_OPTIONS, &lo, sizeof(lo));
+}
+
+
+static int b2th_kernel_connect(struct b2th_transport *t, int dev_id, int proto, const bdaddr_t *bdaddr, uint16_t port,
+        b2th_l2cap_opts_t *opts, int timeout_ms)
+{
+    (void)t;
+
+    union {
+        struct sockaddr sa;
+        struct sockaddr_rc rc;
+        struct sockaddr_l2 l2;
+    } addr;
+    socklen_t addr_len;
+    int type;
+
+    // Bind to the local controller so the connection leaves from the one asked for
+    memset(&addr, 0, sizeof(addr));
+    switch (proto) {
+
+    case BTPROTO_RFCOMM:
+        addr.rc.rc_family = AF_BLUETOOTH;
+        if (hci_devba(dev_id, &addr.rc.rc_bdaddr) == -1)
+            return -1;
+        addr_len = sizeof(addr.rc);
+        type = SOCK_STREAM;
+        break;
+
+    case BTPROTO_L2CAP:
+        addr.l2.l2_family = AF_BLUETOOTH;
+        if (hci_devba(dev_id, &addr.l2.l2_bdaddr) == -1)
+            return -1;
+        addr_len = sizeof(addr.l2);
+        type = SOCK_SEQPACKET;
+        break;
+
+    default:
+        errno = EPROTONOSUPPORT;
+        return -1;
+    }
+
+    int sock = socket(AF_BLUETOOTH, type | SOCK_CLOEXEC, proto);
+    if (sock == -1)
+        return -1;
+
+    if (bind(sock, &addr.sa, addr_len) == -1)
+        goto clean_sock;
+
+    if (proto == BTPROTO_L2CAP && opts && b2th_kernel_l2cap_opts(sock, opts, 1) == -1)
+        goto clean_sock;
+
+    if (proto == BTPROTO_RFCOMM) {
+        bacpy(&addr.rc.rc_bdaddr, bdaddr);
+        addr.rc.rc_channel = port;
+    } else {
+        bacpy(&addr.l2.l2_bdaddr, bdaddr);
+        addr.l2.l2_psm = htobs(port);
+    }
+
+    if (b2th_socket_connect(sock, &addr.sa, addr_len, timeout_ms) == -1)
+        goto clean_sock;
+
+    if (proto == BTPROTO_L2CAP && opts && b2th_kernel_l2cap_opts(sock, opts, 0) == -1)
+        goto clean_sock;
+
+    return sock;
+
+clean_sock:
+    close(sock);
+    return -1;
+}
+
+
+static struct b2th_transport b2th_kernel_transport = {
+    .name = "hci",
+    .get_dev_list = b2th_kernel_get_dev_list,
+    .get_dev_id = b2th_kernel_get_dev_id,
+    .open_dev = b2th_kernel_open_dev,
+    .close_dev = b2th_kernel_close_dev,
+    .set_filter = b2th_kernel_set_filter,
+    .send_cmd = b2th_kernel_send_cmd,
+    .send_req = b2th_kernel_send_req,
+    .connect = b2th_kernel_connect,
+    .open_monitor = b2th_kernel_open_monitor,
+};
+
+
+static struct b2th_transport *b2th_transport = &b2th_kernel_transport;
+
+
+void b2th_transport_set(b2th_transport_t *transport)
+{
+    b2th_transport = transport ? transport : &b2th_kernel_transport;
+}
+
+
+int b2th_hci_get_dev_list(struct hci_dev_info *di, int max)
+{
+    // The registry table, when running, spares the enumeration system calls
+    int count = b2th_registry_get_dev_list(di, max);
+    if (count >= 0)
+        return count;
+
+    return b2th_transport->get_dev_list(b2th_transport, di, max);
+}
+
+
+int b2th_transport_get_dev_list(struct hci_dev_info *di, int max)
+{
+    return b2th_transport->get_dev_list(b2th_transport, di, max);
+}
+
+
+int b2th_get_dev_id(const char *interface)
+{
+    int dev_id;
+    if (b2th_registry_get_dev_id(interface, &dev_id) == 0)
+        return dev_id;
+
+    return b2th_transport->get_dev_id(b2th_transport, interface);
+}
+
+
+int b2th_hci_open_monitor(void)
+{
+    if (!b2th_transport->open_monitor) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    return b2th_transport->open_monitor(b2th_transport);
+}
+
+
+int b2th_hci_open_dev(int dev_id)
+{
+    int sock = b2th_transport->open_dev(b2th_transport, dev_id);
+    if (sock >= 0)
+        b2th_btsnoop_open(sock, dev_id);
+
+    return sock;
+}
+
+
+int b2th_hci_close_dev(int sock)
+{
+    b2th_btsnoop_close(sock);
+
+    return b2th_transport->close_dev(b2th_transport, sock);
+}
+
+
+int b2th_hci_set_filter(int sock, const struct hci_filter *flt)
+{
+    return b2th_transport->set_filter(b2th_transport, sock, flt);
+}
+
+
+int b2th_hci_send_cmd(int sock, uint16_t ogf, uint16_t ocf, uint8_t plen, void *param)
+{
+    b2th_btsnoop_command(sock, ogf, ocf, plen, param);
+
+    return b2th_transport->send_cmd(b2th_transport, sock, ogf, ocf, plen, param);
+}
+
+
+int b2th_hci_send_req(int sock, struct hci_request *rq, int timeout_ms)
+{
+    b2th_btsnoop_command(sock, rq->ogf, rq->ocf, rq->clen, rq->cparam);
+
+    int ret = b2th_transport->send_req(b2th_transport, sock, rq, timeout_ms);
+    if (ret == 0)
+        b2th_btsnoop_reply(sock, rq->event, rq->rparam, rq->rlen);
+
+    return ret;
+}
+
+
+ssize_t b2th_hci_read(int sock, void *buf, size_t len)
+{
+    ssize_t ret = read(sock, buf, len);
+    if (ret > 0)
+        b2th_btsnoop_event(sock, buf, ret);
+
+    return ret;
+}
+
+
+int b2th_bt_connect(int dev_id, int proto, const bdaddr_t *bdaddr, uint16_t port, b2th_l2cap_opts_t *opts,
+        int timeout_ms)
+{
+    if (!b2th_transport->connect) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    return b2th_transport->connect(b2th_transport, dev_id, proto, bdaddr, port, opts, timeout_ms);
+}
@@ -1,39 +1,56 @@
 #include <stdio.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
-
-#include <sys/ioctl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
 #include <bluetooth/hci_lib.h>
 #include <bluetooth/rfcomm.h>
 
-#include "blue2th.h"
+#include "b2th_internal.h"
+
 
+#define B2TH_NAME_CONCURRENCY_DEFAULT   4
+#define B2TH_NAME_TIMEOUT_MS_DEFAULT    5120
+#define B2TH_FORGET_PERIODS_DEFAULT     4
 
-static struct hci_dev_list_req *__get_bluetooth_device_list(int bluetooth_fd)
+
+uint64_t b2th_bdaddr_to_key(const bdaddr_t *ba)
 {
-    // Allocate memory for the devices list + the maximum HCI_MAX_DEV devices
-    struct hci_dev_list_req *hdlr = calloc(1, sizeof(struct hci_dev_list_req)
-            + HCI_MAX_DEV * sizeof(struct hci_dev_req));
-    if (!hdlr) {
-        perror("Failed allocate HCI device request memory");
-        return NULL;
-    }
+    uint64_t key = 0;
 
-    // Fill HCI_MAX_DEV in dev_num to prepare the ioctl request
-    hdlr->dev_num = HCI_MAX_DEV;
+    int i;
+    for (i = 0; i < 6; i++)
+        key |= (uint64_t)ba->b[i] << (8 * i);
 
-    // Retrieve every bluetooth controller available
-    if (ioctl(bluetooth_fd, HCIGETDEVLIST, hdlr) == -1) {
-        perror("Failed to get HCI device list");
-        free(hdlr);
-        return NULL;
-    }
+    return key;
+}
+
+
+void b2th_key_to_bdaddr(uint64_t key, bdaddr_t *ba)
+{
+    int i;
+    for (i = 0; i < 6; i++)
+        ba->b[i] = (key >> (8 * i)) & 0xff;
+}
+
+
+int b2th_str_to_key(const char *address, uint64_t *key)
+{
+    bdaddr_t ba;
+    if (!address || bachk(address) < 0 || str2ba(address, &ba) < 0)
+        return -1;
 
-    return hdlr;
+    *key = b2th_bdaddr_to_key(&ba);
+
+    return 0;
 }
 
 
@@ -43,8 +60,9 @@ b2th_device_t *b2th_device_init()
     if (!bd)
         return NULL;
 
-    bd->address = NULL;
+    b2th_stats_alloc();
     bd->name = NULL;
+    bd->tx_power = B2TH_TX_POWER_UNKNOWN;
 
     init_list(&(bd->node));
 
@@ -52,14 +70,21 @@ b2th_device_t *b2th_device_init()
 }
 
 
-static b2th_device_t *b2th_device_create(const char *address, const char *name)
+b2th_device_t *b2th_device_create(const char *address, const char *name)
 {
     b2th_device_t *bd = b2th_device_init();
     if (!bd)
         return NULL;
 
-    bd->address = strdup(address);
+    strncpy(bd->address, address, sizeof(bd->address) - 1);
     bd->name = strdup(name);
+    if (!bd->name) {
+        free(bd);
+        return NULL;
+    }
+
+    b2th_stats_alloc();
+    b2th_str_to_key(address, &bd->bdaddr);
 
     init_list(&(bd->node));
 
@@ -73,43 +98,198 @@ b2th_list_t *b2th_list_init()
     if (!bl)
         return NULL;
 
+    bl->store = calloc(1, sizeof(struct b2th_list_store));
+    if (!bl->store) {
+        free(bl);
+        return NULL;
+    }
+
+    b2th_stats_alloc();
+    b2th_stats_alloc();
+
     init_list(&(bl->head));
 
     return bl;
 }
 
 
-static int b2th_list_add_node(b2th_list_t *bl, const char *address, const char *name)
+static int b2th_list_index_name(b2th_list_t *bl, b2th_device_t *bd)
+{
+    // Unresolved devices all share the same name, keep them out of the index
+    if (strcmp(bd->name, B2TH_UNKNOWN_NAME) == 0)
+        return 0;
+
+    uint64_t hash = b2th_hash_str(bd->name);
+    b2th_device_t *first = b2th_map_get(&bl->store->name_index, hash);
+    if (!first)
+        return b2th_map_put(&bl->store->name_index, hash, bd);
+
+    // Same name hash: chain at the tail to keep the list order on lookups
+    while (first->name_next)
+        first = first->name_next;
+    first->name_next = bd;
+
+    return 0;
+}
+
+
+static void b2th_list_unindex_name(b2th_list_t *bl, b2th_device_t *bd)
+{
+    if (strcmp(bd->name, B2TH_UNKNOWN_NAME) == 0)
+        return;
+
+    uint64_t hash = b2th_hash_str(bd->name);
+    b2th_device_t *first = b2th_map_get(&bl->store->name_index, hash);
+
+    if (first == bd) {
+        if (bd->name_next)
+            b2th_map_put(&bl->store->name_index, hash, bd->name_next);
+        else
+            b2th_map_del(&bl->store->name_index, hash);
+    } else {
+        while (first && first->name_next != bd)
+            first = first->name_next;
+        if (first)
+            first->name_next = bd->name_next;
+    }
+
+    bd->name_next = NULL;
+}
+
+
+static char *b2th_list_strdup(b2th_list_t *bl, const char *name)
+{
+    if (strcmp(name, B2TH_UNKNOWN_NAME) != 0)
+        return b2th_arena_strdup(&bl->store->arena, name);
+
+    if (!bl->store->unknown_name)
+        bl->store->unknown_name = b2th_arena_strdup(&bl->store->arena, B2TH_UNKNOWN_NAME);
+
+    return bl->store->unknown_name;
+}
+
+
+b2th_device_t *b2th_list_add_node(b2th_list_t *bl, const char *address, const char *name)
 {
-    b2th_device_t *bd_new = calloc(1, sizeof(b2th_device_t));
+    uint64_t bdaddr;
+    if (b2th_str_to_key(address, &bdaddr) == -1)
+        return NULL;
+
+    b2th_device_t *bd_new = b2th_arena_alloc(&bl->store->arena, sizeof(b2th_device_t));
     if (!bd_new)
-        return -1;
+        return NULL;
+
+    memset(bd_new, 0, sizeof(b2th_device_t));
+    strncpy(bd_new->address, address, sizeof(bd_new->address) - 1);
+    bd_new->bdaddr = bdaddr;
+    bd_new->tx_power = B2TH_TX_POWER_UNKNOWN;
+    bd_new->name = b2th_list_strdup(bl, name);
+    if (!bd_new->name || b2th_map_put(&bl->store->addr_index, bdaddr, bd_new) == -1)
+        return NULL;
 
-    bd_new->address = strdup(address);
-    bd_new->name = strdup(name);
+    b2th_list_index_name(bl, bd_new);
 
     list_add_tail(&(bd_new->node), &(bl->head));
+    bl->count++;
+
+    return bd_new;
+}
+
+
+int b2th_list_set_name(b2th_list_t *bl, b2th_device_t *bd, const char *name)
+{
+    // The previous name of a list device stays in the arena until the list is freed
+    char *new_name = bl ? b2th_list_strdup(bl, name) : strdup(name);
+    if (!new_name)
+        return -1;
+
+    if (bl)
+        b2th_list_unindex_name(bl, bd);
+    else
+        free((char *)bd->name);
+
+    bd->name = new_name;
+
+    if (bl)
+        b2th_list_index_name(bl, bd);
 
     return 0;
 }
 
 
+int b2th_list_retain(b2th_list_t *bl, int (*keep)(const b2th_device_t *bd, void *userdata), void *userdata)
+{
+    size_t dropped = 0;
+    b2th_device_t *pos;
+    b2th_device_for_each_entry(bl, pos)
+        if (!keep(pos, userdata))
+            dropped++;
+
+    if (!dropped)
+        return 0;
+
+    b2th_list_t *fresh = b2th_list_init();
+    if (!fresh)
+        return -1;
+
+    b2th_device_for_each_entry(bl, pos) {
+        if (!keep(pos, userdata))
+            continue;
+
+        b2th_device_t *bd = b2th_list_add_node(fresh, pos->address, pos->name);
+        if (!bd)
+            goto error;
+
+        // Everything but the storage and the links owned by the new list
+        const char *name = bd->name;
+        b2th_device_t *name_next = bd->name_next;
+        list_t node = bd->node;
+        *bd = *pos;
+        bd->name = name;
+        bd->name_next = name_next;
+        bd->node = node;
+
+        if (pos->nb_services) {
+            bd->services = b2th_arena_alloc(&fresh->store->arena, pos->nb_services * sizeof(b2th_service_t));
+            if (!bd->services)
+                goto error;
+            memcpy(bd->services, pos->services, pos->nb_services * sizeof(b2th_service_t));
+        }
+    }
+
+    // The old devices leave with the storage handed over to the temporary list
+    struct b2th_list_store *old = bl->store;
+    bl->store = fresh->store;
+    bl->count = fresh->count;
+    init_list(&bl->head);
+    list_splice_init(&fresh->head, &bl->head);
+
+    fresh->store = old;
+    b2th_list_deinit(fresh);
+
+    return dropped;
+
+error:
+    b2th_list_deinit(fresh);
+
+    return -1;
+}
+
+
 void b2th_device_deinit(b2th_device_t *bd)
 {
-    free(bd->address);
-    free(bd->name);
+    // A device outside of any list owns its name
+    free((char *)bd->name);
     free(bd);
 }
 
 
 void b2th_list_deinit(b2th_list_t *head)
 {
-    b2th_device_t *pos, *save;
-    b2th_device_for_each_entry_safe(head, pos, save) {
-        list_del(&(pos->node));
-        b2th_device_deinit(pos);
-    }
-
+    b2th_map_deinit(&head->store->addr_index);
+    b2th_map_deinit(&head->store->name_index);
+    b2th_arena_deinit(&head->store->arena);
+    free(head->store);
     free(head);
 }
 
@@ -122,47 +302,27 @@ enum b2th_field_e {
 
 static void *__b2th_get_device(enum b2th_field_e field)
 {
-    int bluetooth_fd = socket(AF_BLUETOOTH, SOCK_RAW, BTPROTO_HCI);
-    if (bluetooth_fd == -1) {
-        perror("Failed to open raw HCI socket");
-        return NULL;
-    }
-
-    struct hci_dev_list_req *hdlr = __get_bluetooth_device_list(bluetooth_fd);
-    if (!hdlr) {
-        close(bluetooth_fd);
+    struct hci_dev_info di[HCI_MAX_DEV];
+    int nb_dev = b2th_hci_get_dev_list(di, HCI_MAX_DEV);
+    if (nb_dev == -1)
         return NULL;
-    }
 
     b2th_list_t *bl;
     if (field == LIST)
         bl = b2th_list_init();
 
     int i;
-    for (i = 0; i < hdlr->dev_num; i++) {
-
-        struct hci_dev_info di = {
-            .dev_id = (hdlr->dev_req + i)->dev_id
-        };
-
-        if (ioctl(bluetooth_fd, HCIGETDEVINFO, &di) == -1)
-            continue;
+    for (i = 0; i < nb_dev; i++) {
 
         char addr[18];
-        ba2str(&di.bdaddr, addr);
+        ba2str(&di[i].bdaddr, addr);
 
-        if (field == FIRST) {
-            close(bluetooth_fd);
-            free(hdlr);
-            return b2th_device_create(addr, di.name);
-        }
+        if (field == FIRST)
+            return b2th_device_create(addr, di[i].name);
 
-        b2th_list_add_node(bl, addr, di.name);
+        b2th_list_add_node(bl, addr, di[i].name);
     }
 
-    close(bluetooth_fd);
-    free(hdlr);
-
     return bl;
 }
 
@@ -182,118 +342,1540 @@ b2th_list_t *b2th_local_device_get_list()
 struct b2th_inquiry {
     int dev_id;
     int max_rsp;
-    int secs;
-    long flags;
+    const b2th_inquiry_filter_t *filter; /**<! inquiry parameters and filters, may be NULL */
+    int secs;                           /**<! inquiry length, 0 to only resolve the seed names */
+    unsigned int period;                /**<! periodic inquiry period in 1.28 s units, 0 for a single inquiry */
+    int resolve_names;                  /**<! send remote name requests */
+    unsigned int name_concurrency;
+    unsigned int name_timeout_ms;
+    b2th_cache_t *cache;
+    b2th_list_t *seed;                  /**<! devices to start the result with, may be NULL */
+    b2th_scan_stats_t *stats;           /**<! user counters, may be NULL */
+    const volatile sig_atomic_t *stop;  /**<! stop request set asynchronously, may be NULL */
+    unsigned int forget_ms;             /**<! periodic inquiry only: devices not seen for that long are dropped, 0 for the default */
+};
+
+
+long long b2th_now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+int b2th_thread_create(pthread_t *thread, const pthread_attr_t *attr, void *(*fn)(void *), void *arg)
+{
+    // The new thread inherits a full mask: signals go to the application threads, whose scans they interrupt
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    int ret = pthread_create(thread, attr, fn, arg);
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    return ret;
+}
+
+
+enum b2th_name_state_e {
+    NAME_PENDING,
+    NAME_SENT,
+    NAME_DONE
+};
+
+
+struct b2th_name_req {
+    bdaddr_t bdaddr;                    /**<! remote device address */
+    b2th_device_t *bd;                  /**<! device record to fill on completion */
+    long long deadline;                 /**<! monotonic deadline in ms once sent */
+    unsigned long seq;                  /**<! send order, used to match command status events */
+    int wait_status;                    /**<! command status event not received yet */
+    enum b2th_name_state_e state;       /**<! request progress */
+};
+
+
+/*
+ * Scan engine state: one inquiry plus the remote name requests of every
+ * device it reports, all multiplexed on a single raw HCI socket.
+ */
+struct b2th_scan_ctx {
+    int sock;                           /**<! HCI socket bound to the local controller */
+    b2th_list_t *list;                  /**<! list receiving the discovered devices */
+    b2th_scan_cb_t cb;                  /**<! user callback, may be NULL */
+    b2th_cache_t *cache;                /**<! device cache, may be NULL */
+    int seeding;                        /**<! results come from a seed list, not from the controller */
+    int dev_id;                         /**<! local controller id */
+    int resolve_names;                  /**<! send remote name requests */
+    void *userdata;                     /**<! user callback context */
+    int inquiry_running;                /**<! inquiry started and not completed yet */
+    int inquiry_status;                 /**<! 0 on success, -1 if the controller refused it */
+    long long inquiry_deadline;         /**<! safety deadline if inquiry complete never comes */
+    int stopped;                        /**<! scan interrupted by the user callback */
+    struct b2th_name_req *req;          /**<! remote name requests */
+    size_t nb_req;                      /**<! number of requests */
+    size_t req_size;                    /**<! allocated requests */
+    struct b2th_map req_index;          /**<! request position + 1 by device address */
+    size_t nb_done;                     /**<! number of requests completed */
+    size_t next;                        /**<! first request that may still be pending */
+    unsigned long seq;                  /**<! send counter */
+    unsigned int in_flight;             /**<! number of requests sent and not completed */
+    unsigned int max_in_flight;         /**<! concurrency cap, lowered if the controller rejects */
+    unsigned int timeout_ms;            /**<! per request timeout */
+    int names_deferred;                 /**<! controller refused to page during inquiry */
+    unsigned int period_ms;             /**<! periodic inquiry cycle, 0 for a single inquiry */
+    long long forget_ms;                /**<! periodic inquiry: devices not seen for that long are dropped each cycle */
+    int in_gap;                         /**<! periodic inquiry between two inquiries */
+    long long inquiry_start;            /**<! start of the running inquiry */
+    const b2th_inquiry_filter_t *filter; /**<! inquiry filter, may be NULL */
+    struct b2th_map allow;              /**<! addresses of filter->allow */
+    struct b2th_map deny;               /**<! addresses of filter->deny */
+    int class_filter;                   /**<! inquiry result filter set in the controller */
+    b2th_scan_stats_t stats;            /**<! counters not published yet */
+    b2th_scan_stats_t *user_stats;      /**<! user counters the published ones are added to, may be NULL */
+    uint64_t allocs;                    /**<! b2th_allocs when stats were last published */
 };
 
 
-static int b2th_scan_device_id(b2th_list_t *remote_device, struct b2th_inquiry *bi)
+static int b2th_scan_inquiring(struct b2th_scan_ctx *ctx)
+{
+    return ctx->inquiry_running && !ctx->in_gap;
+}
+
+
+static void b2th_scan_inquiry_end(struct b2th_scan_ctx *ctx)
+{
+    if (ctx->inquiry_running && !ctx->in_gap)
+        ctx->stats.inquiry_ms += b2th_now_ms() - ctx->inquiry_start;
+
+    ctx->inquiry_running = 0;
+}
+
+
+static void b2th_scan_publish(struct b2th_scan_ctx *ctx)
+{
+    ctx->stats.allocs = b2th_allocs - ctx->allocs;
+    b2th_stats_scan_done(&ctx->stats, ctx->user_stats);
+
+    // A periodic scan never ends: it publishes every cycle and starts counting again
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    ctx->allocs = b2th_allocs;
+}
+
+
+static int b2th_scan_notify(struct b2th_scan_ctx *ctx, b2th_scan_event_e event, b2th_device_t *bd)
 {
-    inquiry_info *ii = NULL;
-    int num_rsp = hci_inquiry(bi->dev_id, bi->secs, bi->max_rsp, NULL, &ii, bi->flags);
-    if (num_rsp < 0) {
-        perror("hci_inquiry");
-        free(ii);
+    if (!ctx->cb || ctx->stopped)
+        return 0;
+
+    return ctx->cb(event, bd, ctx->userdata);
+}
+
+
+static int b2th_name_send(struct b2th_scan_ctx *ctx, struct b2th_name_req *req)
+{
+    remote_name_req_cp cp;
+    memset(&cp, 0, sizeof(cp));
+    bacpy(&cp.bdaddr, &req->bdaddr);
+    cp.pscan_rep_mode = req->bd->pscan_rep_mode;
+    cp.clock_offset = htobs(req->bd->clock_offset);
+
+    if (b2th_hci_send_cmd(ctx->sock, OGF_LINK_CTL, OCF_REMOTE_NAME_REQ, REMOTE_NAME_REQ_CP_SIZE, &cp) < 0)
         return -1;
+
+    req->state = NAME_SENT;
+    req->deadline = b2th_now_ms() + ctx->timeout_ms;
+    ctx->stats.name_requests++;
+    req->seq = ctx->seq++;
+    req->wait_status = 1;
+    ctx->in_flight++;
+
+    return 0;
+}
+
+
+static void b2th_name_done(struct b2th_scan_ctx *ctx, struct b2th_name_req *req)
+{
+    if (req->state == NAME_DONE)
+        return;
+
+    if (req->state == NAME_SENT)
+        ctx->in_flight--;
+
+    req->state = NAME_DONE;
+    ctx->nb_done++;
+}
+
+
+static void b2th_name_cancel(struct b2th_scan_ctx *ctx, struct b2th_name_req *req)
+{
+    if (req->state == NAME_SENT) {
+        remote_name_req_cancel_cp cp;
+        bacpy(&cp.bdaddr, &req->bdaddr);
+        b2th_hci_send_cmd(ctx->sock, OGF_LINK_CTL, OCF_REMOTE_NAME_REQ_CANCEL, REMOTE_NAME_REQ_CANCEL_CP_SIZE, &cp);
     }
 
-    int sock = hci_open_dev(bi->dev_id);
-    char addr[19] = { 0 };
-    char name[248] = { 0 };
+    b2th_name_done(ctx, req);
+}
 
-    int i;
-    for (i = 0; i < num_rsp; i++) {
 
-        ba2str(&(ii+i)->bdaddr, addr);
+static void b2th_name_fill(struct b2th_scan_ctx *ctx)
+{
+    if (ctx->names_deferred && b2th_scan_inquiring(ctx))
+        return;
 
-        memset(name, 0, sizeof(name));
-        if (hci_read_remote_name(sock, &(ii+i)->bdaddr, sizeof(name), name, 0) < 0)
-            strncpy(name, "unknown", sizeof(name) - 1);
+    while (ctx->in_flight < ctx->max_in_flight && ctx->next < ctx->nb_req) {
+        struct b2th_name_req *req = &ctx->req[ctx->next++];
+        if (req->state != NAME_PENDING)
+            continue;
 
-        b2th_list_add_node(remote_device, addr, name);
+        if (b2th_name_send(ctx, req) == -1)
+            b2th_name_done(ctx, req);
     }
+}
 
-    hci_close_dev(sock);
 
-    free(ii);
+static struct b2th_name_req *b2th_name_find(struct b2th_scan_ctx *ctx, const bdaddr_t *bdaddr)
+{
+    uintptr_t pos = (uintptr_t)b2th_map_get(&ctx->req_index, b2th_bdaddr_to_key(bdaddr));
 
-    return 0;
+    return pos ? &ctx->req[pos - 1] : NULL;
 }
 
 
-static int b2th_get_dev_id(const char *interface)
+static int b2th_scan_filtered(struct b2th_scan_ctx *ctx, const struct b2th_result *res)
 {
-    int dev_id = -1;
+    const b2th_inquiry_filter_t *filter = ctx->filter;
+    if (!filter)
+        return 0;
 
-    if (interface == NULL)
-        dev_id = hci_get_route(NULL); // Passing NULL argument will retrieve the id of first avalaible bluetooth interface
-    else
-        dev_id = hci_devid(interface);
+    // The controller filter may be unsupported or shared: the class is checked again
+    if ((res->dev_class & filter->class_mask) != (filter->class_value & filter->class_mask))
+        return 1;
 
-    return dev_id;
+    uint64_t key = b2th_bdaddr_to_key(&res->bdaddr);
+    if (filter->nb_allow && !b2th_map_get(&ctx->allow, key))
+        return 1;
+
+    return filter->nb_deny && b2th_map_get(&ctx->deny, key);
 }
 
 
-b2th_list_t *b2th_device_scan(b2th_device_t *local_device, unsigned int secs)
+static void b2th_scan_add_result(struct b2th_scan_ctx *ctx, const struct b2th_result *res, const char *name)
 {
-    if (local_device == NULL) {
-        printf("Bluetooth object not initialized\n");
-        return NULL;
+    // The controller may report the same device several times during one inquiry
+    if (!ctx->seeding)
+        ctx->stats.responses++;
+
+    // Dropped before anything is recorded: no device, no name request, no paging time
+    if (b2th_scan_filtered(ctx, res)) {
+        if (!ctx->seeding)
+            ctx->stats.filtered++;
+        return;
     }
 
-    int dev_id = b2th_get_dev_id(local_device->address);
-    if (dev_id < 0) {
-        printf("Couldn't retrieve bluetooth interface\n");
-        return NULL;
+    // Requests may be forgotten once finished, the list knows every device
+    b2th_device_t *bd = b2th_get_device_by_bdaddr(ctx->list, b2th_bdaddr_to_key(&res->bdaddr));
+    if (bd) {
+        if (ctx->seeding)
+            return;
+
+        bd->pscan_rep_mode = res->pscan_rep_mode;
+        bd->clock_offset = res->clock_offset;
+        if (res->rssi)
+            bd->rssi = res->rssi;
+        bd->last_seen = b2th_now_ms();
+        b2th_device_set_eir(bd, res);
+
+        b2th_cache_update(ctx->cache, bd);
+
+        if (b2th_scan_notify(ctx, B2TH_SCAN_DEVICE_SEEN, bd))
+            ctx->stopped = 1;
+        return;
     }
 
-    struct b2th_inquiry bi = {
-        .dev_id = dev_id,
-        .max_rsp = 255,
-        .secs = secs,
-        .flags = IREQ_CACHE_FLUSH,
-    };
+    if (ctx->nb_req == ctx->req_size) {
+        size_t size = ctx->req_size ? ctx->req_size * 2 : 16;
+        struct b2th_name_req *req = realloc(ctx->req, size * sizeof(struct b2th_name_req));
+        if (!req)
+            return;
 
-    b2th_list_t *remote_device = b2th_list_init();
-    if (!remote_device)
-        return NULL;
+        b2th_stats_alloc();
+        ctx->req = req;
+        ctx->req_size = size;
+    }
 
-    b2th_scan_device_id(remote_device, &bi);
+    char addr[19] = { 0 };
+    ba2str(&res->bdaddr, addr);
 
-    return remote_device;
+    bd = b2th_list_add_node(ctx->list, addr, B2TH_UNKNOWN_NAME);
+    if (!bd)
+        return;
+
+    // Keep the paging hints so name requests and connections skip the blind page phase
+    bd->pscan_rep_mode = res->pscan_rep_mode;
+    bd->clock_offset = res->clock_offset;
+    bd->dev_class = res->dev_class;
+    bd->rssi = res->rssi;
+    bd->dev_id = res->dev_id;
+    if (!ctx->seeding)
+        bd->last_seen = b2th_now_ms();
+    b2th_device_set_eir(bd, res);
+
+    if (b2th_map_put(&ctx->req_index, bd->bdaddr, (void *)(uintptr_t)(ctx->nb_req + 1)) == -1)
+        return;
+
+    struct b2th_name_req *req = &ctx->req[ctx->nb_req++];
+    memset(req, 0, sizeof(*req));
+    bacpy(&req->bdaddr, &res->bdaddr);
+    req->bd = bd;
+    req->state = NAME_PENDING;
+
+    if (!ctx->seeding) {
+        b2th_cache_update(ctx->cache, bd);
+        ctx->stats.devices++;
+    }
+
+    if (b2th_scan_notify(ctx, B2TH_SCAN_DEVICE_FOUND, bd))
+        ctx->stopped = 1;
+
+    // A known name, a complete one in the extended inquiry response or a fresh cached one spares the remote name request
+    char cached[HCI_MAX_NAME_LENGTH + 1];
+    int from_eir = 0;
+    if ((!name || strcmp(name, B2TH_UNKNOWN_NAME) == 0) && b2th_result_get_name(res, cached, sizeof(cached)) == 0) {
+        name = cached;
+        from_eir = 1;
+    } else if ((!name || strcmp(name, B2TH_UNKNOWN_NAME) == 0)
+            && b2th_cache_get_name(ctx->cache, bd->address, cached, sizeof(cached)) == 0) {
+        name = cached;
+    }
+
+    if (!name || strcmp(name, B2TH_UNKNOWN_NAME) == 0) {
+        if (!ctx->resolve_names)
+            b2th_name_done(ctx, req);
+        return;
+    }
+
+    b2th_list_set_name(ctx->list, bd, name);
+    b2th_name_done(ctx, req);
+    if (from_eir)
+        ctx->stats.eir_names++;
+    else
+        ctx->stats.name_cache_hits++;
+
+    if (b2th_scan_notify(ctx, B2TH_SCAN_NAME_RESOLVED, bd))
+        ctx->stopped = 1;
 }
 
 
-b2th_device_t *b2th_get_device_by_name(b2th_list_t *head, const char *name)
+static void b2th_scan_add_list(struct b2th_scan_ctx *ctx, b2th_list_t *seed)
 {
-    if (!name)
-        return NULL;
+    ctx->seeding = 1;
 
     b2th_device_t *pos;
-    b2th_device_for_each_entry(head, pos)
-        if (strncmp(pos->name, name, strlen(pos->name)) == 0)
-            return pos;
+    b2th_device_for_each_entry(seed, pos) {
+        struct b2th_result res = {
+            .pscan_rep_mode = pos->pscan_rep_mode,
+            .clock_offset = pos->clock_offset,
+            .dev_class = pos->dev_class,
+            .rssi = pos->rssi,
+            .dev_id = pos->dev_id,
+        };
+        b2th_key_to_bdaddr(pos->bdaddr, &res.bdaddr);
 
-    return NULL;
+        b2th_scan_add_result(ctx, &res, pos->name);
+
+        // Seeded devices keep the time they were last heard at
+        b2th_device_t *bd = b2th_get_device_by_bdaddr(ctx->list, pos->bdaddr);
+        if (bd && !bd->last_seen)
+            bd->last_seen = pos->last_seen;
+    }
+
+    ctx->seeding = 0;
 }
 
 
-b2th_device_t *b2th_get_device_by_addr(b2th_list_t *head, const char *addr)
+static void b2th_scan_handle_cmd_complete(struct b2th_scan_ctx *ctx, evt_cmd_complete *cc, ssize_t len)
 {
-    if (!addr)
-        return NULL;
+    if (btohs(cc->opcode) != cmd_opcode_pack(OGF_LINK_CTL, OCF_PERIODIC_INQUIRY) || len <= EVT_CMD_COMPLETE_SIZE)
+        return;
 
-    b2th_device_t *pos;
-    b2th_device_for_each_entry(head, pos)
-        if (strncmp(pos->address, addr, strlen(pos->address)) == 0)
-            return pos;
+    uint8_t status = ((uint8_t *)cc)[EVT_CMD_COMPLETE_SIZE];
 
-    return NULL;
+    if (status != 0) {
+        fprintf(stderr, "Periodic inquiry refused by controller (status 0x%02x)\n", status);
+        b2th_scan_inquiry_end(ctx);
+        ctx->inquiry_status = -1;
+    }
 }
 
 
-size_t b2th_list_size(b2th_list_t *head)
+struct b2th_scan_forget {
+    struct b2th_scan_ctx *ctx;
+    long long limit;                    /**<! devices last seen before this time are dropped */
+};
+
+
+static int b2th_scan_keep(const b2th_device_t *bd, void *userdata)
+{
+    const struct b2th_scan_forget *sf = userdata;
+
+    return bd->last_seen >= sf->limit || b2th_map_get(&sf->ctx->req_index, bd->bdaddr) != NULL;
+}
+
+
+static void b2th_scan_forget(struct b2th_scan_ctx *ctx, long long now)
+{
+    // Finished requests go, the pending and sent ones keep their send order
+    b2th_map_deinit(&ctx->req_index);
+
+    size_t i;
+    size_t nb_req = 0;
+    for (i = 0; i < ctx->nb_req; i++) {
+        struct b2th_name_req *req = &ctx->req[i];
+        if (req->state == NAME_DONE)
+            continue;
+
+        if (b2th_map_put(&ctx->req_index, b2th_bdaddr_to_key(&req->bdaddr), (void *)(uintptr_t)(nb_req + 1)) == -1) {
+            b2th_name_cancel(ctx, req);
+            continue;
+        }
+
+        ctx->req[nb_req++] = *req;
+    }
+
+    ctx->nb_req = nb_req;
+    ctx->nb_done = 0;
+    ctx->next = 0;
+
+    // Devices with a request left are kept whatever their age, the requests point to them
+    struct b2th_scan_forget sf = { .ctx = ctx, .limit = now - ctx->forget_ms };
+    if (b2th_list_retain(ctx->list, b2th_scan_keep, &sf) <= 0)
+        return;
+
+    for (i = 0; i < ctx->nb_req; i++)
+        ctx->req[i].bd = b2th_get_device_by_bdaddr(ctx->list, b2th_bdaddr_to_key(&ctx->req[i].bdaddr));
+}
+
+
+static void b2th_scan_inquiry_complete(struct b2th_scan_ctx *ctx)
 {
-    return list_length(&(head->head));
+    ctx->stats.inquiries++;
+
+    if (ctx->period_ms) {
+        // Periodic inquiry: the controller starts the next inquiry on its own
+        if (!ctx->in_gap)
+            ctx->stats.inquiry_ms += b2th_now_ms() - ctx->inquiry_start;
+        ctx->in_gap = 1;
+        ctx->inquiry_deadline = b2th_now_ms() + ctx->period_ms + B2TH_INQUIRY_MARGIN_MS;
+    } else {
+        b2th_scan_inquiry_end(ctx);
+    }
+
+    b2th_scan_publish(ctx);
+
+    if (b2th_scan_notify(ctx, B2TH_SCAN_CYCLE_COMPLETE, NULL))
+        ctx->stopped = 1;
+
+    // A periodic scan runs for ever: what it holds is bounded by the devices of the last cycles
+    if (ctx->period_ms)
+        b2th_scan_forget(ctx, b2th_now_ms());
+}
+
+
+static void b2th_scan_handle_cmd_status(struct b2th_scan_ctx *ctx, evt_cmd_status *cs)
+{
+    uint16_t opcode = btohs(cs->opcode);
+
+    if (opcode == cmd_opcode_pack(OGF_LINK_CTL, OCF_INQUIRY)) {
+        if (cs->status != 0) {
+            fprintf(stderr, "Inquiry refused by controller (status 0x%02x)\n", cs->status);
+            b2th_scan_inquiry_end(ctx);
+            ctx->inquiry_status = -1;
+        }
+        return;
+    }
+
+    if (opcode != cmd_opcode_pack(OGF_LINK_CTL, OCF_REMOTE_NAME_REQ))
+        return;
+
+    // Command status events come back in the order the commands were sent
+    struct b2th_name_req *req = NULL;
+    size_t i;
+    for (i = 0; i < ctx->nb_req; i++)
+        if (ctx->req[i].wait_status && (!req || ctx->req[i].seq < req->seq))
+            req = &ctx->req[i];
+
+    if (!req)
+        return;
+
+    req->wait_status = 0;
+    if (cs->status == 0 || req->state != NAME_SENT)
+        return;
+
+    // The controller refused to page one more device: retry later with less parallelism
+    ctx->stats.name_refused++;
+    ctx->in_flight--;
+    if (b2th_scan_inquiring(ctx)) {
+        ctx->names_deferred = 1;
+    } else if (ctx->max_in_flight == 1 && ctx->in_flight == 0) {
+        req->state = NAME_PENDING;
+        b2th_name_done(ctx, req);
+        return;
+    }
+
+    if (ctx->max_in_flight > 1)
+        ctx->max_in_flight--;
+
+    req->state = NAME_PENDING;
+    if ((size_t)(req - ctx->req) < ctx->next)
+        ctx->next = req - ctx->req;
+}
+
+
+static void b2th_scan_handle_name(struct b2th_scan_ctx *ctx, evt_remote_name_req_complete *rn)
+{
+    struct b2th_name_req *req = b2th_name_find(ctx, &rn->bdaddr);
+    if (!req || req->state != NAME_SENT)
+        return;
+
+    b2th_name_done(ctx, req);
+    if (rn->status != 0) {
+        ctx->stats.name_failures++;
+        return;
+    }
+
+    ctx->stats.names_resolved++;
+    b2th_stats_name_latency(&ctx->stats, b2th_now_ms() - (req->deadline - ctx->timeout_ms));
+
+    char name[HCI_MAX_NAME_LENGTH + 1] = { 0 };
+    memcpy(name, rn->name, HCI_MAX_NAME_LENGTH);
+    b2th_list_set_name(ctx->list, req->bd, name);
+    b2th_cache_update(ctx->cache, req->bd);
+
+    if (b2th_scan_notify(ctx, B2TH_SCAN_NAME_RESOLVED, req->bd))
+        ctx->stopped = 1;
+}
+
+
+static void b2th_eir_add_uuid(struct b2th_result *res, uint16_t uuid)
+{
+    if (res->nb_uuids < B2TH_EIR_MAX_UUIDS)
+        res->uuids[res->nb_uuids++] = uuid;
 }
 
+
+void b2th_eir_parse(const uint8_t *eir, size_t len, struct b2th_result *res)
+{
+    // Bluetooth base UUID 00000000-0000-1000-8000-00805f9b34fb, little endian, without its 32-bit part
+    static const uint8_t base_uuid[12] = {
+        0xfb, 0x34, 0x9b, 0x5f, 0x80, 0x00, 0x00, 0x80, 0x00, 0x10, 0x00, 0x00
+    };
+    size_t pos = 0;
+
+    // Length, type, data fields back to back, a zero length ends the significant part
+    while (pos < len && eir[pos] != 0 && pos + 1 + eir[pos] <= len) {
+        uint8_t type = eir[pos + 1];
+        const uint8_t *data = eir + pos + 2;
+        size_t data_len = eir[pos] - 1;
+        size_t i;
+
+        switch (type) {
+
+        case B2TH_EIR_NAME_SHORT:
+        case B2TH_EIR_NAME_COMPLETE:
+            // The complete name wins over a shortened one, whatever their order
+            if (!res->name_complete) {
+                res->name = (const char *)data;
+                res->name_len = data_len;
+                res->name_complete = (type == B2TH_EIR_NAME_COMPLETE);
+            }
+            break;
+
+        case B2TH_EIR_TX_POWER:
+            if (data_len >= 1)
+                res->tx_power = (int8_t)data[0];
+            break;
+
+        case B2TH_EIR_UUID16_SOME:
+        case B2TH_EIR_UUID16_ALL:
+            for (i = 0; i + 2 <= data_len; i += 2)
+                b2th_eir_add_uuid(res, data[i] | (data[i + 1] << 8));
+            break;
+
+        case B2TH_EIR_UUID32_SOME:
+        case B2TH_EIR_UUID32_ALL:
+            // Only the 32-bit UUIDs that are 16-bit ones in disguise fit the device UUID list
+            for (i = 0; i + 4 <= data_len; i += 4)
+                if (data[i + 2] == 0 && data[i + 3] == 0)
+                    b2th_eir_add_uuid(res, data[i] | (data[i + 1] << 8));
+            break;
+
+        case B2TH_EIR_UUID128_SOME:
+        case B2TH_EIR_UUID128_ALL:
+            for (i = 0; i + 16 <= data_len; i += 16)
+                if (memcmp(data + i, base_uuid, sizeof(base_uuid)) == 0 && data[i + 14] == 0 && data[i + 15] == 0)
+                    b2th_eir_add_uuid(res, data[i + 12] | (data[i + 13] << 8));
+            break;
+        }
+
+        pos += 1 + eir[pos];
+    }
+}
+
+
+int b2th_result_get_name(const struct b2th_result *res, char *name, size_t size)
+{
+    if (!res->name || !res->name_complete || size == 0)
+        return -1;
+
+    // Names may be padded with NUL bytes
+    size_t len = strnlen(res->name, res->name_len);
+    if (len == 0)
+        return -1;
+
+    if (len >= size)
+        len = size - 1;
+    memcpy(name, res->name, len);
+    name[len] = '\0';
+
+    return 0;
+}
+
+
+void b2th_device_set_eir(b2th_device_t *bd, const struct b2th_result *res)
+{
+    if (res->tx_power != B2TH_TX_POWER_UNKNOWN)
+        bd->tx_power = res->tx_power;
+
+    if (res->nb_uuids) {
+        memcpy(bd->eir_uuids, res->uuids, res->nb_uuids * sizeof(uint16_t));
+        bd->nb_eir_uuids = res->nb_uuids;
+    }
+}
+
+
+int b2th_inquiry_parse(uint8_t evt, const unsigned char *ptr, ssize_t len, int dev_id, struct b2th_result *res)
+{
+    int num_rsp = (len > 0) ? ptr[0] : 0;
+    int i;
+
+    if (evt == EVT_INQUIRY_RESULT) {
+        for (i = 0; i < num_rsp && i < B2TH_INQUIRY_MAX_RESULTS && 1 + (i + 1) * INQUIRY_INFO_SIZE <= len; i++) {
+            const inquiry_info *ii = (const inquiry_info *)(ptr + 1) + i;
+            memset(&res[i], 0, sizeof(res[i]));
+            bacpy(&res[i].bdaddr, &ii->bdaddr);
+            res[i].pscan_rep_mode = ii->pscan_rep_mode;
+            res[i].clock_offset = btohs(ii->clock_offset) | B2TH_CLOCK_OFFSET_VALID;
+            res[i].dev_class = ii->dev_class[0] | (ii->dev_class[1] << 8) | (ii->dev_class[2] << 16);
+            res[i].dev_id = dev_id;
+            res[i].tx_power = B2TH_TX_POWER_UNKNOWN;
+        }
+        return i;
+    }
+
+    if (evt == EVT_INQUIRY_RESULT_WITH_RSSI) {
+        for (i = 0; i < num_rsp && i < B2TH_INQUIRY_MAX_RESULTS && 1 + (i + 1) * INQUIRY_INFO_WITH_RSSI_SIZE <= len; i++) {
+            const inquiry_info_with_rssi *ii = (const inquiry_info_with_rssi *)(ptr + 1) + i;
+            memset(&res[i], 0, sizeof(res[i]));
+            bacpy(&res[i].bdaddr, &ii->bdaddr);
+            res[i].pscan_rep_mode = ii->pscan_rep_mode;
+            res[i].clock_offset = btohs(ii->clock_offset) | B2TH_CLOCK_OFFSET_VALID;
+            res[i].dev_class = ii->dev_class[0] | (ii->dev_class[1] << 8) | (ii->dev_class[2] << 16);
+            res[i].rssi = ii->rssi;
+            res[i].dev_id = dev_id;
+            res[i].tx_power = B2TH_TX_POWER_UNKNOWN;
+        }
+        return i;
+    }
+
+    // Always a single response, followed by its extended inquiry response
+    if (evt == EVT_EXTENDED_INQUIRY_RESULT && num_rsp >= 1 && 1 + EXTENDED_INQUIRY_INFO_SIZE <= len) {
+        const extended_inquiry_info *ii = (const extended_inquiry_info *)(ptr + 1);
+        memset(&res[0], 0, sizeof(res[0]));
+        bacpy(&res[0].bdaddr, &ii->bdaddr);
+        res[0].pscan_rep_mode = ii->pscan_rep_mode;
+        res[0].clock_offset = btohs(ii->clock_offset) | B2TH_CLOCK_OFFSET_VALID;
+        res[0].dev_class = ii->dev_class[0] | (ii->dev_class[1] << 8) | (ii->dev_class[2] << 16);
+        res[0].rssi = ii->rssi;
+        res[0].dev_id = dev_id;
+        res[0].tx_power = B2TH_TX_POWER_UNKNOWN;
+        b2th_eir_parse(ii->data, sizeof(ii->data), &res[0]);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+static void b2th_scan_handle_event(struct b2th_scan_ctx *ctx, unsigned char *buf, ssize_t len)
+{
+    if (len < 1 + HCI_EVENT_HDR_SIZE || buf[0] != HCI_EVENT_PKT)
+        return;
+
+    hci_event_hdr *hdr = (hci_event_hdr *)(buf + 1);
+    unsigned char *ptr = buf + 1 + HCI_EVENT_HDR_SIZE;
+    len -= 1 + HCI_EVENT_HDR_SIZE;
+
+    struct b2th_result res[B2TH_INQUIRY_MAX_RESULTS];
+    int i, num_rsp;
+
+    if (hdr->evt == EVT_INQUIRY_RESULT || hdr->evt == EVT_INQUIRY_RESULT_WITH_RSSI
+            || hdr->evt == EVT_EXTENDED_INQUIRY_RESULT) {
+        if (ctx->in_gap)
+            ctx->inquiry_start = b2th_now_ms();
+        ctx->in_gap = 0;
+        if (ctx->period_ms)
+            ctx->inquiry_deadline = b2th_now_ms() + ctx->period_ms + B2TH_INQUIRY_MARGIN_MS;
+    }
+
+    switch (hdr->evt) {
+
+    case EVT_INQUIRY_RESULT:
+    case EVT_INQUIRY_RESULT_WITH_RSSI:
+    case EVT_EXTENDED_INQUIRY_RESULT:
+        num_rsp = b2th_inquiry_parse(hdr->evt, ptr, len, ctx->dev_id, res);
+        for (i = 0; i < num_rsp; i++)
+            b2th_scan_add_result(ctx, &res[i], NULL);
+        break;
+
+    case EVT_INQUIRY_COMPLETE:
+        b2th_scan_inquiry_complete(ctx);
+        break;
+
+    case EVT_CMD_COMPLETE:
+        if (len >= EVT_CMD_COMPLETE_SIZE)
+            b2th_scan_handle_cmd_complete(ctx, (evt_cmd_complete *)ptr, len);
+        break;
+
+    case EVT_CMD_STATUS:
+        if (len >= EVT_CMD_STATUS_SIZE)
+            b2th_scan_handle_cmd_status(ctx, (evt_cmd_status *)ptr);
+        break;
+
+    case EVT_REMOTE_NAME_REQ_COMPLETE:
+        if (len >= EVT_REMOTE_NAME_REQ_COMPLETE_SIZE)
+            b2th_scan_handle_name(ctx, (evt_remote_name_req_complete *)ptr);
+        break;
+    }
+}
+
+
+static void b2th_scan_stop(struct b2th_scan_ctx *ctx)
+{
+    if (ctx->inquiry_running) {
+        if (ctx->period_ms)
+            b2th_hci_send_cmd(ctx->sock, OGF_LINK_CTL, OCF_EXIT_PERIODIC_INQUIRY, 0, NULL);
+        else
+            b2th_hci_send_cmd(ctx->sock, OGF_LINK_CTL, OCF_INQUIRY_CANCEL, 0, NULL);
+        b2th_scan_inquiry_end(ctx);
+    }
+
+    size_t i;
+    for (i = 0; i < ctx->nb_req; i++)
+        b2th_name_cancel(ctx, &ctx->req[i]);
+}
+
+
+static void b2th_scan_expire(struct b2th_scan_ctx *ctx, long long now)
+{
+    if (ctx->inquiry_running && ctx->inquiry_deadline <= now) {
+        // A periodic inquiry never ends on its own: the controller went away
+        if (ctx->period_ms)
+            ctx->inquiry_status = -1;
+        b2th_scan_inquiry_end(ctx);
+    }
+
+    size_t i;
+    for (i = 0; i < ctx->nb_req; i++)
+        if (ctx->req[i].state == NAME_SENT && ctx->req[i].deadline <= now) {
+            b2th_name_cancel(ctx, &ctx->req[i]);
+            ctx->stats.name_timeouts++;
+        }
+}
+
+
+static int b2th_scan_next_timeout(struct b2th_scan_ctx *ctx, long long now)
+{
+    long long deadline = ctx->inquiry_running ? ctx->inquiry_deadline : -1;
+
+    size_t i;
+    for (i = 0; i < ctx->nb_req; i++)
+        if (ctx->req[i].state == NAME_SENT && (deadline == -1 || ctx->req[i].deadline < deadline))
+            deadline = ctx->req[i].deadline;
+
+    if (deadline == -1)
+        return -1;
+
+    return (deadline > now) ? (int)(deadline - now) : 0;
+}
+
+
+static int b2th_scan_finished(struct b2th_scan_ctx *ctx)
+{
+    return !ctx->inquiry_running && ctx->nb_done == ctx->nb_req;
+}
+
+
+void b2th_inquiry_mode_set(int sock)
+{
+    // RSSI first then extended: a controller refusing a mode keeps the previous one, the best it supports
+    write_inquiry_mode_cp mode = { .mode = 0x01 };
+    b2th_hci_send_cmd(sock, OGF_HOST_CTL, OCF_WRITE_INQUIRY_MODE, WRITE_INQUIRY_MODE_CP_SIZE, &mode);
+
+    mode.mode = 0x02;
+    b2th_hci_send_cmd(sock, OGF_HOST_CTL, OCF_WRITE_INQUIRY_MODE, WRITE_INQUIRY_MODE_CP_SIZE, &mode);
+}
+
+
+static int b2th_scan_start(struct b2th_scan_ctx *ctx, struct b2th_inquiry *bi)
+{
+    struct hci_filter flt;
+    hci_filter_clear(&flt);
+    hci_filter_set_ptype(HCI_EVENT_PKT, &flt);
+    hci_filter_set_event(EVT_CMD_STATUS, &flt);
+    hci_filter_set_event(EVT_CMD_COMPLETE, &flt);
+    hci_filter_set_event(EVT_INQUIRY_RESULT, &flt);
+    hci_filter_set_event(EVT_INQUIRY_RESULT_WITH_RSSI, &flt);
+    hci_filter_set_event(EVT_EXTENDED_INQUIRY_RESULT, &flt);
+    hci_filter_set_event(EVT_INQUIRY_COMPLETE, &flt);
+    hci_filter_set_event(EVT_REMOTE_NAME_REQ_COMPLETE, &flt);
+    if (b2th_hci_set_filter(ctx->sock, &flt) == -1) {
+        perror("Failed to set HCI filter");
+        return -1;
+    }
+
+    if (bi->secs == 0)
+        return 0;
+
+    b2th_inquiry_mode_set(ctx->sock);
+
+    // Devices of other classes are dropped by the controller, they do not even wake the host up
+    if (bi->filter && bi->filter->class_mask) {
+        uint8_t buf[SET_EVENT_FLT_CP_SIZE + 6];
+        set_event_flt_cp *flt_cp = (set_event_flt_cp *)buf;
+        flt_cp->flt_type = FLT_INQ_RESULT;
+        flt_cp->cond_type = INQ_RESULT_RETURN_CLASS;
+        int i;
+        for (i = 0; i < 3; i++) {
+            flt_cp->condition[i] = (bi->filter->class_value >> (8 * i)) & 0xff;
+            flt_cp->condition[3 + i] = (bi->filter->class_mask >> (8 * i)) & 0xff;
+        }
+        if (b2th_hci_send_cmd(ctx->sock, OGF_HOST_CTL, OCF_SET_EVENT_FLT, sizeof(buf), buf) == 0)
+            ctx->class_filter = 1;
+    }
+
+    uint32_t lap = (bi->filter && bi->filter->lap) ? bi->filter->lap : B2TH_LAP_GIAC;
+
+    if (bi->period) {
+        // Periods are in 1.28 s units and must satisfy max_period > min_period > length
+        unsigned int min_period = (bi->period > (unsigned int)bi->secs) ? bi->period : (unsigned int)bi->secs + 1;
+
+        periodic_inquiry_cp pcp = {
+            .max_period = htobs(min_period + 1),
+            .min_period = htobs(min_period),
+            .lap = { lap & 0xff, (lap >> 8) & 0xff, (lap >> 16) & 0xff },
+            .length = bi->secs,
+            .num_rsp = bi->max_rsp,
+        };
+
+        if (b2th_hci_send_cmd(ctx->sock, OGF_LINK_CTL, OCF_PERIODIC_INQUIRY, PERIODIC_INQUIRY_CP_SIZE, &pcp) < 0) {
+            perror("Failed to start periodic inquiry");
+            return -1;
+        }
+
+        ctx->period_ms = (min_period + 1) * B2TH_INQUIRY_UNIT_MS;
+        ctx->forget_ms = bi->forget_ms ? bi->forget_ms : B2TH_FORGET_PERIODS_DEFAULT * ctx->period_ms;
+        ctx->inquiry_running = 1;
+        ctx->inquiry_start = b2th_now_ms();
+        ctx->inquiry_deadline = ctx->inquiry_start + ctx->period_ms + B2TH_INQUIRY_MARGIN_MS;
+
+        return 0;
+    }
+
+    inquiry_cp cp = {
+        .lap = { lap & 0xff, (lap >> 8) & 0xff, (lap >> 16) & 0xff },
+        .length = bi->secs,
+        .num_rsp = bi->max_rsp,
+    };
+
+    if (b2th_hci_send_cmd(ctx->sock, OGF_LINK_CTL, OCF_INQUIRY, INQUIRY_CP_SIZE, &cp) < 0) {
+        perror("Failed to start inquiry");
+        return -1;
+    }
+
+    ctx->inquiry_running = 1;
+    ctx->inquiry_start = b2th_now_ms();
+    ctx->inquiry_deadline = ctx->inquiry_start + bi->secs * B2TH_INQUIRY_UNIT_MS + B2TH_INQUIRY_MARGIN_MS;
+
+    return 0;
+}
+
+
+static void b2th_scan_filter_deinit(struct b2th_scan_ctx *ctx)
+{
+    // The controller filter outlives the socket, other users of the controller expect every result
+    if (ctx->class_filter) {
+        uint8_t buf[SET_EVENT_FLT_CP_SIZE];
+        set_event_flt_cp *flt_cp = (set_event_flt_cp *)buf;
+        flt_cp->flt_type = FLT_INQ_RESULT;
+        flt_cp->cond_type = INQ_RESULT_RETURN_ALL;
+        b2th_hci_send_cmd(ctx->sock, OGF_HOST_CTL, OCF_SET_EVENT_FLT, sizeof(buf), buf);
+        ctx->class_filter = 0;
+    }
+
+    b2th_map_deinit(&ctx->allow);
+    b2th_map_deinit(&ctx->deny);
+}
+
+
+static int b2th_scan_device_id(b2th_list_t *remote_device, struct b2th_inquiry *bi, b2th_scan_cb_t cb, void *userdata)
+{
+    struct b2th_scan_ctx ctx = {
+        .list = remote_device,
+        .cb = cb,
+        .userdata = userdata,
+        .cache = bi->cache,
+        .dev_id = bi->dev_id,
+        .resolve_names = bi->resolve_names,
+        .max_in_flight = bi->name_concurrency,
+        .timeout_ms = bi->name_timeout_ms,
+        .filter = bi->filter,
+        .stats = { .scans = 1 },
+        .user_stats = bi->stats,
+        .allocs = b2th_allocs,
+    };
+
+    // Address lists become maps, inquiry results are checked against them in constant time
+    if (bi->filter) {
+        size_t i;
+        for (i = 0; i < bi->filter->nb_allow; i++)
+            b2th_map_put(&ctx.allow, bi->filter->allow[i], &ctx);
+        for (i = 0; i < bi->filter->nb_deny; i++)
+            b2th_map_put(&ctx.deny, bi->filter->deny[i], &ctx);
+    }
+
+    ctx.sock = b2th_hci_open_dev(bi->dev_id);
+    if (ctx.sock < 0) {
+        perror("Failed to open HCI device");
+        ctx.stats.errors++;
+        b2th_scan_filter_deinit(&ctx);
+        b2th_scan_publish(&ctx);
+        return -1;
+    }
+
+    ctx.stats.socket_opens++;
+
+    if (b2th_scan_start(&ctx, bi) == -1) {
+        b2th_scan_filter_deinit(&ctx);
+        b2th_hci_close_dev(ctx.sock);
+        ctx.stats.errors++;
+        b2th_scan_publish(&ctx);
+        return -1;
+    }
+
+    if (bi->seed)
+        b2th_scan_add_list(&ctx, bi->seed);
+
+    while (!b2th_scan_finished(&ctx)) {
+
+        // A signal interrupting poll() comes back here: its handler may have asked for a stop
+        if (ctx.stopped || (bi->stop && *bi->stop)) {
+            b2th_scan_stop(&ctx);
+            break;
+        }
+
+        b2th_name_fill(&ctx);
+        if (b2th_scan_finished(&ctx))
+            break;
+
+        struct pollfd pfd = { .fd = ctx.sock, .events = POLLIN };
+        int ret = poll(&pfd, 1, b2th_scan_next_timeout(&ctx, b2th_now_ms()));
+        if (ret == -1 && errno == EINTR)
+            continue;
+
+        if (ret == -1) {
+            perror("poll");
+            ctx.stats.errors++;
+            b2th_scan_stop(&ctx);
+            break;
+        }
+
+        if (ret > 0) {
+            unsigned char buf[HCI_MAX_EVENT_SIZE + 1];
+            ssize_t len = b2th_hci_read(ctx.sock, buf, sizeof(buf));
+            if (len > 0) {
+                ctx.stats.events++;
+                b2th_scan_handle_event(&ctx, buf, len);
+            }
+        }
+
+        b2th_scan_expire(&ctx, b2th_now_ms());
+    }
+
+    b2th_scan_filter_deinit(&ctx);
+    b2th_hci_close_dev(ctx.sock);
+    b2th_map_deinit(&ctx.req_index);
+    free(ctx.req);
+
+    if (ctx.inquiry_status == -1)
+        ctx.stats.errors++;
+    b2th_scan_publish(&ctx);
+
+    return ctx.inquiry_status;
+}
+
+
+void b2th_scan_params_init(b2th_scan_params_t *params)
+{
+    params->name_concurrency = B2TH_NAME_CONCURRENCY_DEFAULT;
+    params->name_timeout_ms = B2TH_NAME_TIMEOUT_MS_DEFAULT;
+    params->cache = NULL;
+    params->no_cache_flush = 0;
+    params->stats = NULL;
+    params->filter = NULL;
+    params->stop = NULL;
+    params->forget_ms = 0;
+}
+
+
+b2th_list_t *b2th_device_scan(b2th_device_t *local_device, unsigned int secs)
+{
+    b2th_scan_params_t params;
+    b2th_scan_params_init(&params);
+
+    return b2th_device_scan_ext(local_device, secs, &params);
+}
+
+
+b2th_list_t *b2th_device_scan_ext(b2th_device_t *local_device, unsigned int secs, const b2th_scan_params_t *params)
+{
+    return b2th_device_scan_stream(local_device, secs, params, NULL, NULL);
+}
+
+
+b2th_list_t *b2th_device_scan_stream(b2th_device_t *local_device, unsigned int secs,
+        const b2th_scan_params_t *params, b2th_scan_cb_t cb, void *userdata)
+{
+    if (local_device == NULL) {
+        printf("Bluetooth object not initialized\n");
+        return NULL;
+    }
+
+    int dev_id = b2th_get_dev_id(local_device->address);
+    if (dev_id < 0) {
+        printf("Couldn't retrieve bluetooth interface\n");
+        return NULL;
+    }
+
+    b2th_scan_params_t defaults;
+    if (!params) {
+        b2th_scan_params_init(&defaults);
+        params = &defaults;
+    }
+
+    struct b2th_inquiry bi = {
+        .dev_id = dev_id,
+        .max_rsp = (params->filter && params->filter->max_rsp) ? params->filter->max_rsp : 255,
+        .filter = params->filter,
+        .secs = secs,
+        .resolve_names = 1,
+        .name_concurrency = params->name_concurrency ? params->name_concurrency : 1,
+        .name_timeout_ms = params->name_timeout_ms,
+        .cache = params->cache,
+        .seed = (params->no_cache_flush && params->cache) ? b2th_cache_get_list(params->cache) : NULL,
+        .stats = params->stats,
+        .stop = params->stop,
+    };
+
+    b2th_list_t *remote_device = b2th_list_init();
+    if (remote_device)
+        b2th_scan_device_id(remote_device, &bi, cb, userdata);
+
+    if (bi.seed)
+        b2th_list_deinit(bi.seed);
+
+    return remote_device;
+}
+
+
+int b2th_device_scan_periodic(b2th_device_t *local_device, unsigned int secs, unsigned int period,
+        const b2th_scan_params_t *params, b2th_scan_cb_t cb, void *userdata)
+{
+    if (local_device == NULL || cb == NULL) {
+        printf("Bluetooth object not initialized\n");
+        return -1;
+    }
+
+    int dev_id = b2th_get_dev_id(local_device->address);
+    if (dev_id < 0) {
+        printf("Couldn't retrieve bluetooth interface\n");
+        return -1;
+    }
+
+    b2th_scan_params_t defaults;
+    if (!params) {
+        b2th_scan_params_init(&defaults);
+        params = &defaults;
+    }
+
+    struct b2th_inquiry bi = {
+        .dev_id = dev_id,
+        .max_rsp = params->filter ? params->filter->max_rsp : 0,
+        .filter = params->filter,
+        .secs = secs ? secs : 1,
+        .period = period,
+        .resolve_names = 1,
+        .name_concurrency = params->name_concurrency ? params->name_concurrency : 1,
+        .name_timeout_ms = params->name_timeout_ms,
+        .cache = params->cache,
+        .seed = (params->no_cache_flush && params->cache) ? b2th_cache_get_list(params->cache) : NULL,
+        .stats = params->stats,
+        .stop = params->stop,
+        .forget_ms = params->forget_ms,
+    };
+
+    // Devices live until a cycle forgets them: the list is only a name resolution context
+    b2th_list_t *remote_device = b2th_list_init();
+    int ret = remote_device ? b2th_scan_device_id(remote_device, &bi, cb, userdata) : -1;
+
+    if (remote_device)
+        b2th_list_deinit(remote_device);
+    if (bi.seed)
+        b2th_list_deinit(bi.seed);
+
+    return ret;
+}
+
+
+struct b2th_adapter_scan {
+    pthread_t thread;                   /**<! thread driving this controller */
+    int running;                        /**<! thread started and not joined yet */
+    struct b2th_inquiry bi;             /**<! inquiry or name resolution to run */
+    b2th_list_t *list;                  /**<! devices reported by this controller */
+    unsigned int load;                  /**<! names assigned to this controller */
+};
+
+
+static void *b2th_adapter_scan_thread(void *arg)
+{
+    struct b2th_adapter_scan *as = arg;
+
+    b2th_scan_device_id(as->list, &as->bi, NULL, NULL);
+
+    return NULL;
+}
+
+
+static void b2th_adapter_scan_run(struct b2th_adapter_scan *as, size_t nb_adapter)
+{
+    size_t i;
+    for (i = 0; i < nb_adapter; i++) {
+        if (!as[i].list || (as[i].bi.secs == 0 && (!as[i].bi.seed || b2th_list_size(as[i].bi.seed) == 0)))
+            continue;
+
+        if (pthread_create(&as[i].thread, NULL, b2th_adapter_scan_thread, &as[i]) != 0) {
+            perror("Failed to start adapter scan thread");
+            b2th_adapter_scan_thread(&as[i]);
+            continue;
+        }
+
+        as[i].running = 1;
+    }
+
+    for (i = 0; i < nb_adapter; i++) {
+        if (as[i].running)
+            pthread_join(as[i].thread, NULL);
+        as[i].running = 0;
+    }
+}
+
+
+static void b2th_merge_device(b2th_list_t *merged, b2th_device_t *bd)
+{
+    b2th_device_t *dst = b2th_get_device_by_bdaddr(merged, bd->bdaddr);
+    int known = (dst != NULL);
+    if (!dst) {
+        dst = b2th_list_add_node(merged, bd->address, bd->name);
+        if (!dst)
+            return;
+    }
+
+    if (strcmp(dst->name, B2TH_UNKNOWN_NAME) == 0 && strcmp(bd->name, B2TH_UNKNOWN_NAME) != 0)
+        b2th_list_set_name(merged, dst, bd->name);
+
+    // Extended inquiry response data does not depend on the controller that heard it
+    if (bd->tx_power != B2TH_TX_POWER_UNKNOWN)
+        dst->tx_power = bd->tx_power;
+    if (bd->nb_eir_uuids) {
+        memcpy(dst->eir_uuids, bd->eir_uuids, sizeof(dst->eir_uuids));
+        dst->nb_eir_uuids = bd->nb_eir_uuids;
+    }
+    if (bd->last_seen > dst->last_seen)
+        dst->last_seen = bd->last_seen;
+
+    // Keep the sighting of the controller that hears the device best
+    if (known && (bd->rssi == 0 || (dst->rssi != 0 && dst->rssi >= bd->rssi)))
+        return;
+
+    dst->dev_class = bd->dev_class;
+    dst->pscan_rep_mode = bd->pscan_rep_mode;
+    dst->clock_offset = bd->clock_offset;
+    dst->rssi = bd->rssi;
+    dst->dev_id = bd->dev_id;
+}
+
+
+static struct b2th_adapter_scan *b2th_name_assign(struct b2th_adapter_scan *as, size_t nb_adapter, b2th_device_t *bd,
+        b2th_device_t **sighting)
+{
+    // Among the controllers that saw the device, pick the least loaded one, then the one hearing it best
+    struct b2th_adapter_scan *best = NULL;
+
+    size_t i;
+    for (i = 0; i < nb_adapter; i++) {
+        if (!as[i].list)
+            continue;
+
+        b2th_device_t *seen = b2th_get_device_by_bdaddr(as[i].list, bd->bdaddr);
+        if (!seen)
+            continue;
+
+        if (!best || as[i].load < best->load || (as[i].load == best->load && seen->rssi > (*sighting)->rssi)) {
+            best = &as[i];
+            *sighting = seen;
+        }
+    }
+
+    return best;
+}
+
+
+b2th_list_t *b2th_device_scan_all(unsigned int secs, const b2th_scan_params_t *params)
+{
+    b2th_list_t *local_device_l = b2th_local_device_get_list();
+    if (!local_device_l)
+        return NULL;
+
+    b2th_scan_params_t defaults;
+    if (!params) {
+        b2th_scan_params_init(&defaults);
+        params = &defaults;
+    }
+
+    size_t nb_adapter = b2th_list_size(local_device_l);
+    struct b2th_adapter_scan *as = calloc(nb_adapter + 1, sizeof(struct b2th_adapter_scan));
+    b2th_list_t *merged = b2th_list_init();
+    if (!as || !merged) {
+        free(as);
+        if (merged)
+            b2th_list_deinit(merged);
+        b2th_list_deinit(local_device_l);
+        return NULL;
+    }
+
+    // Phase 1: one inquiry per controller, all running at the same time
+    size_t i = 0;
+    b2th_device_t *pos;
+    b2th_device_for_each_entry(local_device_l, pos) {
+        int dev_id = b2th_get_dev_id(pos->address);
+        if (dev_id < 0)
+            continue;
+
+        as[i].bi.dev_id = dev_id;
+        as[i].bi.max_rsp = (params->filter && params->filter->max_rsp) ? params->filter->max_rsp : 255;
+        as[i].bi.filter = params->filter;
+        as[i].bi.secs = secs;
+        as[i].bi.resolve_names = 0;
+        as[i].bi.stats = params->stats;
+        as[i].bi.stop = params->stop;
+        as[i].list = b2th_list_init();
+        i++;
+    }
+    nb_adapter = i;
+
+    b2th_adapter_scan_run(as, nb_adapter);
+
+    for (i = 0; i < nb_adapter; i++) {
+        if (!as[i].list)
+            continue;
+        b2th_device_for_each_entry(as[i].list, pos)
+            b2th_merge_device(merged, pos);
+    }
+
+    // Phase 2: spread the names left to resolve over the controllers that saw each device
+    struct b2th_adapter_scan *names = calloc(nb_adapter + 1, sizeof(struct b2th_adapter_scan));
+    for (i = 0; names && i < nb_adapter; i++) {
+        names[i].bi = as[i].bi;
+        names[i].bi.secs = 0;
+        names[i].bi.resolve_names = 1;
+        names[i].bi.name_concurrency = params->name_concurrency ? params->name_concurrency : 1;
+        names[i].bi.name_timeout_ms = params->name_timeout_ms;
+        names[i].list = as[i].list ? b2th_list_init() : NULL;
+        names[i].bi.seed = names[i].list ? b2th_list_init() : NULL;
+    }
+
+    b2th_device_for_each_entry(merged, pos) {
+        char name[HCI_MAX_NAME_LENGTH + 1];
+        if (b2th_cache_get_name(params->cache, pos->address, name, sizeof(name)) == 0)
+            b2th_list_set_name(merged, pos, name);
+
+        b2th_cache_update(params->cache, pos);
+
+        if (!names || strcmp(pos->name, B2TH_UNKNOWN_NAME) != 0)
+            continue;
+
+        b2th_device_t *sighting = NULL;
+        struct b2th_adapter_scan *target = b2th_name_assign(as, nb_adapter, pos, &sighting);
+        if (!target)
+            continue;
+
+        target->load++;
+        struct b2th_adapter_scan *nr = &names[target - as];
+        if (!nr->bi.seed)
+            continue;
+
+        b2th_device_t *bd = b2th_list_add_node(nr->bi.seed, sighting->address, B2TH_UNKNOWN_NAME);
+        if (bd) {
+            bd->pscan_rep_mode = sighting->pscan_rep_mode;
+            bd->clock_offset = sighting->clock_offset;
+            bd->dev_class = sighting->dev_class;
+            bd->rssi = sighting->rssi;
+            bd->dev_id = sighting->dev_id;
+            bd->last_seen = sighting->last_seen;
+        }
+    }
+
+    if (names)
+        b2th_adapter_scan_run(names, nb_adapter);
+
+    for (i = 0; names && i < nb_adapter; i++) {
+        if (names[i].list) {
+            b2th_device_for_each_entry(names[i].list, pos) {
+                if (strcmp(pos->name, B2TH_UNKNOWN_NAME) == 0)
+                    continue;
+
+                b2th_device_t *dst = b2th_get_device_by_bdaddr(merged, pos->bdaddr);
+                if (dst) {
+                    b2th_list_set_name(merged, dst, pos->name);
+                    b2th_cache_update(params->cache, dst);
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < nb_adapter; i++) {
+        if (as[i].list)
+            b2th_list_deinit(as[i].list);
+        if (names && names[i].list)
+            b2th_list_deinit(names[i].list);
+        if (names && names[i].bi.seed)
+            b2th_list_deinit(names[i].bi.seed);
+    }
+
+    free(names);
+    free(as);
+    b2th_list_deinit(local_device_l);
+
+    return merged;
+}
+
+
+int b2th_device_connect(b2th_device_t *local_device, b2th_device_t *bd, unsigned int timeout_ms)
+{
+    if (!local_device || !bd)
+        return -1;
+
+    int dev_id = b2th_get_dev_id(local_device->address);
+    if (dev_id < 0) {
+        printf("Couldn't retrieve bluetooth interface\n");
+        return -1;
+    }
+
+    int sock = b2th_hci_open_dev(dev_id);
+    if (sock < 0) {
+        perror("Failed to open HCI device");
+        return -1;
+    }
+
+    b2th_stats_socket_open();
+
+    create_conn_cp cp;
+    memset(&cp, 0, sizeof(cp));
+    str2ba(bd->address, &cp.bdaddr);
+    cp.pkt_type = htobs(HCI_DM1 | HCI_DM3 | HCI_DM5 | HCI_DH1 | HCI_DH3 | HCI_DH5);
+    cp.pscan_rep_mode = bd->pscan_rep_mode;
+    cp.clock_offset = htobs(bd->clock_offset);
+    cp.role_switch = 0x01;
+
+    evt_conn_complete rp;
+    memset(&rp, 0, sizeof(rp));
+
+    struct hci_request rq = {
+        .ogf = OGF_LINK_CTL,
+        .ocf = OCF_CREATE_CONN,
+        .event = EVT_CONN_COMPLETE,
+        .cparam = &cp,
+        .clen = CREATE_CONN_CP_SIZE,
+        .rparam = &rp,
+        .rlen = EVT_CONN_COMPLETE_SIZE,
+    };
+
+    int ret = b2th_hci_send_req(sock, &rq, timeout_ms ? (int)timeout_ms : B2TH_CONN_TIMEOUT_MS);
+    b2th_hci_close_dev(sock);
+
+    if (ret < 0) {
+        perror("Failed to create connection");
+        return -1;
+    }
+
+    if (rp.status != 0) {
+        fprintf(stderr, "Connection to %s failed (status 0x%02x)\n", bd->address, rp.status);
+        return -1;
+    }
+
+    return btohs(rp.handle);
+}
+
+
+int b2th_device_disconnect(b2th_device_t *local_device, int handle)
+{
+    if (!local_device || handle < 0)
+        return -1;
+
+    int dev_id = b2th_get_dev_id(local_device->address);
+    if (dev_id < 0)
+        return -1;
+
+    int sock = b2th_hci_open_dev(dev_id);
+    if (sock < 0)
+        return -1;
+
+    b2th_stats_socket_open();
+
+    disconnect_cp cp = {
+        .handle = htobs(handle),
+        .reason = HCI_OE_USER_ENDED_CONNECTION,
+    };
+
+    evt_disconn_complete rp;
+    memset(&rp, 0, sizeof(rp));
+
+    struct hci_request rq = {
+        .ogf = OGF_LINK_CTL,
+        .ocf = OCF_DISCONNECT,
+        .event = EVT_DISCONN_COMPLETE,
+        .cparam = &cp,
+        .clen = DISCONNECT_CP_SIZE,
+        .rparam = &rp,
+        .rlen = EVT_DISCONN_COMPLETE_SIZE,
+    };
+
+    int ret = b2th_hci_send_req(sock, &rq, B2TH_CONN_TIMEOUT_MS);
+    b2th_hci_close_dev(sock);
+
+    return (ret < 0 || rp.status != 0) ? -1 : 0;
+}
+
+
+struct b2th_find {
+    const char *address;                /**<! address to look for, may be NULL */
+    const char *name;                   /**<! name to look for, may be NULL */
+    b2th_device_t *match;               /**<! device matching address or name */
+};
+
+
+static int b2th_find_cb(b2th_scan_event_e event, b2th_device_t *bd, void *userdata)
+{
+    struct b2th_find *bf = userdata;
+
+    if (event == B2TH_SCAN_DEVICE_FOUND && bf->address && strcasecmp(bd->address, bf->address) == 0)
+        bf->match = bd;
+
+    if (event == B2TH_SCAN_NAME_RESOLVED && bf->name && strcmp(bd->name, bf->name) == 0)
+        bf->match = bd;
+
+    return bf->match != NULL;
+}
+
+
+b2th_device_t *b2th_device_find(b2th_device_t *local_device, unsigned int secs,
+        const char *address, const char *name, unsigned long *elapsed_ms)
+{
+    if (!address && !name)
+        return NULL;
+
+    struct b2th_find bf = {
+        .address = address,
+        .name = name,
+        .match = NULL,
+    };
+
+    long long start = b2th_now_ms();
+
+    b2th_list_t *remote_device = b2th_device_scan_stream(local_device, secs, NULL, b2th_find_cb, &bf);
+    if (!remote_device)
+        return NULL;
+
+    if (elapsed_ms)
+        *elapsed_ms = b2th_now_ms() - start;
+
+    b2th_device_t *bd = NULL;
+    if (bf.match) {
+        bd = b2th_device_create(bf.match->address, bf.match->name);
+        if (bd) {
+            bd->dev_class = bf.match->dev_class;
+            bd->pscan_rep_mode = bf.match->pscan_rep_mode;
+            bd->clock_offset = bf.match->clock_offset;
+        }
+    }
+
+    b2th_list_deinit(remote_device);
+
+    return bd;
+}
+
+
+b2th_device_t *b2th_get_device_by_name(b2th_list_t *head, const char *name)
+{
+    if (!name)
+        return NULL;
+
+    b2th_device_t *pos;
+    if (strcmp(name, B2TH_UNKNOWN_NAME) == 0) {
+        b2th_device_for_each_entry(head, pos)
+            if (strcmp(pos->name, name) == 0)
+                return pos;
+        return NULL;
+    }
+
+    for (pos = b2th_map_get(&head->store->name_index, b2th_hash_str(name)); pos; pos = pos->name_next)
+        if (strcmp(pos->name, name) == 0)
+            return pos;
+
+    return NULL;
+}
+
+
+b2th_device_t *b2th_get_device_by_addr(b2th_list_t *head, const char *addr)
+{
+    uint64_t key;
+    if (b2th_str_to_key(addr, &key) == -1)
+        return NULL;
+
+    return b2th_map_get(&head->store->addr_index, key);
+}
+
+
+b2th_device_t *b2th_get_device_by_bdaddr(b2th_list_t *head, uint64_t bdaddr)
+{
+    return b2th_map_get(&head->store->addr_index, bdaddr);
+}
+
+
+size_t b2th_list_size(b2th_list_t *head)
+{
+    return head->count;
+}
@@ -7,6 +7,13 @@ extern "C" {
 #endif
 
 
+#include <stdio.h>
+#include <stdint.h>
+#include <signal.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
 #include "list.h"
 
 
@@ -18,11 +25,47 @@ extern "C" {
 
 
 /*!
- * \brief blue2th device object
+ * \brief blue2th service offered by a remote device, found by SDP
  */
 typedef struct {
-    char *address;          /**<! bluetooth 48-bit device address */
-    char *name;             /**<! bluetooth user friendly string name */
+    uint16_t uuid;          /**<! 16-bit service class UUID */
+    uint16_t l2cap_psm;     /**<! L2CAP PSM of the service, 0 if not given */
+    uint8_t rfcomm_channel; /**<! RFCOMM channel of the service, 0 if not over RFCOMM */
+} b2th_service_t;
+
+
+/*!
+ * \brief B2TH_EIR_MAX_UUIDS - most service class UUIDs kept from an extended inquiry response
+ */
+#define B2TH_EIR_MAX_UUIDS 8
+
+
+/*!
+ * \brief B2TH_TX_POWER_UNKNOWN - transmit power of a device that did not advertise it
+ */
+#define B2TH_TX_POWER_UNKNOWN 127
+
+
+/*!
+ * \brief blue2th device object
+ */
+typedef struct b2th_device {
+    char address[18];       /**<! bluetooth 48-bit device address */
+    const char *name;       /**<! bluetooth user friendly string name, changed with b2th_list_set_name() only */
+    uint64_t bdaddr;        /**<! bluetooth 48-bit device address as an integer, first byte of the string in bits 47..40 */
+    uint32_t dev_class;     /**<! bluetooth 24-bit class of device */
+    uint8_t pscan_rep_mode; /**<! page scan repetition mode reported by inquiry */
+    uint16_t clock_offset;  /**<! clock offset reported by inquiry, bit 15 set when valid */
+    int8_t rssi;            /**<! signal strength of the inquiry result in dBm, 0 if unknown */
+    int8_t tx_power;        /**<! transmit power from the extended inquiry response in dBm, B2TH_TX_POWER_UNKNOWN if not given */
+    long long last_seen;    /**<! monotonic time in ms of the last inquiry response, 0 if never heard */
+    uint16_t eir_uuids[B2TH_EIR_MAX_UUIDS]; /**<! 16-bit service class UUIDs from the extended inquiry response */
+    uint8_t nb_eir_uuids;   /**<! number of eir_uuids */
+    int dev_id;             /**<! id of the local controller (hciX) that reported the device */
+    b2th_service_t *services; /**<! services found by b2th_sdp_discover(), owned by the list */
+    uint8_t nb_services;    /**<! number of services */
+    uint8_t sdp_done;       /**<! services have been searched, nb_services is meaningful */
+    struct b2th_device *name_next; /**<! private: next device sharing the same name hash in the list index */
     list_t node;            /**<! linked list node */
 } b2th_device_t;
 
@@ -32,9 +75,438 @@ typedef struct {
  */
 typedef struct b2th_list {
     list_t head;            /**<! linked list head */
+    size_t count;           /**<! number of devices in the list */
+    struct b2th_list_store *store; /**<! private: indexes and storage of the devices */
 } b2th_list_t;
 
 
+/*!
+ * \brief blue2th device cache object (opaque)
+ */
+typedef struct b2th_cache b2th_cache_t;
+
+
+/*!
+ * \brief B2TH_STATS_LATENCY_BUCKETS - name latency histogram buckets: 25, 50, 100, 250, 500 ms, 1, 2.5, 5, 10 s and above
+ */
+#define B2TH_STATS_LATENCY_BUCKETS 10
+
+
+/*!
+ * \brief blue2th scan counters, every field is a uint64_t
+ */
+typedef struct {
+    uint64_t scans;                     /**<! scans run, each asynchronous inquiry or discovery slice counts as one */
+    uint64_t errors;                    /**<! scans that failed or were cut short by an error */
+    uint64_t inquiries;                 /**<! inquiries completed */
+    uint64_t inquiry_ms;                /**<! time spent with an inquiry running */
+    uint64_t inquiries_preempted;       /**<! discovery inquiry slices cut short by a connection */
+    uint64_t responses;                 /**<! inquiry responses, duplicates included */
+    uint64_t filtered;                  /**<! inquiry responses dropped by the inquiry filter */
+    uint64_t devices;                   /**<! distinct devices found */
+    uint64_t name_requests;             /**<! remote name requests sent */
+    uint64_t names_resolved;            /**<! remote name requests answered */
+    uint64_t name_failures;             /**<! remote name requests failed by the controller (page timeout...) */
+    uint64_t name_timeouts;             /**<! remote name requests cancelled on timeout */
+    uint64_t name_refused;              /**<! remote name requests refused by the controller, sent again later */
+    uint64_t name_cache_hits;           /**<! names served by a known or cached name */
+    uint64_t eir_names;                 /**<! names taken from extended inquiry responses, no name request needed */
+    uint64_t name_latency_ms;           /**<! sum of the latencies of the answered name requests */
+    uint64_t name_latency[B2TH_STATS_LATENCY_BUCKETS]; /**<! answered name requests by latency bucket */
+    uint64_t events;                    /**<! HCI events read */
+    uint64_t socket_opens;              /**<! HCI sockets opened */
+    uint64_t allocs;                    /**<! heap allocations made by scans */
+} b2th_scan_stats_t;
+
+
+/*!
+ * \brief B2TH_LAP_GIAC - General Inquiry Access Code, every discoverable device answers
+ */
+#define B2TH_LAP_GIAC 0x9e8b33
+
+
+/*!
+ * \brief B2TH_LAP_LIAC - Limited Inquiry Access Code, only devices in limited discoverable mode answer
+ */
+#define B2TH_LAP_LIAC 0x9e8b00
+
+
+/*!
+ * \brief blue2th inquiry parameters and filters, responses filtered out are dropped before any name request
+ *
+ * The LAP, the response cap and the class of device filter are handed to
+ * the controller, the class being checked again with the address lists.
+ */
+typedef struct {
+    uint32_t lap;                   /**<! inquiry access code, 0 for B2TH_LAP_GIAC */
+    uint8_t max_rsp;                /**<! responses after which the controller ends the inquiry, 0 for no limit */
+    uint32_t class_value;           /**<! class of device wanted, only the bits of class_mask are compared */
+    uint32_t class_mask;            /**<! class of device bits compared, 0 for any class */
+    const uint64_t *allow;          /**<! only these addresses are kept (b2th_device_t::bdaddr layout), NULL for any */
+    size_t nb_allow;                /**<! number of allowed addresses */
+    const uint64_t *deny;           /**<! these addresses are dropped, may be NULL */
+    size_t nb_deny;                 /**<! number of denied addresses */
+} b2th_inquiry_filter_t;
+
+
+/*!
+ * \brief blue2th scan parameters
+ */
+typedef struct {
+    unsigned int name_concurrency;  /**<! maximum number of remote name requests in flight */
+    unsigned int name_timeout_ms;   /**<! timeout of a single remote name request in milliseconds */
+    b2th_cache_t *cache;            /**<! device cache updated by the scan, fresh names skip name requests, may be NULL */
+    int no_cache_flush;             /**<! start the result with the devices still present in the cache */
+    b2th_scan_stats_t *stats;       /**<! counters the scan adds its own to, may be NULL */
+    const b2th_inquiry_filter_t *filter; /**<! inquiry parameters and filters, NULL to keep every device */
+    const volatile sig_atomic_t *stop; /**<! the scan stops once *stop is set, by a signal handler for instance, may be NULL */
+    unsigned int forget_ms;         /**<! periodic scans drop the devices not seen for that long, 0 for 4 periods */
+} b2th_scan_params_t;
+
+
+/*!
+ * \brief B2TH_SDP_MAX_SERVICES - most services attached to a device
+ */
+#define B2TH_SDP_MAX_SERVICES 8
+
+
+/*!
+ * \brief blue2th service discovery parameters
+ */
+typedef struct {
+    unsigned int concurrency;       /**<! devices searched at once */
+    unsigned int timeout_ms;        /**<! connection and search time allowed per device in milliseconds */
+    b2th_cache_t *cache;            /**<! fresh results skip SDP and new ones are stored, may be NULL */
+} b2th_sdp_params_t;
+
+
+/*!
+ * \brief blue2th streaming scan events
+ */
+typedef enum {
+    B2TH_SCAN_DEVICE_FOUND,         /**<! a new device answered the inquiry, its name is still "unknown" */
+    B2TH_SCAN_NAME_RESOLVED,        /**<! the remote name of a device has been resolved */
+    B2TH_SCAN_DEVICE_SEEN,          /**<! a device already reported answered the inquiry again */
+    B2TH_SCAN_CYCLE_COMPLETE        /**<! an inquiry completed, bd is NULL */
+} b2th_scan_event_e;
+
+
+/*!
+ * \brief blue2th streaming scan callback
+ *
+ * \param[in]   event       kind of scan event.
+ * \param[in]   bd          device the event relates to, owned by the scan list, NULL for cycle events.
+ * \param[in]   userdata    user context given to b2th_device_scan_stream().
+ *
+ * \return  0 to continue the scan, non-zero to stop it.
+ */
+typedef int (*b2th_scan_cb_t)(b2th_scan_event_e event, b2th_device_t *bd, void *userdata);
+
+
+/*!
+ * \brief B2TH_LE_ADV_MAX - maximum length of legacy advertising or scan response data
+ */
+#define B2TH_LE_ADV_MAX 31
+
+
+/*!
+ * \brief blue2th LE device object, snapshot of the last advertising reports of a device
+ */
+typedef struct {
+    char address[18];                   /**<! bluetooth 48-bit device address */
+    uint64_t bdaddr;                    /**<! address as an integer, same layout as b2th_device_t::bdaddr */
+    uint8_t addr_type;                  /**<! 0 public, 1 random */
+    uint8_t evt_type;                   /**<! type of the last advertising report */
+    int8_t rssi;                        /**<! RSSI of the last report in dBm */
+    uint8_t adv_len;                    /**<! length of adv_data */
+    uint8_t adv_data[B2TH_LE_ADV_MAX];  /**<! last advertising data */
+    uint8_t scan_rsp_len;               /**<! length of scan_rsp */
+    uint8_t scan_rsp[B2TH_LE_ADV_MAX];  /**<! last scan response data (active scan) */
+    uint32_t nb_reports;                /**<! number of reports received */
+    long long first_seen;               /**<! monotonic time of the first report in ms */
+    long long last_seen;                /**<! monotonic time of the last report in ms */
+} b2th_le_device_t;
+
+
+/*!
+ * \brief blue2th LE scan parameters
+ */
+typedef struct {
+    uint16_t interval;                  /**<! scan interval in 0.625 ms units */
+    uint16_t window;                    /**<! scan window in 0.625 ms units */
+    int active;                         /**<! send scan requests to get scan responses */
+    size_t max_devices;                 /**<! capacity of the device table, allocated up front */
+} b2th_le_params_t;
+
+
+/*!
+ * \brief blue2th LE scan ingestion counters
+ */
+typedef struct {
+    uint64_t events;                    /**<! advertising report events parsed */
+    uint64_t reports;                   /**<! advertising reports parsed */
+    uint64_t batches;                   /**<! recvmmsg() calls that returned events */
+    uint64_t dropped;                   /**<! reports of new devices ignored because the table is full */
+    uint64_t malformed;                 /**<! truncated events */
+} b2th_le_stats_t;
+
+
+/*!
+ * \brief blue2th LE scanner object (opaque)
+ */
+typedef struct b2th_le_scanner b2th_le_scanner_t;
+
+
+/*!
+ * \brief B2TH_TABLE_NAME_SIZE - room for the longest remote name and its terminating NUL
+ */
+#define B2TH_TABLE_NAME_SIZE 249
+
+
+/*!
+ * \brief blue2th shared device table entry, a consistent copy of one device
+ */
+typedef struct {
+    char address[18];                   /**<! bluetooth 48-bit device address */
+    uint64_t bdaddr;                    /**<! address as an integer, same layout as b2th_device_t::bdaddr */
+    char name[B2TH_TABLE_NAME_SIZE];    /**<! last known name, "unknown" until resolved */
+    uint32_t dev_class;                 /**<! 24-bit class of device */
+    int8_t rssi;                        /**<! last known signal strength in dBm, 0 if unknown */
+    uint8_t present;                    /**<! seen since it last expired */
+    uint32_t sightings;                 /**<! updates received */
+    long long first_seen;               /**<! time of the arrival in ms */
+    long long last_seen;                /**<! time of the last sighting in ms */
+} b2th_table_entry_t;
+
+
+/*!
+ * \brief blue2th shared device table object (opaque), one writer at a time and lock-free readers
+ */
+typedef struct b2th_table b2th_table_t;
+
+
+/*!
+ * \brief blue2th shared device table callback
+ *
+ * \param[in]   entry       copy of the device, valid during the callback only.
+ * \param[in]   userdata    user context.
+ */
+typedef void (*b2th_table_cb_t)(const b2th_table_entry_t *entry, void *userdata);
+
+
+/*!
+ * \brief blue2th scan result record, fixed size so that a whole result is one array
+ */
+typedef struct {
+    uint64_t bdaddr;        /**<! bluetooth 48-bit device address as an integer */
+    long long last_seen;    /**<! monotonic time in ms of the last inquiry response, 0 if never heard */
+    uint32_t dev_class;     /**<! bluetooth 24-bit class of device */
+    uint32_t name;          /**<! offset of the NUL terminated name in the snapshot names */
+    int16_t dev_id;         /**<! id of the local controller (hciX) that reported the device, -1 if unknown */
+    int8_t rssi;            /**<! signal strength in dBm, 0 if unknown */
+    int8_t tx_power;        /**<! transmit power in dBm, B2TH_TX_POWER_UNKNOWN if not given */
+    uint8_t name_len;       /**<! name length, 0 while unresolved */
+    uint8_t reserved[3];    /**<! zero */
+} b2th_record_t;
+
+
+/*!
+ * \brief blue2th snapshot record orders
+ */
+typedef enum {
+    B2TH_SORT_ADDRESS,      /**<! ascending address, lookups by address use a binary search */
+    B2TH_SORT_RSSI,         /**<! strongest signal first, unknown RSSI last */
+    B2TH_SORT_LAST_SEEN,    /**<! most recently heard first */
+} b2th_sort_e;
+
+
+/*!
+ * \brief blue2th scan result snapshot object (opaque), records and names in one allocation
+ */
+typedef struct b2th_snapshot b2th_snapshot_t;
+
+
+/*!
+ * \brief blue2th device changes between two snapshots
+ */
+typedef enum {
+    B2TH_DEVICE_ADDED,      /**<! only in the newer snapshot */
+    B2TH_DEVICE_REMOVED,    /**<! only in the older snapshot */
+    B2TH_DEVICE_CHANGED,    /**<! in both, see b2th_change_t::changed */
+} b2th_change_e;
+
+
+#define B2TH_CHANGED_NAME   0x01    /**<! resolved to another name */
+#define B2TH_CHANGED_RSSI   0x02    /**<! RSSI moved by the threshold or more */
+
+
+/*!
+ * \brief blue2th device change
+ */
+typedef struct {
+    b2th_change_e type;             /**<! kind of change */
+    uint8_t changed;                /**<! B2TH_CHANGED_* flags of a changed device */
+    const b2th_record_t *before;    /**<! record in the older snapshot, NULL if added */
+    const b2th_record_t *after;     /**<! record in the newer snapshot, NULL if removed */
+} b2th_change_t;
+
+
+/*!
+ * \brief blue2th differences between two snapshots
+ */
+typedef struct {
+    b2th_change_t *changes;         /**<! devices of the newer snapshot in its order, then the removed ones */
+    size_t nb_changes;              /**<! number of changes */
+    size_t nb_added;                /**<! B2TH_DEVICE_ADDED changes */
+    size_t nb_removed;              /**<! B2TH_DEVICE_REMOVED changes */
+    size_t nb_changed;              /**<! B2TH_DEVICE_CHANGED changes */
+} b2th_diff_t;
+
+
+/*!
+ * \brief blue2th HCI transport object (opaque), the kernel HCI sockets unless replaced
+ */
+typedef struct b2th_transport b2th_transport_t;
+
+
+/*!
+ * \brief blue2th local controller, entry of the controller registry
+ */
+typedef struct {
+    int dev_id;                         /**<! HCI device id */
+    char address[18];                   /**<! bluetooth 48-bit controller address */
+    char name[8];                       /**<! interface name, hciX */
+    int up;                             /**<! controller is up and can be used */
+} b2th_controller_t;
+
+
+/*!
+ * \brief blue2th controller registry events
+ */
+typedef enum {
+    B2TH_CONTROLLER_ADDED,              /**<! a controller appeared, plugged or registered */
+    B2TH_CONTROLLER_REMOVED,            /**<! a controller disappeared, unplugged or unregistered */
+    B2TH_CONTROLLER_UP,                 /**<! a controller was brought up */
+    B2TH_CONTROLLER_DOWN                /**<! a controller was brought down */
+} b2th_controller_event_e;
+
+
+/*!
+ * \brief blue2th controller registry callback, called from the registry thread
+ *
+ * \param[in]   event       kind of change.
+ * \param[in]   ctrl        controller after the change, valid during the callback only.
+ * \param[in]   userdata    user context given to b2th_registry_start().
+ */
+typedef void (*b2th_controller_cb_t)(b2th_controller_event_e event, const b2th_controller_t *ctrl, void *userdata);
+
+
+/*!
+ * \brief blue2th simulated controller model
+ */
+typedef struct {
+    unsigned int nb_adapters;           /**<! simulated local controllers, hci0 to hciN-1 */
+    unsigned int nb_devices;            /**<! remote devices in range of every controller */
+    unsigned int inquiry_unit_ms;       /**<! duration of one 1.28 s inquiry unit, lower it to speed runs up */
+    unsigned int response_window_ms;    /**<! devices answer an inquiry at a random time within this window */
+    unsigned int miss_percent;          /**<! probability for a device to miss one inquiry */
+    unsigned int name_latency_min_ms;   /**<! fastest remote name request */
+    unsigned int name_latency_max_ms;   /**<! slowest remote name request */
+    unsigned int unnamed_percent;       /**<! devices whose name requests end with a page timeout */
+    unsigned int eir_percent;           /**<! devices sending an extended inquiry response, with their name most of the time */
+    unsigned int page_timeout_ms;       /**<! time to fail a name request */
+    unsigned int max_pages;             /**<! name requests a controller accepts at once, 0 for no limit */
+    unsigned int seed;                  /**<! population and timing random seed */
+} b2th_sim_params_t;
+
+
+/*!
+ * \brief blue2th asynchronous context object (opaque)
+ */
+typedef struct b2th_async b2th_async_t;
+
+
+/*!
+ * \brief blue2th asynchronous event types
+ */
+typedef enum {
+    B2TH_ASYNC_INQUIRY_RESULT,          /**<! new device found by the inquiry */
+    B2TH_ASYNC_INQUIRY_COMPLETE,        /**<! inquiry over */
+    B2TH_ASYNC_NAME_COMPLETE,           /**<! remote name request over */
+    B2TH_ASYNC_CONNECT_COMPLETE,        /**<! connection attempt over */
+    B2TH_ASYNC_DISCONNECT_COMPLETE      /**<! disconnection over */
+} b2th_async_event_e;
+
+
+/*!
+ * \brief blue2th asynchronous event
+ */
+typedef struct {
+    b2th_async_event_e event;           /**<! kind of event */
+    int status;                         /**<! 0 on success, HCI status code, -1 on timeout or local error */
+    b2th_device_t *bd;                  /**<! device the event relates to, NULL for inquiry complete and disconnections */
+    const char *name;                   /**<! remote name of a successful name request or of an extended inquiry response, valid during the callback only */
+    int handle;                         /**<! connection handle of connections and disconnections, -1 otherwise */
+} b2th_async_event_t;
+
+
+/*!
+ * \brief blue2th asynchronous callback, called from b2th_async_process() only
+ *
+ * \param[in]   ev          event.
+ * \param[in]   userdata    user context given when the operation was started.
+ */
+typedef void (*b2th_async_cb_t)(const b2th_async_event_t *ev, void *userdata);
+
+
+/*!
+ * \brief blue2th adaptive discovery parameters, see b2th_discovery_params_init() for the defaults
+ */
+typedef struct {
+    unsigned int min_slice;             /**<! shortest inquiry slice in 1.28 s units, reached while nothing new shows up */
+    unsigned int max_slice;             /**<! longest inquiry slice in 1.28 s units, reached while devices keep arriving */
+    unsigned int duty_percent;          /**<! share of the time spent inquiring (1..100), the rest is left to paging */
+    unsigned int grow_devices;          /**<! new devices found by a slice that double the length of the next one */
+} b2th_discovery_params_t;
+
+
+/*!
+ * \brief blue2th RFCOMM connection object (opaque)
+ */
+typedef struct b2th_rfcomm b2th_rfcomm_t;
+
+
+/*!
+ * \brief blue2th pool of persistent RFCOMM connections (opaque)
+ */
+typedef struct b2th_rfcomm_pool b2th_rfcomm_pool_t;
+
+
+/*!
+ * \brief blue2th L2CAP channel object (opaque)
+ */
+typedef struct b2th_l2cap b2th_l2cap_t;
+
+
+/*!
+ * \brief blue2th L2CAP channel options, 0 fields keep the defaults
+ */
+typedef struct {
+    uint16_t imtu;                      /**<! largest packet received, 672 by default */
+    uint16_t omtu;                      /**<! largest packet sent, set by the remote device */
+    uint16_t flush_timeout;             /**<! ms before an unsent packet is dropped, 0xffff to retransmit forever */
+} b2th_l2cap_opts_t;
+
+
+/*!
+ * \brief blue2th L2CAP packet, one buffer per packet
+ */
+typedef struct {
+    void *data;                         /**<! packet buffer */
+    size_t len;                         /**<! packet length, buffer size when receiving */
+} b2th_l2cap_packet_t;
+
+
 /*!
  * \brief b2th_device_for_each_entry - iterate over a b2th device list
  *
@@ -72,17 +544,64 @@ b2th_device_t *b2th_local_device_get_first();
 b2th_list_t *b2th_local_device_get_list();
 
 
+/*!
+ * \brief b2th_registry_start - Enumerate the local controllers once and keep the table up to date
+ *
+ * A thread follows the controllers being added, removed, brought up or down
+ * from the kernel device events. While the registry runs, the local device
+ * functions and every controller lookup of the library read its table and
+ * make no system call. Stop it before changing the transport.
+ *
+ * \param[in]   cb          called on every change, may be NULL.
+ * \param[in]   userdata    user context given to cb.
+ *
+ * \return  0 on success, -1 on error or if already running.
+ */
+int b2th_registry_start(b2th_controller_cb_t cb, void *userdata);
+
+
+/*!
+ * \brief b2th_registry_get_controllers - Copy the controller table of the registry
+ *
+ * \param[out]  ctrls   controllers, in device id order.
+ * \param[in]   max     size of the array.
+ *
+ * \return  number of controllers on success, -1 if the registry is not running.
+ */
+int b2th_registry_get_controllers(b2th_controller_t *ctrls, int max);
+
+
+/*!
+ * \brief b2th_registry_stop - Stop following the controllers, lookups query the transport again
+ */
+void b2th_registry_stop(void);
+
+
 /*!
  * \brief b2th_device_deinit - Free a b2th device handler
  *
+ * Only for devices returned on their own (local device, b2th_device_find(),
+ * cache lookups): devices of a b2th list are freed with the list.
+ *
  * \param[in]   bd     b2th device handler to free.
  */
 void b2th_device_deinit(b2th_device_t *bd);
 
 
+/*!
+ * \brief b2th_list_init - Allocate an empty b2th list
+ *
+ * \return  b2th_list_t on success, NULL on error.
+ */
+b2th_list_t *b2th_list_init();
+
+
 /*!
  * \brief b2th_list_deinit - Free a b2th list
  *
+ * The devices of a list and their names live in a single arena, so freeing
+ * the list does not walk its devices.
+ *
  * \param[in]   head     head of the b2th list to free.
  */
 void b2th_list_deinit(b2th_list_t *head);
@@ -100,47 +619,1088 @@ b2th_list_t *b2th_device_scan(b2th_device_t *local_device, unsigned int secs);
 
 
 /*!
- * \brief b2th_get_device_by_name - Get a b2th device thanks to its bluetooth interface name
- *
- * \param[in]   head    head of the b2th device list.
- * \param[in]   name    b2th device name to retrieve.
+ * \brief b2th_scan_params_init - Fill scan parameters with their default values
  *
- * \return  b2th_device_t on success, NULL on error.
+ * \param[out]  params  scan parameters to initialize.
  */
-b2th_device_t *b2th_get_device_by_name(b2th_list_t *head, const char *name);
+void b2th_scan_params_init(b2th_scan_params_t *params);
 
 
 /*!
- * \brief b2th_get_device_by_addr - Get a b2th device thanks to its bluetooth interface address
+ * \brief b2th_device_scan_ext - Launch a scan with explicit parameters and return the list of b2th device found
  *
- * \param[in]   head    head of the b2th device list.
- * \param[in]   address b2th device address to retrieve.
+ * Remote names are resolved concurrently: up to params->name_concurrency remote
+ * name requests are kept in flight and each one is cancelled after
+ * params->name_timeout_ms. Unresolved devices keep the "unknown" name.
  *
- * \return  b2th_device_t on success, NULL on error.
+ * \param[in]   local_device   local b2th device handler.
+ * \param[in]   secs           time in seconds that the bluetooth scan runs.
+ * \param[in]   params         scan parameters, see b2th_scan_params_init().
+ *
+ * \return  b2th_list_t on success, NULL on error.
  */
-b2th_device_t *b2th_get_device_by_addr(b2th_list_t *head, const char *address);
+b2th_list_t *b2th_device_scan_ext(b2th_device_t *local_device, unsigned int secs, const b2th_scan_params_t *params);
 
 
 /*!
- * \brief b2th_list_size - Get b2th device list size
+ * \brief b2th_device_scan_stream - Launch a scan and report every device as soon as it is discovered
  *
- * \param[in]   head    head of the b2th device list.
+ * The inquiry runs on a raw HCI socket: cb is called with B2TH_SCAN_DEVICE_FOUND
+ * as soon as an inquiry result is received, then with B2TH_SCAN_NAME_RESOLVED
+ * once the remote name of that device is known. Returning non-zero from cb
+ * cancels the inquiry and the pending name requests.
  *
- * \return  b2th list size on success.
+ * \param[in]   local_device   local b2th device handler.
+ * \param[in]   secs           time in seconds that the bluetooth scan runs.
+ * \param[in]   params         scan parameters, see b2th_scan_params_init(), NULL for defaults.
+ * \param[in]   cb             callback called for each scan event, may be NULL.
+ * \param[in]   userdata       user context passed to cb.
+ *
+ * \return  b2th_list_t holding every device reported on success, NULL on error.
  */
-size_t b2th_list_size(b2th_list_t *head);
+b2th_list_t *b2th_device_scan_stream(b2th_device_t *local_device, unsigned int secs,
+        const b2th_scan_params_t *params, b2th_scan_cb_t cb, void *userdata);
 
 
 /*!
- * \brief b2th_device_pairing - Set b2th device connection
+ * \brief b2th_device_scan_periodic - Run a periodic inquiry until the callback stops it
  *
- * \param[in]   bd      b2th device handler to connect to.
+ * The controller repeats an inquiry of secs every period: every answer is
+ * reported to cb (B2TH_SCAN_DEVICE_FOUND the first time, B2TH_SCAN_DEVICE_SEEN
+ * afterwards) and B2TH_SCAN_CYCLE_COMPLETE marks the end of each inquiry.
+ * Names are resolved once per device, between inquiries if the controller
+ * cannot page while inquiring. After each cycle the devices not seen for
+ * params->forget_ms are dropped, they are reported as found if they come
+ * back. Devices passed to cb stay valid until the end of the cycle.
  *
- * \return  0 on success, -1 on error.
- */
-// int b2th_device_pairing(b2th_device_t *bd);
+ * \param[in]   local_device   local b2th device handler.
+ * \param[in]   secs           length of each inquiry in 1.28 seconds units.
+ * \param[in]   period         time between two inquiries in 1.28 seconds units.
+ * \param[in]   params         scan parameters, see b2th_scan_params_init(), NULL for defaults.
+ * \param[in]   cb             callback called for each scan event, return non-zero to stop.
+ * \param[in]   userdata       user context passed to cb.
+ *
+ * \return  0 once stopped by cb, -1 on error.
+ */
+int b2th_device_scan_periodic(b2th_device_t *local_device, unsigned int secs, unsigned int period,
+        const b2th_scan_params_t *params, b2th_scan_cb_t cb, void *userdata);
+
+
+/*!
+ * \brief b2th_device_scan_all - Scan on every local controller at once and merge the results
+ *
+ * An inquiry runs in parallel on each controller. Devices are de-duplicated
+ * by address and keep the sighting with the strongest RSSI: dev_id and rssi
+ * tell which controller heard the device best. Remote names are then
+ * resolved in parallel, each device by one of the controllers that saw it.
+ *
+ * \param[in]   secs           time in seconds that the bluetooth scan runs.
+ * \param[in]   params         scan parameters, see b2th_scan_params_init(), NULL for defaults.
+ *
+ * \return  b2th_list_t on success, NULL on error.
+ */
+b2th_list_t *b2th_device_scan_all(unsigned int secs, const b2th_scan_params_t *params);
+
+
+/*!
+ * \brief b2th_device_find - Scan until a given device shows up
+ *
+ * The inquiry is cancelled as soon as a device whose address matches address,
+ * or whose resolved name matches name, is discovered.
+ *
+ * \param[in]   local_device   local b2th device handler.
+ * \param[in]   secs           maximum time in seconds that the bluetooth scan runs.
+ * \param[in]   address        b2th device address to look for, may be NULL.
+ * \param[in]   name           b2th device name to look for, may be NULL.
+ * \param[out]  elapsed_ms     time spent searching in milliseconds, may be NULL.
+ *
+ * \return  b2th_device_t to free with b2th_device_deinit() on success, NULL if not found or on error.
+ */
+b2th_device_t *b2th_device_find(b2th_device_t *local_device, unsigned int secs,
+        const char *address, const char *name, unsigned long *elapsed_ms);
+
+
+/*!
+ * \brief b2th_device_connect - Open an ACL link to a remote b2th device
+ *
+ * The page scan repetition mode and clock offset learned during inquiry are
+ * handed to the controller so it can page the device directly.
+ *
+ * \param[in]   local_device   local b2th device handler.
+ * \param[in]   bd             remote b2th device to connect to.
+ * \param[in]   timeout_ms     connection timeout in milliseconds, 0 for the default.
+ *
+ * \return  ACL connection handle on success, -1 on error.
+ */
+int b2th_device_connect(b2th_device_t *local_device, b2th_device_t *bd, unsigned int timeout_ms);
+
+
+/*!
+ * \brief b2th_device_disconnect - Close an ACL link opened by b2th_device_connect()
+ *
+ * \param[in]   local_device   local b2th device handler.
+ * \param[in]   handle         ACL connection handle.
+ *
+ * \return  0 on success, -1 on error.
+ */
+int b2th_device_disconnect(b2th_device_t *local_device, int handle);
+
+
+/*!
+ * \brief b2th_get_device_by_name - Get a b2th device thanks to its bluetooth interface name
+ *
+ * \param[in]   head    head of the b2th device list.
+ * \param[in]   name    b2th device name to retrieve.
+ *
+ * \return  b2th_device_t on success, NULL on error.
+ */
+b2th_device_t *b2th_get_device_by_name(b2th_list_t *head, const char *name);
+
+
+/*!
+ * \brief b2th_get_device_by_addr - Get a b2th device thanks to its bluetooth interface address
+ *
+ * \param[in]   head    head of the b2th device list.
+ * \param[in]   address b2th device address to retrieve.
+ *
+ * \return  b2th_device_t on success, NULL on error.
+ */
+b2th_device_t *b2th_get_device_by_addr(b2th_list_t *head, const char *address);
+
+
+/*!
+ * \brief b2th_get_device_by_bdaddr - Get a b2th device thanks to its binary bluetooth address
+ *
+ * \param[in]   head    head of the b2th device list.
+ * \param[in]   bdaddr  b2th device address as stored in b2th_device_t::bdaddr.
+ *
+ * \return  b2th_device_t on success, NULL on error.
+ */
+b2th_device_t *b2th_get_device_by_bdaddr(b2th_list_t *head, uint64_t bdaddr);
+
+
+/*!
+ * \brief b2th_list_size - Get b2th device list size
+ *
+ * \param[in]   head    head of the b2th device list.
+ *
+ * \return  b2th list size on success.
+ */
+size_t b2th_list_size(b2th_list_t *head);
+
+
+/*!
+ * \brief b2th_cache_open - Open a device cache
+ *
+ * Entries are keyed by device address and hold the name, class of device,
+ * paging hints, last sighting and SDP results of a device. When path is given the cache
+ * lives in a memory-mapped file and survives restarts, a file written with
+ * another capacity is reset.
+ *
+ * \param[in]   path            cache file, NULL for an in-memory cache.
+ * \param[in]   capacity        number of devices the cache can hold.
+ * \param[in]   presence_ttl    seconds a device stays present after its last sighting.
+ * \param[in]   name_ttl        seconds a resolved name, or discovered services, are trusted without asking again.
+ *
+ * \return  b2th_cache_t on success, NULL on error.
+ */
+b2th_cache_t *b2th_cache_open(const char *path, size_t capacity, unsigned int presence_ttl, unsigned int name_ttl);
+
+
+/*!
+ * \brief b2th_cache_close - Close a device cache and flush it to its file
+ *
+ * \param[in]   cache   b2th cache to close.
+ */
+void b2th_cache_close(b2th_cache_t *cache);
+
+
+/*!
+ * \brief b2th_cache_update - Record a sighting of a b2th device in the cache
+ *
+ * \param[in]   cache   b2th cache.
+ * \param[in]   bd      b2th device seen, its name is recorded unless it is "unknown".
+ *
+ * \return  0 on success, -1 on error.
+ */
+int b2th_cache_update(b2th_cache_t *cache, const b2th_device_t *bd);
+
+
+/*!
+ * \brief b2th_cache_get_device_by_addr - Get a device still present in the cache thanks to its address
+ *
+ * \param[in]   cache   b2th cache.
+ * \param[in]   address b2th device address to retrieve.
+ *
+ * \return  b2th_device_t to free with b2th_device_deinit() on success, NULL if absent or expired.
+ */
+b2th_device_t *b2th_cache_get_device_by_addr(b2th_cache_t *cache, const char *address);
+
+
+/*!
+ * \brief b2th_cache_get_device_by_name - Get a device still present in the cache thanks to its name
+ *
+ * \param[in]   cache   b2th cache.
+ * \param[in]   name    b2th device name to retrieve.
+ *
+ * \return  b2th_device_t to free with b2th_device_deinit() on success, NULL if absent or expired.
+ */
+b2th_device_t *b2th_cache_get_device_by_name(b2th_cache_t *cache, const char *name);
+
+
+/*!
+ * \brief b2th_cache_get_list - Get the list of devices still present in the cache
+ *
+ * \param[in]   cache   b2th cache.
+ *
+ * \return  b2th_list_t on success, NULL on error.
+ */
+b2th_list_t *b2th_cache_get_list(b2th_cache_t *cache);
+
+
+/*!
+ * \brief b2th_le_params_init - Fill LE scan parameters with their default values
+ *
+ * \param[out]  params  LE scan parameters to initialize.
+ */
+void b2th_le_params_init(b2th_le_params_t *params);
+
+
+/*!
+ * \brief b2th_le_scan_start - Enable LE scanning on a local controller
+ *
+ * Every memory the scanner needs is allocated here: processing reports never
+ * allocates. Devices are de-duplicated in software by address and address type.
+ *
+ * \param[in]   local_device   local b2th device handler.
+ * \param[in]   params         LE scan parameters, NULL for defaults.
+ *
+ * \return  b2th_le_scanner_t on success, NULL on error.
+ */
+b2th_le_scanner_t *b2th_le_scan_start(b2th_device_t *local_device, const b2th_le_params_t *params);
+
+
+/*!
+ * \brief b2th_le_scan_fd - Get the file descriptor to poll for pending reports
+ *
+ * \param[in]   sc      LE scanner.
+ *
+ * \return  pollable file descriptor.
+ */
+int b2th_le_scan_fd(b2th_le_scanner_t *sc);
+
+
+/*!
+ * \brief b2th_le_scan_process - Wait for advertising reports and ingest every pending one
+ *
+ * \param[in]   sc          LE scanner.
+ * \param[in]   timeout_ms  maximum time to wait for the first report, -1 to wait forever.
+ *
+ * \return  number of reports ingested, -1 on error.
+ */
+int b2th_le_scan_process(b2th_le_scanner_t *sc, int timeout_ms);
+
+
+/*!
+ * \brief b2th_le_get_device - Get the snapshot of a LE device thanks to its address
+ *
+ * \param[in]   sc      LE scanner.
+ * \param[in]   address b2th device address to retrieve.
+ *
+ * \return  b2th_le_device_t on success, NULL if never seen.
+ */
+const b2th_le_device_t *b2th_le_get_device(b2th_le_scanner_t *sc, const char *address);
+
+
+/*!
+ * \brief b2th_le_get_devices - Get every LE device seen, in discovery order
+ *
+ * \param[in]   sc      LE scanner.
+ * \param[out]  count   number of devices.
+ *
+ * \return  contiguous array of count devices, valid until the next b2th_le_scan_process().
+ */
+const b2th_le_device_t *b2th_le_get_devices(b2th_le_scanner_t *sc, size_t *count);
+
+
+/*!
+ * \brief b2th_le_get_stats - Get the LE scan ingestion counters
+ *
+ * \param[in]   sc      LE scanner.
+ * \param[out]  stats   counters.
+ */
+void b2th_le_get_stats(b2th_le_scanner_t *sc, b2th_le_stats_t *stats);
+
+
+/*!
+ * \brief b2th_le_scan_stop - Disable LE scanning and free the scanner
+ *
+ * \param[in]   sc      LE scanner.
+ */
+void b2th_le_scan_stop(b2th_le_scanner_t *sc);
+
+
+/*!
+ * \brief b2th_table_create - Allocate a device table shared by one writer and many reader threads
+ *
+ * Every device slot is protected by a sequence counter: readers copy it and
+ * retry if a writer went through meanwhile, they never take a lock nor wait
+ * for one. Writers are serialized by a mutex. Expired devices are marked
+ * absent, their slots are given to new devices.
+ *
+ * \param[in]   max_devices     devices the table can hold present at once.
+ *
+ * \return  b2th_table_t on success, NULL on error.
+ */
+b2th_table_t *b2th_table_create(size_t max_devices);
+
+
+/*!
+ * \brief b2th_table_update - Record a sighting of a device (writer)
+ *
+ * The name is only replaced by a resolved one and the RSSI by a known one.
+ *
+ * \param[in]   table   device table.
+ * \param[in]   bd      device seen.
+ * \param[in]   now     time of the sighting in ms, b2th monotonic time for instance.
+ *
+ * \return  1 if the device arrived (new or absent), 0 if it was present, -1 if max_devices are present.
+ */
+int b2th_table_update(b2th_table_t *table, const b2th_device_t *bd, long long now);
+
+
+/*!
+ * \brief b2th_table_update_list - Record a sighting of every device of a scan result (writer)
+ *
+ * \param[in]   table   device table.
+ * \param[in]   bl      scan result.
+ * \param[in]   now     time of the sightings in ms.
+ *
+ * \return  number of devices that arrived, -1 if some did not fit.
+ */
+int b2th_table_update_list(b2th_table_t *table, b2th_list_t *bl, long long now);
+
+
+/*!
+ * \brief b2th_table_expire - Mark absent the devices not seen since a given time (writer)
+ *
+ * \param[in]   table       device table.
+ * \param[in]   limit       devices last seen before this time in ms depart.
+ * \param[in]   cb          called for each departure, may be NULL.
+ * \param[in]   userdata    user context given to cb.
+ *
+ * \return  number of departures.
+ */
+size_t b2th_table_expire(b2th_table_t *table, long long limit, b2th_table_cb_t cb, void *userdata);
+
+
+/*!
+ * \brief b2th_table_lookup - Get a consistent copy of a present device (reader, lock-free)
+ *
+ * \param[in]   table   device table.
+ * \param[in]   bdaddr  device address as an integer.
+ * \param[out]  entry   copy of the device.
+ *
+ * \return  0 on success, -1 if the device is absent or unknown.
+ */
+int b2th_table_lookup(b2th_table_t *table, uint64_t bdaddr, b2th_table_entry_t *entry);
+
+
+/*!
+ * \brief b2th_table_for_each - Go through the present devices (reader, lock-free)
+ *
+ * Each device is copied consistently, the whole walk is not a single snapshot:
+ * devices updated during the walk are seen before or after their update.
+ *
+ * \param[in]   table       device table.
+ * \param[in]   cb          called with a copy of every present device.
+ * \param[in]   userdata    user context given to cb.
+ *
+ * \return  number of devices given to cb.
+ */
+size_t b2th_table_for_each(b2th_table_t *table, b2th_table_cb_t cb, void *userdata);
+
+
+/*!
+ * \brief b2th_table_count - Get the number of present devices (reader, lock-free)
+ *
+ * \param[in]   table   device table.
+ *
+ * \return  number of present devices.
+ */
+size_t b2th_table_count(b2th_table_t *table);
+
+
+/*!
+ * \brief b2th_table_destroy - Free a device table, no thread may use it anymore
+ *
+ * \param[in]   table   device table.
+ */
+void b2th_table_destroy(b2th_table_t *table);
+
+
+/*!
+ * \brief b2th_snapshot_create - Copy a scan result into an array of records, in list order
+ *
+ * The snapshot does not refer to the list, which may be freed or changed afterwards.
+ *
+ * \param[in]   bl      scan result.
+ *
+ * \return  b2th_snapshot_t on success, NULL on error.
+ */
+b2th_snapshot_t *b2th_snapshot_create(b2th_list_t *bl);
+
+
+/*!
+ * \brief b2th_table_snapshot - Copy the present devices of a shared device table into an array of records (reader, lock-free)
+ *
+ * Records carry no controller id nor transmit power. Like b2th_table_for_each(),
+ * every record is consistent but devices updated meanwhile may be old or new.
+ *
+ * \param[in]   table   device table.
+ *
+ * \return  b2th_snapshot_t on success, NULL on error.
+ */
+b2th_snapshot_t *b2th_table_snapshot(b2th_table_t *table);
+
+
+/*!
+ * \brief b2th_snapshot_sort - Sort the records of a snapshot, equal records by ascending address
+ *
+ * \param[in]   snap    snapshot.
+ * \param[in]   order   sort key.
+ */
+void b2th_snapshot_sort(b2th_snapshot_t *snap, b2th_sort_e order);
+
+
+/*!
+ * \brief b2th_snapshot_records - Get the records of a snapshot
+ *
+ * \param[in]   snap    snapshot.
+ * \param[out]  count   number of records.
+ *
+ * \return  records in the current order, valid until the snapshot is sorted or destroyed.
+ */
+const b2th_record_t *b2th_snapshot_records(const b2th_snapshot_t *snap, size_t *count);
+
+
+/*!
+ * \brief b2th_snapshot_find - Find the record of a device
+ *
+ * Binary search once sorted by address, linear search otherwise.
+ *
+ * \param[in]   snap    snapshot.
+ * \param[in]   bdaddr  device address as an integer.
+ *
+ * \return  record on success, NULL if the device is not in the snapshot.
+ */
+const b2th_record_t *b2th_snapshot_find(const b2th_snapshot_t *snap, uint64_t bdaddr);
+
+
+/*!
+ * \brief b2th_snapshot_name - Get the name of a record
+ *
+ * \param[in]   snap    snapshot of the record.
+ * \param[in]   rec     record.
+ *
+ * \return  name, empty while unresolved.
+ */
+const char *b2th_snapshot_name(const b2th_snapshot_t *snap, const b2th_record_t *rec);
+
+
+/*!
+ * \brief b2th_snapshot_export - Describe the records and names of a snapshot for writev() without copying them
+ *
+ * iov[0] holds the records and iov[1] the names the records point into.
+ *
+ * \param[in]   snap    snapshot.
+ * \param[out]  iov     two buffers, valid until the snapshot is sorted or destroyed.
+ */
+void b2th_snapshot_export(const b2th_snapshot_t *snap, struct iovec iov[2]);
+
+
+/*!
+ * \brief b2th_record_address - Format the address of a record
+ *
+ * \param[in]   rec         record.
+ * \param[out]  address     "XX:XX:XX:XX:XX:XX" and its NUL, 18 bytes.
+ */
+void b2th_record_address(const b2th_record_t *rec, char *address);
+
+
+/*!
+ * \brief b2th_snapshot_diff - Find the devices added, removed and changed from a snapshot to a newer one
+ *
+ * Runs in time linear in the size of both snapshots, whatever their order. A
+ * device that was not resolved in the newer snapshot keeps its name, RSSI
+ * moves involving an unknown RSSI are ignored. The changes point into the
+ * snapshots, which must outlive them and not be sorted meanwhile.
+ *
+ * \param[in]   before          older snapshot, NULL for an empty one.
+ * \param[in]   after           newer snapshot, NULL for an empty one.
+ * \param[in]   rssi_threshold  RSSI move in dB making a device changed, 0 to ignore RSSI moves.
+ * \param[out]  diff            changes, to free with b2th_diff_deinit().
+ *
+ * \return  number of changes on success, -1 on error.
+ */
+int b2th_snapshot_diff(const b2th_snapshot_t *before, const b2th_snapshot_t *after, unsigned int rssi_threshold,
+        b2th_diff_t *diff);
+
+
+/*!
+ * \brief b2th_diff_deinit - Free the changes of a diff
+ *
+ * \param[in]   diff    changes.
+ */
+void b2th_diff_deinit(b2th_diff_t *diff);
+
+
+/*!
+ * \brief b2th_snapshot_destroy - Free a snapshot
+ *
+ * \param[in]   snap    snapshot.
+ */
+void b2th_snapshot_destroy(b2th_snapshot_t *snap);
+
+
+/*!
+ * \brief b2th_transport_set - Route every controller access through a transport
+ *
+ * To be called while no scan or LE scanner is running.
+ *
+ * \param[in]   transport   transport to use, NULL to go back to the kernel HCI sockets.
+ */
+void b2th_transport_set(b2th_transport_t *transport);
+
+
+/*!
+ * \brief b2th_sim_params_init - Fill a simulated controller model with its default values
+ *
+ * \param[out]  params  simulated controller model to initialize.
+ */
+void b2th_sim_params_init(b2th_sim_params_t *params);
+
+
+/*!
+ * \brief b2th_sim_create - Create simulated controllers answering inquiries and name requests
+ *
+ * Lets scans run, be tested and be benchmarked without any bluetooth hardware.
+ * The remote device population only depends on the model seed.
+ *
+ * \param[in]   params  simulated controller model, NULL for defaults.
+ *
+ * \return  b2th_transport_t to give to b2th_transport_set() on success, NULL on error.
+ */
+b2th_transport_t *b2th_sim_create(const b2th_sim_params_t *params);
+
+
+/*!
+ * \brief b2th_sim_destroy - Free simulated controllers
+ *
+ * \param[in]   transport   transport returned by b2th_sim_create(), not in use anymore.
+ */
+void b2th_sim_destroy(b2th_transport_t *transport);
+
+
+/*!
+ * \brief b2th_sim_controller_event - Plug, unplug, bring up or down a simulated controller
+ *
+ * The change is reported to the device event listeners, as the kernel does.
+ *
+ * \param[in]   transport   transport returned by b2th_sim_create().
+ * \param[in]   dev_id      simulated controller, below the nb_adapters of the model.
+ * \param[in]   event       change to apply.
+ *
+ * \return  0 on success, -1 on error.
+ */
+int b2th_sim_controller_event(b2th_transport_t *transport, int dev_id, b2th_controller_event_e event);
+
+
+/*!
+ * \brief b2th_btsnoop_record_start - Record every HCI command and event of the library
+ *
+ * The capture is a btsnoop file using the Linux monitor datalink, as written
+ * by btmon: one session per controller socket, readable by btmon -r and
+ * replayable with b2th_replay_create().
+ *
+ * \param[in]   path    capture file to create.
+ *
+ * \return  0 on success, -1 on error.
+ */
+int b2th_btsnoop_record_start(const char *path);
+
+
+/*!
+ * \brief b2th_btsnoop_record_stop - Stop recording and close the capture
+ */
+void b2th_btsnoop_record_stop();
+
+
+/*!
+ * \brief b2th_replay_create - Create controllers replaying a capture made by b2th_btsnoop_record_start()
+ *
+ * Each socket opened on a controller replays its next recorded session:
+ * recorded events are released after the commands preceding them, with
+ * their original delays divided by speed.
+ *
+ * \param[in]   path    btsnoop capture.
+ * \param[in]   speed   1 for the original pace, N for N times faster, 0 for no delay.
+ *
+ * \return  b2th_transport_t to give to b2th_transport_set() on success, NULL on error.
+ */
+b2th_transport_t *b2th_replay_create(const char *path, unsigned int speed);
+
+
+/*!
+ * \brief b2th_replay_destroy - Free replayed controllers
+ *
+ * \param[in]   transport   transport returned by b2th_replay_create(), not in use anymore.
+ */
+void b2th_replay_destroy(b2th_transport_t *transport);
+
+
+/*!
+ * \brief b2th_stats_get - Get the counters of every scan since start or the last b2th_stats_reset()
+ *
+ * \param[out]  stats   counters.
+ */
+void b2th_stats_get(b2th_scan_stats_t *stats);
+
+
+/*!
+ * \brief b2th_stats_reset - Reset the counters returned by b2th_stats_get()
+ */
+void b2th_stats_reset();
+
+
+/*!
+ * \brief b2th_stats_write_prometheus - Write counters in the Prometheus text exposition format
+ *
+ * \param[in]   stats   counters.
+ * \param[in]   out     output stream.
+ *
+ * \return  0 on success, -1 on error.
+ */
+int b2th_stats_write_prometheus(const b2th_scan_stats_t *stats, FILE *out);
+
+
+/*!
+ * \brief b2th_async_create - Create an asynchronous context on a local controller
+ *
+ * The context starts inquiries, remote name requests and connections without
+ * blocking and without threads: the caller polls b2th_async_fd() in its own
+ * event loop and calls b2th_async_process() when it is readable. Completions
+ * are reported to the callback given to each operation. Name requests and
+ * connections are queued and sent a few at a time, as the controller can
+ * only page a handful of devices at once.
+ *
+ * \param[in]   local_device   local b2th device handler.
+ *
+ * \return  b2th_async_t on success, NULL on error.
+ */
+b2th_async_t *b2th_async_create(b2th_device_t *local_device);
+
+
+/*!
+ * \brief b2th_async_fd - Get the file descriptor to poll for readability
+ *
+ * The descriptor becomes readable on controller events and when an operation
+ * times out: no timeout has to be computed by the caller.
+ *
+ * \param[in]   as      asynchronous context.
+ *
+ * \return  pollable file descriptor, -1 on error.
+ */
+int b2th_async_fd(b2th_async_t *as);
+
+
+/*!
+ * \brief b2th_async_process - Handle pending events and expired operations, never blocks
+ *
+ * \param[in]   as      asynchronous context.
+ *
+ * \return  number of callbacks called, -1 on error.
+ */
+int b2th_async_process(b2th_async_t *as);
+
+
+/*!
+ * \brief b2th_async_inquiry - Start an inquiry
+ *
+ * B2TH_ASYNC_INQUIRY_RESULT is reported once per device, the device being
+ * added to list, then B2TH_ASYNC_INQUIRY_COMPLETE ends the inquiry. The
+ * event name is set when the extended inquiry response of the device
+ * carried its complete name: no name request is needed for it.
+ *
+ * \param[in]   as          asynchronous context.
+ * \param[in]   secs        time in seconds that the bluetooth inquiry runs.
+ * \param[in]   list        list receiving the devices found, see b2th_list_init(), must outlive the inquiry.
+ * \param[in]   cb          callback, may be NULL.
+ * \param[in]   userdata    user context given to cb.
+ *
+ * \return  0 on success, -1 on error or if an inquiry or a discovery is already running.
+ */
+int b2th_async_inquiry(b2th_async_t *as, unsigned int secs, b2th_list_t *list, b2th_async_cb_t cb, void *userdata);
+
+
+/*!
+ * \brief b2th_discovery_params_init - Set the default adaptive discovery parameters
+ *
+ * Slices of 1 to 8 units (1.28 to 10.24 s), inquiring half of the time, a
+ * slice finding 2 new devices or more doubles the next one.
+ *
+ * \param[out]  params  parameters to initialize.
+ */
+void b2th_discovery_params_init(b2th_discovery_params_t *params);
+
+
+/*!
+ * \brief b2th_async_discover - Discover devices with short inquiry slices interleaved with paging windows
+ *
+ * A controller cannot page while it inquires: instead of one long inquiry
+ * stalling name requests and connections, discovery runs slices separated
+ * by windows where only paging happens, the slices taking duty_percent of
+ * the time. A slice finding grow_devices new devices or more doubles the
+ * length of the next one, a slice finding none halves it. Name requests and
+ * connections wait for the next window, a connection started during a slice
+ * cuts it short and no slice starts while a name request or a connection is
+ * under way.
+ *
+ * B2TH_ASYNC_INQUIRY_RESULT is reported once per device, the device being
+ * added to list, B2TH_ASYNC_INQUIRY_COMPLETE ends every slice. A slice the
+ * controller refuses is reported with a positive status and retried after
+ * a back-off doubling from 1.28 to 40.96 s. Discovery goes on until
+ * b2th_async_discover_stop().
+ *
+ * \param[in]   as          asynchronous context.
+ * \param[in]   params      slice lengths and duty cycle, NULL for the defaults.
+ * \param[in]   list        list receiving the devices found, see b2th_list_init(), must outlive the discovery.
+ * \param[in]   cb          callback, may be NULL.
+ * \param[in]   userdata    user context given to cb.
+ *
+ * \return  0 on success, -1 on error or if an inquiry or a discovery is already running.
+ */
+int b2th_async_discover(b2th_async_t *as, const b2th_discovery_params_t *params, b2th_list_t *list,
+        b2th_async_cb_t cb, void *userdata);
+
+
+/*!
+ * \brief b2th_async_discover_stop - Stop a discovery, the running slice is cancelled without calling back
+ *
+ * \param[in]   as      asynchronous context.
+ */
+void b2th_async_discover_stop(b2th_async_t *as);
+
+
+/*!
+ * \brief b2th_async_name - Start a remote name request, reported by B2TH_ASYNC_NAME_COMPLETE
+ *
+ * \param[in]   as          asynchronous context.
+ * \param[in]   bd          remote device, must outlive the request.
+ * \param[in]   timeout_ms  request timeout once sent, 0 for the default.
+ * \param[in]   cb          callback, may be NULL.
+ * \param[in]   userdata    user context given to cb.
+ *
+ * \return  0 on success, -1 on error.
+ */
+int b2th_async_name(b2th_async_t *as, b2th_device_t *bd, unsigned int timeout_ms, b2th_async_cb_t cb, void *userdata);
+
+
+/*!
+ * \brief b2th_async_connect - Start an ACL connection, reported by B2TH_ASYNC_CONNECT_COMPLETE
+ *
+ * \param[in]   as          asynchronous context.
+ * \param[in]   bd          remote device, must outlive the attempt.
+ * \param[in]   timeout_ms  connection timeout once sent, 0 for the default.
+ * \param[in]   cb          callback, may be NULL.
+ * \param[in]   userdata    user context given to cb.
+ *
+ * \return  0 on success, -1 on error.
+ */
+int b2th_async_connect(b2th_async_t *as, b2th_device_t *bd, unsigned int timeout_ms, b2th_async_cb_t cb, void *userdata);
+
+
+/*!
+ * \brief b2th_async_disconnect - Close a connection, reported by B2TH_ASYNC_DISCONNECT_COMPLETE
+ *
+ * \param[in]   as          asynchronous context.
+ * \param[in]   handle      connection handle.
+ * \param[in]   cb          callback, may be NULL.
+ * \param[in]   userdata    user context given to cb.
+ *
+ * \return  0 on success, -1 on error.
+ */
+int b2th_async_disconnect(b2th_async_t *as, int handle, b2th_async_cb_t cb, void *userdata);
+
+
+/*!
+ * \brief b2th_async_destroy - Cancel every operation without calling back and free the context
+ *
+ * Must not be called from a callback.
+ *
+ * \param[in]   as      asynchronous context.
+ */
+void b2th_async_destroy(b2th_async_t *as);
+
+
+/*!
+ * \brief b2th_rfcomm_connect - Open an RFCOMM connection to a channel of a remote device
+ *
+ * \param[in]   local_device   local b2th device handler.
+ * \param[in]   bd             remote device.
+ * \param[in]   channel        RFCOMM channel, 1 to 30.
+ * \param[in]   timeout_ms     connection timeout, 0 for the default.
+ *
+ * \return  b2th_rfcomm_t on success, NULL on error.
+ */
+b2th_rfcomm_t *b2th_rfcomm_connect(b2th_device_t *local_device, b2th_device_t *bd, uint8_t channel,
+        unsigned int timeout_ms);
+
+
+/*!
+ * \brief b2th_rfcomm_fd - Get the socket of a connection, to poll it or tune it
+ *
+ * \param[in]   rc      RFCOMM connection.
+ *
+ * \return  connected socket, -1 on error.
+ */
+int b2th_rfcomm_fd(b2th_rfcomm_t *rc);
+
+
+/*!
+ * \brief b2th_rfcomm_writev - Write every buffer of an I/O vector, in order
+ *
+ * Data goes from the caller buffers to the socket with no intermediate copy.
+ * Short writes are resumed until everything is written.
+ *
+ * \param[in]   rc      RFCOMM connection.
+ * \param[in]   iov     buffers to write.
+ * \param[in]   iovcnt  number of buffers.
+ *
+ * \return  number of bytes written on success, -1 on error.
+ */
+ssize_t b2th_rfcomm_writev(b2th_rfcomm_t *rc, const struct iovec *iov, int iovcnt);
+
+
+/*!
+ * \brief b2th_rfcomm_write - Write a whole buffer, see b2th_rfcomm_writev()
+ *
+ * \param[in]   rc      RFCOMM connection.
+ * \param[in]   buf     data to write.
+ * \param[in]   len     length of data.
+ *
+ * \return  number of bytes written on success, -1 on error.
+ */
+ssize_t b2th_rfcomm_write(b2th_rfcomm_t *rc, const void *buf, size_t len);
+
+
+/*!
+ * \brief b2th_rfcomm_readv - Wait for data and scatter what is available into the caller buffers
+ *
+ * \param[in]   rc          RFCOMM connection.
+ * \param[in]   iov         buffers to fill, in order.
+ * \param[in]   iovcnt      number of buffers.
+ * \param[in]   timeout_ms  maximum time to wait for data, -1 to wait forever.
+ *
+ * \return  number of bytes read, 0 if the device closed the connection, -1 on error or timeout (errno ETIMEDOUT).
+ */
+ssize_t b2th_rfcomm_readv(b2th_rfcomm_t *rc, const struct iovec *iov, int iovcnt, int timeout_ms);
+
+
+/*!
+ * \brief b2th_rfcomm_read - Wait for data and read what is available, see b2th_rfcomm_readv()
+ *
+ * \param[in]   rc          RFCOMM connection.
+ * \param[out]  buf         buffer to fill.
+ * \param[in]   len         size of buf.
+ * \param[in]   timeout_ms  maximum time to wait for data, -1 to wait forever.
+ *
+ * \return  number of bytes read, 0 if the device closed the connection, -1 on error or timeout.
+ */
+ssize_t b2th_rfcomm_read(b2th_rfcomm_t *rc, void *buf, size_t len, int timeout_ms);
+
+
+/*!
+ * \brief b2th_rfcomm_close - Close a connection, a pooled one is dropped from its pool
+ *
+ * \param[in]   rc      RFCOMM connection.
+ */
+void b2th_rfcomm_close(b2th_rfcomm_t *rc);
+
+
+/*!
+ * \brief b2th_rfcomm_pool_create - Create a pool of persistent RFCOMM connections keyed by device address and channel
+ *
+ * Connections are opened on first use and kept open once released, so the
+ * next exchange with the same device skips the page and the RFCOMM setup.
+ * The pool is safe to use from several threads.
+ *
+ * \param[in]   local_device       local b2th device handler.
+ * \param[in]   max_conns          maximum number of connections, the least recently used idle one is closed beyond.
+ * \param[in]   idle_timeout_ms    idle connections are closed after this time, 0 for the default.
+ *
+ * \return  b2th_rfcomm_pool_t on success, NULL on error.
+ */
+b2th_rfcomm_pool_t *b2th_rfcomm_pool_create(b2th_device_t *local_device, size_t max_conns, unsigned int idle_timeout_ms);
+
+
+/*!
+ * \brief b2th_rfcomm_pool_get - Take the connection to a channel of a device, opening it if needed
+ *
+ * A connection is used by one caller at a time until b2th_rfcomm_pool_put().
+ * A connection the device closed while idle is opened again.
+ *
+ * \param[in]   pool        RFCOMM pool.
+ * \param[in]   bd          remote device.
+ * \param[in]   channel     RFCOMM channel, 1 to 30.
+ *
+ * \return  b2th_rfcomm_t on success, NULL on error (errno EBUSY if in use, EAGAIN if the pool is full).
+ */
+b2th_rfcomm_t *b2th_rfcomm_pool_get(b2th_rfcomm_pool_t *pool, b2th_device_t *bd, uint8_t channel);
+
+
+/*!
+ * \brief b2th_rfcomm_pool_put - Give a connection back to its pool
+ *
+ * \param[in]   pool    RFCOMM pool.
+ * \param[in]   rc      connection returned by b2th_rfcomm_pool_get().
+ * \param[in]   drop    close the connection instead of keeping it, after an I/O error for instance.
+ */
+void b2th_rfcomm_pool_put(b2th_rfcomm_pool_t *pool, b2th_rfcomm_t *rc, int drop);
+
+
+/*!
+ * \brief b2th_rfcomm_pool_destroy - Close every connection and free the pool
+ *
+ * \param[in]   pool    RFCOMM pool, every connection taken must have been put back.
+ */
+void b2th_rfcomm_pool_destroy(b2th_rfcomm_pool_t *pool);
 
-// int b2th_device_write(b2th_device_t *bd);
+
+/*!
+ * \brief b2th_l2cap_connect - Open an L2CAP channel to a PSM of a remote device
+ *
+ * Packet boundaries are kept: one send is one packet, one receive returns one packet.
+ *
+ * \param[in]       local_device   local b2th device handler.
+ * \param[in]       bd             remote device.
+ * \param[in]       psm            protocol/service multiplexer, odd.
+ * \param[in,out]   opts           requested options, negotiated ones on return, NULL for the defaults.
+ * \param[in]       timeout_ms     connection timeout, 0 for the default.
+ *
+ * \return  b2th_l2cap_t on success, NULL on error.
+ */
+b2th_l2cap_t *b2th_l2cap_connect(b2th_device_t *local_device, b2th_device_t *bd, uint16_t psm,
+        b2th_l2cap_opts_t *opts, unsigned int timeout_ms);
+
+
+/*!
+ * \brief b2th_l2cap_fd - Get the socket of a channel, to poll it or tune it
+ *
+ * \param[in]   ch      L2CAP channel.
+ *
+ * \return  socket, -1 if ch is NULL.
+ */
+int b2th_l2cap_fd(b2th_l2cap_t *ch);
+
+
+/*!
+ * \brief b2th_l2cap_get_opts - Get the options negotiated for a channel
+ *
+ * \param[in]   ch      L2CAP channel.
+ * \param[out]  opts    negotiated options.
+ */
+void b2th_l2cap_get_opts(b2th_l2cap_t *ch, b2th_l2cap_opts_t *opts);
+
+
+/*!
+ * \brief b2th_l2cap_send - Send one packet
+ *
+ * \param[in]   ch      L2CAP channel.
+ * \param[in]   buf     packet.
+ * \param[in]   len     packet length, at most the outgoing MTU.
+ *
+ * \return  len on success, -1 on error (errno EMSGSIZE above the MTU).
+ */
+ssize_t b2th_l2cap_send(b2th_l2cap_t *ch, const void *buf, size_t len);
+
+
+/*!
+ * \brief b2th_l2cap_send_batch - Send packets with as few system calls as possible
+ *
+ * \param[in]   ch      L2CAP channel.
+ * \param[in]   pkts    packets, each at most the outgoing MTU.
+ * \param[in]   count   number of packets.
+ *
+ * \return  number of packets sent, fewer than count if an error stopped the batch, -1 if none was sent.
+ */
+int b2th_l2cap_send_batch(b2th_l2cap_t *ch, const b2th_l2cap_packet_t *pkts, unsigned int count);
+
+
+/*!
+ * \brief b2th_l2cap_recv - Wait for a packet and read it
+ *
+ * \param[in]   ch          L2CAP channel.
+ * \param[out]  buf         packet buffer, imtu bytes long never truncate.
+ * \param[in]   len         buffer size.
+ * \param[in]   timeout_ms  longest wait, -1 to wait forever.
+ *
+ * \return  packet length, 0 on end of connection, -1 on error (errno ETIMEDOUT on timeout).
+ */
+ssize_t b2th_l2cap_recv(b2th_l2cap_t *ch, void *buf, size_t len, int timeout_ms);
+
+
+/*!
+ * \brief b2th_l2cap_recv_batch - Wait for packets and read all those available into preallocated buffers
+ *
+ * Nothing is allocated: the packets land in the caller buffers, whose len
+ * is replaced with the received packet length.
+ *
+ * \param[in]       ch          L2CAP channel.
+ * \param[in,out]   pkts        packet buffers, imtu bytes long never truncate.
+ * \param[in]       count       number of buffers.
+ * \param[in]       timeout_ms  longest wait for the first packet, -1 to wait forever.
+ *
+ * \return  number of packets received, 0 on end of connection, -1 on error (errno ETIMEDOUT on timeout).
+ */
+int b2th_l2cap_recv_batch(b2th_l2cap_t *ch, b2th_l2cap_packet_t *pkts, unsigned int count, int timeout_ms);
+
+
+/*!
+ * \brief b2th_l2cap_close - Close a channel and free it
+ *
+ * \param[in]   ch      L2CAP channel.
+ */
+void b2th_l2cap_close(b2th_l2cap_t *ch);
+
+
+/*!
+ * \brief b2th_sdp_discover - Search the services of every device of a list, several devices at once
+ *
+ * Each device is asked over one SDP connection for every UUID and the
+ * records found are attached to it, with the RFCOMM channel or L2CAP PSM
+ * to connect to. Devices with fresh results in the cache are not asked.
+ *
+ * \param[in]   local_device    local b2th device handler.
+ * \param[in]   bl              devices to search, b2th_device_t::services are set.
+ * \param[in]   uuids           16-bit service class UUIDs to look for.
+ * \param[in]   nb_uuids        number of UUIDs.
+ * \param[in]   params          concurrency, timeout and cache, NULL for the defaults.
+ *
+ * \return  number of devices offering at least one of the services, -1 on error.
+ */
+int b2th_sdp_discover(b2th_device_t *local_device, b2th_list_t *bl, const uint16_t *uuids, size_t nb_uuids,
+        const b2th_sdp_params_t *params);
+
+
+/*!
+ * \brief b2th_device_pairing - Set b2th device connection
+ *
+ * \param[in]   bd      b2th device handler to connect to.
+ *
+ * \return  0 on success, -1 on error.
+ */
+// int b2th_device_pairing(b2th_device_t *bd);
 
 
 #ifdef __cplusplus
@@ -0,0 +1,272 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "b2th_internal.h"
+#include "daemon.h"
+
+
+#define DAEMON_REQUEST_SIZE 64
+#define DAEMON_MAX_DEVICES  4096
+#define DAEMON_CLIENT_TIMEOUT_MS 1000
+
+
+struct b2th_daemon {
+    const struct b2th_daemon_conf *conf;
+    b2th_table_t *table;                /**<! devices by bdaddr, queries read it without locking */
+    unsigned long dropped;              /**<! sightings dropped since the last cycle, the table was full */
+    int listen_fd;                      /**<! UNIX socket for queries */
+    int wake[2];                        /**<! pipe written to stop the query server */
+};
+
+
+static volatile sig_atomic_t daemon_stop = 0;
+
+
+static void daemon_signal(int sig)
+{
+    (void)sig;
+    daemon_stop = 1;
+}
+
+
+static void daemon_seen(struct b2th_daemon *d, b2th_device_t *bd)
+{
+    switch (b2th_table_update(d->table, bd, b2th_now_ms())) {
+    case 1:
+        printf("arrival [%s][%s]\n", bd->address, bd->name);
+        fflush(stdout);
+        break;
+    case -1:
+        d->dropped++;
+        break;
+    }
+}
+
+
+static void daemon_departure(const b2th_table_entry_t *entry, void *userdata)
+{
+    (void)userdata;
+    printf("departure [%s][%s]\n", entry->address, entry->name);
+}
+
+
+static void daemon_expire(struct b2th_daemon *d)
+{
+    long long limit = b2th_now_ms() - (long long)d->conf->absence_timeout * 1000;
+
+    b2th_table_expire(d->table, limit, daemon_departure, NULL);
+    fflush(stdout);
+
+    if (d->dropped) {
+        fprintf(stderr, "Device table full, %lu sightings dropped\n", d->dropped);
+        d->dropped = 0;
+    }
+}
+
+
+static int daemon_scan_cb(b2th_scan_event_e event, b2th_device_t *bd, void *userdata)
+{
+    struct b2th_daemon *d = userdata;
+
+    switch (event) {
+    case B2TH_SCAN_DEVICE_FOUND:
+    case B2TH_SCAN_DEVICE_SEEN:
+    case B2TH_SCAN_NAME_RESOLVED:
+        daemon_seen(d, bd);
+        break;
+    case B2TH_SCAN_CYCLE_COMPLETE:
+        daemon_expire(d);
+        break;
+    }
+
+    return daemon_stop;
+}
+
+
+struct daemon_reply {
+    FILE *out;                          /**<! client stream */
+    long long now;                      /**<! time of the request in ms */
+};
+
+
+static void daemon_print(const b2th_table_entry_t *entry, void *userdata)
+{
+    struct daemon_reply *reply = userdata;
+
+    fprintf(reply->out, "[%s][%s][%d][%lld]\n", entry->address, entry->name, entry->rssi,
+            (reply->now - entry->last_seen) / 1000);
+}
+
+
+static void daemon_answer(struct b2th_daemon *d, int fd)
+{
+    // A client that sends nothing, or reads nothing, cannot hold the other queries or the shutdown for long
+    struct pollfd pfd[2] = {
+        { .fd = fd, .events = POLLIN },
+        { .fd = d->wake[0], .events = POLLIN },
+    };
+    if (poll(pfd, 2, DAEMON_CLIENT_TIMEOUT_MS) <= 0 || pfd[1].revents || !pfd[0].revents)
+        return;
+
+    struct timeval tv = { .tv_sec = DAEMON_CLIENT_TIMEOUT_MS / 1000, .tv_usec = DAEMON_CLIENT_TIMEOUT_MS % 1000 * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    char req[DAEMON_REQUEST_SIZE] = { 0 };
+    ssize_t len = read(fd, req, sizeof(req) - 1);
+    if (len <= 0)
+        return;
+
+    req[strcspn(req, "\r\n")] = '\0';
+
+    FILE *out = fdopen(dup(fd), "w");
+    if (!out)
+        return;
+
+    struct daemon_reply reply = { .out = out, .now = b2th_now_ms() };
+
+    // Queries never wait for the scanning thread, nor slow it down
+    if (strcmp(req, "list") == 0) {
+        b2th_table_for_each(d->table, daemon_print, &reply);
+    } else if (strncmp(req, "get ", 4) == 0) {
+        uint64_t key;
+        b2th_table_entry_t entry;
+        if (b2th_str_to_key(req + 4, &key) == 0 && b2th_table_lookup(d->table, key, &entry) == 0)
+            daemon_print(&entry, &reply);
+    } else if (strcmp(req, "metrics") == 0) {
+        b2th_scan_stats_t stats;
+        b2th_stats_get(&stats);
+        b2th_stats_write_prometheus(&stats, out);
+    } else {
+        fprintf(out, "unknown request, use \"list\", \"get <address>\" or \"metrics\"\n");
+    }
+
+    fclose(out);
+}
+
+
+static void *daemon_server(void *arg)
+{
+    struct b2th_daemon *d = arg;
+
+    struct pollfd pfd[2] = {
+        { .fd = d->listen_fd, .events = POLLIN },
+        { .fd = d->wake[0], .events = POLLIN },
+    };
+
+    for (;;) {
+        if (poll(pfd, 2, -1) == -1 || pfd[1].revents)
+            break;
+
+        int fd = accept(d->listen_fd, NULL, NULL);
+        if (fd == -1)
+            continue;
+
+        daemon_answer(d, fd);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+
+static int daemon_listen(const char *path)
+{
+    // Non blocking: a client gone between poll() and accept() must not hold the server
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd == -1) {
+        perror("Failed to open UNIX socket");
+        return -1;
+    }
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 8) == -1) {
+        perror("Failed to listen on UNIX socket");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+int b2th_daemon_run(b2th_device_t *local_device, const struct b2th_daemon_conf *conf)
+{
+    struct b2th_daemon d = {
+        .conf = conf,
+    };
+
+    d.table = b2th_table_create(DAEMON_MAX_DEVICES);
+    if (!d.table)
+        return -1;
+
+    d.listen_fd = daemon_listen(conf->socket_path);
+    if (d.listen_fd == -1) {
+        b2th_table_destroy(d.table);
+        return -1;
+    }
+
+    if (pipe(d.wake) == -1) {
+        perror("Failed to open query server pipe");
+        close(d.listen_fd);
+        b2th_table_destroy(d.table);
+        return -1;
+    }
+
+    // The query server blocks the stop signals: they interrupt the scan, which notices the stop right away
+    sigset_t stop_signals, old_mask;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &old_mask);
+
+    pthread_t server;
+    int started = pthread_create(&server, NULL, daemon_server, &d);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (started != 0) {
+        perror("Failed to start query server");
+        close(d.wake[0]);
+        close(d.wake[1]);
+        close(d.listen_fd);
+        b2th_table_destroy(d.table);
+        return -1;
+    }
+
+    struct sigaction sa = { .sa_handler = daemon_signal };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    b2th_scan_params_t params;
+    b2th_scan_params_init(&params);
+    params.stop = &daemon_stop;
+    params.forget_ms = conf->absence_timeout * 1000;
+
+    int ret = b2th_device_scan_periodic(local_device, conf->inquiry_len, conf->period, &params, daemon_scan_cb, &d);
+
+    // Wake the query server up, even in the middle of a client, and wait for it
+    while (write(d.wake[1], "", 1) == -1 && errno == EINTR)
+        ;
+    pthread_join(server, NULL);
+    close(d.wake[0]);
+    close(d.wake[1]);
+    close(d.listen_fd);
+    unlink(conf->socket_path);
+
+    b2th_table_destroy(d.table);
+
+    return ret;
+}
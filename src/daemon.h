@@ -0,0 +1,41 @@
+#ifndef __DAEMON_H__
+#define __DAEMON_H__
+
+
+#include "blue2th.h"
+
+
+/*!
+ * \file daemon.h
+ *
+ * \brief blue2th continuous scanning daemon
+ */
+
+
+/*!
+ * \brief blue2th daemon configuration
+ */
+struct b2th_daemon_conf {
+    const char *socket_path;        /**<! UNIX socket answering presence queries */
+    unsigned int absence_timeout;   /**<! seconds without sighting before a device departs */
+    unsigned int inquiry_len;       /**<! length of each inquiry in 1.28 seconds units */
+    unsigned int period;            /**<! time between two inquiries in 1.28 seconds units */
+};
+
+
+/*!
+ * \brief b2th_daemon_run - Scan continuously and report presence changes until SIGINT/SIGTERM
+ *
+ * Arrivals and departures are printed on stdout. Clients connected to the UNIX
+ * socket send "list" to get every present device, "get <address>" for one, or
+ * "metrics" for the scan counters in the Prometheus text format.
+ *
+ * \param[in]   local_device   local b2th device handler.
+ * \param[in]   conf           daemon configuration.
+ *
+ * \return  0 on success, -1 on error.
+ */
+int b2th_daemon_run(b2th_device_t *local_device, const struct b2th_daemon_conf *conf);
+
+
+#endif /* __DAEMON_H__ */
@@ -1,12 +1,188 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <signal.h>
 
 #include "blue2th.h"
+#include "daemon.h"
 
 
 #define STANDARD_INQUIRY_SEC 10.24
+#define MAX_UUIDS 8
 
 
-int main()
+static void usage(const char *prog)
+{
+    printf("Usage: %s [-d] [-s socket] [-a absence] [-l length] [-p period] [-A] [-S devices] [-w capture] [-r capture [-x speed]] [-m] [-u uuids] [-c class[/mask]] [-L] [-o order] [-D rssi] [-I duty]\n", prog);
+    printf("  -d            run as a daemon reporting device arrivals and departures\n");
+    printf("  -s socket     daemon query socket (default /tmp/blue2th.sock)\n");
+    printf("  -a absence    seconds without sighting before a device departs (default 60)\n");
+    printf("  -l length     daemon inquiry length in 1.28 s units (default 4)\n");
+    printf("  -p period     daemon inquiry period in 1.28 s units (default 10)\n");
+    printf("  -A            run the demo scan through the asynchronous API\n");
+    printf("  -I duty       asynchronous discovery until SIGINT, adaptive inquiry slices taking duty %% of the time\n");
+    printf("  -S devices    run on a simulated controller with this many remote devices\n");
+    printf("  -w capture    record the HCI traffic to a btsnoop capture\n");
+    printf("  -r capture    replay a btsnoop capture instead of using the controllers\n");
+    printf("  -x speed      replay speed factor, 0 for no delay (default 1)\n");
+    printf("  -m            print the scan metrics in Prometheus text format on exit\n");
+    printf("  -u uuids      look for these services (16-bit hex UUIDs, comma separated) on the devices found\n");
+    printf("  -c class/mask only keep the devices of this class (hex, mask defaults to the major class 0x1f00)\n");
+    printf("  -L            limited inquiry, only the devices in limited discoverable mode answer\n");
+    printf("  -o order      print the devices found sorted by address, rssi or seen (most recent first)\n");
+    printf("  -D rssi       scan until SIGINT and only print the changes, RSSI moves of at least rssi dB included (0 for none)\n");
+}
+
+
+static void demo_services(b2th_device_t *local_device, b2th_list_t *remote_device, const uint16_t *uuids,
+        size_t nb_uuids)
+{
+    int found = b2th_sdp_discover(local_device, remote_device, uuids, nb_uuids, NULL);
+    if (found == -1)
+        return;
+
+    printf("%d bluetooth device offers the services searched.\n", found);
+
+    b2th_device_t *pos;
+    b2th_device_for_each_entry(remote_device, pos) {
+        size_t i;
+        for (i = 0; i < pos->nb_services; i++) {
+            const b2th_service_t *svc = &pos->services[i];
+            if (svc->rfcomm_channel)
+                printf("[%s][0x%04x] RFCOMM channel %u\n", pos->address, svc->uuid, svc->rfcomm_channel);
+            else
+                printf("[%s][0x%04x] L2CAP PSM 0x%04x\n", pos->address, svc->uuid, svc->l2cap_psm);
+        }
+    }
+}
+
+
+static void demo_sorted(b2th_list_t *remote_device, b2th_sort_e order)
+{
+    b2th_snapshot_t *snap = b2th_snapshot_create(remote_device);
+    if (!snap)
+        return;
+
+    b2th_snapshot_sort(snap, order);
+
+    size_t count;
+    const b2th_record_t *rec = b2th_snapshot_records(snap, &count);
+
+    size_t i;
+    for (i = 0; i < count; i++) {
+        char address[18];
+        b2th_record_address(&rec[i], address);
+        printf("[%s][%s][%d]\n", address, rec[i].name_len ? b2th_snapshot_name(snap, &rec[i]) : "unknown",
+                rec[i].rssi);
+    }
+
+    b2th_snapshot_destroy(snap);
+}
+
+
+static volatile sig_atomic_t demo_stop = 0;
+
+
+static void demo_signal(int sig)
+{
+    (void)sig;
+    demo_stop = 1;
+}
+
+
+static void demo_print_change(const b2th_change_t *change, const b2th_snapshot_t *before, const b2th_snapshot_t *after)
+{
+    const b2th_record_t *rec = change->after ? change->after : change->before;
+    const char *name = b2th_snapshot_name(change->after ? after : before, rec);
+    char address[18];
+    b2th_record_address(rec, address);
+
+    switch (change->type) {
+    case B2TH_DEVICE_ADDED:
+        printf("added [%s][%s][%d]\n", address, rec->name_len ? name : "unknown", rec->rssi);
+        break;
+
+    case B2TH_DEVICE_REMOVED:
+        printf("removed [%s][%s]\n", address, rec->name_len ? name : "unknown");
+        break;
+
+    case B2TH_DEVICE_CHANGED:
+        if (change->changed & B2TH_CHANGED_NAME)
+            printf("renamed [%s][%s][%s]\n", address, change->before->name_len
+                    ? b2th_snapshot_name(before, change->before) : "unknown", name);
+        if (change->changed & B2TH_CHANGED_RSSI)
+            printf("rssi [%s][%d][%d]\n", address, change->before->rssi, rec->rssi);
+        break;
+    }
+}
+
+
+static int demo_deltas(const b2th_inquiry_filter_t *filter, unsigned int rssi_threshold)
+{
+    b2th_device_t *local_device = b2th_local_device_get_first();
+    if (!local_device)
+        return -1;
+
+    struct sigaction sa = { .sa_handler = demo_signal };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    b2th_scan_params_t params;
+    b2th_scan_params_init(&params);
+    params.filter = filter;
+    params.stop = &demo_stop;
+
+    // Each scan is only compared to the previous one, the first one reports every device as added
+    b2th_snapshot_t *before = NULL;
+    int ret = 0;
+    while (!demo_stop) {
+        b2th_list_t *remote_device = b2th_device_scan_ext(local_device, STANDARD_INQUIRY_SEC, &params);
+        if (!remote_device) {
+            ret = -1;
+            break;
+        }
+
+        // An interrupted scan is partial, its missing devices did not leave
+        if (demo_stop) {
+            b2th_list_deinit(remote_device);
+            break;
+        }
+
+        b2th_snapshot_t *after = b2th_snapshot_create(remote_device);
+        b2th_list_deinit(remote_device);
+        if (!after) {
+            ret = -1;
+            break;
+        }
+
+        b2th_diff_t diff;
+        if (b2th_snapshot_diff(before, after, rssi_threshold, &diff) == -1) {
+            b2th_snapshot_destroy(after);
+            ret = -1;
+            break;
+        }
+
+        size_t i;
+        for (i = 0; i < diff.nb_changes; i++)
+            demo_print_change(&diff.changes[i], before, after);
+        fflush(stdout);
+
+        b2th_diff_deinit(&diff);
+        b2th_snapshot_destroy(before);
+        before = after;
+    }
+
+    b2th_snapshot_destroy(before);
+    b2th_device_deinit(local_device);
+
+    return ret;
+}
+
+
+static int demo(const uint16_t *uuids, size_t nb_uuids, const b2th_inquiry_filter_t *filter, int order)
 {
     // Get first local device
     b2th_device_t *local_device = b2th_local_device_get_first();
@@ -25,17 +201,29 @@ int main()
     b2th_device_for_each_entry(local_device_l, pos)
         printf("Device list -[%s][%s]\n", pos->address, pos->name);
 
-    // Scan on the first local device
-    b2th_list_t *remote_device = b2th_device_scan(local_device, STANDARD_INQUIRY_SEC);
+    // Scan on the first local device, devices left out by the filter are never paged for their name
+    b2th_scan_params_t params;
+    b2th_scan_params_init(&params);
+    params.filter = filter;
+
+    b2th_list_t *remote_device = b2th_device_scan_ext(local_device, STANDARD_INQUIRY_SEC, &params);
     if (!remote_device)
         goto clean_local_device_list;
 
     // Print number of remote devices
     printf("%ld bluetooth device has been found.\n", b2th_list_size(remote_device));
 
-    // Print all remote devices found
-    b2th_device_for_each_entry(remote_device, pos)
-        printf("[%s][%s]\n", pos->address, pos->name);
+    // Print all remote devices found, in the order asked for
+    if (order == -1) {
+        b2th_device_for_each_entry(remote_device, pos)
+            printf("[%s][%s]\n", pos->address, pos->name);
+    } else {
+        demo_sorted(remote_device, order);
+    }
+
+    // Look for services on every device found
+    if (nb_uuids)
+        demo_services(local_device, remote_device, uuids, nb_uuids);
 
     // Check on specific bluetooth interface
     const char *bt_iface_test = "SelDeGuérandeAOC";
@@ -74,3 +262,271 @@ clean:
     return -1;
 }
 
+
+struct demo_async {
+    b2th_async_t *as;
+    int inquiring;
+    int discovering;
+    size_t names;
+};
+
+
+static void demo_async_cb(const b2th_async_event_t *ev, void *userdata)
+{
+    struct demo_async *da = userdata;
+
+    switch (ev->event) {
+    case B2TH_ASYNC_INQUIRY_RESULT:
+        // Names are resolved while the inquiry goes on, unless the device already gave it
+        if (ev->name)
+            printf("[%s][%s]\n", ev->bd->address, ev->name);
+        else if (b2th_async_name(da->as, ev->bd, 0, demo_async_cb, da) == 0)
+            da->names++;
+        break;
+    case B2TH_ASYNC_INQUIRY_COMPLETE:
+        // Discovery slices end one after the other, only a refused slice ends the discovery
+        if (!da->discovering || ev->status > 0)
+            da->inquiring = 0;
+        break;
+    case B2TH_ASYNC_NAME_COMPLETE:
+        printf("[%s][%s]\n", ev->bd->address, ev->name ? ev->name : ev->bd->name);
+        da->names--;
+        break;
+    default:
+        break;
+    }
+}
+
+
+static int demo_async(unsigned int duty)
+{
+    b2th_device_t *local_device = b2th_local_device_get_first();
+    if (!local_device)
+        return -1;
+
+    printf("First local bluetooth controller:[%s][%s]\n", local_device->name, local_device->address);
+
+    struct demo_async da = { .inquiring = 1, .discovering = (duty != 0) };
+    b2th_list_t *remote_device = b2th_list_init();
+    da.as = b2th_async_create(local_device);
+
+    int ret = -1;
+    if (!remote_device || !da.as)
+        goto clean;
+
+    if (duty) {
+        b2th_discovery_params_t params;
+        b2th_discovery_params_init(&params);
+        params.duty_percent = duty;
+
+        struct sigaction sa = { .sa_handler = demo_signal };
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+
+        if (b2th_async_discover(da.as, &params, remote_device, demo_async_cb, &da) == -1)
+            goto clean;
+    } else if (b2th_async_inquiry(da.as, STANDARD_INQUIRY_SEC, remote_device, demo_async_cb, &da) == -1) {
+        goto clean;
+    }
+
+    while (!demo_stop && (da.inquiring || da.names)) {
+        struct pollfd pfd = { .fd = b2th_async_fd(da.as), .events = POLLIN };
+        if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+            goto clean;
+
+        if (b2th_async_process(da.as) == -1)
+            goto clean;
+    }
+
+    printf("%ld bluetooth device has been found.\n", b2th_list_size(remote_device));
+    ret = 0;
+
+clean:
+    b2th_async_destroy(da.as);
+    if (remote_device)
+        b2th_list_deinit(remote_device);
+    b2th_device_deinit(local_device);
+
+    return ret;
+}
+
+
+static void daemon_controller_cb(b2th_controller_event_e event, const b2th_controller_t *ctrl, void *userdata)
+{
+    static const char *events[] = { "added", "removed", "up", "down" };
+    (void)userdata;
+
+    printf("Controller [%s][%s] %s\n", ctrl->name, ctrl->address, events[event]);
+    fflush(stdout);
+}
+
+
+static int daemon_mode(const struct b2th_daemon_conf *conf)
+{
+    // Controller lookups are served from the registry table, kept up to date on hotplug
+    b2th_registry_start(daemon_controller_cb, NULL);
+
+    b2th_device_t *local_device = b2th_local_device_get_first();
+    if (!local_device) {
+        b2th_registry_stop();
+        return -1;
+    }
+
+    printf("Watching from bluetooth controller:[%s][%s], queries on %s\n",
+            local_device->name, local_device->address, conf->socket_path);
+    fflush(stdout);
+
+    int ret = b2th_daemon_run(local_device, conf);
+
+    b2th_device_deinit(local_device);
+    b2th_registry_stop();
+
+    return ret;
+}
+
+
+int main(int argc, char *argv[])
+{
+    int run_daemon = 0;
+    int run_async = 0;
+    unsigned int duty = 0;
+    b2th_transport_t *sim = NULL;
+    const char *record = NULL;
+    const char *replay = NULL;
+    unsigned int speed = 1;
+    int metrics = 0;
+    uint16_t uuids[MAX_UUIDS];
+    size_t nb_uuids = 0;
+    b2th_inquiry_filter_t filter = { .lap = B2TH_LAP_GIAC };
+    int filtered = 0;
+    int order = -1;
+    int deltas = 0;
+    unsigned int rssi_threshold = 0;
+    struct b2th_daemon_conf conf = {
+        .socket_path = "/tmp/blue2th.sock",
+        .absence_timeout = 60,
+        .inquiry_len = 4,
+        .period = 10,
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "ds:a:l:p:AI:S:w:r:x:mu:c:Lo:D:h")) != -1) {
+        switch (opt) {
+        case 'd':
+            run_daemon = 1;
+            break;
+        case 's':
+            conf.socket_path = optarg;
+            break;
+        case 'a':
+            conf.absence_timeout = strtoul(optarg, NULL, 10);
+            break;
+        case 'l':
+            conf.inquiry_len = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            conf.period = strtoul(optarg, NULL, 10);
+            break;
+        case 'A':
+            run_async = 1;
+            break;
+        case 'I':
+            run_async = 1;
+            duty = strtoul(optarg, NULL, 10);
+            break;
+        case 'S': {
+            b2th_sim_params_t params;
+            b2th_sim_params_init(&params);
+            params.nb_devices = strtoul(optarg, NULL, 10);
+            if (!sim)
+                sim = b2th_sim_create(&params);
+            if (!sim)
+                return -1;
+            b2th_transport_set(sim);
+            break;
+        }
+        case 'w':
+            record = optarg;
+            break;
+        case 'r':
+            replay = optarg;
+            break;
+        case 'x':
+            speed = strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            metrics = 1;
+            break;
+        case 'u': {
+            char *uuid = strtok(optarg, ",");
+            for (; uuid && nb_uuids < MAX_UUIDS; uuid = strtok(NULL, ","))
+                uuids[nb_uuids++] = strtoul(uuid, NULL, 16);
+            break;
+        }
+        case 'c': {
+            char *mask;
+            filter.class_value = strtoul(optarg, &mask, 16);
+            filter.class_mask = (*mask == '/') ? strtoul(mask + 1, NULL, 16) : 0x1f00;
+            filtered = 1;
+            break;
+        }
+        case 'L':
+            filter.lap = B2TH_LAP_LIAC;
+            filtered = 1;
+            break;
+        case 'o':
+            if (strcmp(optarg, "address") == 0)
+                order = B2TH_SORT_ADDRESS;
+            else if (strcmp(optarg, "rssi") == 0)
+                order = B2TH_SORT_RSSI;
+            else if (strcmp(optarg, "seen") == 0)
+                order = B2TH_SORT_LAST_SEEN;
+            else {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'D':
+            deltas = 1;
+            rssi_threshold = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return (opt == 'h') ? 0 : -1;
+        }
+    }
+
+    b2th_transport_t *capture = NULL;
+    if (replay) {
+        capture = b2th_replay_create(replay, speed);
+        if (!capture)
+            return -1;
+        b2th_transport_set(capture);
+    }
+
+    if (record && b2th_btsnoop_record_start(record) == -1)
+        return -1;
+
+    int ret;
+    if (run_daemon)
+        ret = daemon_mode(&conf);
+    else if (run_async)
+        ret = demo_async(duty);
+    else if (deltas)
+        ret = demo_deltas(filtered ? &filter : NULL, rssi_threshold);
+    else
+        ret = demo(uuids, nb_uuids, filtered ? &filter : NULL, order);
+
+    if (metrics) {
+        b2th_scan_stats_t stats;
+        b2th_stats_get(&stats);
+        b2th_stats_write_prometheus(&stats, stdout);
+    }
+
+    b2th_btsnoop_record_stop();
+    b2th_transport_set(NULL);
+    b2th_replay_destroy(capture);
+    b2th_sim_destroy(sim);
+
+    return ret;
+}